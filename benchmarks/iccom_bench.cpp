@@ -0,0 +1,504 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* The libiccom hot paths microbenchmarks.
+ *
+ * Every benchmark is calibrated to run at least ICCOM_BENCH_MIN_RUN_NS,
+ * is repeated ICCOM_BENCH_REPEATS times and the median time per
+ * operation is reported. The results can be written to a JSON file
+ * and compared against a baseline JSON file written by the previous
+ * run: the benchmarks which got slower than the given tolerance are
+ * reported as regressions and the tool exits with failure.
+ *
+ * NOTE: the library costs are measured, not the transport,
+ *      so the sockets the library works with are substituted
+ *      (see iccom_open_socket(...) below):
+ *      * netlink build: the sends go to the NETLINK_ROUTE kernel socket
+ *        (which drops them), the receives come from a UNIX datagram
+ *        socket pair,
+ *      * network build: the sends go to /dev/null, the receives come
+ *        from a UNIX stream socket pair.
+ *
+ * Usage: see iccom_bench_usage() below.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "iccom.h"
+
+// internal library routine, see src/utils.h
+extern "C" int __iccom_channel_verify(const unsigned int channel
+        , const int area, const char* const comment);
+
+/* -------------------- MACRO DEFINITIONS ------------------------------ */
+
+#define ICCOM_BENCH_MIN_RUN_NS 100000000ull
+#define ICCOM_BENCH_REPEATS 5
+#define ICCOM_BENCH_DEFAULT_TOLERANCE_PERCENT 10.0
+
+#define ICCOM_BENCH_CHANNEL 100
+// see utils.h: ICCOM_CHANNEL_AREA_ANY
+#define ICCOM_BENCH_CHANNEL_AREA_ANY 3
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+namespace
+{
+
+// The substitute sockets.
+//
+// @tx_fd the socket the library sends to
+// @rx_fd the socket the library receives from
+// @rx_peer_fd the socket to feed the @rx_fd with
+// @next_fd the socket to be returned by the next iccom_open_socket()
+struct bench_sockets {
+        int tx_fd;
+        int rx_fd;
+        int rx_peer_fd;
+        int next_fd;
+};
+
+bench_sockets sockets = {-1, -1, -1, -1};
+
+// A single benchmark.
+//
+// @name the unique benchmark name, the JSON key
+// @size the message size the benchmark works with, 0: not applicable
+// @run runs the measured operation @iterations times
+struct bench {
+        std::string name;
+        size_t size;
+        void (*run)(const size_t size, const size_t iterations);
+};
+
+// @name the benchmark name
+// @ns_per_op the median time per operation
+struct bench_result {
+        std::string name;
+        double ns_per_op;
+};
+
+} // namespace
+
+/* ------------------- SOCKET SUBSTITUTION ----------------------------- */
+
+// Overrides the library iccom_open_socket(...) (the benchmark is linked
+// against the shared library), so the IccomSocket gets the substitute
+// socket instead of the real ICCom channel.
+extern "C" int iccom_open_socket(const unsigned int channel)
+{
+        (void)channel;
+        return dup(sockets.next_fd);
+}
+
+namespace
+{
+
+uint64_t now_ns()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+int sockets_open()
+{
+#ifdef ICCOM_BENCH_NETWORK_SOCKETS
+        sockets.tx_fd = open("/dev/null", O_WRONLY);
+        const int rx_type = SOCK_STREAM;
+#else
+        sockets.tx_fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+        const int rx_type = SOCK_DGRAM;
+#endif
+        int pair[2];
+        if (sockets.tx_fd < 0 || socketpair(AF_UNIX, rx_type, 0, pair) < 0) {
+                return -errno;
+        }
+        sockets.rx_fd = pair[0];
+        sockets.rx_peer_fd = pair[1];
+        return 0;
+}
+
+// Puts a single message of the given size into the receive socket.
+void feed_rx(const size_t size)
+{
+        static std::vector<char> frame;
+        frame.resize(NLMSG_SPACE(size));
+        struct nlmsghdr *const hdr = (struct nlmsghdr *)frame.data();
+#ifdef ICCOM_BENCH_NETWORK_SOCKETS
+        hdr->nlmsg_len = (__u32)size;
+#else
+        hdr->nlmsg_len = (__u32)NLMSG_LENGTH(size);
+#endif
+        if (write(sockets.rx_peer_fd, frame.data(), frame.size())
+                        != (ssize_t)frame.size()) {
+                fprintf(stderr, "could not feed the receive socket\n");
+                exit(EXIT_FAILURE);
+        }
+}
+
+/* ------------------- BENCHMARKS -------------------------------------- */
+
+void bench_cpp_shift_char(const size_t size, const size_t iterations)
+{
+        IccomSocket sk{ICCOM_BENCH_CHANNEL};
+        for (size_t i = 0; i < iterations; i++) {
+                sk.reset_output();
+                for (size_t j = 0; j < size; j++) {
+                        sk << (char)j;
+                }
+        }
+}
+
+void bench_cpp_shift_vector(const size_t size, const size_t iterations)
+{
+        IccomSocket sk{ICCOM_BENCH_CHANNEL};
+        const std::vector<char> data(size, 'x');
+        for (size_t i = 0; i < iterations; i++) {
+                sk.reset_output();
+                sk << data;
+        }
+}
+
+void bench_cpp_send(const size_t size, const size_t iterations)
+{
+        sockets.next_fd = sockets.tx_fd;
+        IccomSocket sk{ICCOM_BENCH_CHANNEL};
+        sk.open();
+        const std::vector<char> data(size, 'x');
+        for (size_t i = 0; i < iterations; i++) {
+                sk << data;
+                sk.send();
+        }
+}
+
+void bench_cpp_receive(const size_t size, const size_t iterations)
+{
+        sockets.next_fd = sockets.rx_fd;
+        IccomSocket sk{ICCOM_BENCH_CHANNEL};
+        sk.open();
+        for (size_t i = 0; i < iterations; i++) {
+                feed_rx(size);
+                sk.receive();
+        }
+}
+
+void bench_cpp_receive_direct(const size_t size, const size_t iterations)
+{
+        sockets.next_fd = sockets.rx_fd;
+        IccomSocket sk{ICCOM_BENCH_CHANNEL};
+        sk.open();
+        std::vector<char> data;
+        for (size_t i = 0; i < iterations; i++) {
+                feed_rx(size);
+                sk.receive_direct(data);
+        }
+}
+
+void bench_c_send_data(const size_t size, const size_t iterations)
+{
+        const std::vector<char> data(size, 'x');
+        for (size_t i = 0; i < iterations; i++) {
+                iccom_send_data(sockets.tx_fd, data.data(), size);
+        }
+}
+
+void bench_c_send_data_nocopy(const size_t size, const size_t iterations)
+{
+        std::vector<char> buf(iccom_get_required_buffer_size(size), 'x');
+        for (size_t i = 0; i < iterations; i++) {
+                iccom_send_data_nocopy(sockets.tx_fd, buf.data(), buf.size()
+                                       , iccom_get_data_payload_offset()
+                                       , size);
+        }
+}
+
+void bench_c_receive_data_nocopy(const size_t size, const size_t iterations)
+{
+        std::vector<char> buf(iccom_get_required_buffer_size(
+                                ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES));
+        int offset;
+        for (size_t i = 0; i < iterations; i++) {
+                feed_rx(size);
+                iccom_receive_data_nocopy(sockets.rx_fd, buf.data()
+                                          , buf.size(), &offset);
+        }
+}
+
+void bench_c_receive_data_pure(const size_t size, const size_t iterations)
+{
+        std::vector<char> buf(iccom_get_required_buffer_size(
+                                ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES));
+        for (size_t i = 0; i < iterations; i++) {
+                feed_rx(size);
+                __iccom_receive_data_pure(sockets.rx_fd, buf.data()
+                                          , buf.size());
+        }
+}
+
+void bench_hex_dump(const size_t size, const size_t iterations)
+{
+        const std::vector<char> data(size, 'x');
+        for (size_t i = 0; i < iterations; i++) {
+                iccom_print_hex_dump(data.data(), data.size());
+        }
+        fflush(stdout);
+}
+
+void bench_channel_verify(const size_t size, const size_t iterations)
+{
+        (void)size;
+        volatile int sink = 0;
+        for (size_t i = 0; i < iterations; i++) {
+                sink += iccom_channel_verify((int)(i & 0xFFFF));
+        }
+        (void)sink;
+}
+
+void bench_channel_verify_internal(const size_t size, const size_t iterations)
+{
+        (void)size;
+        volatile int sink = 0;
+        for (size_t i = 0; i < iterations; i++) {
+                sink += __iccom_channel_verify((unsigned int)(i & 0xFFFF)
+                                , ICCOM_BENCH_CHANNEL_AREA_ANY, NULL);
+        }
+        (void)sink;
+}
+
+std::vector<bench> benchmarks_list()
+{
+        static const size_t sizes[] = {16, 256, 4096};
+        struct {
+                const char *name;
+                void (*run)(const size_t, const size_t);
+        } sized[] = {
+                {"cpp_operator_shift_char", &bench_cpp_shift_char}
+                , {"cpp_operator_shift_vector", &bench_cpp_shift_vector}
+                , {"cpp_send", &bench_cpp_send}
+                , {"cpp_receive", &bench_cpp_receive}
+                , {"cpp_receive_direct", &bench_cpp_receive_direct}
+                , {"c_send_data", &bench_c_send_data}
+                , {"c_send_data_nocopy", &bench_c_send_data_nocopy}
+                , {"c_receive_data_nocopy", &bench_c_receive_data_nocopy}
+                , {"c_receive_data_pure", &bench_c_receive_data_pure}
+                , {"hex_dump", &bench_hex_dump}
+        };
+
+        std::vector<bench> list;
+        for (const auto &b : sized) {
+                for (const size_t size : sizes) {
+                        list.push_back({std::string(b.name) + "_"
+                                        + std::to_string(size), size, b.run});
+                }
+        }
+        list.push_back({"channel_verify", 0, &bench_channel_verify});
+        list.push_back({"channel_verify_internal", 0
+                        , &bench_channel_verify_internal});
+        return list;
+}
+
+/* ------------------- HARNESS ----------------------------------------- */
+
+// RETURNS: the median time per operation in ns
+double bench_measure(const bench &b)
+{
+        // calibration
+        size_t iterations = 1;
+        while (true) {
+                const uint64_t start = now_ns();
+                b.run(b.size, iterations);
+                const uint64_t spent = now_ns() - start;
+                if (spent >= ICCOM_BENCH_MIN_RUN_NS / 10) {
+                        iterations = (size_t)((double)iterations
+                                        * ICCOM_BENCH_MIN_RUN_NS
+                                        / (double)spent) + 1;
+                        break;
+                }
+                iterations *= 10;
+        }
+
+        std::vector<double> results;
+        for (int i = 0; i < ICCOM_BENCH_REPEATS; i++) {
+                const uint64_t start = now_ns();
+                b.run(b.size, iterations);
+                results.push_back((double)(now_ns() - start)
+                                  / (double)iterations);
+        }
+        std::sort(results.begin(), results.end());
+        return results[results.size() / 2];
+}
+
+int results_write_json(const char *const path
+                       , const std::vector<bench_result> &results)
+{
+        FILE *const f = fopen(path, "w");
+        if (!f) {
+                return -errno;
+        }
+        fprintf(f, "{\n  \"benchmarks\": [\n");
+        for (size_t i = 0; i < results.size(); i++) {
+                fprintf(f, "    {\"name\": \"%s\", \"ns_per_op\": %.3f}%s\n"
+                        , results[i].name.c_str(), results[i].ns_per_op
+                        , i + 1 < results.size() ? "," : "");
+        }
+        fprintf(f, "  ]\n}\n");
+        return fclose(f) == 0 ? 0 : -EIO;
+}
+
+// Reads the JSON written by @results_write_json.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int results_read_json(const char *const path
+                      , std::map<std::string, double> &out)
+{
+        FILE *const f = fopen(path, "r");
+        if (!f) {
+                return -errno;
+        }
+        char line[512];
+        while (fgets(line, sizeof(line), f)) {
+                char name[256];
+                double ns;
+                const char *const entry = strstr(line, "{\"name\"");
+                if (entry && sscanf(entry, "{\"name\": \"%255[^\"]\","
+                                    " \"ns_per_op\": %lf", name, &ns) == 2) {
+                        out[name] = ns;
+                }
+        }
+        fclose(f);
+        return out.empty() ? -EINVAL : 0;
+}
+
+void iccom_bench_usage(const char *const name)
+{
+        printf("Usage: %s [OPTIONS]\n"
+               "Runs the libiccom hot paths microbenchmarks.\n"
+               "\n"
+               "  -o FILE    write the results as JSON to FILE\n"
+               "  -b FILE    compare the results against the baseline\n"
+               "             JSON FILE (written by -o before), exit with\n"
+               "             failure on regressions\n"
+               "  -t PCT     regression tolerance in %% (default %.0f)\n"
+               "  -f FILTER  run only benchmarks with FILTER in the name\n"
+               "  -h         print this help\n"
+               , name, ICCOM_BENCH_DEFAULT_TOLERANCE_PERCENT);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+        const char *out_path = NULL;
+        const char *baseline_path = NULL;
+        const char *filter = NULL;
+        double tolerance = ICCOM_BENCH_DEFAULT_TOLERANCE_PERCENT;
+
+        int opt;
+        while ((opt = getopt(argc, argv, "o:b:t:f:h")) != -1) {
+                switch (opt) {
+                case 'o':
+                        out_path = optarg;
+                        break;
+                case 'b':
+                        baseline_path = optarg;
+                        break;
+                case 't':
+                        tolerance = atof(optarg);
+                        break;
+                case 'f':
+                        filter = optarg;
+                        break;
+                case 'h':
+                        iccom_bench_usage(argv[0]);
+                        return EXIT_SUCCESS;
+                default:
+                        iccom_bench_usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        std::map<std::string, double> baseline;
+        if (baseline_path && results_read_json(baseline_path, baseline) < 0) {
+                fprintf(stderr, "could not read baseline %s\n", baseline_path);
+                return EXIT_FAILURE;
+        }
+
+        if (sockets_open() < 0) {
+                fprintf(stderr, "could not open benchmark sockets: %s\n"
+                        , strerror(errno));
+                return EXIT_FAILURE;
+        }
+
+        // the hex dump (and library logs) output is dropped, the report
+        // goes to the original stdout
+        fflush(stdout);
+        const int report_fd = dup(STDOUT_FILENO);
+        const int null_fd = open("/dev/null", O_WRONLY);
+        FILE *const report = fdopen(report_fd, "w");
+        if (report_fd < 0 || null_fd < 0 || !report) {
+                fprintf(stderr, "could not redirect stdout\n");
+                return EXIT_FAILURE;
+        }
+        dup2(null_fd, STDOUT_FILENO);
+
+        std::vector<bench_result> results;
+        int regressions = 0;
+        fprintf(report, "%-36s %14s %14s %9s\n", "benchmark", "ns/op"
+                , "baseline", "change");
+        for (const bench &b : benchmarks_list()) {
+                if (filter && b.name.find(filter) == std::string::npos) {
+                        continue;
+                }
+                const double ns = bench_measure(b);
+                results.push_back({b.name, ns});
+
+                fprintf(report, "%-36s %14.2f", b.name.c_str(), ns);
+                const auto base = baseline.find(b.name);
+                if (base != baseline.end() && base->second > 0) {
+                        const double change = (ns - base->second)
+                                              / base->second * 100.0;
+                        const bool regressed = change > tolerance;
+                        regressions += regressed ? 1 : 0;
+                        fprintf(report, " %14.2f %+8.1f%%%s", base->second
+                                , change, regressed ? "  REGRESSION" : "");
+                }
+                fprintf(report, "\n");
+                fflush(report);
+        }
+
+        if (out_path && results_write_json(out_path, results) < 0) {
+                fprintf(stderr, "could not write %s\n", out_path);
+                return EXIT_FAILURE;
+        }
+        if (baseline_path) {
+                fprintf(report, "%d regression(s) above %.1f%% tolerance\n"
+                        , regressions, tolerance);
+        }
+        fclose(report);
+        return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
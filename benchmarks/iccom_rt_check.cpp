@@ -0,0 +1,359 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* The libiccom real-time profile check: verifies that the steady state
+ * send/receive paths (the C nocopy calls and the IccomSocket
+ * send()/receive()) don't allocate, don't lock, don't print and don't
+ * page fault after the setup and @iccom_rt_prepare(...).
+ *
+ * The harness interposes the malloc family and the pthread mutex lock
+ * calls (the check is linked against the shared library), counts the
+ * calling thread page faults (getrusage(2)) and captures the stdout and
+ * stderr output during the measured run. Any nonzero count fails the
+ * check.
+ *
+ * NOTE: the transport is substituted like in the iccom_bench, see
+ *      iccom_bench.cpp.
+ *
+ * Usage: see iccom_rt_check_usage() below.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <atomic>
+#include <vector>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <linux/netlink.h>
+
+#include "iccom.h"
+
+/* -------------------- MACRO DEFINITIONS ------------------------------ */
+
+#define ICCOM_RT_CHECK_DEFAULT_ITERATIONS 200000
+#define ICCOM_RT_CHECK_WARMUP_ITERATIONS 1000
+
+#define ICCOM_RT_CHECK_CHANNEL 100
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+namespace
+{
+
+// The substitute sockets, see iccom_bench.cpp.
+struct check_sockets {
+        int tx_fd;
+        int rx_fd;
+        int rx_peer_fd;
+        int next_fd;
+};
+
+check_sockets sockets = {-1, -1, -1, -1};
+
+// The counters of the forbidden calls, counted only while @armed.
+std::atomic<bool> armed{false};
+std::atomic<unsigned long> allocations{0};
+std::atomic<unsigned long> locks{0};
+
+int (*real_mutex_lock)(pthread_mutex_t *) = NULL;
+int (*real_mutex_trylock)(pthread_mutex_t *) = NULL;
+
+} // namespace
+
+/* ------------------- INTERPOSITION ----------------------------------- */
+
+// glibc internal allocator entry points
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+extern "C" void *__libc_memalign(size_t alignment, size_t size);
+extern "C" void __libc_free(void *ptr);
+
+namespace
+{
+
+inline void count_allocation()
+{
+        if (armed.load(std::memory_order_relaxed)) {
+                allocations.fetch_add(1, std::memory_order_relaxed);
+        }
+}
+
+} // namespace
+
+extern "C" void *malloc(size_t size)
+{
+        count_allocation();
+        return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+        count_allocation();
+        return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+        count_allocation();
+        return __libc_realloc(ptr, size);
+}
+
+extern "C" void *aligned_alloc(size_t alignment, size_t size)
+{
+        count_allocation();
+        return __libc_memalign(alignment, size);
+}
+
+extern "C" int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+        count_allocation();
+        *ptr = __libc_memalign(alignment, size);
+        return *ptr ? 0 : ENOMEM;
+}
+
+// NOTE: the free itself doesn't allocate, but in the steady state it
+//      comes in pair with the allocation, so it is counted too.
+extern "C" void free(void *ptr)
+{
+        if (ptr) {
+                count_allocation();
+        }
+        __libc_free(ptr);
+}
+
+extern "C" int pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+        if (armed.load(std::memory_order_relaxed)) {
+                locks.fetch_add(1, std::memory_order_relaxed);
+        }
+        return real_mutex_lock(mutex);
+}
+
+extern "C" int pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+        if (armed.load(std::memory_order_relaxed)) {
+                locks.fetch_add(1, std::memory_order_relaxed);
+        }
+        return real_mutex_trylock(mutex);
+}
+
+// Overrides the library iccom_open_socket(...), see iccom_bench.cpp.
+extern "C" int iccom_open_socket(const unsigned int channel)
+{
+        (void)channel;
+        return dup(sockets.next_fd);
+}
+
+namespace
+{
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+int sockets_open()
+{
+#ifdef ICCOM_BENCH_NETWORK_SOCKETS
+        sockets.tx_fd = open("/dev/null", O_WRONLY);
+        const int rx_type = SOCK_STREAM;
+#else
+        sockets.tx_fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+        const int rx_type = SOCK_DGRAM;
+#endif
+        int pair[2];
+        if (sockets.tx_fd < 0 || socketpair(AF_UNIX, rx_type, 0, pair) < 0) {
+                return -errno;
+        }
+        sockets.rx_fd = pair[0];
+        sockets.rx_peer_fd = pair[1];
+        return 0;
+}
+
+// Puts a single message of the given size into the receive socket,
+// the @frame is preallocated for the max message size.
+int feed_rx(std::vector<char> &frame, const size_t size)
+{
+        struct nlmsghdr *const hdr = (struct nlmsghdr *)frame.data();
+#ifdef ICCOM_BENCH_NETWORK_SOCKETS
+        hdr->nlmsg_len = (__u32)size;
+#else
+        hdr->nlmsg_len = (__u32)NLMSG_LENGTH(size);
+#endif
+        const ssize_t frame_size = (ssize_t)NLMSG_SPACE(size);
+        return write(sockets.rx_peer_fd, frame.data(), (size_t)frame_size)
+               == frame_size ? 0 : -EIO;
+}
+
+uint64_t page_faults()
+{
+        struct rusage usage;
+        getrusage(RUSAGE_THREAD, &usage);
+        return (uint64_t)usage.ru_minflt + (uint64_t)usage.ru_majflt;
+}
+
+// The steady state traffic: per iteration the IccomSocket and the C
+// nocopy send and receive of the message of one of the sizes.
+//
+// RETURNS: the number of failed operations
+unsigned long run(const size_t iterations, IccomSocket &tx_sk
+                  , IccomSocket &rx_sk, const std::vector<char> *const data
+                  , const size_t data_count, std::vector<char> &tx_buf
+                  , std::vector<char> &rx_buf, std::vector<char> &frame)
+{
+        unsigned long failures = 0;
+        int offset;
+        for (size_t i = 0; i < iterations; i++) {
+                const std::vector<char> &msg = data[i % data_count];
+
+                tx_sk << msg;
+                failures += tx_sk.send() < 0;
+                failures += feed_rx(frame, msg.size()) < 0;
+                failures += rx_sk.receive() != (int)msg.size();
+
+                failures += iccom_send_data_nocopy(sockets.tx_fd
+                                , tx_buf.data()
+                                , iccom_get_required_buffer_size(msg.size())
+                                , iccom_get_data_payload_offset()
+                                , msg.size()) < 0;
+                failures += feed_rx(frame, msg.size()) < 0;
+                failures += iccom_receive_data_nocopy(sockets.rx_fd
+                                , rx_buf.data(), rx_buf.size(), &offset)
+                            != (int)msg.size();
+        }
+        return failures;
+}
+
+void iccom_rt_check_usage(const char *const name)
+{
+        printf("Usage: %s [OPTIONS]\n"
+               "Checks that the libiccom steady state send/receive paths\n"
+               "don't allocate, lock, print nor page fault.\n"
+               "\n"
+               "  -n N       the number of iterations (default %d)\n"
+               "  -h         print this help\n"
+               , name, ICCOM_RT_CHECK_DEFAULT_ITERATIONS);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+        size_t iterations = ICCOM_RT_CHECK_DEFAULT_ITERATIONS;
+
+        int opt;
+        while ((opt = getopt(argc, argv, "n:h")) != -1) {
+                switch (opt) {
+                case 'n':
+                        iterations = (size_t)strtoul(optarg, NULL, 10);
+                        break;
+                case 'h':
+                        iccom_rt_check_usage(argv[0]);
+                        return EXIT_SUCCESS;
+                default:
+                        iccom_rt_check_usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        real_mutex_lock = (int (*)(pthread_mutex_t *))
+                        dlsym(RTLD_NEXT, "pthread_mutex_lock");
+        real_mutex_trylock = (int (*)(pthread_mutex_t *))
+                        dlsym(RTLD_NEXT, "pthread_mutex_trylock");
+        if (!real_mutex_lock || !real_mutex_trylock) {
+                fprintf(stderr, "could not resolve the pthread mutex calls\n");
+                return EXIT_FAILURE;
+        }
+        if (sockets_open() < 0) {
+                fprintf(stderr, "could not open check sockets: %s\n"
+                        , strerror(errno));
+                return EXIT_FAILURE;
+        }
+
+        // setup: everything is allocated here
+        IccomSocket tx_sk{ICCOM_RT_CHECK_CHANNEL};
+        IccomSocket rx_sk{ICCOM_RT_CHECK_CHANNEL};
+        sockets.next_fd = sockets.tx_fd;
+        const int tx_res = tx_sk.open();
+        sockets.next_fd = sockets.rx_fd;
+        const int rx_res = rx_sk.open();
+        if (tx_res < 0 || rx_res < 0) {
+                fprintf(stderr, "could not open the IccomSockets\n");
+                return EXIT_FAILURE;
+        }
+        const std::vector<char> data[] = {
+                std::vector<char>(1, 'x')
+                , std::vector<char>(64, 'x')
+                , std::vector<char>(1000, 'x')
+                , std::vector<char>(ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES, 'x')
+        };
+        const size_t data_count = sizeof(data) / sizeof(data[0]);
+        const size_t max_space = iccom_get_required_buffer_size(
+                                        ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES);
+        std::vector<char> tx_buf(max_space, 'x');
+        std::vector<char> rx_buf(max_space);
+        std::vector<char> frame(max_space);
+
+        // the library output during the measured run goes to the file
+        fflush(stdout);
+        fflush(stderr);
+        FILE *const output = tmpfile();
+        const int report_fd = dup(STDOUT_FILENO);
+        FILE *const report = fdopen(report_fd, "w");
+        if (!output || report_fd < 0 || !report) {
+                fprintf(stderr, "could not redirect the output\n");
+                return EXIT_FAILURE;
+        }
+        dup2(fileno(output), STDOUT_FILENO);
+        dup2(fileno(output), STDERR_FILENO);
+
+        unsigned long failures = run(ICCOM_RT_CHECK_WARMUP_ITERATIONS, tx_sk
+                                     , rx_sk, data, data_count, tx_buf
+                                     , rx_buf, frame);
+        const int prepare_res = iccom_rt_prepare(0);
+        fflush(stdout);
+        const long output_before = lseek(STDOUT_FILENO, 0, SEEK_END);
+
+        const uint64_t faults_before = page_faults();
+        armed.store(true);
+        failures += run(iterations, tx_sk, rx_sk, data, data_count, tx_buf
+                        , rx_buf, frame);
+        armed.store(false);
+        const uint64_t faults = page_faults() - faults_before;
+
+        fflush(stdout);
+        fflush(stderr);
+        const long printed = lseek(STDOUT_FILENO, 0, SEEK_END) - output_before;
+
+        if (prepare_res < 0) {
+                fprintf(report, "NOTE: iccom_rt_prepare: %s (memory is not"
+                        " locked, the page faults may happen)\n"
+                        , strerror(-prepare_res));
+        }
+        fprintf(report, "iterations:     %zu\n", iterations);
+        fprintf(report, "failed ops:     %lu\n", failures);
+        fprintf(report, "allocations:    %lu\n", allocations.load());
+        fprintf(report, "mutex locks:    %lu\n", locks.load());
+        fprintf(report, "printed bytes:  %ld\n", printed);
+        fprintf(report, "page faults:    %llu\n", (unsigned long long)faults);
+
+        const bool ok = !failures && !allocations.load() && !locks.load()
+                        && !printed && !faults;
+        fprintf(report, "%s\n", ok ? "PASSED" : "FAILED");
+        fclose(report);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -42,7 +42,7 @@ function(set_salt_default_cxx_config target_name)
     set_property(TARGET "${target_name}" PROPERTY
                  VERBOSE_MAKEFILE "ON")
 
-    set_property(TARGET "${target_name}" PROPERTY CXX_STANDARD 16)
+    set_property(TARGET "${target_name}" PROPERTY CXX_STANDARD 11)
     set_property(TARGET "${target_name}" PROPERTY CXX_STANDARD_REQUIRED ON)
 
     set_property(TARGET "${target_name}" PROPERTY CXX_EXTENSIONS OFF)
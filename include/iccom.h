@@ -23,12 +23,16 @@
 
 #ifdef __cplusplus
 #include <vector>
+#include <algorithm>
 #include <string>
 #include <stdexcept>
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
+#include <atomic>
 #else
 #include <stddef.h>
+#include <stdint.h>
 #include <assert.h>
 #endif
 
@@ -119,6 +123,11 @@ void iccom_print_hex_dump_prefixed(const void *const data
                 , const char* prefix);
 
 
+// The socket descriptor value which tells the library facility to open
+// (and close) the channel socket on its own, see for example
+// @iccom_receiver_cfg.sock_fd.
+#define ICCOM_OPEN_SOCKET (-1)
+
 // Opens the iccom socket to given channel.
 //
 // NOTE: by default socket has no timeout on receiving data operation,
@@ -217,6 +226,36 @@ int iccom_send_data_nocopy(const int sock_fd, const void *const buf
 int iccom_send_data(const int sock_fd, const void *const data
                     , const  size_t data_size_bytes);
 
+// The single message description for @iccom_send_data_batch_nocopy.
+//
+// @buf the message buffer, see @iccom_send_data_nocopy
+// @buf_size_bytes the message buffer size, see @iccom_send_data_nocopy
+// @data_size_bytes the message payload size, see @iccom_send_data_nocopy
+typedef struct iccom_send_batch_item {
+        const void *buf;
+        size_t buf_size_bytes;
+        size_t data_size_bytes;
+} iccom_send_batch_item;
+
+// Sends a batch of messages to the given iccom socket with as few
+// syscalls as possible (the messages are still delivered as separate
+// messages). Every message buffer is to be prepared exactly as for
+// @iccom_send_data_nocopy (user data at @iccom_get_data_payload_offset()).
+//
+// @sock_fd {the valid file desctiptor} of iccom socket opened with
+//      @open_iccom_socket(...).
+// @items {valid ptr} the array of messages to send
+// @count {>0} the number of messages in @items
+//
+// RETURNS:
+//      >0: the number of the first messages from @items which were
+//          sent, if less than @count, then the next message failed
+//          (repeat the call for the rest to get the error code)
+//      <0: negated error code, if the first message failed
+int iccom_send_data_batch_nocopy(const int sock_fd
+                                 , const iccom_send_batch_item *const items
+                                 , const size_t count);
+
 // RETURNS:
 //      the offset of the consumer payload data in the buffer
 //      which contains the full transportation ready message
@@ -288,6 +327,15 @@ static inline size_t iccom_get_max_payload_size(void)
 //                    will not be respected.
 //      <0: negated error code, when failed
 //           NOTE: the timeout is not interpreted as an error
+//           NOTE: -ENOBUFS means the socket receive queue overrun,
+//              some messages were lost, but the socket stays
+//              usable (see @iccom_get_socket_rx_stats)
+//           NOTE:
+//              ICCOM OVER TCP:
+//                  -ETIMEDOUT means the peer stalled in the middle of
+//                  the message longer than the socket read timeout,
+//                  the stream framing is lost, the socket is to be
+//                  reopened
 int iccom_receive_data_nocopy(
                 const int sock_fd, void *const receive_buffer
                 , const size_t buffer_size, int *const data_offset__out);
@@ -306,6 +354,40 @@ int iccom_receive_data(const int sock_fd, void *const receive_buffer
 int __iccom_receive_data_pure(const int sock_fd, void *const receive_buffer
                             , const size_t buffer_size);
 
+// Receives the next message into the buffer sized for it: the buffer
+// is taken from the library size class pool (the smallest class which
+// fits the message), so the small messages occupy small buffers. Is
+// for the consumers which keep many received messages queued, where
+// the max size buffers waste the memory and the cache.
+//
+// In the kernel modification the message size is peeked first
+// (MSG_PEEK | MSG_TRUNC), then the message is received right into the
+// buffer.
+//
+// @sock_fd {valid opened ICCom socket}
+// @buf__out {valid ptr} where to write the buffer ptr to, the buffer
+//      holds the whole netlink message and is to be returned with
+//      @iccom_free_received_buffer; NULL is written when no message is
+//      received
+// @data_offset__out {valid ptr} where to write the payload offset
+//      within the buffer to
+//
+// RETURNS:
+//      >0: the payload size of the received message
+//      0: timeout (see @iccom_receive_data_nocopy)
+//      -ENOMEM: no buffer memory for the message, the message is
+//          dropped (see @iccom_get_socket_rx_stats), the socket stays
+//          usable
+//      <0: negated error code
+int iccom_receive_data_alloc(const int sock_fd, void **const buf__out
+                             , int *const data_offset__out);
+
+// Returns the buffer got from @iccom_receive_data_alloc to the pool.
+// Can be called from any thread.
+//
+// @buf {valid ptr from @iccom_receive_data_alloc || NULL}
+void iccom_free_received_buffer(void *const buf);
+
 // The function enables the ICCom loopback for the given range of channels
 // every channel #C end-point from range [from_ch; to_ch] will get connected
 // to the channel end-point #(C + range_size) from range
@@ -321,6 +403,12 @@ int __iccom_receive_data_pure(const int sock_fd, void *const receive_buffer
 // ----------------------- HW --------------------------------------------
 // NOTE: THE HW PATHS ARE CUT OUT FROM SRC AND DST REGION
 //
+// NOTE: in the network sockets modification the loopback is emulated by
+//      the calling process: it serves the TCP ports of both regions on
+//      the local host (up to 1024 channels per region) and relays the
+//      frames between them till the loopback is disabled or the process
+//      exits.
+//
 // @from_ch {valid, [ICCOM_MIN_CHANNEL; ICCOM_MAX_CHANNEL]} the source
 //  channel region first channel
 // @to_ch {valid, [from_ch; ICCOM_MAX_CHANNEL]} the source channel region
@@ -356,6 +444,833 @@ char iccom_loopback_is_active(void);
 //      <0: negated error code (out data is undefined)
 int iccom_loopback_get(loopback_cfg *const out);
 
+/* ------------------- ICCOM TRAFFIC CAPTURE API ----------------------- */
+
+// The capture facility records every frame sent and received by the
+// library (all sockets of the process) into a memory mapped append-only
+// binary file. Recording is lock-free: every writer reserves its record
+// space with a single atomic add and copies the frame directly into the
+// mapped file, so whole production traffic can be captured for hours
+// with minimal overhead.
+//
+// Capture file layout:
+//
+//      |--file header--|--record--|--record--|-- ... --|--unused--|
+//
+// every record is:
+//
+//      |--record header--|--payload (cap_size bytes)--|-padding-|
+//
+// where padding aligns the next record to ICCOM_CAPTURE_ALIGN bytes.
+// Record with record_size == 0 marks the end of the valid data (this
+// also covers records which were not yet committed at the moment the
+// process crashed).
+//
+// NOTE: all fields are stored in host byte order.
+
+#define ICCOM_CAPTURE_MAGIC 0x50434349u /* "ICCP" on little endian */
+#define ICCOM_CAPTURE_VERSION 1
+#define ICCOM_CAPTURE_ALIGN 8
+
+#define ICCOM_CAPTURE_DIR_TX 0
+#define ICCOM_CAPTURE_DIR_RX 1
+
+// the channel value stored when the frame channel is not known
+// (socket was not opened via @iccom_open_socket)
+#define ICCOM_CAPTURE_CHANNEL_UNKNOWN 0xFFFFFFFFu
+
+// The capture file header.
+//
+// @magic ICCOM_CAPTURE_MAGIC
+// @version ICCOM_CAPTURE_VERSION
+// @header_size the size of this header in bytes (records begin here)
+// @capacity_bytes the maximal size of the file (including header)
+// @used_bytes the size of valid data (including header), written
+//      on capture closing, 0 while capture is still running
+// @realtime_base_ns CLOCK_REALTIME at capture start, ns
+// @monotonic_base_ns CLOCK_MONOTONIC at capture start, ns, together
+//      with @realtime_base_ns allows to convert record timestamps
+//      to wall clock time
+// @snaplen maximal number of payload bytes stored per record
+typedef struct iccom_capture_file_header {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t header_size;
+        uint64_t capacity_bytes;
+        uint64_t used_bytes;
+        uint64_t realtime_base_ns;
+        uint64_t monotonic_base_ns;
+        uint32_t snaplen;
+        uint32_t reserved;
+} iccom_capture_file_header;
+
+// The capture record header.
+//
+// @record_size the total record size (header + payload + padding),
+//      0 means end of data.
+// @direction ICCOM_CAPTURE_DIR_TX or ICCOM_CAPTURE_DIR_RX
+// @flags reserved, 0
+// @channel the channel of the frame, or ICCOM_CAPTURE_CHANNEL_UNKNOWN
+// @orig_size the original payload size of the frame in bytes
+// @cap_size the number of payload bytes stored in the record
+//      (<= @orig_size, limited by snaplen)
+// @timestamp_ns CLOCK_MONOTONIC time of the frame, ns
+typedef struct iccom_capture_record_header {
+        uint32_t record_size;
+        uint16_t direction;
+        uint16_t flags;
+        uint32_t channel;
+        uint32_t orig_size;
+        uint32_t cap_size;
+        uint32_t reserved;
+        uint64_t timestamp_ns;
+} iccom_capture_record_header;
+
+// The capture statistics.
+//
+// @records number of records written
+// @bytes number of capture file bytes used by records
+// @dropped number of frames not recorded due to full capture file
+typedef struct iccom_capture_stats {
+        uint64_t records;
+        uint64_t bytes;
+        uint64_t dropped;
+} iccom_capture_stats;
+
+// Creates the capture file and maps it into memory. The capture
+// is opened in disabled state (nothing is recorded), use
+// @iccom_capture_enable or the toggle signal to start recording.
+//
+// NOTE: the file is created (or truncated) and preallocated to
+//      @capacity_bytes size, on @iccom_capture_close it is truncated
+//      to the actually used size.
+//
+// @path {valid null-terminated str ptr} the capture file path
+// @capacity_bytes {> sizeof(iccom_capture_file_header)} the maximal
+//      capture file size, when the file is full, new frames are
+//      counted as dropped.
+// @snaplen {>0} the maximal number of payload bytes stored per frame
+//      frames bigger than that are stored truncated.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_capture_open(const char *const path, const size_t capacity_bytes
+                       , const size_t snaplen);
+
+// Enables or disables the recording into the opened capture file.
+//
+// NOTE: async signal safe.
+//
+// @enable !0: enable recording, 0: disable recording
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code (-EBADF if capture is not opened)
+int iccom_capture_enable(const int enable);
+
+// RETURNS:
+//      !0: recording is currently active
+//      0: recording is disabled or capture is not opened
+int iccom_capture_is_enabled(void);
+
+// Installs the signal handler which toggles the recording state
+// of the opened capture (say, `kill -USR2 <pid>` to start/stop capture
+// of the production process).
+//
+// @signo {valid signal number || 0} the signal to use for toggling,
+//      0 restores the default handler of the previously set signal.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_capture_set_toggle_signal(const int signo);
+
+// Provides the current capture statistics.
+//
+// @out {valid ptr} where to write the statistics to
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_capture_get_stats(iccom_capture_stats *const out);
+
+// Stops the recording, waits for all in-flight writers to finish,
+// finalizes the file header and unmaps and truncates the capture file.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_capture_close(void);
+
+/* ------------------- ICCOM FLIGHT RECORDER API ----------------------- */
+
+// The flight recorder is always on: for every opened channel it keeps
+// the ring of the last frames (metadata plus first snaplen payload
+// bytes). Recording costs a single atomic add and one copy into a
+// preallocated slot, no locks. The rings can be dumped to a file on
+// demand: by API call, by signal or automatically when a send/receive
+// error path fires, to get the context of rare production failures.
+//
+// The dump file has exactly the capture file format (see
+// @iccom_capture_open), the records are grouped per channel, and
+// ordered by time within the channel.
+//
+// NOTE: the ring of a channel is allocated on the first opening of the
+//      channel and kept till the process exits, so the history survives
+//      the channel reopening.
+
+#define ICCOM_FLIGHT_RECORDER_DEFAULT_FRAMES 32
+#define ICCOM_FLIGHT_RECORDER_DEFAULT_SNAPLEN 32
+#define ICCOM_FLIGHT_RECORDER_MAX_FRAMES 65536
+
+// Configures the flight recorder rings.
+//
+// NOTE: applies only to the rings of the channels which were not yet
+//      opened, so it is to be called before opening the sockets.
+//
+// @frames [0; ICCOM_FLIGHT_RECORDER_MAX_FRAMES] the number of the last
+//      frames to keep per channel (rounded up to the power of 2),
+//      0 disables the flight recorder for new channels.
+// @snaplen [0; ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES] the number of
+//      the first payload bytes to keep per frame
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_flight_recorder_configure(const unsigned int frames
+                                    , const unsigned int snaplen);
+
+// Sets the file to dump the flight recorder to on signal (see
+// @iccom_flight_recorder_set_dump_signal) and on error paths.
+// Error triggered dumps are rate limited (not more than one per second)
+// and are written by the dedicated thread (started on the first call
+// with non-NULL @path), so the failing send/receive call never waits
+// for the file I/O.
+//
+// @path {valid null-terminated str ptr || NULL} the dump file path,
+//      NULL disables the signal and error triggered dumps.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_flight_recorder_set_dump_path(const char *const path);
+
+// Installs the signal handler which dumps the flight recorder to the
+// configured dump path (say, `kill -USR1 <pid>`).
+//
+// @signo {valid signal number || 0} the signal to use for dumping,
+//      0 restores the default handler of the previously set signal.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_flight_recorder_set_dump_signal(const int signo);
+
+// Dumps the flight recorder rings of all channels to the file.
+//
+// @path {valid null-terminated str ptr || NULL} the dump file path,
+//      if NULL, then the configured dump path is used
+//
+// RETURNS:
+//      >=0: the number of frames dumped
+//      <0: negated error code
+int iccom_flight_recorder_dump(const char *const path);
+
+/* ------------------- ICCOM TRAFFIC REPLAY API ------------------------ */
+
+// The replay engine reads the recorded traffic (capture file or flight
+// recorder dump) and re-emits the frames via @iccom_send_data_nocopy
+// on their original channels (optionally shifted, say, to the loopback
+// remote end). Used to reproduce the production load shapes on x86
+// simulation and to benchmark consumers against real traffic.
+
+// the frames are sent keeping the original inter-arrival times
+// (scaled by @speed)
+#define ICCOM_REPLAY_TIMING_ORIGINAL 0
+// the frames are sent as fast as possible, consecutive frames of the
+// same channel are sent in batches (see @iccom_send_data_batch_nocopy)
+#define ICCOM_REPLAY_TIMING_MAX_SPEED 1
+
+#define ICCOM_REPLAY_DIR_MASK(dir) (1u << (dir))
+
+// The replay configuration.
+//
+// @path {valid null-terminated str ptr} the recorded traffic file
+// @timing ICCOM_REPLAY_TIMING_*
+// @speed {>0} the time scaling for ICCOM_REPLAY_TIMING_ORIGINAL:
+//      1.0 - original timing, 2.0 - twice faster, 0.5 - twice slower
+// @directions the mask of recorded directions to replay, built with
+//      ICCOM_REPLAY_DIR_MASK(ICCOM_CAPTURE_DIR_*); 0 means all
+// @channel_shift the value added to the recorded channel to get the
+//      channel to send to
+// @batch_size [1; ...] max frames per batch in
+//      ICCOM_REPLAY_TIMING_MAX_SPEED mode, 0 means 1
+// @loops number of times to replay the file, 0 means 1
+typedef struct iccom_replay_cfg {
+        const char *path;
+        int timing;
+        double speed;
+        unsigned int directions;
+        int channel_shift;
+        unsigned int batch_size;
+        unsigned int loops;
+} iccom_replay_cfg;
+
+// The replay results.
+//
+// @frames_sent number of frames sent
+// @bytes_sent number of payload bytes sent
+// @frames_padded number of frames which were recorded truncated
+//      (snaplen), they are sent with original size, zero-padded
+// @frames_skipped number of frames not replayed (filtered direction,
+//      unknown or invalid channel, malformed record)
+// @send_errors number of frames failed to be sent
+// @duration_ns the replay duration
+// @max_lag_ns the max delay of the frame behind its scheduled time
+//      (ICCOM_REPLAY_TIMING_ORIGINAL only)
+typedef struct iccom_replay_stats {
+        uint64_t frames_sent;
+        uint64_t bytes_sent;
+        uint64_t frames_padded;
+        uint64_t frames_skipped;
+        uint64_t send_errors;
+        uint64_t duration_ns;
+        uint64_t max_lag_ns;
+} iccom_replay_stats;
+
+// Replays the recorded traffic file. Blocks until the whole file
+// (all @loops) is replayed. The records are replayed in their
+// timestamp order (the file order for the equal timestamps), not in
+// the file order. The sockets for the channels are opened
+// on first use and closed at the end.
+//
+// @cfg {valid ptr} the replay configuration
+// @stats {valid ptr || NULL} where to write the replay results to
+//
+// RETURNS:
+//      0: on success (see @stats for per frame failures)
+//      <0: negated error code
+int iccom_replay_run(const iccom_replay_cfg *const cfg
+                     , iccom_replay_stats *const stats);
+
+/* ------------------- ICCOM LINK EMULATION API ------------------------ */
+
+// The link emulator shapes the traffic of the network sockets ICCom
+// modification like the real ICCom link does: the frames are split into
+// fixed size packages (each with its framing overhead), the packages
+// are transferred not more often than the link transfer interval at the
+// link bitrate, and the delivery is delayed by the link latency and
+// jitter. This way the x86 simulation shows the target like throughput
+// and latencies.
+//
+// The frames are shaped per link direction: the frames sent to the
+// loopback remote region channels (see @iccom_loopback_enable) go the
+// "target -> host" direction, all other frames - the "host -> target"
+// one. The frames order within a direction is kept.
+//
+// NOTE: the emulation can also be enabled without the code change, via
+//      the ICCOM_LINK_EMU environment variable, read on the first socket
+//      open, like:
+//          ICCOM_LINK_EMU="bitrate=20000000,package=64,overhead=8,
+//                          interval_us=0,latency_us=200,jitter_us=50,
+//                          queue=256"
+//      (all keys are optional, see @iccom_link_emu_cfg).
+//
+// NOTE: available only in the network sockets ICCom modification, the
+//      kernel one returns -EOPNOTSUPP.
+
+// The link emulation configuration.
+//
+// @bitrate_bps the link bitrate in bits per second, 0 - not limited
+// @package_payload_bytes the payload size of a single link package,
+//      the frame of N bytes takes ceil(N / package_payload_bytes)
+//      packages, 0 - every frame is a single package
+// @package_overhead_bytes the framing overhead of every package (headers,
+//      CRC, ...), counted against the bitrate
+// @xfer_interval_us the minimal period between the package transfers
+//      (the link transfer cycle), 0 - not limited
+// @latency_us the fixed delay added to the delivery of every frame
+// @jitter_us the max random delay (uniform in [0; jitter_us]) added
+//      to the delivery of every frame, the frames order is kept anyway
+// @queue_frames the max frames in flight per link, the senders block
+//      when the queue is full (backpressure), the non-blocking senders
+//      get -EAGAIN, 0 - 256
+typedef struct iccom_link_emu_cfg {
+        uint64_t bitrate_bps;
+        uint32_t package_payload_bytes;
+        uint32_t package_overhead_bytes;
+        uint32_t xfer_interval_us;
+        uint32_t latency_us;
+        uint32_t jitter_us;
+        uint32_t queue_frames;
+} iccom_link_emu_cfg;
+
+// The link emulation counters (since the emulation is enabled).
+//
+// @frames the number of frames sent via the emulated link
+// @bytes the payload bytes sent via the emulated link
+// @packages the number of link packages used
+// @wire_bytes the bytes put onto the emulated wire (payload plus
+//      packages overhead and padding)
+// @blocked_sends the number of sends blocked (or refused with -EAGAIN
+//      on the non-blocking sockets) by the full queue
+// @queue_max the max frames in flight observed
+// @max_delay_ns the max delay of the frame delivery from its send
+typedef struct iccom_link_emu_stats {
+        uint64_t frames;
+        uint64_t bytes;
+        uint64_t packages;
+        uint64_t wire_bytes;
+        uint64_t blocked_sends;
+        uint64_t queue_max;
+        uint64_t max_delay_ns;
+} iccom_link_emu_stats;
+
+// Enables the link emulation (or changes its configuration). The
+// frames in flight are delivered according to the previous
+// configuration.
+//
+// @cfg {valid ptr} the link configuration
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_link_emu_enable(const iccom_link_emu_cfg *const cfg);
+
+// Disables the link emulation, the frames in flight are delivered
+// immediately (keeping the order) before the call returns.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_link_emu_disable(void);
+
+// Gets the link emulation counters.
+//
+// @out {valid ptr} where to write the counters to
+//
+// RETURNS:
+//      0: on success
+//      -ENODEV: the emulation is not enabled
+//      <0: negated error code
+int iccom_link_emu_get_stats(iccom_link_emu_stats *const out);
+
+/* ------------------- ICCOM VIRTUAL CLOCK API ------------------------- */
+
+// The virtual clock speeds up the simulation runs, which spend most of
+// their time waiting for the receive timeouts and sleeping. While the
+// virtual clock is enabled, the receive timeouts (see
+// @iccom_set_socket_read_timeout) and @iccom_vclock_sleep_us run on
+// the virtual time, which goes with the real time, but jumps ahead to
+// the nearest timeout expiration as soon as all simulation participants
+// are idle (waiting in the receive or @iccom_vclock_sleep_us calls).
+//
+// NOTE: the virtual clock covers the waits within the single process,
+//      so all threads taking part in the scenario are to be counted in
+//      the @participants, and to do their waits via libiccom (the
+//      plain sleeps are seen as busy participant and block the jumps).
+//
+// NOTE: available only in the network sockets ICCom modification, in
+//      the kernel one the enable call returns -EOPNOTSUPP, and the
+//      clock and sleep calls run on the real time.
+
+// The virtual clock configuration.
+//
+// @participants {>0} the number of threads taking part in the scenario,
+//      the clock jumps only when all of them are idle
+// @quiet_us the real time all participants are to stay idle before
+//      the jump, gives the frames in flight (relays, link emulation)
+//      the chance to arrive; 0 - 1000us
+typedef struct iccom_vclock_cfg {
+        unsigned int participants;
+        uint32_t quiet_us;
+} iccom_vclock_cfg;
+
+// The virtual clock counters (since the clock is enabled).
+//
+// @jumps the number of the clock jumps
+// @skipped_ns the total virtual time skipped by the jumps
+typedef struct iccom_vclock_stats {
+        uint64_t jumps;
+        uint64_t skipped_ns;
+} iccom_vclock_stats;
+
+// Enables the virtual clock (or changes its configuration).
+//
+// @cfg {valid ptr} the virtual clock configuration
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_vclock_enable(const iccom_vclock_cfg *const cfg);
+
+// Disables the virtual clock, the ongoing waits continue on the real
+// time. The virtual time stays where it is (see @iccom_vclock_now_ns).
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_vclock_disable(void);
+
+// Tells the virtual clock that the calling thread doesn't take part in
+// the scenario anymore (say, it is done and exits), so the clock doesn't
+// wait for it to get idle.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_vclock_leave(void);
+
+// RETURNS: the virtual CLOCK_MONOTONIC time in ns (the real one plus
+//      all the jumps made), the deadlines of the scenario are to be
+//      computed against it
+uint64_t iccom_vclock_now_ns(void);
+
+// Sleeps for the given virtual time, the calling thread is idle
+// participant meanwhile. When the virtual clock is disabled, this is
+// a plain real time sleep.
+//
+// @us the time to sleep in microseconds
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_vclock_sleep_us(const uint64_t us);
+
+// Gets the virtual clock counters.
+//
+// @out {valid ptr} where to write the counters to
+//
+// RETURNS:
+//      0: on success
+//      -ENODEV: the virtual clock is not enabled
+//      <0: negated error code
+int iccom_vclock_get_stats(iccom_vclock_stats *const out);
+
+/* ------------------- ICCOM SOCKET FILTER API ------------------------- */
+
+// The socket filter lets the consumer, which cares only about some
+// messages (identified by the first payload bytes and/or size), to get
+// rid of the rest before it crosses into the user space: the filter
+// rules are compiled into the classic BPF program which is attached to
+// the socket (SO_ATTACH_FILTER), so the kernel drops the unmatched
+// messages right away, and the receive calls never see them.
+//
+// The message passes the filter if it matches ANY of the rules. The
+// message matches the rule if ALL the rule conditions are met.
+//
+// NOTE: in the network sockets ICCom modification the same rules are
+//      evaluated in the library, the unmatched messages are consumed by
+//      the receive call, which then waits for the next message.
+
+// max rules per socket filter
+#define ICCOM_FILTER_MAX_RULES 64
+
+// The single filter rule.
+//
+// @offset the payload offset of the matched field in bytes
+// @width the matched field width in bytes: 1, 2 or 4, the field bytes
+//      are read as big endian number (the first payload byte is the
+//      most significant); 0 - no field match (size range only)
+// @mask the field mask, applied before comparison
+// @value the expected masked field value; the messages shorter than
+//      @offset + @width do not match
+// @min_size the min payload size of the matching message
+// @max_size the max payload size of the matching message, 0 - no limit
+typedef struct iccom_filter_rule {
+        uint32_t offset;
+        uint32_t width;
+        uint32_t mask;
+        uint32_t value;
+        uint32_t min_size;
+        uint32_t max_size;
+} iccom_filter_rule;
+
+// Sets (or replaces) the socket filter. The messages which are already
+// received by the socket are not affected.
+//
+// @sock_fd {valid opened ICCom socket}
+// @rules {valid ptr to @count rules || NULL if @count == 0} the filter
+//      rules, the rules are copied
+// @count [0; ICCOM_FILTER_MAX_RULES] the number of rules, 0 - removes
+//      the filter (see @iccom_clear_socket_filter)
+//
+// RETURNS:
+//      0: on success
+//      -EINVAL: invalid rule (the rule width, mask or offset)
+//      <0: negated error code
+int iccom_set_socket_filter(const int sock_fd
+                            , const iccom_filter_rule *const rules
+                            , const size_t count);
+
+// Removes the socket filter, so the socket receives all messages again.
+// Does nothing if the socket has no filter.
+//
+// @sock_fd {valid opened ICCom socket}
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_clear_socket_filter(const int sock_fd);
+
+/* ------------------- ICCOM SOCKET RECEIVE BUFFER API ----------------- */
+
+// The kernel ICCom delivers the messages into the netlink socket receive
+// queue, and when the queue is full (the consumer doesn't keep up with
+// the burst), the messages are dropped, and the next receive call on
+// the socket fails with -ENOBUFS (the overrun). The API below sizes the
+// socket receive buffer, counts the overruns per socket and optionally
+// grows the buffer on every overrun.
+//
+// NOTE: in the network sockets ICCom modification the stream transport
+//      has the backpressure and never overruns, so the overrun related
+//      calls succeed, but have no effect.
+
+// The socket receive counters (since the socket is opened).
+//
+// @overruns the number of the receive queue overruns (each one means
+//      one or more lost messages)
+// @rcvbuf_grows the number of automatic receive buffer grows
+// @busy_poll_hits the number of messages caught by the receive busy
+//      polling (see @iccom_set_socket_busy_poll)
+// @busy_poll_misses the number of busy polling budgets exhausted
+//      before the message came
+// @busy_poll_budget_ns the current busy polling budget, 0 if disabled
+//      or the socket is considered idle
+// @nomem_drops the number of messages dropped by
+//      @iccom_receive_data_alloc for no buffer memory
+typedef struct iccom_socket_rx_stats {
+        uint64_t overruns;
+        uint64_t rcvbuf_grows;
+        uint64_t busy_poll_hits;
+        uint64_t busy_poll_misses;
+        uint64_t busy_poll_budget_ns;
+        uint64_t nomem_drops;
+} iccom_socket_rx_stats;
+
+// Sets the socket receive buffer size. Tries SO_RCVBUFFORCE first (to
+// exceed the system rmem_max limit, needs CAP_NET_ADMIN), and falls
+// back to SO_RCVBUF (capped by the rmem_max) if not permitted.
+//
+// @sock_fd {valid opened ICCom socket}
+// @bytes {>0} the requested buffer size in bytes (NOTE: the kernel
+//      doubles it for the bookkeeping overhead, see socket(7))
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_set_socket_rcvbuf(const int sock_fd, const int bytes);
+
+// RETURNS:
+//      >0: the current socket receive buffer size in bytes (as
+//          reported by the kernel)
+//      <0: negated error code
+int iccom_get_socket_rcvbuf(const int sock_fd);
+
+// Enables/disables the automatic socket receive buffer sizing: on every
+// overrun the buffer size is doubled up to the given limit, so the
+// buffer adapts to the largest burst observed on the socket.
+//
+// NOTE: without CAP_NET_ADMIN the buffer grows up to the system limit
+//      (net.core.rmem_max) only, what is logged once.
+//
+// @sock_fd {valid opened ICCom socket}
+// @max_bytes the max buffer size to grow to, 0 - disables the automatic
+//      sizing
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_set_socket_rcvbuf_auto(const int sock_fd, const int max_bytes);
+
+// Enables/disables the NETLINK_NO_ENOBUFS mode of the socket: the
+// overruns are not reported to the receive calls (and thus are not
+// counted), the messages are still lost on overrun. Is for the
+// consumers which tolerate the losses and don't want to handle the
+// -ENOBUFS error.
+//
+// @sock_fd {valid opened ICCom socket}
+// @enable !0 - enables the mode, 0 - disables it
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_set_socket_no_enobufs(const int sock_fd, const char enable);
+
+// Gets the socket receive counters.
+//
+// @sock_fd {valid opened ICCom socket}
+// @out {valid ptr} where to write the counters to
+//
+// RETURNS:
+//      0: on success
+//      -EBADF: the socket is not tracked (see sock registry notes)
+//      <0: negated error code
+int iccom_get_socket_rx_stats(const int sock_fd
+                              , iccom_socket_rx_stats *const out);
+
+// Enables/disables the adaptive spin-then-block receive mode of the
+// socket: the receive calls busy poll the socket (non-blocking checks)
+// for the spin budget first, and only then block, so the message which
+// comes within the budget is taken without the wakeup latency of the
+// blocking receive.
+//
+// The budget adapts to the observed waits for the messages: it is
+// about twice the average wait, but within [@max_spin_us / 16;
+// @max_spin_us], and when the average wait exceeds @max_spin_us (the
+// idle channel) the receive blocks right away, so the idle channel
+// doesn't keep the CPU busy.
+//
+// NOTE: the busy polling is a trade of the CPU time for the latency,
+//      it pays off on the channels with the regular traffic and a
+//      dedicated (or at least not overloaded) CPU.
+// NOTE: the read timeout of the socket is counted from the end of
+//      the spin, so the timed out receive takes up to @max_spin_us
+//      longer.
+//
+// @sock_fd {valid opened ICCom socket}
+// @max_spin_us {[0; 100000]} the max spin budget in us, 0 - disables
+//      the busy polling
+//
+// RETURNS:
+//      0: on success
+//      -EBADF: the socket is not tracked (see sock registry notes)
+//      <0: negated error code
+int iccom_set_socket_busy_poll(const int sock_fd, const int max_spin_us);
+
+/* ------------------- ICCOM REAL-TIME API ----------------------------- */
+
+// Prepares the process for the hard real-time steady state, to be
+// called once after the setup (sockets opened, buffers allocated) and
+// before the time critical loop:
+// * locks all current and future process memory (mlockall(2)), so no
+//   page is ever swapped out and the future allocations are faulted
+//   in at once,
+// * tunes the malloc to never give the memory back to the system nor
+//   to serve the allocations by separate mmap()s (no page faults on
+//   the later allocations of the freed memory),
+// * prefaults the calling thread stack for @stack_bytes.
+//
+// NOTE: after that the send/receive nocopy calls and the IccomSocket
+//      send()/receive() don't allocate, don't lock and (with the
+//      ICCOM_RT_PROFILE build option) don't print, see the
+//      iccom_rt_check harness in benchmarks.
+// NOTE: the memory locking requires CAP_IPC_LOCK or the sufficient
+//      RLIMIT_MEMLOCK; if it fails, the rest is done anyway and the
+//      error is returned.
+//
+// @stack_bytes the stack size to prefault, 0 - 64KiB
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_rt_prepare(const size_t stack_bytes);
+
+/* ------------------- ICCOM LIBRARY THREADS PLACEMENT API ------------- */
+
+// The threads owned by the library (the receivers, the dispatchers, the
+// conflators, the broker, the senders, the network sockets loopback,
+// the link emulator, the virtual clock and the flight recorder error
+// dumps thread) are placed by their role:
+// the CPU affinity, the scheduling policy and priority are set per
+// role, and the CPUs of the application workers can be excluded from
+// all library threads at once (isolation). The placement is applied by
+// the thread itself on its start, so it is to be configured before the
+// corresponding facility is started.
+//
+// NOTE: the explicit per instance CPU (like @iccom_receiver_cfg.cpu)
+//      overrides the role CPUs and the isolation.
+// NOTE: the scheduling changes which are not permitted (SCHED_FIFO
+//      without CAP_SYS_NICE for example) are logged and skipped, the
+//      thread runs anyway.
+
+// the library thread roles
+#define ICCOM_THREAD_RECEIVER 0
+#define ICCOM_THREAD_DISPATCHER_WORKER 1
+#define ICCOM_THREAD_DISPATCHER_RX 2
+#define ICCOM_THREAD_LOOPBACK 3
+#define ICCOM_THREAD_LINK_EMU 4
+#define ICCOM_THREAD_VCLOCK 5
+#define ICCOM_THREAD_CONFLATOR 6
+#define ICCOM_THREAD_BROKER 7
+#define ICCOM_THREAD_SENDER 8
+#define ICCOM_THREAD_FLIGHT_RECORDER 9
+#define ICCOM_THREAD_ROLES_COUNT 10
+
+// the library thread scheduling policies
+#define ICCOM_SCHED_INHERIT 0
+#define ICCOM_SCHED_OTHER 1
+#define ICCOM_SCHED_FIFO 2
+#define ICCOM_SCHED_RR 3
+
+#define ICCOM_THREAD_MAX_CPUS 256
+
+// The CPU set, CPU #i is in the set if bit (i % 64) of bits[i / 64] is
+// set. The zero initialized mask is empty.
+typedef struct iccom_cpu_mask {
+        uint64_t bits[ICCOM_THREAD_MAX_CPUS / 64];
+} iccom_cpu_mask;
+
+// The library threads role placement.
+//
+// @cpus the CPUs the role threads run on, empty - any CPU (except the
+//      isolated ones, see @iccom_set_thread_isolation)
+// @spread !0 - every thread of the role is pinned to a single CPU of
+//      @cpus, the threads take the CPUs round robin in the order of
+//      their start; 0 - every thread may run on all @cpus
+// @sched the scheduling policy, ICCOM_SCHED_*
+// @priority the SCHED_FIFO/SCHED_RR priority [1; 99], or the
+//      SCHED_OTHER nice value [-20; 19]
+typedef struct iccom_thread_placement {
+        iccom_cpu_mask cpus;
+        int spread;
+        int sched;
+        int priority;
+} iccom_thread_placement;
+
+// Adds the CPU to the mask.
+static inline void iccom_cpu_mask_add(iccom_cpu_mask *const mask
+                                      , const unsigned int cpu)
+{
+        if (cpu < ICCOM_THREAD_MAX_CPUS) {
+                mask->bits[cpu / 64] |= (uint64_t)1 << (cpu % 64);
+        }
+}
+
+// Sets the placement of the library threads of the given role, applies
+// to the threads started afterwards.
+//
+// @role {ICCOM_THREAD_*} the threads role
+// @placement the placement, NULL - the default one (the threads
+//      inherit the affinity and scheduling of the starting thread)
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_set_thread_placement(const int role
+                               , const iccom_thread_placement *const placement);
+
+// Gets the placement of the library threads of the given role.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_get_thread_placement(const int role
+                               , iccom_thread_placement *const out);
+
+// Isolates the application CPUs from all library threads: the library
+// threads started afterwards never run on the given CPUs (unless
+// pinned to them explicitly).
+//
+// @app_cpus the application CPUs, NULL or empty - no isolation
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_set_thread_isolation(const iccom_cpu_mask *const app_cpus);
+
+
 
 #ifdef __cplusplus
 }
@@ -382,6 +1297,40 @@ namespace
 {
 #endif
 
+// The IccomSocket buffers allocation policy.
+//
+// ICCOM_SOCKET_BUFFERS_RESERVED: (default) both message buffers are
+//      reserved on construction, so no allocations happen at run time
+// ICCOM_SOCKET_BUFFERS_LAZY: every buffer is reserved on its first use
+//      (the first receive, the first written byte), so the send only
+//      socket never gets the input buffer and vice versa
+// ICCOM_SOCKET_BUFFERS_SHARED: the idle socket owns no buffers: the
+//      message is received into the per thread scratch buffer shared
+//      by all SHARED sockets of the thread (the input stays valid till
+//      the next SHARED receive on the thread, then @input_size() gives
+//      0; the input is seen only by the thread which received it, on
+//      other threads @input_size() gives 0), and the outgoing message
+//      is built in the per thread spare
+//      buffer taken on the first write and given back on
+//      @reset_output() (so on every successful @send())
+enum IccomSocketBufferPolicy {
+        ICCOM_SOCKET_BUFFERS_RESERVED = 0,
+        ICCOM_SOCKET_BUFFERS_LAZY = 1,
+        ICCOM_SOCKET_BUFFERS_SHARED = 2
+};
+
+// The per thread buffers of the ICCOM_SOCKET_BUFFERS_SHARED sockets.
+//
+// @in the scratch input buffer
+// @in_owner the id of the socket which @in holds the input of, 0 if
+//      none (see IccomSocket::m_id)
+// @out_spare the spare output buffer (empty if taken)
+struct IccomSocketScratch {
+        std::vector<char> in;
+        uint64_t in_owner;
+        std::vector<char> out_spare;
+};
+
 // Convenience class to wrap raw ICCom API.
 //
 // CONCURRENCE:
@@ -393,27 +1342,39 @@ namespace
 // @m_incoming_data contains the received data including netlink header
 //      and padding
 //      NOTE: its reserved size is always NLMSG_SPACE(maximal message size)
-//          to avoid reallocations at run time.
+//          to avoid reallocations at run time (once allocated, see
+//          @m_buffer_policy).
 //      NOTE: if its actual size is 0, it means
 //          "no data was received correctly"
+//      NOTE: not used by ICCOM_SOCKET_BUFFERS_SHARED socket (always
+//          empty), the input is in the thread scratch then
 // @m_outgoing_data contains the outgoing data including hetlink header
 //      and padding
-//      NOTE: its size never goes below NLMSG_SPACE(0).
+//      NOTE: its size never goes below NLMSG_SPACE(0) unless no buffer
+//          is allocated (size 0, see @m_buffer_policy).
 //      NOTE: if its size is NLMSG_SPACE(0) this means that no output
 //          data was provided yet
 //      NOTE: its reserved size is always NLMSG_SPACE(maximal message size)
-//          to avoid reallocations at run time.
+//          to avoid reallocations at run time (once allocated).
 //      NOTE: its size should be always equal to NLMSG_SPACE(current payload
-//          data size to send)
+//          data size to send) (or 0, see above)
 // @m_outgoing_payload_size as long as @m_outgoing_data vector contains
 //      padding for netlink allignment, we can not use its size to determine
 //      actual size of the output data provided by user, so this variable
 //      tracks the size of the data actually provided by user.
+// @m_buffer_policy the buffers allocation policy
+// @m_id the socket id unique for the process life time, marks the
+//      socket input in the thread scratch (ICCOM_SOCKET_BUFFERS_SHARED
+//      only, 0 otherwise); the socket never keeps a pointer to the
+//      scratch as the receiving thread (and its scratch) may be gone
+//      while the socket is used by another thread
 // @m_debug if true, then debug printing is enabled, otherwise - disabled
 class IccomSocket
 {
 public:
-        IccomSocket(const unsigned int channel);
+        IccomSocket(const unsigned int channel
+                    , const IccomSocketBufferPolicy buffer_policy
+                            = ICCOM_SOCKET_BUFFERS_RESERVED);
         ~IccomSocket();
 
         int open() noexcept;
@@ -429,6 +1390,8 @@ public:
 
         int set_read_timeout(const int ms) const noexcept;
         int read_timeout() const noexcept;
+        int set_filter(const std::vector<iccom_filter_rule> &rules
+                       ) const noexcept;
 
         void set_dbg_mode(const bool dbg_mode) noexcept;
 
@@ -454,11 +1417,18 @@ public:
         inline size_t input_size() const noexcept;
 
 private:
+        static IccomSocketScratch &thread_scratch() noexcept;
+        static uint64_t next_id() noexcept;
+        inline const std::vector<char> &input_data() const noexcept;
+        inline bool prepare_output(const size_t payload_size) noexcept;
+
         int m_sock_fd;
         const unsigned int m_channel;
         std::vector<char> m_incoming_data;
         std::vector<char> m_outgoing_data;
         size_t m_outgoing_payload_size;
+        const IccomSocketBufferPolicy m_buffer_policy;
+        const uint64_t m_id;
         bool m_dbg;
 };
 
@@ -468,6 +1438,9 @@ private:
 // Constructs the @IccomSocket for given channel but doesn't
 // open it.
 //
+// @buffer_policy the message buffers allocation policy, see
+//      IccomSocketBufferPolicy
+//
 // DEFAULT STATE:
 //      output data: empty
 //      input data: empty
@@ -479,23 +1452,36 @@ private:
 //      std::length_error: if requested buffer capacity is bigger
 //          than max_size()
 //      std::bad_alloc: if memory allocation for buffers fail
-IccomSocket::IccomSocket(const unsigned int channel):
+IccomSocket::IccomSocket(const unsigned int channel
+                         , const IccomSocketBufferPolicy buffer_policy):
             m_sock_fd{-EAGAIN}
             , m_channel{channel}
             , m_incoming_data{}
             , m_outgoing_data{}
             , m_outgoing_payload_size{0}
+            , m_buffer_policy{buffer_policy}
+            , m_id{buffer_policy == ICCOM_SOCKET_BUFFERS_SHARED
+                   ? next_id() : 0}
             , m_dbg{false}
 {
         this->m_sock_fd = -1;
         if (iccom_channel_verify(m_channel) < 0) {
                 throw std::out_of_range("channel out of range");
         }
+        if (m_buffer_policy != ICCOM_SOCKET_BUFFERS_RESERVED) {
+                return;
+        }
         this->m_incoming_data.reserve(
                         NLMSG_SPACE(iccom_get_max_payload_size()));
         this->m_outgoing_data.reserve(
                         NLMSG_SPACE(iccom_get_max_payload_size()));
 
+#ifdef ICCOM_RT_PROFILE
+        // the real-time profile: the buffers pages are faulted in here,
+        // not on the first send/receive
+        this->m_incoming_data.resize(m_incoming_data.capacity());
+        this->m_outgoing_data.resize(m_outgoing_data.capacity());
+#endif
         this->m_incoming_data.resize(0);
         this->m_outgoing_data.resize(NLMSG_SPACE(m_outgoing_payload_size));
 }
@@ -504,6 +1490,24 @@ IccomSocket::IccomSocket(const unsigned int channel):
 IccomSocket::~IccomSocket()
 {
         this->close();
+        // the next socket at the same address must not see the input
+        this->reset_input();
+}
+
+// RETURNS:
+//      the scratch buffers of the calling thread
+IccomSocketScratch &IccomSocket::thread_scratch() noexcept
+{
+        static thread_local IccomSocketScratch scratch;
+        return scratch;
+}
+
+// RETURNS:
+//      the new socket id, never 0
+uint64_t IccomSocket::next_id() noexcept
+{
+        static std::atomic<uint64_t> last_id{0};
+        return last_id.fetch_add(1, std::memory_order_relaxed) + 1;
 }
 
 // Opens the socket for corresponding channel.
@@ -606,17 +1610,29 @@ int IccomSocket::send(const bool reset_message_on_success) noexcept
 //      see @iccom_receive_data_nocopy description
 int IccomSocket::receive() noexcept
 {
+        std::vector<char> *in = &m_incoming_data;
+        if (m_buffer_policy == ICCOM_SOCKET_BUFFERS_SHARED) {
+                IccomSocketScratch &scratch = thread_scratch();
+                scratch.in_owner = m_id;
+                in = &scratch.in;
+        }
+
         // NOTE: unless some magic happenes for memory
-        //      allocation/freeing policy, this resize
+        //      allocation/freeing policy (or the buffer is not
+        //      allocated yet, see @m_buffer_policy), this resize
         //      will do nothing more than size value assignment
-        m_incoming_data.resize(NLMSG_SPACE(
-                    iccom_get_max_payload_size()));
+        try {
+                in->resize(NLMSG_SPACE(iccom_get_max_payload_size()));
+        } catch (...) {
+                reset_input();
+                return -ENOMEM;
+        }
 
         int data_offset = 0;
         int res = iccom_receive_data_nocopy(
                         this->m_sock_fd
-                        , m_incoming_data.data()
-                        , m_incoming_data.size()
+                        , in->data()
+                        , in->size()
                         , &data_offset);
         // == 0 case includes the timeout case
         if (res <= 0) {
@@ -628,7 +1644,7 @@ int IccomSocket::receive() noexcept
                 reset_input();
                 return -EFAULT;
         }
-        m_incoming_data.resize(NLMSG_LENGTH(res));
+        in->resize(NLMSG_LENGTH(res));
 
         if (this->m_dbg) {
                 print_channel_data(true, "    [RCV]:");
@@ -654,7 +1670,9 @@ int IccomSocket::send_direct(
         return iccom_send_data(this->m_sock_fd, data.data(), data.size());
 }
 
-// Wrapper of @__iccom_receive_data_pure for current channel
+// Wrapper of @iccom_receive_data_alloc for current channel, the
+// @data_out gets exactly the message size (no max size buffer is
+// allocated per message).
 //
 // @data_out will be resized to 0 in case of failure,
 //      will contain user message in case of success.
@@ -670,14 +1688,17 @@ int IccomSocket::receive_direct(
                 return -EBADFD;
         }
 
-        data_out.resize(NLMSG_SPACE(iccom_get_max_payload_size()));
-        int res = __iccom_receive_data_pure(this->m_sock_fd, data_out.data()
-                                            , data_out.size());
-        if (res < 0) {
+        void *buf = NULL;
+        int data_offset = 0;
+        int res = iccom_receive_data_alloc(this->m_sock_fd, &buf
+                                           , &data_offset);
+        if (res <= 0) {
                 data_out.resize(0);
                 return res;
         }
-        data_out.resize(res);
+        const char *const data = (const char *)buf + data_offset;
+        data_out.assign(data, data + res);
+        iccom_free_received_buffer(buf);
         return res;
 }
 
@@ -713,6 +1734,22 @@ int IccomSocket::read_timeout() const noexcept
         return iccom_get_socket_read_timeout(this->m_sock_fd);
 }
 
+// Sets the socket filter, empty rules vector removes the filter.
+// Wrapper around @iccom_set_socket_filter(...)
+//
+// RETURNS:
+//      0: on success
+//      <0: a negated error code
+int IccomSocket::set_filter(const std::vector<iccom_filter_rule> &rules
+                            ) const noexcept
+{
+        if (!is_open()) {
+                return -EBADF;
+        }
+        return iccom_set_socket_filter(this->m_sock_fd, rules.data()
+                                       , rules.size());
+}
+
 // Sets the debug printing mode.
 //
 // In dbg mode on every receive/send the corresponding
@@ -742,21 +1779,21 @@ void IccomSocket::print_channel_data(const bool incoming
                                , prefix.data(), m_channel);
                         return;
                 }
-                assert(m_incoming_data.size() >= NLMSG_SPACE(size));
+                assert(input_data().size() >= NLMSG_LENGTH(size));
                 print_channel_data_raw(true
-                                , NLMSG_DATA(m_incoming_data.data())
+                                , NLMSG_DATA(input_data().data())
                                 , size, m_channel, prefix);
                 return;
         }
 
-        assert(m_outgoing_data.size()
-                    == NLMSG_SPACE(m_outgoing_payload_size));
-
         if (m_outgoing_payload_size == 0) {
                 printf("%sno output data on channel %d\n"
                        , prefix.data(), m_channel);
                 return;
         }
+
+        assert(m_outgoing_data.size()
+                    == NLMSG_SPACE(m_outgoing_payload_size));
         print_channel_data_raw(false, NLMSG_DATA(m_outgoing_data.data())
                                , m_outgoing_payload_size
                                , m_channel, prefix);
@@ -805,20 +1842,85 @@ void IccomSocket::print_channel_data_raw(
 
 // Resets the output buffer efficiently, so the next write
 // will be at the beginning of the data to send.
+//
+// NOTE: the ICCOM_SOCKET_BUFFERS_SHARED socket gives its output buffer
+//      back to the thread spare (or frees it if the spare is there).
 inline void IccomSocket::reset_output() noexcept
 {
-        m_outgoing_data.resize(NLMSG_SPACE(0));
         m_outgoing_payload_size = 0;
+        if (m_outgoing_data.capacity() == 0) {
+                return;
+        }
+        if (m_buffer_policy != ICCOM_SOCKET_BUFFERS_SHARED) {
+                m_outgoing_data.resize(NLMSG_SPACE(0));
+                return;
+        }
+        IccomSocketScratch &scratch = thread_scratch();
+        if (scratch.out_spare.capacity() == 0) {
+                m_outgoing_data.swap(scratch.out_spare);
+        } else {
+                std::vector<char>().swap(m_outgoing_data);
+        }
 }
 
 // Resets the input buffer efficiently. This is only
 // to track/mark the incoming message as "done", and
 // will not affect the socket work anyhow.
+//
+// NOTE: the ICCOM_SOCKET_BUFFERS_SHARED socket touches only the
+//      scratch of the calling thread, the input in another thread
+//      scratch is left there till overwritten (it is never seen
+//      again, as socket ids are not reused).
 inline void IccomSocket::reset_input() noexcept
 {
+        if (m_buffer_policy == ICCOM_SOCKET_BUFFERS_SHARED) {
+                IccomSocketScratch &scratch = thread_scratch();
+                if (scratch.in_owner == m_id) {
+                        scratch.in.resize(0);
+                        scratch.in_owner = 0;
+                }
+        }
         m_incoming_data.resize(0);
 }
 
+// RETURNS:
+//      the buffer holding the current incoming message (empty if none)
+inline const std::vector<char> &IccomSocket::input_data() const noexcept
+{
+        // the SHARED socket input is gone once another SHARED socket
+        // of the thread receives, and is not seen from other threads
+        if (m_buffer_policy == ICCOM_SOCKET_BUFFERS_SHARED) {
+                const IccomSocketScratch &scratch = thread_scratch();
+                if (scratch.in_owner == m_id) {
+                        return scratch.in;
+                }
+        }
+        return m_incoming_data;
+}
+
+// Makes the outgoing buffer hold @payload_size bytes payload, takes
+// the buffer first if the socket has none yet (see @m_buffer_policy).
+//
+// RETURNS:
+//      true: on success
+//      false: the buffer could not be allocated
+inline bool IccomSocket::prepare_output(const size_t payload_size) noexcept
+{
+        const size_t capacity = NLMSG_SPACE(iccom_get_max_payload_size());
+        if (m_outgoing_data.capacity() < capacity) {
+                if (m_buffer_policy == ICCOM_SOCKET_BUFFERS_SHARED) {
+                        m_outgoing_data.swap(thread_scratch().out_spare);
+                }
+                try {
+                        m_outgoing_data.reserve(capacity);
+                } catch (...) {
+                        return false;
+                }
+        }
+        m_outgoing_data.resize(NLMSG_SPACE(payload_size));
+        return true;
+}
+
 // RETURNS:
 //      the current size of outgoing message (in bytes)
 //      NOTE: only raw consumer data is taken into account
@@ -849,11 +1951,13 @@ inline IccomSocket & IccomSocket::operator <<(const char ch) noexcept
     if (m_outgoing_payload_size >= iccom_get_max_payload_size()) {
             return *this;
     }
-    m_outgoing_data.push_back(ch);
+    // NOTE: the buffer ends with padding, so the character is
+    //      written right after the current payload, not appended
+    if (!prepare_output(m_outgoing_payload_size + 1)) {
+            return *this;
+    }
+    m_outgoing_data[NLMSG_LENGTH(m_outgoing_payload_size)] = ch;
     m_outgoing_payload_size++;
-    // NOTE: this resize is needed, cause padding can be added
-    //      to the end of the buffer after one character addition.
-    m_outgoing_data.resize(NLMSG_SPACE(m_outgoing_payload_size));
     return *this;
 }
 
@@ -867,14 +1971,15 @@ inline IccomSocket & IccomSocket::operator <<(
 {
     // we can not write more data
     if (m_outgoing_payload_size + data.size()
-                    >= iccom_get_max_payload_size()) {
+                    > iccom_get_max_payload_size()) {
             return *this;
     }
-    for (auto ch : data) {
-            this->m_outgoing_data.push_back(ch);
+    if (!prepare_output(m_outgoing_payload_size + data.size())) {
+            return *this;
     }
+    std::copy(data.begin(), data.end(), m_outgoing_data.begin()
+                                        + NLMSG_LENGTH(m_outgoing_payload_size));
     m_outgoing_payload_size += data.size();
-    m_outgoing_data.resize(NLMSG_SPACE(m_outgoing_payload_size));
     return *this;
 }
 
@@ -887,19 +1992,19 @@ inline IccomSocket & IccomSocket::operator <<(
 inline const char & IccomSocket::operator[] (const size_t idx) const noexcept
 {
         assert(idx >= 0 && idx < input_size());
-        return m_incoming_data[idx + NLMSG_LENGTH(0)];
+        return input_data()[idx + NLMSG_LENGTH(0)];
 }
 
 // RETURNS:
 //      the size of current incoming user message (in bytes)
 //      NOTE: only raw consumer data is taken into account
+//      NOTE: @receive() sizes the incoming data to NLMSG_LENGTH(payload
+//          size), so the header length field is not used (its meaning
+//          differs between the backends)
 inline size_t IccomSocket::input_size() const noexcept
 {
-        auto nlmsghdr = (struct nlmsghdr*)(
-                            this->m_incoming_data.data());
-        return (this->m_incoming_data.size() >= NLMSG_SPACE(0))
-                ? (NLMSG_PAYLOAD(nlmsghdr, 0))
-                : 0;
+        const size_t size = input_data().size();
+        return (size >= NLMSG_LENGTH(0)) ? size - NLMSG_LENGTH(0) : 0;
 }
 #endif // ifndef LIBICCOM_CPP_WRAPPER_EXTERNAL
 
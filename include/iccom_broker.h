@@ -0,0 +1,222 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the ICCom local channel broker: the channel can be
+ * bound by a single socket only, so the broker process owns the channel
+ * sockets and shares the channels with any number of client processes
+ * over the shared memory:
+ *
+ * * the received frames of every channel are published into the
+ *   channel rx ring, which the clients map read only; every client
+ *   reads the ring at its own pace, the broker never waits for the
+ *   clients, and the client which falls behind by the whole ring loses
+ *   the overwritten frames (and gets them counted);
+ * * the clients send by putting the frames into the channel tx ring
+ *   (multi-producer, lock free), the broker sends them in batches.
+ *
+ * The broker publishes the frame by receiving it right into the rx ring
+ * slot, and sends the tx ring frames right from their slots, so the
+ * frames are copied only by the clients.
+ *
+ * The shared memory objects (see shm_open(3)) of the broker "NAME" are:
+ * "/NAME.ctl" (the broker wakeup), "/NAME-CH.rx" and "/NAME-CH.tx" for
+ * every channel CH.
+ *
+ * NOTE: the client which dies in the middle of the send (the moment
+ *      between the tx slot reservation and its commit) stalls the
+ *      channel tx ring for about a second: the broker then skips its
+ *      slot (counted as @tx_stalled) and the channel goes on; the
+ *      frames the other clients sent meanwhile are kept. The client
+ *      which is not dead, but stalls that long between the slot
+ *      reservation and the frame write, gets -ETIMEDOUT and writes
+ *      nothing; the client stalled in the middle of the frame write
+ *      is waited for, so no late write ever hits a reused slot.
+ *
+ * NOTE: the client tags its tx slots with its pid, so the clients are
+ *      to run in the broker pid namespace and the client is not to be
+ *      used across fork(2).
+ */
+
+#ifndef LIBICCOM_BROKER_H
+#define LIBICCOM_BROKER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "iccom.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------- ICCOM BROKER API -------------------------------- */
+
+#define ICCOM_BROKER_MAX_CHANNELS 256
+#define ICCOM_BROKER_DEFAULT_NAME "iccom"
+
+typedef struct iccom_broker iccom_broker;
+typedef struct iccom_broker_client iccom_broker_client;
+
+// The broker configuration.
+//
+// @name the shared memory objects name prefix (no slashes), NULL -
+//      ICCOM_BROKER_DEFAULT_NAME
+// @channels {valid ptr} the channels to broker
+// @channels_count {[1; ICCOM_BROKER_MAX_CHANNELS]} the channels number
+// @rx_slots the rx ring size in frames, power of two, 0 - 1024
+// @tx_slots the tx ring size in frames, power of two, 0 - 256
+// @slot_size max frame payload size, 0 - the max ICCom message size;
+//      the longer received frames are dropped; the ring slots are sized
+//      for it, so the small slot size shrinks the rings memory
+// @mode the shared memory objects permissions, 0 - 0660
+// @cpu the CPU to pin the broker threads to, <0 - the threads are placed
+//      as the ICCOM_THREAD_BROKER role (see @iccom_set_thread_placement)
+typedef struct iccom_broker_cfg {
+        const char *name;
+        const unsigned int *channels;
+        unsigned int channels_count;
+        unsigned int rx_slots;
+        unsigned int tx_slots;
+        unsigned int slot_size;
+        unsigned int mode;
+        int cpu;
+} iccom_broker_cfg;
+
+// The broker counters (all channels).
+//
+// @received the number of frames received and published
+// @sent the number of client frames sent
+// @dropped the number of received frames too long for the slot
+// @receive_errors the number of failed receive calls
+// @send_errors the number of client frames failed to be sent
+// @tx_stalled the number of tx slots skipped as reserved but not
+//      committed by their clients in time (see the file description)
+typedef struct iccom_broker_stats {
+        uint64_t received;
+        uint64_t sent;
+        uint64_t dropped;
+        uint64_t receive_errors;
+        uint64_t send_errors;
+        uint64_t tx_stalled;
+} iccom_broker_stats;
+
+// The broker client counters.
+//
+// @received the number of frames read
+// @lost the number of frames overwritten before the client read them
+// @sent the number of frames put into the tx ring
+// @tx_full the number of sends failed on the full tx ring
+typedef struct iccom_broker_client_stats {
+        uint64_t received;
+        uint64_t lost;
+        uint64_t sent;
+        uint64_t tx_full;
+} iccom_broker_client_stats;
+
+// Creates the shared memory objects, opens the channel sockets and
+// starts the broker threads (receive and send).
+//
+// @cfg {valid ptr} the broker configuration
+// @broker__out {valid ptr} where to write the broker ptr to
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_broker_start(const iccom_broker_cfg *const cfg
+                       , iccom_broker **const broker__out);
+
+// Stops the broker, closes the channel sockets and removes the shared
+// memory objects (the clients keep their mappings, but get no more
+// frames).
+//
+// @broker {valid ptr || NULL}
+void iccom_broker_stop(iccom_broker *const broker);
+
+// Gets the broker counters.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_broker_get_stats(const iccom_broker *const broker
+                           , iccom_broker_stats *const out);
+
+// Attaches to the channel of the running broker, the client gets the
+// frames received after the call.
+//
+// @name the broker name, NULL - ICCOM_BROKER_DEFAULT_NAME
+// @channel the channel
+// @client__out {valid ptr} where to write the client ptr to
+//
+// RETURNS:
+//      0: on success
+//      -ENOENT: no broker of the channel
+//      <0: other negated error code
+int iccom_broker_client_open(const char *const name
+                             , const unsigned int channel
+                             , iccom_broker_client **const client__out);
+
+// Detaches from the broker channel.
+//
+// @client {valid ptr || NULL}
+void iccom_broker_client_close(iccom_broker_client *const client);
+
+// Reads the next frame of the channel.
+//
+// CONCURRENCE: to be called by a single thread at a time
+//
+// @client {valid ptr}
+// @buf {valid ptr} where to copy the frame payload to
+// @buf_size the @buf size
+// @timeout_ms the max wait time, 0 - no wait, <0 - infinite
+//
+// RETURNS:
+//      >0: the frame size
+//      0: no frame within the timeout
+//      -EOVERFLOW: the frame doesn't fit the @buf, it is skipped
+//      <0: other negated error code
+int iccom_broker_client_receive(iccom_broker_client *const client
+                                , void *const buf, const size_t buf_size
+                                , const int timeout_ms);
+
+// Puts the frame into the channel tx ring, the broker sends it, never
+// blocks.
+//
+// CONCURRENCE: thread safe
+//
+// @client {valid ptr}
+// @data {valid ptr} the frame payload
+// @size {>0} the payload size
+//
+// RETURNS:
+//      0: on success
+//      -EAGAIN: the tx ring is full
+//      -EMSGSIZE: the frame is longer than the broker slot size
+//      -ETIMEDOUT: the call stalled so long between the slot
+//          reservation and the frame write that the broker skipped the
+//          slot, the frame is not sent (see the file description)
+//      <0: other negated error code
+int iccom_broker_client_send(iccom_broker_client *const client
+                             , const void *const data, const size_t size);
+
+// Gets the client counters.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_broker_client_get_stats(const iccom_broker_client *const client
+                                  , iccom_broker_client_stats *const out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //ifndef LIBICCOM_BROKER_H
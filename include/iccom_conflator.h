@@ -0,0 +1,202 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the ICCom conflating receiver for the channels
+ * carrying the periodic state snapshots, where the consumer needs only
+ * the newest value: the conflator thread drains the channel socket and
+ * keeps only the latest message per channel or per key (the fixed
+ * position payload field), so the consumer which falls behind skips
+ * the intermediate values instead of processing them.
+ *
+ * Every key value is double buffered: the conflator thread receives the
+ * message into its spare buffer, swaps it with the key buffer the
+ * consumer is not expected to read (no copy) and publishes it, so
+ * the consumer reads the latest value lock free and without waiting,
+ * and retries only when the value got updated twice during its read.
+ * Every buffer is guarded by its own sequence counter (seqlock).
+ *
+ * The key slots are preallocated; the key gets the slot on its first
+ * message and keeps it till the conflator is stopped.
+ */
+
+#ifndef LIBICCOM_CONFLATOR_H
+#define LIBICCOM_CONFLATOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "iccom.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------- ICCOM CONFLATOR API ----------------------------- */
+
+typedef struct iccom_conflator iccom_conflator;
+
+// The conflator configuration.
+//
+// @channel the channel to receive from (if @sock_fd is ICCOM_OPEN_SOCKET)
+// @sock_fd the already opened ICCom socket to receive from (the conflator
+//      sets its read timeout to @stop_latency_ms, restores it on stop
+//      and doesn't close the socket), ICCOM_OPEN_SOCKET - the conflator
+//      opens and closes the socket on its own
+// @key_offset {<= ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES - @key_width} the
+//      offset of the key in the payload
+// @key_width {0, 1, 2, 4} the key size in bytes (host byte order),
+//      0 - no key, the channel keeps the single latest value (key 0)
+// @max_keys max number of the distinct keys, 0 - 64
+// @cpu the CPU to pin the conflator thread to, <0 - the thread is placed
+//      as the ICCOM_THREAD_CONFLATOR role (see @iccom_set_thread_placement)
+// @stop_latency_ms the socket read timeout used by the conflator thread,
+//      the max time @iccom_conflator_stop waits for it, 0 - 100ms
+typedef struct iccom_conflator_cfg {
+        unsigned int channel;
+        int sock_fd;
+        unsigned int key_offset;
+        unsigned int key_width;
+        unsigned int max_keys;
+        int cpu;
+        unsigned int stop_latency_ms;
+} iccom_conflator_cfg;
+
+// The conflator counters.
+//
+// @received the number of messages received
+// @keys the number of the distinct keys seen
+// @dropped the number of messages dropped: too short for the key or
+//      no free key slot
+// @receive_errors the number of failed receive calls
+typedef struct iccom_conflator_stats {
+        uint64_t received;
+        uint64_t keys;
+        uint64_t dropped;
+        uint64_t receive_errors;
+} iccom_conflator_stats;
+
+// Starts the conflator thread.
+//
+// @cfg {valid ptr} the conflator configuration
+// @conflator__out {valid ptr} where to write the conflator ptr to
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_conflator_start(const iccom_conflator_cfg *const cfg
+                          , iccom_conflator **const conflator__out);
+
+// Stops the conflator thread and frees the conflator.
+//
+// @conflator {valid ptr || NULL}
+void iccom_conflator_stop(iccom_conflator *const conflator);
+
+// Reads the latest value of the key, never blocks nor enters the kernel.
+//
+// @conflator {valid ptr}
+// @key the key, 0 if the conflator has no key
+// @buf {valid ptr || (NULL && @buf_size == 0)} where to copy the value
+// @buf_size the @buf size
+// @version__inout {valid ptr || NULL} in: the version of the value the
+//      consumer has already seen (0 - none), out: the version read; the
+//      version is the number of messages received for the key, so the
+//      difference between the reads is the number of the values
+//      received meanwhile
+//
+// RETURNS:
+//      >=0: the value size
+//      -ENOENT: no value for the key yet
+//      -EAGAIN: the value is the same as the seen one (@version__inout)
+//      -EOVERFLOW: the value doesn't fit the @buf
+//      <0: other negated error code
+int iccom_conflator_read(iccom_conflator *const conflator
+                         , const uint32_t key, void *const buf
+                         , const size_t buf_size
+                         , uint64_t *const version__inout);
+
+// Gets the conflator counters.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_conflator_get_stats(const iccom_conflator *const conflator
+                              , iccom_conflator_stats *const out);
+
+#ifdef __cplusplus
+}
+
+/* ----------------------- C++ class part ------------------------------ */
+
+// Convenience class to run the conflator, stopped on destruction.
+//
+// CONCURRENCE: read can be called from any number of threads
+class IccomConflator
+{
+public:
+        explicit IccomConflator(const iccom_conflator_cfg &cfg) noexcept
+                : m_cfg(cfg), m_conflator(NULL) {}
+        ~IccomConflator() { stop(); }
+
+        IccomConflator(const IccomConflator &) = delete;
+        IccomConflator &operator=(const IccomConflator &) = delete;
+
+        // RETURNS: see @iccom_conflator_start
+        int start() noexcept
+        {
+                if (m_conflator) {
+                        return 0;
+                }
+                return iccom_conflator_start(&m_cfg, &m_conflator);
+        }
+
+        void stop() noexcept
+        {
+                iccom_conflator_stop(m_conflator);
+                m_conflator = NULL;
+        }
+
+        // Reads the latest key value into @value (resized to the value
+        // size).
+        //
+        // RETURNS: see @iccom_conflator_read, 0 on success
+        int read(const uint32_t key, std::vector<char> &value
+                 , uint64_t *const version__inout = NULL) noexcept
+        {
+                if (!m_conflator) {
+                        return -EBADFD;
+                }
+                value.resize(ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES);
+                const int res = iccom_conflator_read(m_conflator, key
+                                                     , value.data()
+                                                     , value.size()
+                                                     , version__inout);
+                value.resize(res > 0 ? (size_t)res : 0);
+                return res < 0 ? res : 0;
+        }
+
+        iccom_conflator_stats stats() const noexcept
+        {
+                iccom_conflator_stats out = iccom_conflator_stats();
+                if (m_conflator) {
+                        iccom_conflator_get_stats(m_conflator, &out);
+                }
+                return out;
+        }
+
+private:
+        iccom_conflator_cfg m_cfg;
+        iccom_conflator *m_conflator;
+};
+
+#endif
+
+#endif //ifndef LIBICCOM_CONFLATOR_H
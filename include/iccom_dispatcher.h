@@ -0,0 +1,230 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the ICCom work-stealing dispatcher: the messages of
+ * many channels are processed by the pool of worker threads, but the
+ * messages of any given channel are still processed strictly in order,
+ * one at a time.
+ *
+ * Every channel has its strand: the serial queue of the channel messages,
+ * which is scheduled to the workers as a single unit of work. Only one
+ * worker runs the strand at a time, it processes up to the batch of
+ * its messages and then reschedules it (if not empty), so a slow
+ * channel occupies at most one worker, while the other channels are
+ * spread over the other workers. The idle workers steal the scheduled
+ * strands from the busy ones (Chase-Lev work-stealing deques).
+ *
+ * The messages come from the dispatcher receive thread, which drains all
+ * attached channel sockets, or are submitted by the application.
+ */
+
+#ifndef LIBICCOM_DISPATCHER_H
+#define LIBICCOM_DISPATCHER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "iccom.h"
+#include "iccom_receiver.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------- ICCOM DISPATCHER API ---------------------------- */
+
+typedef struct iccom_dispatcher iccom_dispatcher;
+
+// The channel message handler, called by a worker thread, never
+// concurrently for the same channel.
+//
+// @ctx the handler context given at the channel attach
+// @channel the message channel
+// @msg the message, freed by the dispatcher after the handler returns,
+//      unless the handler takes it over (moves it out and zeroes
+//      @msg->buf)
+typedef void (*iccom_dispatch_handler)(void *const ctx
+                                       , const unsigned int channel
+                                       , iccom_rx_message *const msg);
+
+// The dispatcher configuration.
+//
+// @workers the number of the worker threads, 0 - number of online CPUs
+// @first_cpu the CPU to pin the first worker to, the worker #i is pinned
+//      to the CPU @first_cpu + i; <0 - the workers are placed as the
+//      ICCOM_THREAD_DISPATCHER_WORKER role (see
+//      @iccom_set_thread_placement)
+// @strand_batch max messages of the strand processed in a row before
+//      the strand yields the worker to other strands, 0 - 16
+// @max_channels max channels attached to the dispatcher, 0 - 256
+// @max_queue max messages queued in the channel strand (rounded up to
+//      the power of two), 0 - 512; the strand queue is preallocated on
+//      the channel attach, the received message which finds it full is
+//      dropped (see @iccom_dispatcher_stats), the
+//      @iccom_dispatcher_submit gets -EAGAIN
+typedef struct iccom_dispatcher_cfg {
+        unsigned int workers;
+        int first_cpu;
+        unsigned int strand_batch;
+        unsigned int max_channels;
+        unsigned int max_queue;
+} iccom_dispatcher_cfg;
+
+// The dispatcher counters.
+//
+// @dispatched the number of messages processed by the handlers
+// @strand_runs the number of the strand runs
+// @steals the number of the strands stolen by idle workers
+// @dropped the number of the received messages dropped for the full
+//      strand queue
+typedef struct iccom_dispatcher_stats {
+        uint64_t dispatched;
+        uint64_t strand_runs;
+        uint64_t steals;
+        uint64_t dropped;
+} iccom_dispatcher_stats;
+
+// Starts the dispatcher workers and receive thread.
+//
+// @cfg {valid ptr} the dispatcher configuration
+// @dispatcher__out {valid ptr} where to write the dispatcher ptr to
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_dispatcher_start(const iccom_dispatcher_cfg *const cfg
+                           , iccom_dispatcher **const dispatcher__out);
+
+// Stops the dispatcher: stops receiving, waits for all queued messages
+// to be processed, stops the workers and frees the dispatcher (closes
+// the sockets opened by the dispatcher).
+//
+// NOTE: no @iccom_dispatcher_submit calls are allowed once the stop is
+//      called.
+//
+// @dispatcher {valid ptr || NULL}
+void iccom_dispatcher_stop(iccom_dispatcher *const dispatcher);
+
+// Attaches the channel to the dispatcher.
+//
+// @channel the channel
+// @sock_fd the already opened ICCom channel socket to receive from (the
+//      dispatcher sets its read timeout, restores it on stop and doesn't
+//      close the socket), ICCOM_OPEN_SOCKET - the dispatcher opens the
+//      channel socket on its own; ICCOM_DISPATCHER_NO_SOCKET - the
+//      channel gets the messages only via @iccom_dispatcher_submit
+// @handler {valid ptr} the channel message handler
+// @ctx the handler context
+//
+// RETURNS:
+//      0: on success
+//      -EEXIST: the channel is already attached
+//      -ENOSPC: max channels are attached already
+//      <0: negated error code
+#define ICCOM_DISPATCHER_NO_SOCKET (-2)
+int iccom_dispatcher_attach(iccom_dispatcher *const dispatcher
+                            , const unsigned int channel
+                            , const int sock_fd
+                            , const iccom_dispatch_handler handler
+                            , void *const ctx);
+
+// Submits the message to the channel strand, can be called from any
+// thread (including the handlers).
+//
+// @msg {valid ptr} the message, the dispatcher takes it over, @msg gets
+//      empty
+//
+// RETURNS:
+//      0: on success
+//      -ENOENT: the channel is not attached
+//      -EAGAIN: the channel strand queue is full, @msg is left to the
+//          caller
+//      <0: negated error code
+int iccom_dispatcher_submit(iccom_dispatcher *const dispatcher
+                            , const unsigned int channel
+                            , iccom_rx_message *const msg);
+
+// Gets the dispatcher counters.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_dispatcher_get_stats(const iccom_dispatcher *const dispatcher
+                               , iccom_dispatcher_stats *const out);
+
+#ifdef __cplusplus
+}
+
+/* ----------------------- C++ class part ------------------------------ */
+
+// Convenience class to wrap the ICCom dispatcher, the dispatcher is
+// stopped on destruction.
+class IccomDispatcher
+{
+public:
+        explicit IccomDispatcher(const iccom_dispatcher_cfg &cfg) noexcept
+                : m_cfg(cfg), m_dispatcher(NULL) {}
+        ~IccomDispatcher() { stop(); }
+
+        IccomDispatcher(const IccomDispatcher &) = delete;
+        IccomDispatcher &operator=(const IccomDispatcher &) = delete;
+
+        // RETURNS: see @iccom_dispatcher_start
+        int start() noexcept
+        {
+                if (m_dispatcher) {
+                        return 0;
+                }
+                return iccom_dispatcher_start(&m_cfg, &m_dispatcher);
+        }
+
+        void stop() noexcept
+        {
+                iccom_dispatcher_stop(m_dispatcher);
+                m_dispatcher = NULL;
+        }
+
+        bool is_running() const noexcept { return m_dispatcher != NULL; }
+
+        // RETURNS: see @iccom_dispatcher_attach
+        int attach(const unsigned int channel, const int sock_fd
+                   , const iccom_dispatch_handler handler
+                   , void *const ctx) noexcept
+        {
+                return iccom_dispatcher_attach(m_dispatcher, channel
+                                               , sock_fd, handler, ctx);
+        }
+
+        // RETURNS: see @iccom_dispatcher_submit
+        int submit(const unsigned int channel
+                   , iccom_rx_message *const msg) noexcept
+        {
+                return iccom_dispatcher_submit(m_dispatcher, channel, msg);
+        }
+
+        iccom_dispatcher_stats stats() const noexcept
+        {
+                iccom_dispatcher_stats out = iccom_dispatcher_stats();
+                if (m_dispatcher) {
+                        iccom_dispatcher_get_stats(m_dispatcher, &out);
+                }
+                return out;
+        }
+
+private:
+        iccom_dispatcher_cfg m_cfg;
+        iccom_dispatcher *m_dispatcher;
+};
+
+#endif
+
+#endif //ifndef LIBICCOM_DISPATCHER_H
@@ -0,0 +1,371 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the ICCom in-process fan-out: only one socket can
+ * bind the channel, so when several components of the process need the
+ * same channel, the fan-out thread receives its messages once and
+ * publishes every message to all subscribers without copying: the
+ * message buffer is shared, immutable and reference counted, and is
+ * returned to the library pool when the last subscriber releases it.
+ *
+ * Every subscriber has its own bounded queue (SPSC ring) and the policy
+ * for the case the queue is full: drop the new message, drop the oldest
+ * queued one, or make the fan-out thread wait (which backpressures all
+ * subscribers of the channel).
+ */
+
+#ifndef LIBICCOM_FANOUT_H
+#define LIBICCOM_FANOUT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "iccom.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------- ICCOM FANOUT API -------------------------------- */
+
+// the subscriber full queue policies
+#define ICCOM_FANOUT_DROP_NEWEST 0
+#define ICCOM_FANOUT_DROP_OLDEST 1
+#define ICCOM_FANOUT_BLOCK 2
+
+typedef struct iccom_fanout iccom_fanout;
+typedef struct iccom_subscriber iccom_subscriber;
+
+// The shared received message, immutable.
+//
+// @data the message payload
+// @size the payload size
+// @rx_time_ns the CLOCK_MONOTONIC time when the message was received
+//      by the fan-out thread
+typedef struct iccom_shared_msg {
+        const char *data;
+        int size;
+        uint64_t rx_time_ns;
+} iccom_shared_msg;
+
+// The fan-out configuration.
+//
+// @channel the channel to receive from (if @sock_fd is ICCOM_OPEN_SOCKET)
+// @sock_fd the already opened ICCom socket to receive from (the fan-out
+//      sets its read timeout to @stop_latency_ms, restores it on stop
+//      and doesn't close the socket), ICCOM_OPEN_SOCKET - the fan-out
+//      opens and closes the socket on its own
+// @cpu the CPU to pin the fan-out thread to, <0 - the thread is placed
+//      as the ICCOM_THREAD_RECEIVER role (see @iccom_set_thread_placement)
+// @stop_latency_ms the socket read timeout used by the fan-out thread,
+//      the max time @iccom_fanout_stop waits for it, 0 - 100ms
+typedef struct iccom_fanout_cfg {
+        unsigned int channel;
+        int sock_fd;
+        int cpu;
+        unsigned int stop_latency_ms;
+} iccom_fanout_cfg;
+
+// The subscriber configuration.
+//
+// @queue_size the queue size in messages, power of two, 0 - 256
+// @policy ICCOM_FANOUT_* the full queue policy
+typedef struct iccom_subscriber_cfg {
+        unsigned int queue_size;
+        int policy;
+} iccom_subscriber_cfg;
+
+// The fan-out counters.
+//
+// @received the number of messages received
+// @receive_errors the number of failed receive calls
+typedef struct iccom_fanout_stats {
+        uint64_t received;
+        uint64_t receive_errors;
+} iccom_fanout_stats;
+
+// The subscriber counters.
+//
+// @queued the number of messages put into the subscriber queue
+// @dropped the number of messages dropped by the full queue policy
+// @full_waits the number of times the fan-out thread waited for the
+//      subscriber (ICCOM_FANOUT_BLOCK)
+typedef struct iccom_subscriber_stats {
+        uint64_t queued;
+        uint64_t dropped;
+        uint64_t full_waits;
+} iccom_subscriber_stats;
+
+// Takes one more reference to the message, can be called from any
+// thread.
+//
+// @msg {valid ptr got from the subscriber}
+void iccom_shared_msg_ref(const iccom_shared_msg *const msg);
+
+// Releases the reference to the message, the message is freed with the
+// last one, can be called from any thread.
+//
+// @msg {valid ptr got from the subscriber || NULL}
+void iccom_shared_msg_unref(const iccom_shared_msg *const msg);
+
+// Starts the fan-out thread.
+//
+// @cfg {valid ptr} the fan-out configuration
+// @fanout__out {valid ptr} where to write the fan-out ptr to
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_fanout_start(const iccom_fanout_cfg *const cfg
+                       , iccom_fanout **const fanout__out);
+
+// Stops the fan-out thread and frees the fan-out.
+//
+// @fanout {valid ptr, all subscribers unsubscribed || NULL}
+void iccom_fanout_stop(iccom_fanout *const fanout);
+
+// Gets the fan-out counters.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_fanout_get_stats(const iccom_fanout *const fanout
+                           , iccom_fanout_stats *const out);
+
+// Adds the subscriber, it gets the messages received after the call.
+// Can be called while the fan-out runs.
+//
+// @fanout {valid ptr}
+// @cfg {valid ptr} the subscriber configuration
+// @subscriber__out {valid ptr} where to write the subscriber ptr to
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_fanout_subscribe(iccom_fanout *const fanout
+                           , const iccom_subscriber_cfg *const cfg
+                           , iccom_subscriber **const subscriber__out);
+
+// Removes the subscriber and releases its queued messages.
+//
+// @subscriber {valid ptr || NULL}
+void iccom_fanout_unsubscribe(iccom_subscriber *const subscriber);
+
+// Takes the next message of the subscriber if any, never blocks nor
+// enters the kernel.
+//
+// CONCURRENCE: to be called by a single consumer thread at a time
+//
+// @subscriber {valid ptr}
+// @msg__out {valid ptr} where to write the message ptr to, the consumer
+//      owns the reference then (see @iccom_shared_msg_unref)
+//
+// RETURNS:
+//      1: the message is taken
+//      0: no messages
+int iccom_subscriber_poll(iccom_subscriber *const subscriber
+                          , const iccom_shared_msg **const msg__out);
+
+// Same as @iccom_subscriber_poll, but waits for the message if there
+// is none.
+//
+// @timeout_ms the max wait time, <0 - infinite
+//
+// RETURNS:
+//      1: the message is taken
+//      0: timeout
+int iccom_subscriber_wait(iccom_subscriber *const subscriber
+                          , const iccom_shared_msg **const msg__out
+                          , const int timeout_ms);
+
+// Gets the subscriber counters.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_subscriber_get_stats(const iccom_subscriber *const subscriber
+                               , iccom_subscriber_stats *const out);
+
+#ifdef __cplusplus
+}
+
+/* ----------------------- C++ class part ------------------------------ */
+
+// The shared message reference, released on destruction, copying
+// takes one more reference.
+class IccomSharedMsg
+{
+public:
+        IccomSharedMsg() noexcept : m_msg(NULL) {}
+        ~IccomSharedMsg() { iccom_shared_msg_unref(m_msg); }
+
+        IccomSharedMsg(const IccomSharedMsg &other) noexcept
+                : m_msg(other.m_msg)
+        {
+                if (m_msg) {
+                        iccom_shared_msg_ref(m_msg);
+                }
+        }
+        IccomSharedMsg &operator=(const IccomSharedMsg &other) noexcept
+        {
+                if (this != &other) {
+                        if (other.m_msg) {
+                                iccom_shared_msg_ref(other.m_msg);
+                        }
+                        iccom_shared_msg_unref(m_msg);
+                        m_msg = other.m_msg;
+                }
+                return *this;
+        }
+        IccomSharedMsg(IccomSharedMsg &&other) noexcept : m_msg(other.m_msg)
+        {
+                other.m_msg = NULL;
+        }
+        IccomSharedMsg &operator=(IccomSharedMsg &&other) noexcept
+        {
+                if (this != &other) {
+                        iccom_shared_msg_unref(m_msg);
+                        m_msg = other.m_msg;
+                        other.m_msg = NULL;
+                }
+                return *this;
+        }
+
+        bool empty() const noexcept { return m_msg == NULL; }
+        const char *data() const noexcept { return m_msg->data; }
+        size_t size() const noexcept { return (size_t)m_msg->size; }
+        uint64_t rx_time_ns() const noexcept { return m_msg->rx_time_ns; }
+
+        // releases the current message and gives the slot for the new one
+        const iccom_shared_msg **reset() noexcept
+        {
+                iccom_shared_msg_unref(m_msg);
+                m_msg = NULL;
+                return &m_msg;
+        }
+
+private:
+        const iccom_shared_msg *m_msg;
+};
+
+// Convenience class to run the fan-out, stopped on destruction (after
+// all its IccomSubscribers are gone).
+class IccomFanout
+{
+public:
+        explicit IccomFanout(const iccom_fanout_cfg &cfg) noexcept
+                : m_cfg(cfg), m_fanout(NULL) {}
+        ~IccomFanout() { stop(); }
+
+        IccomFanout(const IccomFanout &) = delete;
+        IccomFanout &operator=(const IccomFanout &) = delete;
+
+        // RETURNS: see @iccom_fanout_start
+        int start() noexcept
+        {
+                if (m_fanout) {
+                        return 0;
+                }
+                return iccom_fanout_start(&m_cfg, &m_fanout);
+        }
+
+        void stop() noexcept
+        {
+                iccom_fanout_stop(m_fanout);
+                m_fanout = NULL;
+        }
+
+        iccom_fanout *handle() noexcept { return m_fanout; }
+
+        iccom_fanout_stats stats() const noexcept
+        {
+                iccom_fanout_stats out = iccom_fanout_stats();
+                if (m_fanout) {
+                        iccom_fanout_get_stats(m_fanout, &out);
+                }
+                return out;
+        }
+
+private:
+        iccom_fanout_cfg m_cfg;
+        iccom_fanout *m_fanout;
+};
+
+// Convenience class to subscribe to the started IccomFanout,
+// unsubscribed on destruction.
+//
+// CONCURRENCE: the receive methods are to be called by a single
+//      consumer thread at a time
+class IccomSubscriber
+{
+public:
+        explicit IccomSubscriber(const iccom_subscriber_cfg &cfg
+                                 = iccom_subscriber_cfg()) noexcept
+                : m_cfg(cfg), m_subscriber(NULL) {}
+        ~IccomSubscriber() { unsubscribe(); }
+
+        IccomSubscriber(const IccomSubscriber &) = delete;
+        IccomSubscriber &operator=(const IccomSubscriber &) = delete;
+
+        // RETURNS: see @iccom_fanout_subscribe
+        int subscribe(IccomFanout &fanout) noexcept
+        {
+                if (m_subscriber) {
+                        return 0;
+                }
+                if (!fanout.handle()) {
+                        return -EBADFD;
+                }
+                return iccom_fanout_subscribe(fanout.handle(), &m_cfg
+                                              , &m_subscriber);
+        }
+
+        void unsubscribe() noexcept
+        {
+                iccom_fanout_unsubscribe(m_subscriber);
+                m_subscriber = NULL;
+        }
+
+        // RETURNS: see @iccom_subscriber_poll
+        int poll(IccomSharedMsg &msg) noexcept
+        {
+                return m_subscriber
+                       ? iccom_subscriber_poll(m_subscriber, msg.reset())
+                       : 0;
+        }
+
+        // RETURNS: see @iccom_subscriber_wait
+        int wait(IccomSharedMsg &msg, const int timeout_ms) noexcept
+        {
+                return m_subscriber
+                       ? iccom_subscriber_wait(m_subscriber, msg.reset()
+                                               , timeout_ms)
+                       : 0;
+        }
+
+        iccom_subscriber_stats stats() const noexcept
+        {
+                iccom_subscriber_stats out = iccom_subscriber_stats();
+                if (m_subscriber) {
+                        iccom_subscriber_get_stats(m_subscriber, &out);
+                }
+                return out;
+        }
+
+private:
+        iccom_subscriber_cfg m_cfg;
+        iccom_subscriber *m_subscriber;
+};
+
+#endif
+
+#endif //ifndef LIBICCOM_FANOUT_H
@@ -0,0 +1,323 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the ICCom sub-channels: many logical streams are
+ * multiplexed over a single ICCom channel, so the small streams share
+ * one socket (and its buffers) and one receive loop instead of taking
+ * a channel each.
+ *
+ * Every sub-channel message payload starts with the sub-channel id as
+ * the LEB128 varint (7 bits per byte, low bits first, the high bit set
+ * on all bytes but the last): 1 byte for the ids below 128, 2 bytes
+ * below 16384, up to 5 bytes.
+ *
+ * The demultiplexer thread receives the channel and puts every message
+ * into the queue of its sub-channel stream (the message buffer is moved,
+ * not copied); the full stream queue drops the new messages, so a slow
+ * stream never stalls the others.
+ */
+
+#ifndef LIBICCOM_MUX_H
+#define LIBICCOM_MUX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "iccom.h"
+#include "iccom_receiver.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------- ICCOM SUB-CHANNELS API -------------------------- */
+
+// max sub-channel header size
+#define ICCOM_MUX_MAX_HEADER_SIZE 5
+
+typedef struct iccom_demux iccom_demux;
+typedef struct iccom_demux_stream iccom_demux_stream;
+
+// RETURNS: the header size of the sub-channel id
+static inline size_t iccom_mux_header_size(uint32_t sub_id)
+{
+        size_t size = 1;
+        while (sub_id >= 0x80) {
+                sub_id >>= 7;
+                size++;
+        }
+        return size;
+}
+
+// Writes the sub-channel header.
+//
+// @sub_id the sub-channel id
+// @out {valid ptr, >= @iccom_mux_header_size(@sub_id) bytes} where to
+//      write the header to
+//
+// RETURNS: the header size
+static inline size_t iccom_mux_write_header(uint32_t sub_id
+                                            , void *const out)
+{
+        uint8_t *const p = (uint8_t *)out;
+        size_t i = 0;
+        while (sub_id >= 0x80) {
+                p[i++] = (uint8_t)(sub_id | 0x80);
+                sub_id >>= 7;
+        }
+        p[i++] = (uint8_t)sub_id;
+        return i;
+}
+
+// Reads the sub-channel header.
+//
+// @payload {valid ptr} the message payload
+// @size the payload size
+// @sub_id__out {valid ptr} where to write the sub-channel id to
+//
+// RETURNS:
+//      >0: the header size (the sub-channel data follows it)
+//      -EBADMSG: no valid header
+int iccom_mux_parse(const void *const payload, const size_t size
+                    , uint32_t *const sub_id__out);
+
+// Sends the message to the sub-channel.
+//
+// @sock_fd {valid opened ICCom socket}
+// @sub_id the sub-channel id
+// @data {valid ptr || (NULL && @size == 0)} the sub-channel data
+// @size {<= ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES - the header size}
+//      the data size
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_mux_send(const int sock_fd, const uint32_t sub_id
+                   , const void *const data, const size_t size);
+
+// The demultiplexer configuration.
+//
+// @channel the channel to receive from (if @sock_fd is ICCOM_OPEN_SOCKET)
+// @sock_fd the already opened ICCom socket to receive from (the
+//      demultiplexer sets its read timeout to @stop_latency_ms, restores
+//      it on stop and doesn't close the socket), ICCOM_OPEN_SOCKET - the
+//      demultiplexer opens and closes the socket on its own
+// @max_streams max streams opened at once, 0 - 64
+// @cpu the CPU to pin the demultiplexer thread to, <0 - the thread is
+//      placed as the ICCOM_THREAD_RECEIVER role (see
+//      @iccom_set_thread_placement)
+// @stop_latency_ms the socket read timeout used by the demultiplexer
+//      thread, the max time @iccom_demux_stop waits for it, 0 - 100ms
+typedef struct iccom_demux_cfg {
+        unsigned int channel;
+        int sock_fd;
+        unsigned int max_streams;
+        int cpu;
+        unsigned int stop_latency_ms;
+} iccom_demux_cfg;
+
+// The demultiplexer counters.
+//
+// @received the number of messages received
+// @delivered the number of messages put into the stream queues
+// @dropped the number of messages dropped by the full stream queues
+// @unknown the number of messages of the sub-channels without stream
+// @malformed the number of messages without the valid header
+// @receive_errors the number of failed receive calls
+typedef struct iccom_demux_stats {
+        uint64_t received;
+        uint64_t delivered;
+        uint64_t dropped;
+        uint64_t unknown;
+        uint64_t malformed;
+        uint64_t receive_errors;
+} iccom_demux_stats;
+
+// Starts the demultiplexer thread.
+//
+// @cfg {valid ptr} the demultiplexer configuration
+// @demux__out {valid ptr} where to write the demultiplexer ptr to
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_demux_start(const iccom_demux_cfg *const cfg
+                      , iccom_demux **const demux__out);
+
+// Stops the demultiplexer thread and frees it.
+//
+// @demux {valid ptr, all streams closed || NULL}
+void iccom_demux_stop(iccom_demux *const demux);
+
+// Gets the demultiplexer counters.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_demux_get_stats(const iccom_demux *const demux
+                          , iccom_demux_stats *const out);
+
+// Opens the stream of the sub-channel, it gets the sub-channel messages
+// received after the call. Can be called while the demultiplexer runs.
+//
+// @demux {valid ptr}
+// @sub_id the sub-channel id
+// @queue_size the stream queue size in messages, power of two, 0 - 64
+// @stream__out {valid ptr} where to write the stream ptr to
+//
+// RETURNS:
+//      0: on success
+//      -EEXIST: the sub-channel stream is already open
+//      -ENOSPC: max streams are open
+//      <0: other negated error code
+int iccom_demux_open_stream(iccom_demux *const demux, const uint32_t sub_id
+                            , const unsigned int queue_size
+                            , iccom_demux_stream **const stream__out);
+
+// Closes the stream and frees its queued messages.
+//
+// @stream {valid ptr || NULL}
+void iccom_demux_close_stream(iccom_demux_stream *const stream);
+
+// Takes the next message of the stream if any, never blocks nor enters
+// the kernel.
+//
+// CONCURRENCE: to be called by a single consumer thread at a time
+//
+// @stream {valid ptr}
+// @msg__out {valid ptr} where to write the message to, its payload is
+//      the sub-channel data (without the header), the consumer owns
+//      the message then (see @iccom_rx_message_free)
+//
+// RETURNS:
+//      1: the message is taken
+//      0: no messages
+int iccom_demux_stream_poll(iccom_demux_stream *const stream
+                            , iccom_rx_message *const msg__out);
+
+// Same as @iccom_demux_stream_poll, but waits for the message if there
+// is none.
+//
+// @timeout_ms the max wait time, <0 - infinite
+//
+// RETURNS:
+//      1: the message is taken
+//      0: timeout
+int iccom_demux_stream_wait(iccom_demux_stream *const stream
+                            , iccom_rx_message *const msg__out
+                            , const int timeout_ms);
+
+#ifdef __cplusplus
+}
+
+/* ----------------------- C++ class part ------------------------------ */
+
+// Convenience class to run the demultiplexer, stopped on destruction
+// (after all its IccomDemuxStreams are gone).
+class IccomDemux
+{
+public:
+        explicit IccomDemux(const iccom_demux_cfg &cfg) noexcept
+                : m_cfg(cfg), m_demux(NULL) {}
+        ~IccomDemux() { stop(); }
+
+        IccomDemux(const IccomDemux &) = delete;
+        IccomDemux &operator=(const IccomDemux &) = delete;
+
+        // RETURNS: see @iccom_demux_start
+        int start() noexcept
+        {
+                if (m_demux) {
+                        return 0;
+                }
+                return iccom_demux_start(&m_cfg, &m_demux);
+        }
+
+        void stop() noexcept
+        {
+                iccom_demux_stop(m_demux);
+                m_demux = NULL;
+        }
+
+        iccom_demux *handle() noexcept { return m_demux; }
+
+        iccom_demux_stats stats() const noexcept
+        {
+                iccom_demux_stats out = iccom_demux_stats();
+                if (m_demux) {
+                        iccom_demux_get_stats(m_demux, &out);
+                }
+                return out;
+        }
+
+private:
+        iccom_demux_cfg m_cfg;
+        iccom_demux *m_demux;
+};
+
+// Convenience class to own the sub-channel stream of the started
+// IccomDemux, closed on destruction.
+//
+// CONCURRENCE: the receive methods are to be called by a single
+//      consumer thread at a time
+class IccomDemuxStream
+{
+public:
+        IccomDemuxStream() noexcept : m_stream(NULL) {}
+        ~IccomDemuxStream() { close(); }
+
+        IccomDemuxStream(const IccomDemuxStream &) = delete;
+        IccomDemuxStream &operator=(const IccomDemuxStream &) = delete;
+
+        // RETURNS: see @iccom_demux_open_stream
+        int open(IccomDemux &demux, const uint32_t sub_id
+                 , const unsigned int queue_size = 0) noexcept
+        {
+                if (m_stream) {
+                        return -EALREADY;
+                }
+                if (!demux.handle()) {
+                        return -EBADFD;
+                }
+                return iccom_demux_open_stream(demux.handle(), sub_id
+                                               , queue_size, &m_stream);
+        }
+
+        void close() noexcept
+        {
+                iccom_demux_close_stream(m_stream);
+                m_stream = NULL;
+        }
+
+        // RETURNS: see @iccom_demux_stream_poll
+        int poll(IccomRxMessage &msg) noexcept
+        {
+                return m_stream
+                       ? iccom_demux_stream_poll(m_stream, msg.reset()) : 0;
+        }
+
+        // RETURNS: see @iccom_demux_stream_wait
+        int wait(IccomRxMessage &msg, const int timeout_ms) noexcept
+        {
+                return m_stream
+                       ? iccom_demux_stream_wait(m_stream, msg.reset()
+                                                 , timeout_ms)
+                       : 0;
+        }
+
+private:
+        iccom_demux_stream *m_stream;
+};
+
+#endif
+
+#endif //ifndef LIBICCOM_MUX_H
@@ -0,0 +1,264 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the ICCom dedicated receiver: the channel receive
+ * loop running on its own (optionally pinned) thread, which drains the
+ * socket as fast as the messages come and hands them over to the
+ * consumer thread via the lock-free single producer single consumer
+ * ring. This way the slow consumer processing doesn't delay the socket
+ * draining (and doesn't cause the receive queue overruns), and the
+ * consumer can poll for the messages without any syscall.
+ */
+
+#ifndef LIBICCOM_RECEIVER_H
+#define LIBICCOM_RECEIVER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "iccom.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------- ICCOM RECEIVER API ------------------------------ */
+
+typedef struct iccom_receiver iccom_receiver;
+
+// The received message handle, owns the message buffer (see
+// @iccom_receive_data_alloc) till @iccom_rx_message_free.
+//
+// @buf the message buffer
+// @data_offset the payload offset within the buffer
+// @size the payload size
+// @rx_time_ns the CLOCK_MONOTONIC time when the message was received
+//      by the receiver thread
+typedef struct iccom_rx_message {
+        void *buf;
+        int data_offset;
+        int size;
+        uint64_t rx_time_ns;
+} iccom_rx_message;
+
+// The receiver configuration.
+//
+// @channel the channel to receive from (if @sock_fd is ICCOM_OPEN_SOCKET)
+// @sock_fd the already opened ICCom socket to receive from (the
+//      receiver sets its read timeout to @stop_latency_ms, restores it
+//      on stop and doesn't close the socket), ICCOM_OPEN_SOCKET - the
+//      receiver opens and closes the socket on its own
+//      NOTE: not an ICCom socket (like 0 of the zero initialized
+//          configuration) is rejected
+// @ring_size the ring size in messages, power of two, 0 - 1024; when
+//      the ring is full the receiver waits for the consumer (leaving
+//      the messages in the socket receive queue)
+// @cpu the CPU to pin the receiver thread to, <0 - the thread is placed
+//      as the ICCOM_THREAD_RECEIVER role (see @iccom_set_thread_placement)
+// @stop_latency_ms the socket read timeout used by the receiver thread,
+//      the max time @iccom_receiver_stop waits for it, 0 - 100ms
+typedef struct iccom_receiver_cfg {
+        unsigned int channel;
+        int sock_fd;
+        unsigned int ring_size;
+        int cpu;
+        unsigned int stop_latency_ms;
+} iccom_receiver_cfg;
+
+// The receiver counters.
+//
+// @received the number of messages received
+// @ring_full_waits the number of times the receiver waited for the
+//      consumer to free the ring space
+// @receive_errors the number of failed receive calls
+typedef struct iccom_receiver_stats {
+        uint64_t received;
+        uint64_t ring_full_waits;
+        uint64_t receive_errors;
+} iccom_receiver_stats;
+
+// Starts the receiver thread.
+//
+// @cfg {valid ptr} the receiver configuration
+// @receiver__out {valid ptr} where to write the receiver ptr to
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_receiver_start(const iccom_receiver_cfg *const cfg
+                         , iccom_receiver **const receiver__out);
+
+// Stops the receiver thread and frees the receiver, the messages not
+// taken by the consumer are freed.
+//
+// @receiver {valid ptr || NULL}
+void iccom_receiver_stop(iccom_receiver *const receiver);
+
+// Takes the next received message if any, never blocks nor enters the
+// kernel.
+//
+// CONCURRENCE: to be called by a single consumer thread at a time
+//
+// @receiver {valid ptr}
+// @msg__out {valid ptr} where to write the message to, the consumer
+//      owns the message then (see @iccom_rx_message_free)
+//
+// RETURNS:
+//      1: the message is taken
+//      0: no messages
+int iccom_receiver_poll(iccom_receiver *const receiver
+                        , iccom_rx_message *const msg__out);
+
+// Same as @iccom_receiver_poll, but waits for the message if there is
+// none.
+//
+// @timeout_ms the max wait time, <0 - infinite
+//
+// RETURNS:
+//      1: the message is taken
+//      0: timeout
+int iccom_receiver_wait(iccom_receiver *const receiver
+                        , iccom_rx_message *const msg__out
+                        , const int timeout_ms);
+
+// Gets the receiver counters.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_receiver_get_stats(const iccom_receiver *const receiver
+                             , iccom_receiver_stats *const out);
+
+// Frees the message buffer, can be called from any thread.
+//
+// @msg {valid ptr} the message, gets empty
+void iccom_rx_message_free(iccom_rx_message *const msg);
+
+// RETURNS: the message payload ptr
+static inline const char *iccom_rx_message_data(
+                const iccom_rx_message *const msg)
+{
+        return (const char *)msg->buf + msg->data_offset;
+}
+
+#ifdef __cplusplus
+}
+
+/* ----------------------- C++ class part ------------------------------ */
+
+// The received message owner, frees the message on destruction.
+class IccomRxMessage
+{
+public:
+        IccomRxMessage() noexcept : m_msg() {}
+        ~IccomRxMessage() { iccom_rx_message_free(&m_msg); }
+
+        IccomRxMessage(IccomRxMessage &&other) noexcept : m_msg(other.m_msg)
+        {
+                other.m_msg = iccom_rx_message();
+        }
+        IccomRxMessage &operator=(IccomRxMessage &&other) noexcept
+        {
+                if (this != &other) {
+                        iccom_rx_message_free(&m_msg);
+                        m_msg = other.m_msg;
+                        other.m_msg = iccom_rx_message();
+                }
+                return *this;
+        }
+        IccomRxMessage(const IccomRxMessage &) = delete;
+        IccomRxMessage &operator=(const IccomRxMessage &) = delete;
+
+        bool empty() const noexcept { return m_msg.buf == NULL; }
+        const char *data() const noexcept
+        {
+                return iccom_rx_message_data(&m_msg);
+        }
+        size_t size() const noexcept { return (size_t)m_msg.size; }
+        uint64_t rx_time_ns() const noexcept { return m_msg.rx_time_ns; }
+
+        // frees the current message and gives the slot for the new one
+        iccom_rx_message *reset() noexcept
+        {
+                iccom_rx_message_free(&m_msg);
+                return &m_msg;
+        }
+
+private:
+        iccom_rx_message m_msg;
+};
+
+// Convenience class to wrap the ICCom receiver, the receiver is
+// stopped on destruction.
+//
+// CONCURRENCE: the receive methods are to be called by a single
+//      consumer thread at a time
+class IccomReceiver
+{
+public:
+        explicit IccomReceiver(const iccom_receiver_cfg &cfg) noexcept
+                : m_cfg(cfg), m_receiver(NULL) {}
+        ~IccomReceiver() { stop(); }
+
+        IccomReceiver(const IccomReceiver &) = delete;
+        IccomReceiver &operator=(const IccomReceiver &) = delete;
+
+        // RETURNS: see @iccom_receiver_start
+        int start() noexcept
+        {
+                if (m_receiver) {
+                        return 0;
+                }
+                return iccom_receiver_start(&m_cfg, &m_receiver);
+        }
+
+        void stop() noexcept
+        {
+                iccom_receiver_stop(m_receiver);
+                m_receiver = NULL;
+        }
+
+        bool is_running() const noexcept { return m_receiver != NULL; }
+
+        // RETURNS: true if the message was taken into @msg
+        bool poll(IccomRxMessage &msg) noexcept
+        {
+                return m_receiver
+                       && iccom_receiver_poll(m_receiver, msg.reset()) > 0;
+        }
+
+        // RETURNS: true if the message was taken into @msg within the
+        //      @timeout_ms (<0 - infinite)
+        bool wait(IccomRxMessage &msg, const int timeout_ms) noexcept
+        {
+                return m_receiver
+                       && iccom_receiver_wait(m_receiver, msg.reset()
+                                              , timeout_ms) > 0;
+        }
+
+        // RETURNS: see @iccom_receiver_get_stats
+        int stats(iccom_receiver_stats &out) const noexcept
+        {
+                if (!m_receiver) {
+                        return -ENODEV;
+                }
+                return iccom_receiver_get_stats(m_receiver, &out);
+        }
+
+private:
+        const iccom_receiver_cfg m_cfg;
+        iccom_receiver *m_receiver;
+};
+
+#endif //ifdef __cplusplus
+
+#endif //ifndef LIBICCOM_RECEIVER_H
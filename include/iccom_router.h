@@ -0,0 +1,292 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the ICCom message type router: the message id is
+ * read from the fixed position of the payload (1, 2 or 4 bytes at the
+ * configured offset), and the message is passed to the handler
+ * registered for the id.
+ *
+ * The ids below the configured dense limit are looked up in the flat
+ * table indexed by the id directly, the rest (sparse ids) in the open
+ * addressing hash table, so the dispatch is constant time either way,
+ * and for the dense ids it is a single indexed load.
+ *
+ * Every route counts its messages and bytes.
+ *
+ * CONCURRENCE: the routes are to be set up before the dispatching
+ *      starts; the dispatch is to be run by one thread at a time; the
+ *      counters can be read from any thread.
+ */
+
+#ifndef LIBICCOM_ROUTER_H
+#define LIBICCOM_ROUTER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "iccom.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------- ICCOM ROUTER API -------------------------------- */
+
+// max size of the dense (directly indexed) ids range
+#define ICCOM_ROUTER_MAX_DENSE_IDS 65536
+
+// the message id given to the default handler for the messages too
+// short to contain the id
+#define ICCOM_ROUTER_NO_ID UINT32_MAX
+
+typedef struct iccom_router iccom_router;
+
+// The message handler.
+//
+// @ctx the context given with the route
+// @msg_id the message id
+// @payload the whole message payload (including the id), valid only
+//      during the call
+// @size the payload size
+typedef void (*iccom_route_handler)(void *const ctx, const uint32_t msg_id
+                                    , const void *const payload
+                                    , const size_t size);
+
+// The router configuration.
+//
+// @id_offset {<= ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES - @id_width} the
+//      offset of the message id in the payload
+// @id_width {0, 1, 2, 4} the message id size in bytes, 0 - 1
+// @id_big_endian !0 if the multibyte id is in the network byte order,
+//      0 - in the host byte order
+// @dense_ids {<= ICCOM_ROUTER_MAX_DENSE_IDS} the ids [0; @dense_ids)
+//      are routed by the direct table, 0 - 256
+typedef struct iccom_router_cfg {
+        unsigned int id_offset;
+        unsigned int id_width;
+        int id_big_endian;
+        uint32_t dense_ids;
+} iccom_router_cfg;
+
+// The route counters.
+//
+// @messages the number of the messages passed to the route handler
+// @bytes the total payload size of these messages
+typedef struct iccom_route_stats {
+        uint64_t messages;
+        uint64_t bytes;
+} iccom_route_stats;
+
+// The router counters.
+//
+// @routed the number of messages passed to the route handlers
+// @unrouted the number of messages with the ids without the route
+// @malformed the number of messages too short to contain the id
+typedef struct iccom_router_stats {
+        uint64_t routed;
+        uint64_t unrouted;
+        uint64_t malformed;
+} iccom_router_stats;
+
+// Creates the router without routes.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_router_create(const iccom_router_cfg *const cfg
+                        , iccom_router **const router__out);
+
+// Destroys the router.
+void iccom_router_destroy(iccom_router *const router);
+
+// Sets the handler of the message id, replacing the previous one.
+//
+// @router {valid router}
+// @msg_id {!= ICCOM_ROUTER_NO_ID, fits the configured id width} the id
+//      (the messages with the id ICCOM_ROUTER_NO_ID go to the default
+//      handler)
+// @handler the handler, NULL - removes the route
+// @ctx the handler context
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_router_set_route(iccom_router *const router, const uint32_t msg_id
+                           , const iccom_route_handler handler
+                           , void *const ctx);
+
+// Sets the handler of the messages without the route and the malformed
+// ones (they get ICCOM_ROUTER_NO_ID as the id), NULL - such messages are
+// dropped (default).
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_router_set_default(iccom_router *const router
+                             , const iccom_route_handler handler
+                             , void *const ctx);
+
+// Passes the message payload to the handler of its id.
+//
+// @router {valid router}
+// @payload the message payload
+// @size the payload size
+//
+// RETURNS:
+//      0: the message is passed to its route handler
+//      -ENOENT: no route for the message id (passed to the default
+//          handler if it is set)
+//      -EBADMSG: the message is too short to contain the id (passed to
+//          the default handler if it is set)
+//      <0: other negated error code
+int iccom_router_dispatch(iccom_router *const router
+                          , const void *const payload, const size_t size);
+
+// Receives one message from the socket (blocking up to the socket read
+// timeout) into the router buffer and dispatches it.
+//
+// RETURNS:
+//      see @iccom_router_dispatch
+//      -EAGAIN: no message came within the socket read timeout
+//      <0: negated receive error code (see @iccom_receive_data_nocopy)
+int iccom_router_receive(iccom_router *const router, const int sock_fd);
+
+// Gets the counters of the route.
+//
+// RETURNS:
+//      0: on success
+//      -ENOENT: no route for the id
+//      <0: other negated error code
+int iccom_router_get_route_stats(const iccom_router *const router
+                                 , const uint32_t msg_id
+                                 , iccom_route_stats *const out);
+
+// Gets the router counters.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_router_get_stats(const iccom_router *const router
+                           , iccom_router_stats *const out);
+
+#ifdef __cplusplus
+}
+
+/* ----------------------- C++ class part ------------------------------ */
+
+// Convenience class to own the router and to dispatch the messages
+// received by the IccomSocket.
+//
+// CONCURRENCE: see the router description above
+//
+// NOTE: follows the IccomSocket linkage (see iccom.h).
+#if !defined(LIBICCOM_CPP_WRAPPER_EXTERNAL) \
+    && !defined(LIBICCOM_CPP_WRAPPER_DEFINITION)
+namespace
+{
+#endif
+class IccomRouter
+{
+public:
+        explicit IccomRouter(const iccom_router_cfg &cfg
+                             = iccom_router_cfg()) noexcept
+                : m_router(NULL)
+        {
+                iccom_router_create(&cfg, &m_router);
+        }
+        ~IccomRouter() { iccom_router_destroy(m_router); }
+
+        IccomRouter(const IccomRouter &) = delete;
+        IccomRouter &operator=(const IccomRouter &) = delete;
+
+        // RETURNS: true if the router was created successfully
+        bool is_valid() const noexcept { return m_router != NULL; }
+
+        // RETURNS: see @iccom_router_set_route
+        int set_route(const uint32_t msg_id, const iccom_route_handler handler
+                      , void *const ctx = NULL) noexcept
+        {
+                return m_router ? iccom_router_set_route(m_router, msg_id
+                                                         , handler, ctx)
+                                : -EBADFD;
+        }
+
+        // RETURNS: see @iccom_router_set_default
+        int set_default(const iccom_route_handler handler
+                        , void *const ctx = NULL) noexcept
+        {
+                return m_router ? iccom_router_set_default(m_router
+                                                           , handler, ctx)
+                                : -EBADFD;
+        }
+
+        // Dispatches the message last received by the socket.
+        //
+        // RETURNS:
+        //      -ENODATA: no message received by the socket
+        //      see @iccom_router_dispatch
+        int dispatch(const IccomSocket &sk) noexcept
+        {
+                if (!m_router) {
+                        return -EBADFD;
+                }
+                if (!sk.input_size()) {
+                        return -ENODATA;
+                }
+                return iccom_router_dispatch(m_router, &sk[0]
+                                             , sk.input_size());
+        }
+
+        // Receives the next message by the socket and dispatches it.
+        //
+        // RETURNS:
+        //      see @dispatch
+        //      <0: negated receive error code (see IccomSocket::receive)
+        int receive(IccomSocket &sk) noexcept
+        {
+                const int res = sk.receive();
+                if (res < 0) {
+                        return res;
+                }
+                return dispatch(sk);
+        }
+
+        // RETURNS: the route counters, zeroes if no route
+        iccom_route_stats route_stats(const uint32_t msg_id) const noexcept
+        {
+                iccom_route_stats out = iccom_route_stats();
+                if (m_router) {
+                        iccom_router_get_route_stats(m_router, msg_id, &out);
+                }
+                return out;
+        }
+
+        iccom_router_stats stats() const noexcept
+        {
+                iccom_router_stats out = iccom_router_stats();
+                if (m_router) {
+                        iccom_router_get_stats(m_router, &out);
+                }
+                return out;
+        }
+
+private:
+        iccom_router *m_router;
+};
+#if !defined(LIBICCOM_CPP_WRAPPER_EXTERNAL) \
+    && !defined(LIBICCOM_CPP_WRAPPER_DEFINITION)
+} // end of unnamed namespace
+#endif
+
+#endif
+
+#endif //ifndef LIBICCOM_ROUTER_H
@@ -0,0 +1,313 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the ICCom request/response (RPC) helper: every
+ * request gets the correlation id, many requests can be outstanding on
+ * the channel at once, and the responses are matched to the requests by
+ * the id, so the throughput is not bounded by the round trip time.
+ *
+ * Every RPC message payload starts with @iccom_rpc_hdr. The client
+ * stamps the id into the request, the server copies it into the
+ * response (see @iccom_rpc_parse and @iccom_rpc_reply).
+ *
+ * The client is driven by a single thread: it issues the requests
+ * (@iccom_rpc_call_async) and runs @iccom_rpc_poll, which receives the
+ * responses, expires the timed out requests and calls the completion
+ * callbacks. The outstanding requests are kept in a fixed pool, looked
+ * up by the id via an open addressing hash table, and their timeouts
+ * are tracked by a hashed timer wheel, so all operations are O(1) and
+ * allocation free after the client is created.
+ */
+
+#ifndef LIBICCOM_RPC_H
+#define LIBICCOM_RPC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "iccom.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------- ICCOM RPC API ----------------------------------- */
+
+#define ICCOM_RPC_KIND_REQUEST 1
+#define ICCOM_RPC_KIND_RESPONSE 2
+
+// The RPC message header, in the host byte order.
+//
+// @id the correlation id, never 0
+// @kind ICCOM_RPC_KIND_*
+// @reserved 0
+typedef struct iccom_rpc_hdr {
+        uint32_t id;
+        uint16_t kind;
+        uint16_t reserved;
+} iccom_rpc_hdr;
+
+#define ICCOM_RPC_MAX_BODY_SIZE \
+        (ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES - (int)sizeof(iccom_rpc_hdr))
+
+typedef struct iccom_rpc iccom_rpc;
+
+// The request completion callback.
+//
+// @ctx the context given with the request
+// @status 0 - the response came, -ETIMEDOUT - the request timed out,
+//      -ECANCELED - the client is destroyed
+// @body the response body (valid only during the call), NULL if
+//      @status != 0
+// @size the response body size
+typedef void (*iccom_rpc_callback)(void *const ctx, const int status
+                                   , const void *const body
+                                   , const size_t size);
+
+// The RPC client configuration.
+//
+// @sock_fd {valid opened ICCom socket} the channel socket, the client
+//      doesn't close it
+// @max_outstanding max requests outstanding at once, 0 - 256
+// @tick_ms the timeouts granularity, 0 - 1ms
+typedef struct iccom_rpc_cfg {
+        int sock_fd;
+        unsigned int max_outstanding;
+        unsigned int tick_ms;
+} iccom_rpc_cfg;
+
+// The RPC client counters.
+//
+// @sent the number of requests sent
+// @completed the number of requests completed by the response
+// @timed_out the number of requests timed out
+// @late the number of responses came after the request timed out
+// @unmatched the number of received messages which are not the
+//      responses (or are malformed)
+typedef struct iccom_rpc_stats {
+        uint64_t sent;
+        uint64_t completed;
+        uint64_t timed_out;
+        uint64_t late;
+        uint64_t unmatched;
+} iccom_rpc_stats;
+
+// Creates the RPC client.
+//
+// RETURNS:
+//      0: on success
+//      -EBADF: @cfg->sock_fd is not an ICCom socket
+//      <0: negated error code
+int iccom_rpc_create(const iccom_rpc_cfg *const cfg, iccom_rpc **const rpc__out);
+
+// Destroys the RPC client, the outstanding requests are completed with
+// -ECANCELED.
+//
+// @rpc {valid ptr || NULL}
+void iccom_rpc_destroy(iccom_rpc *const rpc);
+
+// Sends the request, the @callback is called from @iccom_rpc_poll when
+// the response comes or the request times out.
+//
+// @body the request body, @size {[0; ICCOM_RPC_MAX_BODY_SIZE]}
+// @timeout_ms {>0} the response timeout
+// @id__out where to write the request correlation id to, can be NULL
+//
+// RETURNS:
+//      0: on success
+//      -EBUSY: max requests are outstanding already
+//      <0: negated error code
+int iccom_rpc_call_async(iccom_rpc *const rpc, const void *const body
+                         , const size_t size, const unsigned int timeout_ms
+                         , const iccom_rpc_callback callback
+                         , void *const ctx, uint32_t *const id__out);
+
+// Sends the request and waits for its response (other outstanding
+// requests are completed meanwhile as usual).
+//
+// RETURNS:
+//      >=0: the response body size (the body is written to @resp_buf)
+//      -ETIMEDOUT: the request timed out
+//      -EOVERFLOW: the response doesn't fit into @resp_buf
+//      -EPIPE: the stream socket peer has closed the connection
+//      <0: negated error code (the receive failed, the request is
+//          dropped)
+int iccom_rpc_call(iccom_rpc *const rpc, const void *const body
+                   , const size_t size, const unsigned int timeout_ms
+                   , void *const resp_buf, const size_t resp_buf_size);
+
+// Receives the responses and expires the timed out requests, calling
+// their callbacks. Waits up to @timeout_ms for something to happen.
+//
+// NOTE: not to be called from the callbacks.
+//
+// @timeout_ms the max wait, 0 - doesn't wait, <0 - waits till some
+//      request is completed
+//
+// RETURNS:
+//      >=0: the number of requests completed (including timed out ones)
+//      -EPIPE: the stream socket peer has closed the connection
+//      <0: negated error code
+int iccom_rpc_poll(iccom_rpc *const rpc, const int timeout_ms);
+
+// RETURNS: the number of outstanding requests
+unsigned int iccom_rpc_outstanding(const iccom_rpc *const rpc);
+
+// Gets the RPC client counters.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_rpc_get_stats(const iccom_rpc *const rpc
+                        , iccom_rpc_stats *const out);
+
+// Server side: parses the received RPC message.
+//
+// @payload, @size the received message payload
+// @hdr__out where to write the header to
+// @body__out where to write the body ptr to (points into @payload)
+//
+// RETURNS:
+//      >=0: the body size
+//      -EBADMSG: not an RPC message
+int iccom_rpc_parse(const void *const payload, const size_t size
+                    , iccom_rpc_hdr *const hdr__out
+                    , const void **const body__out);
+
+// Server side: sends the response to the request with the given id.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_rpc_reply(const int sock_fd, const uint32_t id
+                    , const void *const body, const size_t size);
+
+#ifdef __cplusplus
+}
+
+/* ----------------------- C++ class part ------------------------------ */
+
+// Convenience class to run the RPC client over the IccomSocket, the
+// client is destroyed (outstanding requests are canceled) on
+// destruction, the socket stays open.
+//
+// CONCURRENCE: to be driven by a single thread
+//
+// NOTE: follows the IccomSocket linkage (see iccom.h).
+#if !defined(LIBICCOM_CPP_WRAPPER_EXTERNAL) \
+    && !defined(LIBICCOM_CPP_WRAPPER_DEFINITION)
+namespace
+{
+#endif
+class IccomRpc
+{
+public:
+        explicit IccomRpc(IccomSocket &socket
+                          , const unsigned int max_outstanding = 0
+                          , const unsigned int tick_ms = 0) noexcept
+                : m_socket(socket), m_max_outstanding(max_outstanding)
+                , m_tick_ms(tick_ms), m_rpc(NULL) {}
+        ~IccomRpc() { iccom_rpc_destroy(m_rpc); }
+
+        IccomRpc(const IccomRpc &) = delete;
+        IccomRpc &operator=(const IccomRpc &) = delete;
+
+        // Opens the socket (if needed) and creates the client.
+        //
+        // RETURNS: see @iccom_rpc_create
+        int start() noexcept
+        {
+                if (m_rpc) {
+                        return 0;
+                }
+                const int fd = m_socket.open();
+                if (fd < 0) {
+                        return fd;
+                }
+                iccom_rpc_cfg cfg = iccom_rpc_cfg();
+                cfg.sock_fd = fd;
+                cfg.max_outstanding = m_max_outstanding;
+                cfg.tick_ms = m_tick_ms;
+                return iccom_rpc_create(&cfg, &m_rpc);
+        }
+
+        // RETURNS: see @iccom_rpc_call_async
+        int call_async(const std::vector<char> &request
+                       , const unsigned int timeout_ms
+                       , const iccom_rpc_callback callback
+                       , void *const ctx) noexcept
+        {
+                if (!m_rpc) {
+                        return -EBADFD;
+                }
+                return iccom_rpc_call_async(m_rpc, request.data()
+                                            , request.size(), timeout_ms
+                                            , callback, ctx, NULL);
+        }
+
+        // Sends the request and waits for the response, @response gets
+        // exactly the response size (0 on failure).
+        //
+        // RETURNS:
+        //      0: on success
+        //      <0: see @iccom_rpc_call
+        int call(const std::vector<char> &request
+                 , std::vector<char> &response
+                 , const unsigned int timeout_ms) noexcept
+        {
+                if (!m_rpc) {
+                        response.resize(0);
+                        return -EBADFD;
+                }
+                response.resize(ICCOM_RPC_MAX_BODY_SIZE);
+                const int res = iccom_rpc_call(m_rpc, request.data()
+                                               , request.size(), timeout_ms
+                                               , response.data()
+                                               , response.size());
+                response.resize(res > 0 ? (size_t)res : 0);
+                return res < 0 ? res : 0;
+        }
+
+        // RETURNS: see @iccom_rpc_poll
+        int poll(const int timeout_ms) noexcept
+        {
+                return m_rpc ? iccom_rpc_poll(m_rpc, timeout_ms) : -EBADFD;
+        }
+
+        unsigned int outstanding() const noexcept
+        {
+                return m_rpc ? iccom_rpc_outstanding(m_rpc) : 0;
+        }
+
+        iccom_rpc_stats stats() const noexcept
+        {
+                iccom_rpc_stats out = iccom_rpc_stats();
+                if (m_rpc) {
+                        iccom_rpc_get_stats(m_rpc, &out);
+                }
+                return out;
+        }
+
+private:
+        IccomSocket &m_socket;
+        unsigned int m_max_outstanding;
+        unsigned int m_tick_ms;
+        iccom_rpc *m_rpc;
+};
+#if !defined(LIBICCOM_CPP_WRAPPER_EXTERNAL) \
+    && !defined(LIBICCOM_CPP_WRAPPER_DEFINITION)
+} // end of unnamed namespace
+#endif
+
+#endif
+
+#endif //ifndef LIBICCOM_RPC_H
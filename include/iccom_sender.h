@@ -0,0 +1,252 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the ICCom concurrent sender: any number of
+ * producer threads send to the same channel without a common lock.
+ * Every producer builds its message right in the transport ready
+ * buffer of its own (see @iccom_tx_message_alloc, taken from the
+ * producer thread buffer cache) and submits the buffer into the lock
+ * free bounded MPSC queue; the single flusher
+ * thread drains the queue and sends the queued messages in batches
+ * (see @iccom_send_data_batch_nocopy), so neither the message building
+ * nor the syscall are serialized between the producers.
+ *
+ * The messages of a single producer are sent in the submit order.
+ */
+
+#ifndef LIBICCOM_SENDER_H
+#define LIBICCOM_SENDER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "iccom.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------- ICCOM SENDER API -------------------------------- */
+
+typedef struct iccom_sender iccom_sender;
+
+// The outgoing message handle, owns the message buffer till submitted
+// (see @iccom_sender_submit) or freed (see @iccom_tx_message_free).
+//
+// @buf the message buffer, the payload is at
+//      @iccom_get_data_payload_offset() (see @iccom_tx_message_data)
+// @capacity the max payload size the buffer can hold
+// @size the payload size to send, set by the producer
+typedef struct iccom_tx_message {
+        void *buf;
+        size_t capacity;
+        size_t size;
+} iccom_tx_message;
+
+// The sender configuration.
+//
+// @channel the channel to send to (if @sock_fd is ICCOM_OPEN_SOCKET)
+// @sock_fd the already opened ICCom socket to send to (the sender
+//      doesn't close it), ICCOM_OPEN_SOCKET - the sender opens and closes
+//      the socket on its own
+// @queue_size the queue size in messages, power of two, 0 - 1024
+// @max_batch max messages sent by the single batch call, 0 - 64
+// @cpu the CPU to pin the flusher thread to, <0 - the thread is placed
+//      as the ICCOM_THREAD_SENDER role (see @iccom_set_thread_placement)
+typedef struct iccom_sender_cfg {
+        unsigned int channel;
+        int sock_fd;
+        unsigned int queue_size;
+        unsigned int max_batch;
+        int cpu;
+} iccom_sender_cfg;
+
+// The sender counters.
+//
+// @submitted the number of messages queued
+// @sent the number of messages sent
+// @batches the number of batch send calls
+// @full the number of submits rejected by the full queue
+// @send_errors the number of messages failed to be sent (dropped)
+typedef struct iccom_sender_stats {
+        uint64_t submitted;
+        uint64_t sent;
+        uint64_t batches;
+        uint64_t full;
+        uint64_t send_errors;
+} iccom_sender_stats;
+
+// Gets the outgoing message buffer (from the same size class pool as
+// the received buffers, so the steady state gets no heap calls).
+//
+// The buffer comes from the calling thread own cache of the pool, the
+// flusher gives the sent buffers back to the producers through the
+// lock free return stack, so in the steady state neither the producers
+// nor the flusher take a lock; the pool lock is taken only when both
+// the thread cache and the return stack are empty (the first messages,
+// the bursts above the cached amount).
+//
+// @capacity [1; ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES] the max payload
+//      size the message is going to have
+// @msg__out {valid ptr} where to write the message to, its @size is 0
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_tx_message_alloc(const size_t capacity
+                           , iccom_tx_message *const msg__out);
+
+// Frees the not submitted message buffer (NULL buffer is fine).
+void iccom_tx_message_free(iccom_tx_message *const msg);
+
+// RETURNS: the message payload ptr
+static inline char *iccom_tx_message_data(const iccom_tx_message *const msg)
+{
+        return (char *)msg->buf + iccom_get_data_payload_offset();
+}
+
+// Starts the sender flusher thread.
+//
+// @cfg {valid ptr} the sender configuration
+// @sender__out {valid ptr} where to write the sender ptr to
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_sender_start(const iccom_sender_cfg *const cfg
+                       , iccom_sender **const sender__out);
+
+// Stops the sender: the messages queued before are still sent, then
+// the flusher thread exits and the sender is freed.
+//
+// @sender {valid ptr, no submits in progress || NULL}
+void iccom_sender_stop(iccom_sender *const sender);
+
+// Queues the message to be sent, never blocks.
+//
+// CONCURRENCE: thread safe, lock free
+//
+// @sender {valid ptr}
+// @msg {valid ptr} the message, its @size in [1; @capacity]; on
+//      success the sender owns the buffer and the message is cleared
+//
+// RETURNS:
+//      0: on success
+//      -EAGAIN: the queue is full (the message stays with the caller)
+//      <0: other negated error code
+int iccom_sender_submit(iccom_sender *const sender
+                        , iccom_tx_message *const msg);
+
+// Copies the data into the new message and submits it.
+//
+// CONCURRENCE: thread safe, lock free in the steady state (see
+//      @iccom_tx_message_alloc)
+//
+// RETURNS: see @iccom_sender_submit
+int iccom_sender_send(iccom_sender *const sender, const void *const data
+                      , const size_t size);
+
+// Waits till all messages submitted before the call are sent (or
+// failed).
+//
+// @timeout_ms the max wait time, <0 - infinite
+//
+// RETURNS:
+//      0: on success
+//      -ETIMEDOUT: the timeout
+int iccom_sender_flush(iccom_sender *const sender, const int timeout_ms);
+
+// Gets the sender counters.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_sender_get_stats(const iccom_sender *const sender
+                           , iccom_sender_stats *const out);
+
+#ifdef __cplusplus
+}
+
+/* ----------------------- C++ class part ------------------------------ */
+
+// Convenience class to run the sender, stopped on destruction.
+//
+// CONCURRENCE: the send methods are thread safe
+class IccomSender
+{
+public:
+        explicit IccomSender(const iccom_sender_cfg &cfg) noexcept
+                : m_cfg(cfg), m_sender(NULL) {}
+        ~IccomSender() { stop(); }
+
+        IccomSender(const IccomSender &) = delete;
+        IccomSender &operator=(const IccomSender &) = delete;
+
+        // RETURNS: see @iccom_sender_start
+        int start() noexcept
+        {
+                if (m_sender) {
+                        return 0;
+                }
+                return iccom_sender_start(&m_cfg, &m_sender);
+        }
+
+        void stop() noexcept
+        {
+                iccom_sender_stop(m_sender);
+                m_sender = NULL;
+        }
+
+        // RETURNS: see @iccom_sender_send
+        int send(const void *const data, const size_t size) noexcept
+        {
+                return m_sender ? iccom_sender_send(m_sender, data, size)
+                                : -EBADFD;
+        }
+
+        // RETURNS: see @iccom_sender_send
+        int send(const std::vector<char> &data) noexcept
+        {
+                return send(data.data(), data.size());
+        }
+
+        // RETURNS: see @iccom_sender_submit
+        int submit(iccom_tx_message &msg) noexcept
+        {
+                return m_sender ? iccom_sender_submit(m_sender, &msg)
+                                : -EBADFD;
+        }
+
+        // RETURNS: see @iccom_sender_flush
+        int flush(const int timeout_ms = -1) noexcept
+        {
+                return m_sender ? iccom_sender_flush(m_sender, timeout_ms)
+                                : 0;
+        }
+
+        iccom_sender_stats stats() const noexcept
+        {
+                iccom_sender_stats out = iccom_sender_stats();
+                if (m_sender) {
+                        iccom_sender_get_stats(m_sender, &out);
+                }
+                return out;
+        }
+
+private:
+        iccom_sender_cfg m_cfg;
+        iccom_sender *m_sender;
+};
+
+#endif
+
+#endif //ifndef LIBICCOM_SENDER_H
@@ -0,0 +1,1154 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the ICCom local channel broker, see iccom_broker.h.
+ *
+ * The rx ring is the broadcast ring: every slot is guarded by its
+ * sequence counter, which is 2 * N + 1 while the frame #N is written
+ * into the slot and 2 * N + 2 when it is there, so the readers detect
+ * the slot overwritten under them. The frames [write_seq - slots + 1;
+ * write_seq) are readable (the slot of the frame #write_seq is the one
+ * being received into).
+ *
+ * The tx ring is the bounded MPSC queue with the per slot sequence
+ * (D. Vyukov): the producers reserve the slot by CAS on the enqueue
+ * position, claim it for the write by CAS of the slot sequence to the
+ * claim tagged with their pid, and commit it by the sequence store;
+ * the broker consumes the committed slots in order. The slot which
+ * stays not committed for ICCOM_BROKER_TX_STALL_MS is taken back by
+ * the broker with the sequence CAS, so the channel is not stuck behind
+ * it: the reserved but not claimed slot at once (the late claim
+ * fails, so the client never writes into the slot given to the next
+ * lap), the claimed one only once its client is dead (the live client
+ * is in the middle of the write, it is waited for).
+ *
+ * Waiting: the broker send thread and the waiting clients sleep on the
+ * futexes in the shared memory, the wakers touch the futex word and
+ * wake only when somebody sleeps (Dekker style flag + full fences).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "iccom.h"
+#include "iccom_broker.h"
+#include "threads.h"
+#include "utils.h"
+
+/* -------------------- BUILD TIME CONFIGURATION ----------------------- */
+
+#define ICCOM_BROKER_DEFAULT_RX_SLOTS 1024
+#define ICCOM_BROKER_DEFAULT_TX_SLOTS 256
+#define ICCOM_BROKER_DEFAULT_MODE 0660
+
+// the broker threads wait timeout and the read timeout of the channel
+// sockets: the stop latency
+#define ICCOM_BROKER_TIMEOUT_MS 100
+
+// max frames of the channel sent by a single batch
+#define ICCOM_BROKER_TX_BATCH 32
+
+// the time the reserved tx slot may stay not committed before the
+// broker skips it (the client is considered dead)
+#define ICCOM_BROKER_TX_STALL_MS 1000
+
+#define ICCOM_BROKER_RX_EVENTS 16
+
+/* -------------------- MACRO DEFINITIONS ------------------------------ */
+
+#define ICCOM_BROKER_MAGIC 0x49434252u
+#define ICCOM_BROKER_LAYOUT_VERSION 2
+
+// the tx slot sequence of the slot claimed for the write, see the file
+// description
+#define ICCOM_BROKER_SLOT_CLAIMED (1ull << 63)
+#define ICCOM_BROKER_SLOT_CLAIM(pos, pid)                                    \
+        (ICCOM_BROKER_SLOT_CLAIMED | ((uint64_t)(uint32_t)(pid) << 32)       \
+         | (uint32_t)(pos))
+#define ICCOM_BROKER_SLOT_CLAIM_PID(seq) ((pid_t)(((seq) >> 32) & INT_MAX))
+
+// max shared memory object name length (with the leading '/')
+#define ICCOM_BROKER_SHM_NAME_MAX 64
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+// The broker control object "/NAME.ctl".
+//
+// @magic ICCOM_BROKER_MAGIC when the object is ready
+// @doorbell the send thread futex, touched by the clients only when
+//      the send thread sleeps
+// @sleeping !0 while the send thread is (about to be) sleeping
+struct iccom_broker_ctl {
+        _Atomic uint32_t magic;
+        uint32_t version;
+        _Alignas(ICCOM_CACHE_LINE_SIZE) _Atomic uint32_t doorbell;
+        _Atomic uint32_t sleeping;
+};
+
+// The ring object header, for both "/NAME-CH.rx" and "/NAME-CH.tx".
+//
+// @magic ICCOM_BROKER_MAGIC when the object is ready
+// @channel the channel
+// @slots the ring size
+// @slot_size the max frame payload size
+// @slot_stride the slot size in the ring
+// @write_seq (rx) the number of the frames published
+// @enqueue_pos (tx) the next slot to reserve by the producers
+// @dequeue_pos (tx) the next slot to consume by the broker
+// @rx_notify (tx) the rx readers futex, touched by the broker only
+//      when @rx_waiters != 0
+// @rx_waiters (tx) the number of the waiting rx readers
+struct iccom_broker_ring {
+        _Atomic uint32_t magic;
+        uint32_t version;
+        uint32_t channel;
+        uint32_t slots;
+        uint32_t slot_size;
+        uint32_t slot_stride;
+        _Alignas(ICCOM_CACHE_LINE_SIZE) _Atomic uint64_t write_seq;
+        _Alignas(ICCOM_CACHE_LINE_SIZE) _Atomic uint64_t enqueue_pos;
+        _Alignas(ICCOM_CACHE_LINE_SIZE) _Atomic uint64_t dequeue_pos;
+        _Alignas(ICCOM_CACHE_LINE_SIZE) _Atomic uint32_t rx_notify;
+        _Atomic uint32_t rx_waiters;
+        _Alignas(ICCOM_CACHE_LINE_SIZE) char slots_area[];
+};
+
+// The ring slot, @buf is the netlink buffer of the frame.
+//
+// @seq see the file description
+// @size the frame payload size
+// @offset the payload offset in @buf
+struct iccom_broker_slot {
+        _Atomic uint64_t seq;
+        int32_t size;
+        int32_t offset;
+        char buf[];
+};
+
+// The mapped ring.
+//
+// @ring the mapping
+// @size the mapping size
+struct iccom_broker_map {
+        struct iccom_broker_ring *ring;
+        size_t size;
+};
+
+// @channel the channel
+// @sock_fd the channel socket
+// @rx, @tx the channel rings
+// @stall_pos the tx position the broker waits to be committed since
+//      @stall_ns (0 - not waiting)
+struct iccom_broker_channel {
+        unsigned int channel;
+        int sock_fd;
+        struct iccom_broker_map rx;
+        struct iccom_broker_map tx;
+        uint64_t stall_pos;
+        uint64_t stall_ns;
+};
+
+// @name the broker name
+// @channels the channels, @channels_count of them
+// @ctl the control object, @ctl_size mapped
+// @buf_size the slot netlink buffer size (fits the slot size payload)
+// @epoll_fd the receive thread epoll
+// @rx_thread, @tx_thread the receive and send threads
+// @threads the number of the started threads
+// @stop !0 when the threads are to exit
+// @cpu the CPU to pin the threads to, <0 if none
+// @received, @sent, @dropped, @receive_errors, @send_errors,
+//      @tx_stalled the counters
+struct iccom_broker {
+        char name[ICCOM_BROKER_SHM_NAME_MAX];
+        struct iccom_broker_channel *channels;
+        unsigned int channels_count;
+        struct iccom_broker_ctl *ctl;
+        size_t buf_size;
+        int epoll_fd;
+        pthread_t rx_thread;
+        pthread_t tx_thread;
+        int threads;
+        _Atomic int stop;
+        int cpu;
+        _Atomic uint64_t received;
+        _Atomic uint64_t sent;
+        _Atomic uint64_t dropped;
+        _Atomic uint64_t receive_errors;
+        _Atomic uint64_t send_errors;
+        _Atomic uint64_t tx_stalled;
+};
+
+// @rx, @tx the channel rings
+// @ctl the broker control object
+// @pos the next frame to read
+// @pid the client process, tags the tx slot claims
+// @received, @lost the reader counters
+// @sent, @tx_full the sender counters
+struct iccom_broker_client {
+        struct iccom_broker_map rx;
+        struct iccom_broker_map tx;
+        struct iccom_broker_ctl *ctl;
+        uint64_t pos;
+        pid_t pid;
+        _Atomic uint64_t received;
+        _Atomic uint64_t lost;
+        _Atomic uint64_t sent;
+        _Atomic uint64_t tx_full;
+};
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+static inline struct iccom_broker_slot *iccom_broker_slot(
+                const struct iccom_broker_ring *const ring
+                , const uint64_t pos)
+{
+        return (struct iccom_broker_slot *)(ring->slots_area
+                        + (size_t)(pos & (ring->slots - 1))
+                          * ring->slot_stride);
+}
+
+static int iccom_broker_futex_wait(_Atomic uint32_t *const addr
+                                   , const uint32_t val, const int timeout_ms)
+{
+        struct timespec ts = {
+                .tv_sec = timeout_ms / 1000
+                , .tv_nsec = (long)(timeout_ms % 1000) * 1000000
+        };
+        return (int)syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT, val
+                            , timeout_ms < 0 ? NULL : &ts, NULL, 0);
+}
+
+static void iccom_broker_futex_wake(_Atomic uint32_t *const addr
+                                    , const int count)
+{
+        syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE, count, NULL, NULL
+                , 0);
+}
+
+// Composes the shared memory object name.
+//
+// @suffix the name suffix, like ".ctl" or "-100.rx"
+static int iccom_broker_shm_name(char *const out, const char *const name
+                                 , const char *const suffix)
+{
+        const int len = snprintf(out, ICCOM_BROKER_SHM_NAME_MAX, "/%s%s"
+                                 , name ? name : ICCOM_BROKER_DEFAULT_NAME
+                                 , suffix);
+        if (len < 0 || len >= ICCOM_BROKER_SHM_NAME_MAX
+                    || strchr(out + 1, '/')) {
+                log("Invalid broker name: %s", name);
+                return -EINVAL;
+        }
+        return 0;
+}
+
+// Creates (replacing the stale one) and maps the shared memory object.
+//
+// RETURNS: the mapping, NULL on failure (errno is set)
+static void *iccom_broker_shm_create(const char *const shm_name
+                                     , const size_t size
+                                     , const unsigned int mode)
+{
+        shm_unlink(shm_name);
+        const int fd = shm_open(shm_name, O_CREAT | O_EXCL | O_RDWR
+                                , (mode_t)mode);
+        if (fd < 0) {
+                return NULL;
+        }
+        // not limited by the umask
+        void *mem = MAP_FAILED;
+        if (fchmod(fd, (mode_t)mode) == 0 && ftruncate(fd, (off_t)size) == 0) {
+                mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED
+                           , fd, 0);
+        }
+        const int err = errno;
+        close(fd);
+        if (mem == MAP_FAILED) {
+                shm_unlink(shm_name);
+                errno = err;
+                return NULL;
+        }
+        return mem;
+}
+
+// Maps the existing shared memory object as a whole.
+//
+// RETURNS: the mapping, NULL on failure (errno is set)
+static void *iccom_broker_shm_map(const char *const shm_name
+                                  , const int writable, size_t *const size__out)
+{
+        const int fd = shm_open(shm_name, writable ? O_RDWR : O_RDONLY, 0);
+        if (fd < 0) {
+                return NULL;
+        }
+        struct stat st;
+        void *mem = MAP_FAILED;
+        if (fstat(fd, &st) == 0) {
+                if (st.st_size > 0) {
+                        mem = mmap(NULL, (size_t)st.st_size
+                                   , writable ? PROT_READ | PROT_WRITE
+                                              : PROT_READ
+                                   , MAP_SHARED, fd, 0);
+                } else {
+                        // created, but not sized yet
+                        errno = ENOENT;
+                }
+        }
+        const int err = errno;
+        close(fd);
+        if (mem == MAP_FAILED) {
+                errno = err;
+                return NULL;
+        }
+        *size__out = (size_t)st.st_size;
+        return mem;
+}
+
+// Creates the channel ring object.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+static int iccom_broker_ring_create(struct iccom_broker *const b
+                                    , struct iccom_broker_map *const map
+                                    , const char *const suffix
+                                    , const unsigned int channel
+                                    , const unsigned int slots
+                                    , const unsigned int slot_size
+                                    , const unsigned int mode
+                                    , const int tx)
+{
+        char shm_name[ICCOM_BROKER_SHM_NAME_MAX];
+        char ring_suffix[32];
+        snprintf(ring_suffix, sizeof(ring_suffix), "-%u%s", channel, suffix);
+        int res = iccom_broker_shm_name(shm_name, b->name, ring_suffix);
+        if (res < 0) {
+                return res;
+        }
+        const size_t stride = (sizeof(struct iccom_broker_slot) + b->buf_size
+                               + ICCOM_CACHE_LINE_SIZE - 1)
+                              / ICCOM_CACHE_LINE_SIZE * ICCOM_CACHE_LINE_SIZE;
+        const size_t size = sizeof(struct iccom_broker_ring) + slots * stride;
+        struct iccom_broker_ring *const ring = (struct iccom_broker_ring *)
+                        iccom_broker_shm_create(shm_name, size, mode);
+        if (!ring) {
+                res = -errno;
+                log("Could not create the broker ring %s: %d(%s)", shm_name
+                    , errno, strerror(errno));
+                return res;
+        }
+        ring->version = ICCOM_BROKER_LAYOUT_VERSION;
+        ring->channel = channel;
+        ring->slots = slots;
+        ring->slot_size = slot_size;
+        ring->slot_stride = (uint32_t)stride;
+        for (unsigned int i = 0; i < slots; i++) {
+                // tx: the slot #i is free for the position i; rx: no
+                // frame (the frame #0 expects 2)
+                atomic_init(&iccom_broker_slot(ring, i)->seq, tx ? i : 0);
+        }
+        atomic_store_explicit(&ring->magic, ICCOM_BROKER_MAGIC
+                              , memory_order_release);
+        map->ring = ring;
+        map->size = size;
+        return 0;
+}
+
+static void iccom_broker_ring_remove(const struct iccom_broker *const b
+                                     , struct iccom_broker_map *const map
+                                     , const char *const suffix)
+{
+        if (!map->ring) {
+                return;
+        }
+        char shm_name[ICCOM_BROKER_SHM_NAME_MAX];
+        char ring_suffix[32];
+        snprintf(ring_suffix, sizeof(ring_suffix), "-%u%s"
+                 , map->ring->channel, suffix);
+        if (iccom_broker_shm_name(shm_name, b->name, ring_suffix) == 0) {
+                shm_unlink(shm_name);
+        }
+        munmap(map->ring, map->size);
+        map->ring = NULL;
+}
+
+// Receives the frame of the channel right into the next rx ring slot
+// and publishes it.
+static void iccom_broker_publish(struct iccom_broker *const b
+                                 , struct iccom_broker_channel *const ch)
+{
+        struct iccom_broker_ring *const rx = ch->rx.ring;
+        const uint64_t n = atomic_load_explicit(&rx->write_seq
+                                                , memory_order_relaxed);
+        struct iccom_broker_slot *const slot = iccom_broker_slot(rx, n);
+
+        // the readers of the frame #(n - slots) see it is gone
+        atomic_store_explicit(&slot->seq, 2 * n + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        // the frames longer than the slot are consumed and dropped by
+        // the receive call itself (-EOVERFLOW)
+        int offset;
+        const int res = iccom_receive_data_nocopy(ch->sock_fd, slot->buf
+                                                  , b->buf_size, &offset);
+        if (res == -EOVERFLOW) {
+                atomic_fetch_add_explicit(&b->dropped, 1
+                                          , memory_order_relaxed);
+                return;
+        }
+        if (res <= 0) {
+                if (res < 0 && res != -EINTR) {
+                        atomic_fetch_add_explicit(&b->receive_errors, 1
+                                                  , memory_order_relaxed);
+                }
+                return;
+        }
+        slot->size = res;
+        slot->offset = offset;
+        atomic_store_explicit(&slot->seq, 2 * n + 2, memory_order_release);
+        atomic_store_explicit(&rx->write_seq, n + 1, memory_order_release);
+        atomic_fetch_add_explicit(&b->received, 1, memory_order_relaxed);
+
+        // pairs with the fence in @iccom_broker_client_receive
+        atomic_thread_fence(memory_order_seq_cst);
+        struct iccom_broker_ring *const tx = ch->tx.ring;
+        if (atomic_load_explicit(&tx->rx_waiters, memory_order_relaxed)) {
+                atomic_fetch_add_explicit(&tx->rx_notify, 1
+                                          , memory_order_release);
+                iccom_broker_futex_wake(&tx->rx_notify, INT_MAX);
+        }
+}
+
+// The receive thread: publishes the frames of all channels.
+static void *iccom_broker_rx_loop(void *arg)
+{
+        struct iccom_broker *const b = (struct iccom_broker *)arg;
+        struct epoll_event events[ICCOM_BROKER_RX_EVENTS];
+
+        __iccom_thread_place(ICCOM_THREAD_BROKER, b->cpu);
+
+        while (!atomic_load_explicit(&b->stop, memory_order_relaxed)) {
+                const int n = epoll_wait(b->epoll_fd, events
+                                         , ICCOM_BROKER_RX_EVENTS
+                                         , ICCOM_BROKER_TIMEOUT_MS);
+                for (int i = 0; i < n; i++) {
+                        struct iccom_broker_channel *const ch
+                                = (struct iccom_broker_channel *)
+                                  events[i].data.ptr;
+                        if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                                log("Channel %u socket %d is closed or"
+                                    " failed, not receiving from it anymore"
+                                    , ch->channel, ch->sock_fd);
+                                epoll_ctl(b->epoll_fd, EPOLL_CTL_DEL
+                                          , ch->sock_fd, NULL);
+                                continue;
+                        }
+                        iccom_broker_publish(b, ch);
+                }
+        }
+        return NULL;
+}
+
+// Skips the tx slot which is reserved but not committed for longer than
+// ICCOM_BROKER_TX_STALL_MS, otherwise the dead client would stall the
+// channel tx ring for good. The slot claimed for the write is skipped
+// only once its client is dead.
+//
+// @pos the next tx position, not committed
+//
+// RETURNS: 1 if the slot is skipped, 0 otherwise
+static int iccom_broker_tx_stall(struct iccom_broker *const b
+                                 , struct iccom_broker_channel *const ch
+                                 , const uint64_t pos)
+{
+        struct iccom_broker_ring *const tx = ch->tx.ring;
+        // nothing reserved: just empty
+        if (atomic_load_explicit(&tx->enqueue_pos, memory_order_relaxed)
+                        == pos) {
+                ch->stall_ns = 0;
+                return 0;
+        }
+        const uint64_t now = __iccom_now_ns();
+        if (!ch->stall_ns || ch->stall_pos != pos) {
+                ch->stall_pos = pos;
+                ch->stall_ns = now;
+                return 0;
+        }
+        if (now - ch->stall_ns < ICCOM_BROKER_TX_STALL_MS * 1000000ull) {
+                return 0;
+        }
+
+        struct iccom_broker_slot *const slot = iccom_broker_slot(tx, pos);
+        uint64_t expected = atomic_load_explicit(&slot->seq
+                                                 , memory_order_acquire);
+        if (expected & ICCOM_BROKER_SLOT_CLAIMED) {
+                // the client is in the middle of the write: the slot
+                // is reused only once nobody may write into it anymore
+                const pid_t pid = ICCOM_BROKER_SLOT_CLAIM_PID(expected);
+                if (kill(pid, 0) == 0 || errno != ESRCH) {
+                        return 0;
+                }
+        } else if (expected != pos) {
+                // committed right now
+                return 0;
+        }
+
+        ch->stall_ns = 0;
+        // the reserved but not claimed slot keeps the sequence it had
+        // while free, the client claim CAS fails once the slot is
+        // given to the next lap
+        if (!atomic_compare_exchange_strong_explicit(
+                        &slot->seq, &expected, pos + tx->slots
+                        , memory_order_acq_rel, memory_order_relaxed)) {
+                // claimed or committed right now
+                return 0;
+        }
+        atomic_store_explicit(&tx->dequeue_pos, pos + 1
+                              , memory_order_relaxed);
+        atomic_fetch_add_explicit(&b->tx_stalled, 1, memory_order_relaxed);
+        log("The channel %u tx slot stayed not committed for %d ms"
+            ", skipped.", ch->channel, ICCOM_BROKER_TX_STALL_MS);
+        return 1;
+}
+
+// Sends the committed frames of the channel tx ring (up to the batch).
+//
+// RETURNS: the number of the frames consumed
+static int iccom_broker_send(struct iccom_broker *const b
+                             , struct iccom_broker_channel *const ch)
+{
+        struct iccom_broker_ring *const tx = ch->tx.ring;
+        iccom_send_batch_item items[ICCOM_BROKER_TX_BATCH];
+        const uint64_t start = atomic_load_explicit(&tx->dequeue_pos
+                                                    , memory_order_relaxed);
+        size_t consumed = 0;
+        size_t count = 0;
+        while (consumed < ICCOM_BROKER_TX_BATCH) {
+                const struct iccom_broker_slot *const slot
+                                = iccom_broker_slot(tx, start + consumed);
+                if (atomic_load_explicit(&slot->seq, memory_order_acquire)
+                                != start + consumed + 1) {
+                        break;
+                }
+                consumed++;
+                // the size is written by the client, the bad one would
+                // fail the whole batch
+                const int32_t size = slot->size;
+                if (size <= 0 || (uint32_t)size > tx->slot_size) {
+                        atomic_fetch_add_explicit(&b->send_errors, 1
+                                                  , memory_order_relaxed);
+                        continue;
+                }
+                items[count].buf = slot->buf;
+                items[count].buf_size_bytes = iccom_get_required_buffer_size(
+                                (size_t)size);
+                items[count].data_size_bytes = (size_t)size;
+                count++;
+        }
+        if (!consumed) {
+                return iccom_broker_tx_stall(b, ch, start);
+        }
+        ch->stall_ns = 0;
+
+        size_t done = 0;
+        while (done < count) {
+                const int res = iccom_send_data_batch_nocopy(ch->sock_fd
+                                                , items + done, count - done);
+                if (res > 0) {
+                        atomic_fetch_add_explicit(&b->sent, (uint64_t)res
+                                                  , memory_order_relaxed);
+                        done += (size_t)res;
+                        continue;
+                }
+                // the frame failed for good, no retries (the clients
+                // would stall)
+                atomic_fetch_add_explicit(&b->send_errors, 1
+                                          , memory_order_relaxed);
+                done++;
+        }
+
+        for (size_t i = 0; i < consumed; i++) {
+                atomic_store_explicit(&iccom_broker_slot(tx, start + i)->seq
+                                      , start + i + tx->slots
+                                      , memory_order_release);
+        }
+        atomic_store_explicit(&tx->dequeue_pos, start + consumed
+                              , memory_order_relaxed);
+        return (int)consumed;
+}
+
+// RETURNS: !0 if any tx ring has the committed frame
+static int iccom_broker_tx_pending(const struct iccom_broker *const b)
+{
+        for (unsigned int i = 0; i < b->channels_count; i++) {
+                const struct iccom_broker_ring *const tx
+                                = b->channels[i].tx.ring;
+                const uint64_t pos = atomic_load_explicit(&tx->dequeue_pos
+                                                        , memory_order_relaxed);
+                if (atomic_load_explicit(&iccom_broker_slot(tx, pos)->seq
+                                         , memory_order_acquire) == pos + 1) {
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+// The send thread: sends the client frames of all channels.
+static void *iccom_broker_tx_loop(void *arg)
+{
+        struct iccom_broker *const b = (struct iccom_broker *)arg;
+        struct iccom_broker_ctl *const ctl = b->ctl;
+
+        __iccom_thread_place(ICCOM_THREAD_BROKER, b->cpu);
+
+        while (!atomic_load_explicit(&b->stop, memory_order_relaxed)) {
+                int sent = 0;
+                for (unsigned int i = 0; i < b->channels_count; i++) {
+                        sent += iccom_broker_send(b, &b->channels[i]);
+                }
+                if (sent) {
+                        continue;
+                }
+
+                const uint32_t bell = atomic_load_explicit(&ctl->doorbell
+                                                        , memory_order_relaxed);
+                atomic_store_explicit(&ctl->sleeping, 1, memory_order_relaxed);
+                // pairs with the fence in @iccom_broker_client_send
+                atomic_thread_fence(memory_order_seq_cst);
+                if (!iccom_broker_tx_pending(b)) {
+                        iccom_broker_futex_wait(&ctl->doorbell, bell
+                                                , ICCOM_BROKER_TIMEOUT_MS);
+                }
+                atomic_store_explicit(&ctl->sleeping, 0, memory_order_relaxed);
+        }
+        return NULL;
+}
+
+static void iccom_broker_free(struct iccom_broker *const b)
+{
+        if (b->epoll_fd >= 0) {
+                close(b->epoll_fd);
+        }
+        for (unsigned int i = 0; i < b->channels_count; i++) {
+                struct iccom_broker_channel *const ch = &b->channels[i];
+                if (ch->sock_fd >= 0) {
+                        iccom_close_socket(ch->sock_fd);
+                }
+                iccom_broker_ring_remove(b, &ch->rx, ".rx");
+                iccom_broker_ring_remove(b, &ch->tx, ".tx");
+        }
+        if (b->ctl) {
+                char shm_name[ICCOM_BROKER_SHM_NAME_MAX];
+                if (iccom_broker_shm_name(shm_name, b->name, ".ctl") == 0) {
+                        shm_unlink(shm_name);
+                }
+                munmap(b->ctl, sizeof(*b->ctl));
+        }
+        free(b->channels);
+        free(b);
+}
+
+// See iccom_broker.h
+int iccom_broker_start(const iccom_broker_cfg *const cfg
+                       , iccom_broker **const broker__out)
+{
+        if (!cfg || !broker__out || !cfg->channels) {
+                log("no configuration, channels or output ptr is provided");
+                return -EINVAL;
+        }
+        if (!cfg->channels_count
+                    || cfg->channels_count > ICCOM_BROKER_MAX_CHANNELS) {
+                log("The channels number %u is out of [1; %d]"
+                    , cfg->channels_count, ICCOM_BROKER_MAX_CHANNELS);
+                return -EINVAL;
+        }
+        const unsigned int rx_slots = cfg->rx_slots ? cfg->rx_slots
+                                      : ICCOM_BROKER_DEFAULT_RX_SLOTS;
+        const unsigned int tx_slots = cfg->tx_slots ? cfg->tx_slots
+                                      : ICCOM_BROKER_DEFAULT_TX_SLOTS;
+        if ((rx_slots & (rx_slots - 1)) || (tx_slots & (tx_slots - 1))
+                    || rx_slots < 2) {
+                log("The ring sizes %u, %u are not powers of two (>1)"
+                    , rx_slots, tx_slots);
+                return -EINVAL;
+        }
+        const unsigned int slot_size = cfg->slot_size ? cfg->slot_size
+                                       : ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES;
+        if (slot_size > ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES) {
+                log("The slot size %u exceeds max %d", slot_size
+                    , ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES);
+                return -EINVAL;
+        }
+        const unsigned int mode = cfg->mode ? cfg->mode
+                                            : ICCOM_BROKER_DEFAULT_MODE;
+
+        struct iccom_broker *const b = (struct iccom_broker *)
+                        calloc(1, sizeof(*b));
+        if (!b) {
+                return -ENOMEM;
+        }
+        b->epoll_fd = -1;
+        b->cpu = cfg->cpu;
+        snprintf(b->name, sizeof(b->name), "%s"
+                 , cfg->name ? cfg->name : ICCOM_BROKER_DEFAULT_NAME);
+        // the ring slots hold the slot size frames only, so the rings
+        // shrink with it
+        b->buf_size = iccom_get_required_buffer_size(slot_size);
+        b->channels = (struct iccom_broker_channel *)calloc(
+                        cfg->channels_count, sizeof(b->channels[0]));
+        if (!b->channels) {
+                free(b);
+                return -ENOMEM;
+        }
+
+        int res;
+        char shm_name[ICCOM_BROKER_SHM_NAME_MAX];
+        res = iccom_broker_shm_name(shm_name, b->name, ".ctl");
+        if (res < 0) {
+                goto free_broker;
+        }
+        b->ctl = (struct iccom_broker_ctl *)iccom_broker_shm_create(shm_name
+                                                , sizeof(*b->ctl), mode);
+        if (!b->ctl) {
+                res = -errno;
+                log("Could not create the broker object %s: %d(%s)"
+                    , shm_name, errno, strerror(errno));
+                goto free_broker;
+        }
+        b->ctl->version = ICCOM_BROKER_LAYOUT_VERSION;
+        atomic_store_explicit(&b->ctl->magic, ICCOM_BROKER_MAGIC
+                              , memory_order_release);
+
+        b->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (b->epoll_fd < 0) {
+                res = -errno;
+                log("Could not create the broker epoll: %d(%s)", errno
+                    , strerror(errno));
+                goto free_broker;
+        }
+
+        for (unsigned int i = 0; i < cfg->channels_count; i++) {
+                struct iccom_broker_channel *const ch = &b->channels[i];
+                ch->channel = cfg->channels[i];
+                ch->sock_fd = -1;
+                b->channels_count = i + 1;
+
+                res = iccom_broker_ring_create(b, &ch->rx, ".rx", ch->channel
+                                               , rx_slots, slot_size, mode
+                                               , 0);
+                if (res < 0) {
+                        goto free_broker;
+                }
+                res = iccom_broker_ring_create(b, &ch->tx, ".tx", ch->channel
+                                               , tx_slots, slot_size, mode
+                                               , 1);
+                if (res < 0) {
+                        goto free_broker;
+                }
+                ch->sock_fd = iccom_open_socket(ch->channel);
+                if (ch->sock_fd < 0) {
+                        res = ch->sock_fd;
+                        goto free_broker;
+                }
+                res = iccom_set_socket_read_timeout(ch->sock_fd
+                                                , ICCOM_BROKER_TIMEOUT_MS);
+                if (res < 0) {
+                        goto free_broker;
+                }
+                struct epoll_event ev;
+                memset(&ev, 0, sizeof(ev));
+                ev.events = EPOLLIN;
+                ev.data.ptr = ch;
+                if (epoll_ctl(b->epoll_fd, EPOLL_CTL_ADD, ch->sock_fd
+                              , &ev) < 0) {
+                        res = -errno;
+                        log("Could not watch the channel %u socket: %d(%s)"
+                            , ch->channel, errno, strerror(errno));
+                        goto free_broker;
+                }
+        }
+
+        res = -pthread_create(&b->rx_thread, NULL, iccom_broker_rx_loop, b);
+        if (res < 0) {
+                log("Could not start the broker receive thread: %d(%s)"
+                    , -res, strerror(-res));
+                goto free_broker;
+        }
+        b->threads = 1;
+        res = -pthread_create(&b->tx_thread, NULL, iccom_broker_tx_loop, b);
+        if (res < 0) {
+                log("Could not start the broker send thread: %d(%s)"
+                    , -res, strerror(-res));
+                goto stop_threads;
+        }
+        b->threads = 2;
+
+        *broker__out = b;
+        return 0;
+
+stop_threads:
+        atomic_store_explicit(&b->stop, 1, memory_order_relaxed);
+        pthread_join(b->rx_thread, NULL);
+free_broker:
+        iccom_broker_free(b);
+        return res;
+}
+
+// See iccom_broker.h
+void iccom_broker_stop(iccom_broker *const b)
+{
+        if (!b) {
+                return;
+        }
+        atomic_store_explicit(&b->stop, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&b->ctl->doorbell, 1, memory_order_relaxed);
+        iccom_broker_futex_wake(&b->ctl->doorbell, 1);
+        pthread_join(b->rx_thread, NULL);
+        pthread_join(b->tx_thread, NULL);
+        iccom_broker_free(b);
+}
+
+// See iccom_broker.h
+int iccom_broker_get_stats(const iccom_broker *const b
+                           , iccom_broker_stats *const out)
+{
+        if (!b || !out) {
+                log("no broker or output ptr is provided");
+                return -EINVAL;
+        }
+        out->received = atomic_load_explicit(&b->received
+                                             , memory_order_relaxed);
+        out->sent = atomic_load_explicit(&b->sent, memory_order_relaxed);
+        out->dropped = atomic_load_explicit(&b->dropped
+                                            , memory_order_relaxed);
+        out->receive_errors = atomic_load_explicit(&b->receive_errors
+                                                   , memory_order_relaxed);
+        out->send_errors = atomic_load_explicit(&b->send_errors
+                                                , memory_order_relaxed);
+        out->tx_stalled = atomic_load_explicit(&b->tx_stalled
+                                               , memory_order_relaxed);
+        return 0;
+}
+
+// Maps the broker object and checks it is the ready one.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+static int iccom_broker_client_map(const char *const name
+                                   , const char *const suffix
+                                   , const int writable
+                                   , const unsigned int channel
+                                   , void **const mem__out
+                                   , size_t *const size__out)
+{
+        char shm_name[ICCOM_BROKER_SHM_NAME_MAX];
+        int res = iccom_broker_shm_name(shm_name, name, suffix);
+        if (res < 0) {
+                return res;
+        }
+        void *const mem = iccom_broker_shm_map(shm_name, writable
+                                               , size__out);
+        if (!mem) {
+                return -errno;
+        }
+        // the ring and the control object share the magic + version head
+        const struct iccom_broker_ring *const head
+                        = (const struct iccom_broker_ring *)mem;
+        const int is_ring = suffix[0] == '-';
+        if (*size__out < (is_ring ? sizeof(struct iccom_broker_ring)
+                                  : sizeof(struct iccom_broker_ctl))
+                    || atomic_load_explicit(&head->magic, memory_order_acquire)
+                       != ICCOM_BROKER_MAGIC) {
+                // the broker is still starting
+                munmap(mem, *size__out);
+                return -ENOENT;
+        }
+        if (head->version != ICCOM_BROKER_LAYOUT_VERSION
+                    || (is_ring && (head->channel != channel
+                                    || sizeof(struct iccom_broker_ring)
+                                       + (size_t)head->slots
+                                         * head->slot_stride
+                                       > *size__out))) {
+                log("The broker object %s is incompatible"
+                    , shm_name);
+                munmap(mem, *size__out);
+                return -EPROTO;
+        }
+        *mem__out = mem;
+        return 0;
+}
+
+// See iccom_broker.h
+int iccom_broker_client_open(const char *const name
+                             , const unsigned int channel
+                             , iccom_broker_client **const client__out)
+{
+        if (!client__out) {
+                log("no output ptr is provided");
+                return -EINVAL;
+        }
+        struct iccom_broker_client *const c = (struct iccom_broker_client *)
+                        calloc(1, sizeof(*c));
+        if (!c) {
+                return -ENOMEM;
+        }
+
+        char rx_suffix[32];
+        char tx_suffix[32];
+        snprintf(rx_suffix, sizeof(rx_suffix), "-%u.rx", channel);
+        snprintf(tx_suffix, sizeof(tx_suffix), "-%u.tx", channel);
+        size_t ctl_size;
+        void *mem;
+        int res = iccom_broker_client_map(name, ".ctl", 1, channel, &mem
+                                          , &ctl_size);
+        if (res < 0) {
+                goto free_client;
+        }
+        c->ctl = (struct iccom_broker_ctl *)mem;
+        res = iccom_broker_client_map(name, rx_suffix, 0, channel, &mem
+                                      , &c->rx.size);
+        if (res < 0) {
+                goto unmap;
+        }
+        c->rx.ring = (struct iccom_broker_ring *)mem;
+        res = iccom_broker_client_map(name, tx_suffix, 1, channel, &mem
+                                      , &c->tx.size);
+        if (res < 0) {
+                goto unmap;
+        }
+        c->tx.ring = (struct iccom_broker_ring *)mem;
+
+        c->pos = atomic_load_explicit(&c->rx.ring->write_seq
+                                      , memory_order_acquire);
+        c->pid = getpid();
+        *client__out = c;
+        return 0;
+
+unmap:
+        if (c->rx.ring) {
+                munmap(c->rx.ring, c->rx.size);
+        }
+        munmap(c->ctl, ctl_size);
+free_client:
+        free(c);
+        return res;
+}
+
+// See iccom_broker.h
+void iccom_broker_client_close(iccom_broker_client *const c)
+{
+        if (!c) {
+                return;
+        }
+        munmap(c->tx.ring, c->tx.size);
+        munmap(c->rx.ring, c->rx.size);
+        munmap(c->ctl, sizeof(*c->ctl));
+        free(c);
+}
+
+// Reads the next frame if any.
+//
+// RETURNS: see @iccom_broker_client_receive, 0 - no frame
+static int iccom_broker_client_read(struct iccom_broker_client *const c
+                                    , void *const buf, const size_t buf_size)
+{
+        const struct iccom_broker_ring *const rx = c->rx.ring;
+        while (1) {
+                const uint64_t ws = atomic_load_explicit(&rx->write_seq
+                                                        , memory_order_acquire);
+                if (c->pos >= ws) {
+                        return 0;
+                }
+                const uint64_t oldest = ws > rx->slots - 1
+                                        ? ws - (rx->slots - 1) : 0;
+                if (c->pos < oldest) {
+                        atomic_fetch_add_explicit(&c->lost, oldest - c->pos
+                                                  , memory_order_relaxed);
+                        c->pos = oldest;
+                }
+
+                const struct iccom_broker_slot *const slot
+                                = iccom_broker_slot(rx, c->pos);
+                const uint64_t seq = atomic_load_explicit(&slot->seq
+                                                        , memory_order_acquire);
+                if (seq != 2 * c->pos + 2) {
+                        // overwritten meanwhile
+                        continue;
+                }
+                const int32_t size = slot->size;
+                const int32_t offset = slot->offset;
+                const int fits = size >= 0 && (size_t)size <= buf_size
+                                 && offset >= 0 && (size_t)offset
+                                    + (size_t)size <= c->rx.size;
+                if (fits) {
+                        memcpy(buf, slot->buf + offset, (size_t)size);
+                }
+                atomic_thread_fence(memory_order_acquire);
+                if (atomic_load_explicit(&slot->seq, memory_order_relaxed)
+                                != seq) {
+                        continue;
+                }
+                c->pos++;
+                if (!fits) {
+                        return -EOVERFLOW;
+                }
+                atomic_fetch_add_explicit(&c->received, 1
+                                          , memory_order_relaxed);
+                return size;
+        }
+}
+
+// See iccom_broker.h
+int iccom_broker_client_receive(iccom_broker_client *const c
+                                , void *const buf, const size_t buf_size
+                                , const int timeout_ms)
+{
+        if (!c || !buf) {
+                return -EINVAL;
+        }
+        int res = iccom_broker_client_read(c, buf, buf_size);
+        if (res || timeout_ms == 0) {
+                return res;
+        }
+
+        struct iccom_broker_ring *const tx = c->tx.ring;
+        const uint64_t start_ns = __iccom_now_ns();
+        atomic_fetch_add_explicit(&tx->rx_waiters, 1, memory_order_relaxed);
+        while (1) {
+                const uint32_t notify = atomic_load_explicit(&tx->rx_notify
+                                                        , memory_order_relaxed);
+                // pairs with the fence in @iccom_broker_publish
+                atomic_thread_fence(memory_order_seq_cst);
+                res = iccom_broker_client_read(c, buf, buf_size);
+                if (res) {
+                        break;
+                }
+                int wait_ms = timeout_ms;
+                if (timeout_ms > 0) {
+                        const uint64_t spent_ms
+                                = (__iccom_now_ns() - start_ns) / 1000000;
+                        if (spent_ms >= (uint64_t)timeout_ms) {
+                                break;
+                        }
+                        wait_ms = timeout_ms - (int)spent_ms;
+                }
+                iccom_broker_futex_wait(&tx->rx_notify, notify, wait_ms);
+        }
+        atomic_fetch_sub_explicit(&tx->rx_waiters, 1, memory_order_relaxed);
+        return res;
+}
+
+// See iccom_broker.h
+int iccom_broker_client_send(iccom_broker_client *const c
+                             , const void *const data, const size_t size)
+{
+        if (!c || !data || !size) {
+                return -EINVAL;
+        }
+        struct iccom_broker_ring *const tx = c->tx.ring;
+        if (size > tx->slot_size) {
+                return -EMSGSIZE;
+        }
+
+        uint64_t pos = atomic_load_explicit(&tx->enqueue_pos
+                                            , memory_order_relaxed);
+        struct iccom_broker_slot *slot;
+        while (1) {
+                slot = iccom_broker_slot(tx, pos);
+                const uint64_t seq = atomic_load_explicit(&slot->seq
+                                                        , memory_order_acquire);
+                int64_t diff = (int64_t)(seq - pos);
+                if (seq & ICCOM_BROKER_SLOT_CLAIMED) {
+                        // the slot is taken by the position the claim
+                        // tags: ours (so enqueue_pos is ahead already) or
+                        // the previous lap one (the ring is full)
+                        diff = (int32_t)((uint32_t)seq - (uint32_t)pos) < 0
+                               ? -1 : 1;
+                }
+                if (diff == 0) {
+                        if (atomic_compare_exchange_weak_explicit(
+                                        &tx->enqueue_pos, &pos, pos + 1
+                                        , memory_order_relaxed
+                                        , memory_order_relaxed)) {
+                                break;
+                        }
+                } else if (diff < 0) {
+                        atomic_fetch_add_explicit(&c->tx_full, 1
+                                                  , memory_order_relaxed);
+                        return -EAGAIN;
+                } else {
+                        pos = atomic_load_explicit(&tx->enqueue_pos
+                                                   , memory_order_relaxed);
+                }
+        }
+
+        // fails only if the broker took the slot back as stalled
+        uint64_t expected = pos;
+        if (!atomic_compare_exchange_strong_explicit(&slot->seq, &expected
+                                , ICCOM_BROKER_SLOT_CLAIM(pos, c->pid)
+                                , memory_order_acquire
+                                , memory_order_relaxed)) {
+                log("The tx slot was not claimed within %d ms, the frame"
+                    " is dropped by the broker", ICCOM_BROKER_TX_STALL_MS);
+                return -ETIMEDOUT;
+        }
+        memcpy(slot->buf + iccom_get_data_payload_offset(), data, size);
+        slot->size = (int32_t)size;
+        slot->offset = iccom_get_data_payload_offset();
+        // the claimed slot is never taken back while we are alive
+        atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+        atomic_fetch_add_explicit(&c->sent, 1, memory_order_relaxed);
+
+        // pairs with the fence in @iccom_broker_tx_loop
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&c->ctl->sleeping, memory_order_relaxed)) {
+                atomic_fetch_add_explicit(&c->ctl->doorbell, 1
+                                          , memory_order_release);
+                iccom_broker_futex_wake(&c->ctl->doorbell, 1);
+        }
+        return 0;
+}
+
+// See iccom_broker.h
+int iccom_broker_client_get_stats(const iccom_broker_client *const c
+                                  , iccom_broker_client_stats *const out)
+{
+        if (!c || !out) {
+                log("no client or output ptr is provided");
+                return -EINVAL;
+        }
+        out->received = atomic_load_explicit(&c->received
+                                             , memory_order_relaxed);
+        out->lost = atomic_load_explicit(&c->lost, memory_order_relaxed);
+        out->sent = atomic_load_explicit(&c->sent, memory_order_relaxed);
+        out->tx_full = atomic_load_explicit(&c->tx_full
+                                            , memory_order_relaxed);
+        return 0;
+}
@@ -0,0 +1,188 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the adaptive receive busy polling shared by all
+ * ICCom modifications, see busy_poll.h.
+ *
+ * Every wait for the message is measured (from the receive call till
+ * the socket gets readable, whether caught by spinning or by blocking),
+ * and the moving average of the waits predicts the next one. The spin
+ * budget is twice the predicted wait (within [max / 16; max]), and if
+ * the predicted wait exceeds the max budget (the idle channel), the
+ * receive blocks right away, so the idle channels don't burn the CPU.
+ * The samples are capped at 4 x max budget, so the average recovers
+ * within a few messages after the idle period.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "iccom.h"
+#include "utils.h"
+#include "sock_registry.h"
+#include "busy_poll.h"
+
+/* -------------------- BUILD TIME CONFIGURATION ----------------------- */
+
+// the budget limit, not to get the huge latency on a timed out read
+#define ICCOM_BUSY_POLL_MAX_US_LIMIT 100000
+
+// the wait moving average weight of the new sample is 1 / 2^SHIFT
+#define ICCOM_BUSY_POLL_AVG_SHIFT 3
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+static void iccom_busy_poll_account(struct iccom_sock_state *const st
+                                    , uint64_t wait_ns
+                                    , const uint64_t max_ns)
+{
+        if (wait_ns > 4 * max_ns) {
+                wait_ns = 4 * max_ns;
+        }
+        const uint64_t avg = atomic_load_explicit(&st->busy_poll_wait_ns
+                                                  , memory_order_relaxed);
+        const int64_t delta = ((int64_t)wait_ns - (int64_t)avg)
+                              / (1 << ICCOM_BUSY_POLL_AVG_SHIFT);
+        atomic_store_explicit(&st->busy_poll_wait_ns
+                              , (uint64_t)((int64_t)avg + delta)
+                              , memory_order_relaxed);
+}
+
+// RETURNS: the current spin budget in ns, 0 if the wait is predicted
+//      to be longer than the max budget
+static uint64_t iccom_busy_poll_budget_ns(const uint64_t avg_ns
+                                          , const uint64_t max_ns)
+{
+        if (avg_ns > max_ns) {
+                return 0;
+        }
+        uint64_t budget = 2 * avg_ns;
+        if (budget < max_ns / 16) {
+                budget = max_ns / 16;
+        }
+        return budget < max_ns ? budget : max_ns;
+}
+
+// RETURNS: the socket read timeout in ms for poll(2), -1 if none
+static int iccom_busy_poll_read_timeout_ms(const int sock_fd)
+{
+        struct timeval tv;
+        socklen_t len = sizeof(tv);
+        if (getsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, &len) < 0
+                    || (tv.tv_sec == 0 && tv.tv_usec == 0)) {
+                return -1;
+        }
+        // rounded up, not to return before the read would time out
+        return (int)(tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000);
+}
+
+// See busy_poll.h
+int __iccom_busy_poll_wait(const int sock_fd)
+{
+        struct iccom_sock_state *const st = __iccom_sock_state(sock_fd);
+        if (!st) {
+                return 1;
+        }
+        const int max_us = atomic_load_explicit(&st->busy_poll_max_us
+                                                , memory_order_relaxed);
+        if (!max_us) {
+                return 1;
+        }
+        const uint64_t max_ns = (uint64_t)max_us * 1000;
+        const uint64_t budget_ns = iccom_busy_poll_budget_ns(
+                        atomic_load_explicit(&st->busy_poll_wait_ns
+                                             , memory_order_relaxed)
+                        , max_ns);
+
+        struct pollfd pfd = { .fd = sock_fd, .events = POLLIN };
+        const uint64_t start_ns = __iccom_now_ns();
+        uint64_t now_ns = start_ns;
+        do {
+                if (poll(&pfd, 1, 0) != 0) {
+                        // readable, or the error the read is to report
+                        iccom_busy_poll_account(st, now_ns - start_ns
+                                                , max_ns);
+                        atomic_fetch_add_explicit(&st->busy_poll_hits, 1
+                                                  , memory_order_relaxed);
+                        return 1;
+                }
+                // lets the sender side run if it shares the CPU
+                sched_yield();
+                now_ns = __iccom_now_ns();
+        } while (now_ns - start_ns < budget_ns);
+
+        if (budget_ns) {
+                atomic_fetch_add_explicit(&st->busy_poll_misses, 1
+                                          , memory_order_relaxed);
+        }
+        const int flags = fcntl(sock_fd, F_GETFL);
+        if (flags >= 0 && (flags & O_NONBLOCK)) {
+                return 1;
+        }
+
+        // blocking, but still measuring the wait
+        const int res = poll(&pfd, 1
+                             , iccom_busy_poll_read_timeout_ms(sock_fd));
+        if (res == 0) {
+                iccom_busy_poll_account(st, __iccom_now_ns()
+                                            - start_ns, max_ns);
+                return 0;
+        }
+        if (res > 0) {
+                iccom_busy_poll_account(st, __iccom_now_ns()
+                                            - start_ns, max_ns);
+        }
+        return 1;
+}
+
+// See iccom.h
+int iccom_set_socket_busy_poll(const int sock_fd, const int max_spin_us)
+{
+        struct iccom_sock_state *const st = __iccom_sock_state(sock_fd);
+        if (!st) {
+                log("The socket %d is not tracked", sock_fd);
+                return -EBADF;
+        }
+        if (max_spin_us < 0 || max_spin_us > ICCOM_BUSY_POLL_MAX_US_LIMIT) {
+                log("The busy polling budget %d us is out of [0; %d]"
+                    , max_spin_us, ICCOM_BUSY_POLL_MAX_US_LIMIT);
+                return -EINVAL;
+        }
+        // starts with the max budget, then adapts
+        atomic_store_explicit(&st->busy_poll_wait_ns
+                              , (uint64_t)max_spin_us * 1000 / 2
+                              , memory_order_relaxed);
+        atomic_store_explicit(&st->busy_poll_max_us, max_spin_us
+                              , memory_order_relaxed);
+        return 0;
+}
+
+// See busy_poll.h
+uint64_t __iccom_busy_poll_budget(const struct iccom_sock_state *const st)
+{
+        return iccom_busy_poll_budget_ns(
+                        atomic_load_explicit(&st->busy_poll_wait_ns
+                                             , memory_order_relaxed)
+                        , (uint64_t)atomic_load_explicit(
+                                        &st->busy_poll_max_us
+                                        , memory_order_relaxed) * 1000);
+}
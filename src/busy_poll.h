@@ -0,0 +1,50 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+// Internal hooks of the adaptive receive busy polling, see
+// @iccom_set_socket_busy_poll in iccom.h.
+
+#ifndef LIBICCOM_BUSY_POLL_H
+#define LIBICCOM_BUSY_POLL_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "sock_registry.h"
+
+/* -------------------- ROUTINES DECLARATIONS -------------------------- */
+
+// Waits for the socket to become readable: busy polls for the adaptive
+// budget first, then blocks within the socket read timeout.
+//
+// RETURNS:
+//      1: the socket is readable, or it is to be read as usual
+//          (non-blocking socket, signal, socket error)
+//      0: the read timeout expired
+int __iccom_busy_poll_wait(const int sock_fd);
+
+// RETURNS: the current busy polling budget of the socket in ns, 0 if
+//      the busy polling is disabled or the socket is considered idle
+uint64_t __iccom_busy_poll_budget(const struct iccom_sock_state *const st);
+
+// RETURNS:
+//      !0: the busy polling is enabled for the socket (costs a single
+//          relaxed load)
+//      0: otherwise
+static inline int __iccom_busy_poll_active(const int sock_fd)
+{
+        const struct iccom_sock_state *const st = __iccom_sock_state(sock_fd);
+        return st && atomic_load_explicit(&st->busy_poll_max_us
+                                          , memory_order_relaxed);
+}
+
+#endif //ifndef LIBICCOM_BUSY_POLL_H
@@ -0,0 +1,345 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the ICCom traffic capture facility, common
+ * for all ICCom modifications. See iccom.h for the IF and file format
+ * description.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "iccom.h"
+#include "utils.h"
+#include "capture.h"
+#include "sock_registry.h"
+
+/* -------------------- MACRO DEFINITIONS ------------------------------ */
+
+#define ICCOM_CAPTURE_ALIGNED(size)                                          \
+        (((size) + ICCOM_CAPTURE_ALIGN - 1) & ~((size_t)ICCOM_CAPTURE_ALIGN - 1))
+
+/* ------------------- GLOBAL VARIABLES / CONSTANTS -------------------- */
+
+// @base the capture file mapping
+// @capacity the capture file mapping size
+// @snaplen max payload bytes per record
+// @fd the capture file descriptor
+// @offset the offset of the next record to be reserved
+// @records number of committed records
+// @dropped number of dropped frames
+// @writers number of writers currently touching the mapping
+// @toggle_signo the currently installed toggle signal, 0 if none
+// @lock serializes the open/close/signal configuration calls
+//      (never taken on the frame recording path)
+static struct {
+        char *base;
+        size_t capacity;
+        size_t snaplen;
+        int fd;
+        _Atomic uint64_t offset;
+        _Atomic uint64_t records;
+        _Atomic uint64_t dropped;
+        _Atomic int writers;
+        int toggle_signo;
+        pthread_mutex_t lock;
+} capture = {
+        .base = NULL
+        , .capacity = 0
+        , .snaplen = 0
+        , .fd = -1
+        , .toggle_signo = 0
+        , .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+// NOTE: the ENABLED bit can only be set while the OPEN bit is set,
+//      this is why both live in a single atomic.
+_Atomic int __iccom_capture_state = 0;
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+// The frame recording path. Lock-free: the record space is reserved
+// with a single atomic add, then filled and committed by the release
+// store of its size.
+//
+// The writers counter is incremented before the state is checked
+// (and checked by iccom_capture_close() after the state is dropped),
+// so the mapping is never removed under an active writer.
+void __iccom_capture_frame(const int sock_fd, const int direction
+                           , const void *const payload
+                           , const size_t payload_size)
+{
+        atomic_fetch_add(&capture.writers, 1);
+        if (!(atomic_load(&__iccom_capture_state)
+              & ICCOM_CAPTURE_ST_ENABLED)) {
+                goto out;
+        }
+
+        const size_t cap_size = payload_size < capture.snaplen
+                                ? payload_size : capture.snaplen;
+        const size_t rec_size = ICCOM_CAPTURE_ALIGNED(
+                        sizeof(iccom_capture_record_header) + cap_size);
+        const uint64_t offset = atomic_fetch_add_explicit(
+                        &capture.offset, rec_size, memory_order_relaxed);
+
+        if (offset + rec_size > capture.capacity) {
+                atomic_fetch_add_explicit(&capture.dropped, 1
+                                          , memory_order_relaxed);
+                goto out;
+        }
+
+        iccom_capture_record_header *const rec
+                = (iccom_capture_record_header *)(capture.base + offset);
+        const int channel = __iccom_sock_channel(sock_fd);
+
+        rec->direction = (uint16_t)direction;
+        rec->flags = 0;
+        rec->channel = (channel == ICCOM_SOCK_CHANNEL_UNKNOWN)
+                       ? ICCOM_CAPTURE_CHANNEL_UNKNOWN : (uint32_t)channel;
+        rec->orig_size = (uint32_t)payload_size;
+        rec->cap_size = (uint32_t)cap_size;
+        rec->reserved = 0;
+        rec->timestamp_ns = __iccom_clock_ns(CLOCK_MONOTONIC);
+        if (cap_size) {
+                memcpy(rec + 1, payload, cap_size);
+        }
+        atomic_store_explicit((_Atomic uint32_t *)&rec->record_size
+                              , (uint32_t)rec_size, memory_order_release);
+
+        atomic_fetch_add_explicit(&capture.records, 1, memory_order_relaxed);
+out:
+        atomic_fetch_sub_explicit(&capture.writers, 1, memory_order_release);
+}
+
+// See iccom.h
+int iccom_capture_open(const char *const path, const size_t capacity_bytes
+                       , const size_t snaplen)
+{
+        if (!path) {
+                log("no capture file path provided");
+                return -EINVAL;
+        }
+        if (capacity_bytes <= sizeof(iccom_capture_file_header)) {
+                log("capture capacity %zu is too small", capacity_bytes);
+                return -EINVAL;
+        }
+        if (snaplen == 0) {
+                log("snaplen must be > 0");
+                return -EINVAL;
+        }
+
+        pthread_mutex_lock(&capture.lock);
+
+        int ret_val = 0;
+        if (atomic_load(&__iccom_capture_state) & ICCOM_CAPTURE_ST_OPEN) {
+                log("capture is already opened");
+                ret_val = -EBUSY;
+                goto unlock;
+        }
+
+        const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+                const int err = errno;
+                log("failed to create capture file %s: %d(%s)"
+                    , path, err, strerror(err));
+                ret_val = -err;
+                goto unlock;
+        }
+        if (ftruncate(fd, (off_t)capacity_bytes) < 0) {
+                const int err = errno;
+                log("failed to preallocate capture file %s to %zu bytes"
+                    ": %d(%s)", path, capacity_bytes, err, strerror(err));
+                close(fd);
+                ret_val = -err;
+                goto unlock;
+        }
+        void *const base = mmap(NULL, capacity_bytes, PROT_READ | PROT_WRITE
+                                , MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) {
+                const int err = errno;
+                log("failed to map capture file %s: %d(%s)"
+                    , path, err, strerror(err));
+                close(fd);
+                ret_val = -err;
+                goto unlock;
+        }
+
+        iccom_capture_file_header *const hdr
+                = (iccom_capture_file_header *)base;
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->magic = ICCOM_CAPTURE_MAGIC;
+        hdr->version = ICCOM_CAPTURE_VERSION;
+        hdr->header_size = sizeof(*hdr);
+        hdr->capacity_bytes = capacity_bytes;
+        hdr->used_bytes = 0;
+        hdr->realtime_base_ns = __iccom_clock_ns(CLOCK_REALTIME);
+        hdr->monotonic_base_ns = __iccom_clock_ns(CLOCK_MONOTONIC);
+        hdr->snaplen = (uint32_t)snaplen;
+
+        capture.base = (char *)base;
+        capture.capacity = capacity_bytes;
+        capture.snaplen = snaplen;
+        capture.fd = fd;
+        atomic_store(&capture.offset, sizeof(*hdr));
+        atomic_store(&capture.records, 0);
+        atomic_store(&capture.dropped, 0);
+
+        atomic_store(&__iccom_capture_state, ICCOM_CAPTURE_ST_OPEN);
+
+unlock:
+        pthread_mutex_unlock(&capture.lock);
+        return ret_val;
+}
+
+// See iccom.h
+int iccom_capture_enable(const int enable)
+{
+        int state = atomic_load(&__iccom_capture_state);
+        do {
+                if (!(state & ICCOM_CAPTURE_ST_OPEN)) {
+                        return -EBADF;
+                }
+        } while (!atomic_compare_exchange_weak(
+                        &__iccom_capture_state, &state
+                        , enable ? (state | ICCOM_CAPTURE_ST_ENABLED)
+                                 : (state & ~ICCOM_CAPTURE_ST_ENABLED)));
+        return 0;
+}
+
+// See iccom.h
+int iccom_capture_is_enabled(void)
+{
+        return (atomic_load(&__iccom_capture_state)
+                & ICCOM_CAPTURE_ST_ENABLED) ? 1 : 0;
+}
+
+// NOTE: only atomics are touched, so it is async signal safe.
+static void iccom_capture_toggle_handler(int signo)
+{
+        (void)signo;
+        int state = atomic_load(&__iccom_capture_state);
+        do {
+                if (!(state & ICCOM_CAPTURE_ST_OPEN)) {
+                        return;
+                }
+        } while (!atomic_compare_exchange_weak(
+                        &__iccom_capture_state, &state
+                        , state ^ ICCOM_CAPTURE_ST_ENABLED));
+}
+
+// See iccom.h
+int iccom_capture_set_toggle_signal(const int signo)
+{
+        if (signo < 0 || signo >= NSIG) {
+                log("invalid signal number: %d", signo);
+                return -EINVAL;
+        }
+
+        pthread_mutex_lock(&capture.lock);
+
+        if (capture.toggle_signo) {
+                signal(capture.toggle_signo, SIG_DFL);
+                capture.toggle_signo = 0;
+        }
+
+        int ret_val = 0;
+        if (signo) {
+                struct sigaction sa;
+                memset(&sa, 0, sizeof(sa));
+                sa.sa_handler = &iccom_capture_toggle_handler;
+                sa.sa_flags = SA_RESTART;
+                sigemptyset(&sa.sa_mask);
+                if (sigaction(signo, &sa, NULL) < 0) {
+                        const int err = errno;
+                        log("failed to install capture toggle handler for"
+                            " signal %d: %d(%s)", signo, err, strerror(err));
+                        ret_val = -err;
+                } else {
+                        capture.toggle_signo = signo;
+                }
+        }
+
+        pthread_mutex_unlock(&capture.lock);
+        return ret_val;
+}
+
+// See iccom.h
+int iccom_capture_get_stats(iccom_capture_stats *const out)
+{
+        if (!out) {
+                log("no output ptr is provided");
+                return -EINVAL;
+        }
+
+        const uint64_t offset = atomic_load(&capture.offset);
+        const uint64_t used = offset < capture.capacity
+                              ? offset : capture.capacity;
+
+        out->records = atomic_load(&capture.records);
+        out->bytes = used > sizeof(iccom_capture_file_header)
+                     ? used - sizeof(iccom_capture_file_header) : 0;
+        out->dropped = atomic_load(&capture.dropped);
+        return 0;
+}
+
+// See iccom.h
+int iccom_capture_close(void)
+{
+        pthread_mutex_lock(&capture.lock);
+
+        int ret_val = 0;
+        if (!(atomic_exchange(&__iccom_capture_state, 0)
+              & ICCOM_CAPTURE_ST_OPEN)) {
+                ret_val = -EBADF;
+                goto unlock;
+        }
+
+        while (atomic_load(&capture.writers) != 0) {
+                sched_yield();
+        }
+
+        const uint64_t offset = atomic_load(&capture.offset);
+        const size_t used = offset < capture.capacity
+                            ? (size_t)offset : capture.capacity;
+
+        ((iccom_capture_file_header *)capture.base)->used_bytes = used;
+
+        if (msync(capture.base, capture.capacity, MS_SYNC) < 0) {
+                const int err = errno;
+                log("capture file sync failed: %d(%s)", err, strerror(err));
+                ret_val = -err;
+        }
+        munmap(capture.base, capture.capacity);
+        if (ftruncate(capture.fd, (off_t)used) < 0) {
+                const int err = errno;
+                log("capture file truncation failed: %d(%s)"
+                    , err, strerror(err));
+                ret_val = -err;
+        }
+        close(capture.fd);
+
+        capture.base = NULL;
+        capture.capacity = 0;
+        capture.fd = -1;
+
+unlock:
+        pthread_mutex_unlock(&capture.lock);
+        return ret_val;
+}
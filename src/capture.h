@@ -0,0 +1,57 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+// Internal hooks of the traffic capture facility, to be called
+// by the ICCom modifications on every sent/received frame.
+//
+// NOTE: the public capture IF is declared in the iccom.h.
+
+#ifndef LIBICCOM_CAPTURE_H
+#define LIBICCOM_CAPTURE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/* -------------------- MACRO DEFINITIONS ------------------------------ */
+
+// the capture state bits
+#define ICCOM_CAPTURE_ST_OPEN 1
+#define ICCOM_CAPTURE_ST_ENABLED 2
+
+/* -------------------- ROUTINES DECLARATIONS -------------------------- */
+
+extern _Atomic int __iccom_capture_state;
+
+void __iccom_capture_frame(const int sock_fd, const int direction
+                           , const void *const payload
+                           , const size_t payload_size);
+
+// Records the frame into the capture file if capture is enabled.
+// When capture is disabled costs a single relaxed load.
+//
+// @sock_fd the socket the frame was sent/received via
+// @direction ICCOM_CAPTURE_DIR_TX or ICCOM_CAPTURE_DIR_RX
+// @payload {valid ptr} the frame payload
+// @payload_size the frame payload size
+static inline void __iccom_capture(const int sock_fd, const int direction
+                                   , const void *const payload
+                                   , const size_t payload_size)
+{
+        if (!(atomic_load_explicit(&__iccom_capture_state
+                                   , memory_order_relaxed)
+              & ICCOM_CAPTURE_ST_ENABLED)) {
+                return;
+        }
+        __iccom_capture_frame(sock_fd, direction, payload, payload_size);
+}
+
+#endif //ifndef LIBICCOM_CAPTURE_H
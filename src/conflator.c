@@ -0,0 +1,433 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the ICCom conflating receiver, see iccom_conflator.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "iccom.h"
+#include "iccom_conflator.h"
+#include "threads.h"
+#include "utils.h"
+
+/* -------------------- BUILD TIME CONFIGURATION ----------------------- */
+
+#define ICCOM_CONFLATOR_DEFAULT_MAX_KEYS 64
+#define ICCOM_CONFLATOR_DEFAULT_STOP_LATENCY_MS 100
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+// The value buffer, all fields are guarded by @seq.
+//
+// @seq the sequence counter, odd while the buffer is written
+// @data the netlink buffer with the message
+// @offset the payload offset within @data
+// @size the payload size
+// @version the value version (the number of the key messages)
+struct iccom_conflated_buf {
+        _Atomic uint32_t seq;
+        _Atomic(char *) data;
+        _Atomic int offset;
+        _Atomic int size;
+        _Atomic uint64_t version;
+};
+
+// The key value.
+//
+// @version the latest published version, its buffer is
+//      @bufs[@version & 1], 0 - no value yet
+// @bufs the value buffers
+struct iccom_conflated_value {
+        _Alignas(ICCOM_CACHE_LINE_SIZE) _Atomic uint64_t version;
+        struct iccom_conflated_buf bufs[2];
+};
+
+// The key index entry.
+//
+// @tag the key + 1, 0 - the entry is free; published after @value
+// @value the key value index
+struct iccom_conflated_key {
+        _Atomic uint64_t tag;
+        uint32_t value;
+};
+
+// @values the key values, @max_keys of them
+// @keys the key index (open addressing), @keys_mask + 1 entries
+// @keys_count the number of the used values
+// @spare the conflator thread receive buffer
+// @buffers the memory of all netlink buffers
+// @buf_size the netlink buffer size
+// @key_offset, @key_width see @iccom_conflator_cfg
+// @sock the socket to receive from
+// @stop !0 when the conflator thread is to exit
+// @thread the conflator thread
+// @cpu the CPU to pin the thread to, <0 if none
+// @received, @dropped, @receive_errors the counters
+struct iccom_conflator {
+        struct iccom_conflated_value *values;
+        unsigned int max_keys;
+        struct iccom_conflated_key *keys;
+        uint32_t keys_mask;
+        _Atomic uint64_t keys_count;
+        char *spare;
+        char *buffers;
+        size_t buf_size;
+        unsigned int key_offset;
+        unsigned int key_width;
+        struct iccom_rx_socket sock;
+        _Atomic int stop;
+        pthread_t thread;
+        int cpu;
+        _Atomic uint64_t received;
+        _Atomic uint64_t dropped;
+        _Atomic uint64_t receive_errors;
+};
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+static inline uint32_t iccom_conflator_home(const struct iccom_conflator *c
+                                            , const uint32_t key)
+{
+        return (key * 2654435761u) & c->keys_mask;
+}
+
+// RETURNS: the key value, NULL if the key has no value slot
+static struct iccom_conflated_value *iccom_conflator_find(
+                const struct iccom_conflator *const c, const uint32_t key)
+{
+        const uint64_t tag = (uint64_t)key + 1;
+        uint32_t i = iccom_conflator_home(c, key);
+        while (1) {
+                const uint64_t t = atomic_load_explicit(&c->keys[i].tag
+                                                        , memory_order_acquire);
+                if (t == tag) {
+                        return &c->values[c->keys[i].value];
+                }
+                if (!t) {
+                        return NULL;
+                }
+                i = (i + 1) & c->keys_mask;
+        }
+}
+
+// Finds or adds (conflator thread only) the key value.
+//
+// RETURNS: the key value, NULL if no free value slot
+static struct iccom_conflated_value *iccom_conflator_get(
+                struct iccom_conflator *const c, const uint32_t key)
+{
+        const uint64_t tag = (uint64_t)key + 1;
+        uint32_t i = iccom_conflator_home(c, key);
+        while (1) {
+                const uint64_t t = atomic_load_explicit(&c->keys[i].tag
+                                                        , memory_order_relaxed);
+                if (t == tag) {
+                        return &c->values[c->keys[i].value];
+                }
+                if (!t) {
+                        break;
+                }
+                i = (i + 1) & c->keys_mask;
+        }
+        const uint64_t count = atomic_load_explicit(&c->keys_count
+                                                    , memory_order_relaxed);
+        if (count >= c->max_keys) {
+                return NULL;
+        }
+        c->keys[i].value = (uint32_t)count;
+        atomic_store_explicit(&c->keys_count, count + 1, memory_order_relaxed);
+        atomic_store_explicit(&c->keys[i].tag, tag, memory_order_release);
+        return &c->values[count];
+}
+
+// RETURNS: the message key
+//
+// NOTE: the message is expected to contain the key
+static inline uint32_t iccom_conflator_key(const struct iccom_conflator *c
+                                           , const char *const payload)
+{
+        const char *const p = payload + c->key_offset;
+        switch (c->key_width) {
+        case 0:
+                return 0;
+        case 1:
+                return (uint8_t)p[0];
+        case 2: {
+                uint16_t v;
+                memcpy(&v, p, sizeof(v));
+                return v;
+        }
+        default: {
+                uint32_t v;
+                memcpy(&v, p, sizeof(v));
+                return v;
+        }
+        }
+}
+
+// Publishes the message received into the spare buffer as the new key
+// value: the spare buffer replaces the value buffer not published
+// currently, and that one becomes the spare buffer.
+static void iccom_conflator_publish(struct iccom_conflator *const c
+                                    , struct iccom_conflated_value *const v
+                                    , const int offset, const int size)
+{
+        const uint64_t version = atomic_load_explicit(&v->version
+                                                      , memory_order_relaxed)
+                                 + 1;
+        struct iccom_conflated_buf *const b = &v->bufs[version & 1];
+        const uint32_t seq = atomic_load_explicit(&b->seq
+                                                  , memory_order_relaxed);
+
+        atomic_store_explicit(&b->seq, seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        char *const old = atomic_load_explicit(&b->data
+                                               , memory_order_relaxed);
+        atomic_store_explicit(&b->data, c->spare, memory_order_relaxed);
+        atomic_store_explicit(&b->offset, offset, memory_order_relaxed);
+        atomic_store_explicit(&b->size, size, memory_order_relaxed);
+        atomic_store_explicit(&b->version, version, memory_order_relaxed);
+
+        atomic_store_explicit(&b->seq, seq + 2, memory_order_release);
+        atomic_store_explicit(&v->version, version, memory_order_release);
+        c->spare = old;
+}
+
+// The conflator thread.
+static void *iccom_conflator_loop(void *arg)
+{
+        struct iccom_conflator *const c = (struct iccom_conflator *)arg;
+
+        __iccom_thread_place(ICCOM_THREAD_CONFLATOR, c->cpu);
+
+        while (!atomic_load_explicit(&c->stop, memory_order_relaxed)) {
+                int offset;
+                const uint64_t start_ns = __iccom_now_ns();
+                const int res = iccom_receive_data_nocopy(c->sock.fd
+                                                          , c->spare
+                                                          , c->buf_size
+                                                          , &offset);
+                if (res <= 0) {
+                        if (res < 0) {
+                                atomic_fetch_add_explicit(&c->receive_errors
+                                                , 1, memory_order_relaxed);
+                        }
+                        __iccom_rx_backoff(res, start_ns);
+                        continue;
+                }
+                atomic_fetch_add_explicit(&c->received, 1
+                                          , memory_order_relaxed);
+
+                struct iccom_conflated_value *v = NULL;
+                if ((unsigned int)res >= c->key_width
+                            && (unsigned int)res - c->key_width
+                               >= c->key_offset) {
+                        v = iccom_conflator_get(c, iccom_conflator_key(c
+                                                , c->spare + offset));
+                }
+                if (!v) {
+                        atomic_fetch_add_explicit(&c->dropped, 1
+                                                  , memory_order_relaxed);
+                        continue;
+                }
+                iccom_conflator_publish(c, v, offset, res);
+        }
+        return NULL;
+}
+
+// See iccom_conflator.h
+int iccom_conflator_start(const iccom_conflator_cfg *const cfg
+                          , iccom_conflator **const conflator__out)
+{
+        if (!cfg || !conflator__out) {
+                log("no configuration or output ptr is provided");
+                return -EINVAL;
+        }
+        if (cfg->key_width != 0 && cfg->key_width != 1
+                        && cfg->key_width != 2 && cfg->key_width != 4) {
+                log("unsupported key width: %u", cfg->key_width);
+                return -EINVAL;
+        }
+        if (cfg->key_width && cfg->key_offset
+                    > ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES - cfg->key_width) {
+                log("the key doesn't fit the message: offset %u"
+                    , cfg->key_offset);
+                return -EINVAL;
+        }
+
+        struct iccom_conflator *const c = (struct iccom_conflator *)
+                        calloc(1, sizeof(*c));
+        if (!c) {
+                return -ENOMEM;
+        }
+        c->key_offset = cfg->key_width ? cfg->key_offset : 0;
+        c->key_width = cfg->key_width;
+        c->max_keys = !cfg->key_width ? 1
+                      : cfg->max_keys ? cfg->max_keys
+                      : ICCOM_CONFLATOR_DEFAULT_MAX_KEYS;
+        c->cpu = cfg->cpu;
+        uint32_t keys_size = 2;
+        while (keys_size < 2 * c->max_keys) {
+                keys_size <<= 1;
+        }
+        c->keys_mask = keys_size - 1;
+        c->buf_size = iccom_get_required_buffer_size(
+                                ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES);
+
+        int res = -ENOMEM;
+        c->values = (struct iccom_conflated_value *)aligned_alloc(
+                        ICCOM_CACHE_LINE_SIZE
+                        , c->max_keys * sizeof(c->values[0]));
+        c->keys = (struct iccom_conflated_key *)calloc(keys_size
+                                                       , sizeof(c->keys[0]));
+        // 2 buffers per key and the spare one
+        c->buffers = (char *)malloc((2 * c->max_keys + 1) * c->buf_size);
+        if (!c->values || !c->keys || !c->buffers) {
+                goto free_conflator;
+        }
+        memset(c->values, 0, c->max_keys * sizeof(c->values[0]));
+        for (unsigned int i = 0; i < c->max_keys; i++) {
+                for (int b = 0; b < 2; b++) {
+                        atomic_init(&c->values[i].bufs[b].data, c->buffers
+                                        + (2 * i + b) * c->buf_size);
+                }
+        }
+        c->spare = c->buffers + 2 * c->max_keys * c->buf_size;
+
+        res = __iccom_rx_socket_take(cfg->channel, cfg->sock_fd
+                        , cfg->stop_latency_ms
+                          ? (int)cfg->stop_latency_ms
+                          : ICCOM_CONFLATOR_DEFAULT_STOP_LATENCY_MS
+                        , &c->sock);
+        if (res < 0) {
+                goto free_conflator;
+        }
+
+        res = -pthread_create(&c->thread, NULL, iccom_conflator_loop, c);
+        if (res < 0) {
+                log("Could not start the conflator thread: %d(%s)"
+                    , -res, strerror(-res));
+                goto close_socket;
+        }
+
+        *conflator__out = c;
+        return 0;
+
+close_socket:
+        __iccom_rx_socket_release(&c->sock);
+free_conflator:
+        free(c->buffers);
+        free(c->keys);
+        free(c->values);
+        free(c);
+        return res;
+}
+
+// See iccom_conflator.h
+void iccom_conflator_stop(iccom_conflator *const c)
+{
+        if (!c) {
+                return;
+        }
+        atomic_store_explicit(&c->stop, 1, memory_order_relaxed);
+        pthread_join(c->thread, NULL);
+
+        __iccom_rx_socket_release(&c->sock);
+        free(c->buffers);
+        free(c->keys);
+        free(c->values);
+        free(c);
+}
+
+// See iccom_conflator.h
+int iccom_conflator_read(iccom_conflator *const c, const uint32_t key
+                         , void *const buf, const size_t buf_size
+                         , uint64_t *const version__inout)
+{
+        if (!c || (!buf && buf_size)) {
+                return -EINVAL;
+        }
+        struct iccom_conflated_value *const v = iccom_conflator_find(c, key);
+        if (!v) {
+                return -ENOENT;
+        }
+
+        while (1) {
+                const uint64_t version = atomic_load_explicit(&v->version
+                                                        , memory_order_acquire);
+                if (!version) {
+                        return -ENOENT;
+                }
+                if (version__inout && version == *version__inout) {
+                        return -EAGAIN;
+                }
+                struct iccom_conflated_buf *const b = &v->bufs[version & 1];
+                const uint32_t seq = atomic_load_explicit(&b->seq
+                                                        , memory_order_acquire);
+                if (seq & 1) {
+                        // the value got updated twice meanwhile
+                        continue;
+                }
+                const char *const data = atomic_load_explicit(&b->data
+                                                        , memory_order_relaxed);
+                const int offset = atomic_load_explicit(&b->offset
+                                                        , memory_order_relaxed);
+                const int size = atomic_load_explicit(&b->size
+                                                      , memory_order_relaxed);
+                const uint64_t buf_version = atomic_load_explicit(
+                                &b->version, memory_order_relaxed);
+                const int fits = (size_t)size <= buf_size;
+                if (fits) {
+                        memcpy(buf, data + offset, (size_t)size);
+                }
+                atomic_thread_fence(memory_order_acquire);
+                if (atomic_load_explicit(&b->seq, memory_order_relaxed)
+                                != seq) {
+                        continue;
+                }
+                if (!fits) {
+                        return -EOVERFLOW;
+                }
+                if (version__inout) {
+                        *version__inout = buf_version;
+                }
+                return size;
+        }
+}
+
+// See iccom_conflator.h
+int iccom_conflator_get_stats(const iccom_conflator *const c
+                              , iccom_conflator_stats *const out)
+{
+        if (!c || !out) {
+                log("no conflator or output ptr is provided");
+                return -EINVAL;
+        }
+        out->received = atomic_load_explicit(&c->received
+                                             , memory_order_relaxed);
+        out->keys = atomic_load_explicit(&c->keys_count
+                                         , memory_order_relaxed);
+        out->dropped = atomic_load_explicit(&c->dropped
+                                            , memory_order_relaxed);
+        out->receive_errors = atomic_load_explicit(&c->receive_errors
+                                                   , memory_order_relaxed);
+        return 0;
+}
@@ -0,0 +1,848 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the ICCom work-stealing dispatcher, see
+ * iccom_dispatcher.h.
+ *
+ * The strand (channel serial queue) is the unit of scheduling: it is
+ * either idle or scheduled, and the scheduled strand is either queued
+ * exactly once (in some worker deque or in the injection queue) or is
+ * being run by exactly one worker. So the handler calls of a channel
+ * never overlap and keep the submit order, and the deques never hold
+ * more than max channels entries (thus have fixed capacity).
+ *
+ * The worker takes the work from the bottom of its own deque first,
+ * then from the injection queue (the strands scheduled by non-worker
+ * threads, like the receive thread), then steals from the top of other
+ * workers deques, and sleeps when there is no work at all.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+
+#include "iccom.h"
+#include "iccom_receiver.h"
+#include "iccom_dispatcher.h"
+#include "utils.h"
+#include "ring.h"
+#include "threads.h"
+
+/* -------------------- BUILD TIME CONFIGURATION ----------------------- */
+
+#define ICCOM_DISPATCHER_DEFAULT_STRAND_BATCH 16
+#define ICCOM_DISPATCHER_DEFAULT_MAX_CHANNELS 256
+
+#define ICCOM_DISPATCHER_DEFAULT_MAX_QUEUE 512
+
+// the receive thread epoll timeout and the read timeout of the sockets
+// opened by the dispatcher: the stop latency
+#define ICCOM_DISPATCHER_RX_TIMEOUT_MS 100
+
+// the idle worker sleep, just the safety net, the workers are woken up
+// when the work comes
+#define ICCOM_DISPATCHER_IDLE_SLEEP_MS 10
+
+#define ICCOM_DISPATCHER_RX_EVENTS 32
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+// The channel strand.
+//
+// @channel the channel
+// @sock the channel socket, @sock.fd <0 if none
+// @handler, @ctx the channel handler
+// @scheduled !0 while the strand is queued or run
+// @lock protects the messages queue
+// @msgs the messages queue ring, preallocated
+// @capacity the ring capacity, power of two
+// @head the index of the first message
+// @count the number of messages in the queue
+struct iccom_dispatch_strand {
+        unsigned int channel;
+        struct iccom_rx_socket sock;
+        iccom_dispatch_handler handler;
+        void *ctx;
+
+        _Alignas(ICCOM_CACHE_LINE_SIZE) _Atomic int scheduled;
+        pthread_mutex_t lock;
+        iccom_rx_message *msgs;
+        size_t capacity;
+        size_t head;
+        size_t count;
+};
+
+// The Chase-Lev work-stealing deque of the scheduled strands, the
+// owner worker pushes and pops at the bottom, the thieves steal from
+// the top.
+struct iccom_dispatch_deque {
+        _Alignas(ICCOM_CACHE_LINE_SIZE) _Atomic int64_t top;
+        _Alignas(ICCOM_CACHE_LINE_SIZE) _Atomic int64_t bottom;
+        struct iccom_dispatch_strand *_Atomic *slots;
+        int64_t mask;
+};
+
+// The worker.
+//
+// @deque the worker own deque
+// @d the dispatcher
+// @index the worker index
+// @rand the victim selection random state
+// @thread the worker thread
+// @dispatched, @strand_runs, @steals the worker counters
+struct iccom_dispatch_worker {
+        struct iccom_dispatch_deque deque;
+        struct iccom_dispatcher *d;
+        unsigned int index;
+        uint32_t rand;
+        pthread_t thread;
+        _Alignas(ICCOM_CACHE_LINE_SIZE) _Atomic uint64_t dispatched;
+        _Atomic uint64_t strand_runs;
+        _Atomic uint64_t steals;
+};
+
+// @workers the workers array
+// @workers_count the number of workers
+// @first_cpu see @iccom_dispatcher_cfg
+// @strand_batch see @iccom_dispatcher_cfg
+// @max_channels see @iccom_dispatcher_cfg
+// @queue_capacity the strand queue capacity, power of two
+// @inject_lock protects the injection queue
+// @inject the injection queue ring (capacity is @mask + 1)
+// @inject_head, @inject_count the injection queue state
+// @mask the deques and injection queue capacity - 1
+// @idle the idle workers sleep
+// @draining !0 when the workers are to exit once out of work
+// @attach_lock serializes the channels attach
+// @table the channel -> strand open addressing table (@table_mask + 1
+//      entries, the entries are never removed)
+// @strands the attached strands, @strands_count of them
+// @epoll_fd the receive thread epoll
+// @rx_thread the receive thread
+// @rx_stop !0 when the receive thread is to exit
+// @dropped see @iccom_dispatcher_stats
+struct iccom_dispatcher {
+        struct iccom_dispatch_worker *workers;
+        unsigned int workers_count;
+        int first_cpu;
+        unsigned int strand_batch;
+        unsigned int max_channels;
+        size_t queue_capacity;
+
+        _Alignas(ICCOM_CACHE_LINE_SIZE) pthread_mutex_t inject_lock;
+        struct iccom_dispatch_strand **inject;
+        int64_t inject_head;
+        _Atomic int64_t inject_count;
+        int64_t mask;
+
+        _Alignas(ICCOM_CACHE_LINE_SIZE) struct iccom_waiter idle;
+        _Atomic int draining;
+
+        _Alignas(ICCOM_CACHE_LINE_SIZE) pthread_mutex_t attach_lock;
+        struct iccom_dispatch_strand *_Atomic *table;
+        unsigned int table_mask;
+        struct iccom_dispatch_strand **strands;
+        unsigned int strands_count;
+
+        int epoll_fd;
+        pthread_t rx_thread;
+        _Atomic int rx_stop;
+        _Atomic uint64_t dropped;
+};
+
+// the worker which runs the calling thread, NULL if it is not a worker
+static _Thread_local struct iccom_dispatch_worker *iccom_dispatch_self;
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+/* ------------------- DEQUE ------------------------------------------- */
+
+// NOTE: the capacity is never exceeded, see the file header.
+static void iccom_dispatch_deque_push(struct iccom_dispatch_deque *const q
+                                      , struct iccom_dispatch_strand *s)
+{
+        const int64_t b = atomic_load_explicit(&q->bottom
+                                               , memory_order_relaxed);
+        atomic_store_explicit(&q->slots[b & q->mask], s
+                              , memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+}
+
+// Owner side take from the bottom.
+static struct iccom_dispatch_strand *iccom_dispatch_deque_pop(
+                struct iccom_dispatch_deque *const q)
+{
+        const int64_t b = atomic_load_explicit(&q->bottom
+                                               , memory_order_relaxed) - 1;
+        atomic_store_explicit(&q->bottom, b, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        int64_t t = atomic_load_explicit(&q->top, memory_order_relaxed);
+        if (t > b) {
+                atomic_store_explicit(&q->bottom, b + 1
+                                      , memory_order_relaxed);
+                return NULL;
+        }
+        struct iccom_dispatch_strand *s = atomic_load_explicit(
+                        &q->slots[b & q->mask], memory_order_relaxed);
+        if (t == b) {
+                // the last one, racing with the thieves
+                if (!atomic_compare_exchange_strong_explicit(
+                                &q->top, &t, t + 1, memory_order_seq_cst
+                                , memory_order_relaxed)) {
+                        s = NULL;
+                }
+                atomic_store_explicit(&q->bottom, b + 1
+                                      , memory_order_relaxed);
+        }
+        return s;
+}
+
+// Thief side take from the top.
+//
+// RETURNS: the strand, NULL if the deque is empty or the race is lost
+static struct iccom_dispatch_strand *iccom_dispatch_deque_steal(
+                struct iccom_dispatch_deque *const q)
+{
+        int64_t t = atomic_load_explicit(&q->top, memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        const int64_t b = atomic_load_explicit(&q->bottom
+                                               , memory_order_acquire);
+        if (t >= b) {
+                return NULL;
+        }
+        struct iccom_dispatch_strand *const s = atomic_load_explicit(
+                        &q->slots[t & q->mask], memory_order_relaxed);
+        if (!atomic_compare_exchange_strong_explicit(
+                        &q->top, &t, t + 1, memory_order_seq_cst
+                        , memory_order_relaxed)) {
+                return NULL;
+        }
+        return s;
+}
+
+static int iccom_dispatch_deque_nonempty(struct iccom_dispatch_deque *const q)
+{
+        return atomic_load_explicit(&q->top, memory_order_relaxed)
+               < atomic_load_explicit(&q->bottom, memory_order_relaxed);
+}
+
+/* ------------------- SCHEDULING -------------------------------------- */
+
+static int iccom_dispatch_has_work(struct iccom_dispatcher *const d)
+{
+        if (atomic_load_explicit(&d->inject_count, memory_order_relaxed)) {
+                return 1;
+        }
+        for (unsigned int i = 0; i < d->workers_count; i++) {
+                if (iccom_dispatch_deque_nonempty(&d->workers[i].deque)) {
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+// RETURNS: !0 if the worker is not to sleep
+static int iccom_dispatch_ready(void *const ctx)
+{
+        struct iccom_dispatcher *const d = (struct iccom_dispatcher *)ctx;
+        return iccom_dispatch_has_work(d)
+               || atomic_load_explicit(&d->draining, memory_order_relaxed);
+}
+
+// Queues the scheduled strand: to the own deque when called by the
+// dispatcher worker, to the injection queue otherwise.
+static void iccom_dispatch_schedule(struct iccom_dispatcher *const d
+                                    , struct iccom_dispatch_strand *s)
+{
+        struct iccom_dispatch_worker *const self = iccom_dispatch_self;
+        if (self && self->d == d) {
+                iccom_dispatch_deque_push(&self->deque, s);
+        } else {
+                pthread_mutex_lock(&d->inject_lock);
+                const int64_t count = atomic_load_explicit(
+                                &d->inject_count, memory_order_relaxed);
+                d->inject[(d->inject_head + count) & d->mask] = s;
+                atomic_store_explicit(&d->inject_count, count + 1
+                                      , memory_order_relaxed);
+                pthread_mutex_unlock(&d->inject_lock);
+        }
+        __iccom_waiter_wake(&d->idle, 0);
+}
+
+static struct iccom_dispatch_strand *iccom_dispatch_inject_pop(
+                struct iccom_dispatcher *const d)
+{
+        if (!atomic_load_explicit(&d->inject_count, memory_order_relaxed)) {
+                return NULL;
+        }
+        struct iccom_dispatch_strand *s = NULL;
+        pthread_mutex_lock(&d->inject_lock);
+        const int64_t count = atomic_load_explicit(&d->inject_count
+                                                   , memory_order_relaxed);
+        if (count) {
+                s = d->inject[d->inject_head & d->mask];
+                d->inject_head++;
+                atomic_store_explicit(&d->inject_count, count - 1
+                                      , memory_order_relaxed);
+        }
+        pthread_mutex_unlock(&d->inject_lock);
+        return s;
+}
+
+// Appends the message to the strand queue.
+//
+// RETURNS:
+//      1: the strand was idle and is to be scheduled by the caller
+//      0: the strand is already scheduled
+//      -EAGAIN: the queue is full
+static int iccom_dispatch_strand_push(struct iccom_dispatch_strand *const s
+                                      , const iccom_rx_message *const msg)
+{
+        pthread_mutex_lock(&s->lock);
+        if (s->count == s->capacity) {
+                pthread_mutex_unlock(&s->lock);
+                return -EAGAIN;
+        }
+        s->msgs[(s->head + s->count) & (s->capacity - 1)] = *msg;
+        s->count++;
+        pthread_mutex_unlock(&s->lock);
+
+        return !atomic_exchange_explicit(&s->scheduled, 1
+                                         , memory_order_acq_rel);
+}
+
+// RETURNS: 1 if the message was taken into @msg__out, 0 if empty
+static int iccom_dispatch_strand_pop(struct iccom_dispatch_strand *const s
+                                     , iccom_rx_message *const msg__out)
+{
+        int got = 0;
+        pthread_mutex_lock(&s->lock);
+        if (s->count) {
+                *msg__out = s->msgs[s->head];
+                s->head = (s->head + 1) & (s->capacity - 1);
+                s->count--;
+                got = 1;
+        }
+        pthread_mutex_unlock(&s->lock);
+        return got;
+}
+
+static int iccom_dispatch_strand_empty(struct iccom_dispatch_strand *const s)
+{
+        pthread_mutex_lock(&s->lock);
+        const int empty = (s->count == 0);
+        pthread_mutex_unlock(&s->lock);
+        return empty;
+}
+
+// Runs up to the batch of the strand messages, then either reschedules
+// the strand to the own deque, or gets it idle if it is out of messages.
+static void iccom_dispatch_run(struct iccom_dispatch_worker *const w
+                               , struct iccom_dispatch_strand *const s)
+{
+        struct iccom_dispatcher *const d = w->d;
+        uint64_t done = 0;
+        iccom_rx_message msg;
+        while (done < d->strand_batch && iccom_dispatch_strand_pop(s, &msg)) {
+                s->handler(s->ctx, s->channel, &msg);
+                iccom_rx_message_free(&msg);
+                done++;
+        }
+        atomic_fetch_add_explicit(&w->dispatched, done, memory_order_relaxed);
+        atomic_fetch_add_explicit(&w->strand_runs, 1, memory_order_relaxed);
+
+        if (!iccom_dispatch_strand_empty(s)) {
+                iccom_dispatch_deque_push(&w->deque, s);
+                __iccom_waiter_wake(&d->idle, 0);
+                return;
+        }
+        atomic_store_explicit(&s->scheduled, 0, memory_order_seq_cst);
+        // the message pushed after the emptiness check but before the
+        // store above found the strand scheduled, so we take it over
+        if (!iccom_dispatch_strand_empty(s)
+                    && !atomic_exchange_explicit(&s->scheduled, 1
+                                                 , memory_order_acq_rel)) {
+                iccom_dispatch_deque_push(&w->deque, s);
+                __iccom_waiter_wake(&d->idle, 0);
+        }
+}
+
+static struct iccom_dispatch_strand *iccom_dispatch_steal(
+                struct iccom_dispatch_worker *const w)
+{
+        struct iccom_dispatcher *const d = w->d;
+        if (d->workers_count < 2) {
+                return NULL;
+        }
+        // xorshift32
+        w->rand ^= w->rand << 13;
+        w->rand ^= w->rand >> 17;
+        w->rand ^= w->rand << 5;
+        const unsigned int start = w->rand % d->workers_count;
+        for (unsigned int i = 0; i < d->workers_count; i++) {
+                const unsigned int victim = (start + i) % d->workers_count;
+                if (victim == w->index) {
+                        continue;
+                }
+                struct iccom_dispatch_strand *const s
+                                = iccom_dispatch_deque_steal(
+                                        &d->workers[victim].deque);
+                if (s) {
+                        atomic_fetch_add_explicit(&w->steals, 1
+                                                  , memory_order_relaxed);
+                        return s;
+                }
+        }
+        return NULL;
+}
+
+// Sleeps till the work comes (or the safety timeout).
+//
+// RETURNS: !0 if the worker is to exit (draining and out of work)
+static int iccom_dispatch_idle(struct iccom_dispatcher *const d)
+{
+        __iccom_waiter_wait(&d->idle, iccom_dispatch_ready, d
+                            , ICCOM_DISPATCHER_IDLE_SLEEP_MS);
+        return atomic_load_explicit(&d->draining, memory_order_relaxed)
+               && !iccom_dispatch_has_work(d);
+}
+
+// The worker thread.
+static void *iccom_dispatch_worker_loop(void *arg)
+{
+        struct iccom_dispatch_worker *const w
+                        = (struct iccom_dispatch_worker *)arg;
+        struct iccom_dispatcher *const d = w->d;
+
+        iccom_dispatch_self = w;
+        __iccom_thread_place(ICCOM_THREAD_DISPATCHER_WORKER
+                             , d->first_cpu >= 0
+                               ? d->first_cpu + (int)w->index : -1);
+
+        while (1) {
+                struct iccom_dispatch_strand *s
+                                = iccom_dispatch_deque_pop(&w->deque);
+                if (!s) {
+                        s = iccom_dispatch_inject_pop(d);
+                }
+                if (!s) {
+                        s = iccom_dispatch_steal(w);
+                }
+                if (s) {
+                        iccom_dispatch_run(w, s);
+                        continue;
+                }
+                if (iccom_dispatch_idle(d)) {
+                        break;
+                }
+        }
+        iccom_dispatch_self = NULL;
+        return NULL;
+}
+
+/* ------------------- RECEIVING --------------------------------------- */
+
+static struct iccom_dispatch_strand *iccom_dispatch_lookup(
+                struct iccom_dispatcher *const d, const unsigned int channel)
+{
+        for (unsigned int i = channel & d->table_mask; ; ) {
+                struct iccom_dispatch_strand *const s = atomic_load_explicit(
+                                &d->table[i], memory_order_acquire);
+                if (!s || s->channel == channel) {
+                        return s;
+                }
+                i = (i + 1) & d->table_mask;
+        }
+}
+
+static int iccom_dispatch_submit(struct iccom_dispatcher *const d
+                                 , struct iccom_dispatch_strand *const s
+                                 , const iccom_rx_message *const msg)
+{
+        const int res = iccom_dispatch_strand_push(s, msg);
+        if (res > 0) {
+                iccom_dispatch_schedule(d, s);
+        }
+        return res < 0 ? res : 0;
+}
+
+// The receive thread: drains all attached channel sockets into the
+// channel strands.
+static void *iccom_dispatch_rx_loop(void *arg)
+{
+        struct iccom_dispatcher *const d = (struct iccom_dispatcher *)arg;
+        struct epoll_event events[ICCOM_DISPATCHER_RX_EVENTS];
+
+        __iccom_thread_place(ICCOM_THREAD_DISPATCHER_RX, -1);
+
+        while (!atomic_load_explicit(&d->rx_stop, memory_order_relaxed)) {
+                const int n = epoll_wait(d->epoll_fd, events
+                                         , ICCOM_DISPATCHER_RX_EVENTS
+                                         , ICCOM_DISPATCHER_RX_TIMEOUT_MS);
+                for (int i = 0; i < n; i++) {
+                        struct iccom_dispatch_strand *const s
+                                = (struct iccom_dispatch_strand *)
+                                  events[i].data.ptr;
+                        iccom_rx_message msg;
+                        const int res = iccom_receive_data_alloc(
+                                        s->sock.fd, &msg.buf
+                                        , &msg.data_offset);
+                        if (res > 0) {
+                                msg.size = res;
+                                msg.rx_time_ns = __iccom_now_ns();
+                                if (iccom_dispatch_submit(d, s, &msg) < 0) {
+                                        atomic_fetch_add_explicit(
+                                                &d->dropped, 1
+                                                , memory_order_relaxed);
+                                        iccom_free_received_buffer(msg.buf);
+                                }
+                                continue;
+                        }
+                        if (res == -ENOBUFS || res == -EINTR
+                                    || !(events[i].events
+                                         & (EPOLLHUP | EPOLLRDHUP
+                                            | EPOLLERR))) {
+                                continue;
+                        }
+                        // the socket is gone for good, no busy loop on it
+                        log("Channel %u socket %d is closed or failed (%d),"
+                            " not receiving from it anymore", s->channel
+                            , s->sock.fd, res);
+                        epoll_ctl(d->epoll_fd, EPOLL_CTL_DEL, s->sock.fd
+                                  , NULL);
+                }
+        }
+        return NULL;
+}
+
+/* ------------------- API --------------------------------------------- */
+
+static unsigned int iccom_dispatch_pow2(const unsigned int n)
+{
+        unsigned int p = 1;
+        while (p < n) {
+                p <<= 1;
+        }
+        return p;
+}
+
+static void iccom_dispatch_free(struct iccom_dispatcher *const d)
+{
+        for (unsigned int i = 0; i < d->strands_count; i++) {
+                struct iccom_dispatch_strand *const s = d->strands[i];
+                iccom_rx_message msg;
+                while (iccom_dispatch_strand_pop(s, &msg)) {
+                        iccom_rx_message_free(&msg);
+                }
+                __iccom_rx_socket_release(&s->sock);
+                pthread_mutex_destroy(&s->lock);
+                free(s->msgs);
+                free(s);
+        }
+        if (d->workers) {
+                for (unsigned int i = 0; i < d->workers_count; i++) {
+                        free(d->workers[i].deque.slots);
+                }
+        }
+        if (d->epoll_fd >= 0) {
+                close(d->epoll_fd);
+        }
+        pthread_mutex_destroy(&d->attach_lock);
+        __iccom_waiter_destroy(&d->idle);
+        pthread_mutex_destroy(&d->inject_lock);
+        free(d->strands);
+        free(d->table);
+        free(d->inject);
+        free(d->workers);
+        free(d);
+}
+
+// See iccom_dispatcher.h
+int iccom_dispatcher_start(const iccom_dispatcher_cfg *const cfg
+                           , iccom_dispatcher **const dispatcher__out)
+{
+        if (!cfg || !dispatcher__out) {
+                log("no configuration or output ptr is provided");
+                return -EINVAL;
+        }
+        if (cfg->max_queue > (1u << 31)) {
+                log("The strand queue size %u is too big", cfg->max_queue);
+                return -EINVAL;
+        }
+        unsigned int workers = cfg->workers;
+        if (!workers) {
+                const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                workers = cpus > 0 ? (unsigned int)cpus : 1;
+        }
+
+        const size_t size = (sizeof(struct iccom_dispatcher)
+                             + ICCOM_CACHE_LINE_SIZE - 1)
+                            / ICCOM_CACHE_LINE_SIZE * ICCOM_CACHE_LINE_SIZE;
+        struct iccom_dispatcher *const d = (struct iccom_dispatcher *)
+                        aligned_alloc(ICCOM_CACHE_LINE_SIZE, size);
+        if (!d) {
+                return -ENOMEM;
+        }
+        memset(d, 0, sizeof(*d));
+        d->epoll_fd = -1;
+        d->first_cpu = cfg->first_cpu;
+        d->strand_batch = cfg->strand_batch
+                          ? cfg->strand_batch
+                          : ICCOM_DISPATCHER_DEFAULT_STRAND_BATCH;
+        d->max_channels = cfg->max_channels
+                          ? cfg->max_channels
+                          : ICCOM_DISPATCHER_DEFAULT_MAX_CHANNELS;
+        d->queue_capacity = iccom_dispatch_pow2(cfg->max_queue
+                                        ? cfg->max_queue
+                                        : ICCOM_DISPATCHER_DEFAULT_MAX_QUEUE);
+        pthread_mutex_init(&d->inject_lock, NULL);
+        __iccom_waiter_init(&d->idle);
+        pthread_mutex_init(&d->attach_lock, NULL);
+
+        int res = -ENOMEM;
+        const unsigned int capacity = iccom_dispatch_pow2(d->max_channels);
+        d->mask = capacity - 1;
+        d->table_mask = 2 * capacity - 1;
+        d->inject = (struct iccom_dispatch_strand **)
+                        calloc(capacity, sizeof(d->inject[0]));
+        d->table = (struct iccom_dispatch_strand *_Atomic *)
+                        calloc(2 * capacity, sizeof(d->table[0]));
+        d->strands = (struct iccom_dispatch_strand **)
+                        calloc(d->max_channels, sizeof(d->strands[0]));
+        // the worker embeds the cache line aligned deque
+        d->workers = (struct iccom_dispatch_worker *)
+                        aligned_alloc(ICCOM_CACHE_LINE_SIZE
+                                      , workers * sizeof(d->workers[0]));
+        if (!d->inject || !d->table || !d->strands || !d->workers) {
+                goto free_dispatcher;
+        }
+        memset(d->workers, 0, workers * sizeof(d->workers[0]));
+        for (unsigned int i = 0; i < workers; i++) {
+                struct iccom_dispatch_worker *const w = &d->workers[i];
+                w->d = d;
+                w->index = i;
+                w->rand = 2463534242u + i * 2654435761u;
+                w->deque.mask = d->mask;
+                w->deque.slots = (struct iccom_dispatch_strand *_Atomic *)
+                                calloc(capacity, sizeof(w->deque.slots[0]));
+                if (!w->deque.slots) {
+                        d->workers_count = i;
+                        goto free_dispatcher;
+                }
+        }
+        d->workers_count = workers;
+
+        d->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (d->epoll_fd < 0) {
+                res = -errno;
+                log("Could not create the dispatcher epoll: %d(%s)"
+                    , -res, strerror(-res));
+                goto free_dispatcher;
+        }
+
+        unsigned int started = 0;
+        for (; started < workers; started++) {
+                res = -pthread_create(&d->workers[started].thread, NULL
+                                      , iccom_dispatch_worker_loop
+                                      , &d->workers[started]);
+                if (res < 0) {
+                        log("Could not start the dispatcher worker: %d(%s)"
+                            , -res, strerror(-res));
+                        goto stop_workers;
+                }
+        }
+        res = -pthread_create(&d->rx_thread, NULL, iccom_dispatch_rx_loop, d);
+        if (res < 0) {
+                log("Could not start the dispatcher receive thread: %d(%s)"
+                    , -res, strerror(-res));
+                goto stop_workers;
+        }
+
+        *dispatcher__out = d;
+        return 0;
+
+stop_workers:
+        atomic_store_explicit(&d->draining, 1, memory_order_relaxed);
+        __iccom_waiter_wake(&d->idle, 1);
+        for (unsigned int i = 0; i < started; i++) {
+                pthread_join(d->workers[i].thread, NULL);
+        }
+free_dispatcher:
+        iccom_dispatch_free(d);
+        return res;
+}
+
+// See iccom_dispatcher.h
+void iccom_dispatcher_stop(iccom_dispatcher *const d)
+{
+        if (!d) {
+                return;
+        }
+        atomic_store_explicit(&d->rx_stop, 1, memory_order_relaxed);
+        pthread_join(d->rx_thread, NULL);
+
+        // the workers finish all queued work and exit
+        atomic_store_explicit(&d->draining, 1, memory_order_relaxed);
+        __iccom_waiter_wake(&d->idle, 1);
+        for (unsigned int i = 0; i < d->workers_count; i++) {
+                pthread_join(d->workers[i].thread, NULL);
+        }
+
+        iccom_dispatch_free(d);
+}
+
+// See iccom_dispatcher.h
+int iccom_dispatcher_attach(iccom_dispatcher *const d
+                            , const unsigned int channel
+                            , const int sock_fd
+                            , const iccom_dispatch_handler handler
+                            , void *const ctx)
+{
+        if (!d || !handler) {
+                log("no dispatcher or handler is provided");
+                return -EINVAL;
+        }
+
+        int res = 0;
+        pthread_mutex_lock(&d->attach_lock);
+        if (iccom_dispatch_lookup(d, channel)) {
+                res = -EEXIST;
+                goto unlock;
+        }
+        if (d->strands_count == d->max_channels) {
+                log("Could not attach the channel %u: max %u channels are"
+                    " attached already", channel, d->max_channels);
+                res = -ENOSPC;
+                goto unlock;
+        }
+
+        // the strand struct size is the cache line multiple already
+        struct iccom_dispatch_strand *const s = (struct iccom_dispatch_strand *)
+                        aligned_alloc(ICCOM_CACHE_LINE_SIZE, sizeof(*s));
+        if (!s) {
+                res = -ENOMEM;
+                goto unlock;
+        }
+        memset(s, 0, sizeof(*s));
+        s->channel = channel;
+        s->handler = handler;
+        s->ctx = ctx;
+        s->capacity = d->queue_capacity;
+        s->msgs = (iccom_rx_message *)malloc(s->capacity * sizeof(s->msgs[0]));
+        if (!s->msgs) {
+                res = -ENOMEM;
+                goto free_strand;
+        }
+        pthread_mutex_init(&s->lock, NULL);
+
+        if (sock_fd == ICCOM_DISPATCHER_NO_SOCKET) {
+                s->sock.fd = -1;
+                s->sock.saved_timeout_ms = -1;
+        } else {
+                // the filtered out frames mustn't block the receive
+                // thread for long
+                res = __iccom_rx_socket_take(channel, sock_fd
+                                             , ICCOM_DISPATCHER_RX_TIMEOUT_MS
+                                             , &s->sock);
+                if (res < 0) {
+                        goto destroy_strand;
+                }
+        }
+        if (s->sock.fd >= 0) {
+                struct epoll_event ev;
+                memset(&ev, 0, sizeof(ev));
+                ev.events = EPOLLIN | EPOLLRDHUP;
+                ev.data.ptr = s;
+                if (epoll_ctl(d->epoll_fd, EPOLL_CTL_ADD, s->sock.fd
+                              , &ev) < 0) {
+                        res = -errno;
+                        log("Could not watch the channel %u socket %d:"
+                            " %d(%s)", channel, s->sock.fd, -res
+                            , strerror(-res));
+                        goto close_socket;
+                }
+        }
+
+        unsigned int i = channel & d->table_mask;
+        while (atomic_load_explicit(&d->table[i], memory_order_relaxed)) {
+                i = (i + 1) & d->table_mask;
+        }
+        atomic_store_explicit(&d->table[i], s, memory_order_release);
+        d->strands[d->strands_count++] = s;
+        pthread_mutex_unlock(&d->attach_lock);
+        return 0;
+
+close_socket:
+        __iccom_rx_socket_release(&s->sock);
+destroy_strand:
+        pthread_mutex_destroy(&s->lock);
+free_strand:
+        free(s->msgs);
+        free(s);
+unlock:
+        pthread_mutex_unlock(&d->attach_lock);
+        return res;
+}
+
+// See iccom_dispatcher.h
+int iccom_dispatcher_submit(iccom_dispatcher *const d
+                            , const unsigned int channel
+                            , iccom_rx_message *const msg)
+{
+        if (!d || !msg) {
+                log("no dispatcher or message is provided");
+                return -EINVAL;
+        }
+        struct iccom_dispatch_strand *const s = iccom_dispatch_lookup(d
+                                                                , channel);
+        if (!s) {
+                return -ENOENT;
+        }
+        const int res = iccom_dispatch_submit(d, s, msg);
+        if (res == 0) {
+                memset(msg, 0, sizeof(*msg));
+        }
+        return res;
+}
+
+// See iccom_dispatcher.h
+int iccom_dispatcher_get_stats(const iccom_dispatcher *const d
+                               , iccom_dispatcher_stats *const out)
+{
+        if (!d || !out) {
+                log("no dispatcher or output ptr is provided");
+                return -EINVAL;
+        }
+        memset(out, 0, sizeof(*out));
+        for (unsigned int i = 0; i < d->workers_count; i++) {
+                struct iccom_dispatch_worker *const w = &d->workers[i];
+                out->dispatched += atomic_load_explicit(
+                                &w->dispatched, memory_order_relaxed);
+                out->strand_runs += atomic_load_explicit(
+                                &w->strand_runs, memory_order_relaxed);
+                out->steals += atomic_load_explicit(&w->steals
+                                                    , memory_order_relaxed);
+        }
+        out->dropped = atomic_load_explicit(&d->dropped, memory_order_relaxed);
+        return 0;
+}
@@ -0,0 +1,509 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the ICCom in-process fan-out, see iccom_fanout.h.
+ *
+ * The shared message header is taken from the received buffers pool
+ * too (smallest size class), so neither the header nor the buffer
+ * allocation hits the heap in the steady state.
+ *
+ * The subscriber queue is the SPSC ring (the fan-out thread produces,
+ * the consumer consumes). For ICCOM_FANOUT_DROP_OLDEST the fan-out
+ * thread consumes from the full ring too, so then both sides advance
+ * the head with CAS. The consumer blocking wait is the waiter (see
+ * ring.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "iccom.h"
+#include "iccom_fanout.h"
+#include "msg_pool.h"
+#include "threads.h"
+#include "utils.h"
+#include "ring.h"
+
+/* -------------------- BUILD TIME CONFIGURATION ----------------------- */
+
+#define ICCOM_FANOUT_DEFAULT_QUEUE_SIZE 256
+#define ICCOM_FANOUT_DEFAULT_STOP_LATENCY_MS 100
+
+// the fan-out thread sleep while the ICCOM_FANOUT_BLOCK subscriber
+// queue is full
+#define ICCOM_FANOUT_FULL_SLEEP_NS 50000
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+// The shared message.
+//
+// @pub the public part
+// @refs the number of references
+// @buf the received buffer
+struct iccom_fanout_msg {
+        iccom_shared_msg pub;
+        _Atomic uint32_t refs;
+        void *buf;
+};
+
+// @tail the next slot to write (fan-out thread)
+// @head_cache the fan-out thread copy of @head
+// @head the next slot to read
+// @tail_cache the consumer copy of @tail
+// @consumer the consumer blocking wait
+// @slots the ring slots
+// @mask the ring size - 1
+// @policy ICCOM_FANOUT_* the full queue policy
+// @closing !0 when the subscriber is being removed
+// @fanout the fan-out
+// @queued, @dropped, @full_waits the counters
+struct iccom_subscriber {
+        _Alignas(ICCOM_CACHE_LINE_SIZE) _Atomic uint64_t tail;
+        uint64_t head_cache;
+
+        _Alignas(ICCOM_CACHE_LINE_SIZE) _Atomic uint64_t head;
+        uint64_t tail_cache;
+
+        _Alignas(ICCOM_CACHE_LINE_SIZE) struct iccom_waiter consumer;
+
+        _Alignas(ICCOM_CACHE_LINE_SIZE)
+                        _Atomic(struct iccom_fanout_msg *) *slots;
+        uint64_t mask;
+        int policy;
+        _Atomic int closing;
+        struct iccom_fanout *fanout;
+        _Atomic uint64_t queued;
+        _Atomic uint64_t dropped;
+        _Atomic uint64_t full_waits;
+};
+
+// @lock protects @subscribers, held by the fan-out thread while it
+//      publishes the message
+// @subscribers the subscribers array, @count of @capacity used
+// @sock the socket to receive from
+// @stop !0 when the fan-out thread is to exit
+// @thread the fan-out thread
+// @cpu the CPU to pin the thread to, <0 if none
+// @received, @receive_errors the counters
+struct iccom_fanout {
+        pthread_mutex_t lock;
+        struct iccom_subscriber **subscribers;
+        unsigned int count;
+        unsigned int capacity;
+        struct iccom_rx_socket sock;
+        _Atomic int stop;
+        pthread_t thread;
+        int cpu;
+        _Atomic uint64_t received;
+        _Atomic uint64_t receive_errors;
+};
+
+// The @iccom_subscriber_wait context.
+struct iccom_subscriber_take {
+        iccom_subscriber *s;
+        const iccom_shared_msg **msg__out;
+};
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+// See iccom_fanout.h
+void iccom_shared_msg_ref(const iccom_shared_msg *const msg)
+{
+        struct iccom_fanout_msg *const m = (struct iccom_fanout_msg *)msg;
+        atomic_fetch_add_explicit(&m->refs, 1, memory_order_relaxed);
+}
+
+// See iccom_fanout.h
+void iccom_shared_msg_unref(const iccom_shared_msg *const msg)
+{
+        if (!msg) {
+                return;
+        }
+        struct iccom_fanout_msg *const m = (struct iccom_fanout_msg *)msg;
+        if (atomic_fetch_sub_explicit(&m->refs, 1
+                                      , memory_order_acq_rel) != 1) {
+                return;
+        }
+        iccom_free_received_buffer(m->buf);
+        iccom_free_received_buffer(m);
+}
+
+// Drops the oldest message of the full ICCOM_FANOUT_DROP_OLDEST queue,
+// unless the consumer frees the space meanwhile.
+static void iccom_fanout_drop_oldest(struct iccom_subscriber *const s
+                                     , const uint64_t tail)
+{
+        uint64_t head = s->head_cache;
+        while (tail - head > s->mask) {
+                struct iccom_fanout_msg *const old = atomic_load_explicit(
+                                &s->slots[head & s->mask]
+                                , memory_order_relaxed);
+                if (atomic_compare_exchange_weak_explicit(&s->head, &head
+                                , head + 1, memory_order_acq_rel
+                                , memory_order_acquire)) {
+                        iccom_shared_msg_unref(&old->pub);
+                        atomic_fetch_add_explicit(&s->dropped, 1
+                                                  , memory_order_relaxed);
+                        head++;
+                        break;
+                }
+        }
+        s->head_cache = head;
+}
+
+// Puts the message into the subscriber queue according to the
+// subscriber policy.
+static void iccom_fanout_push(struct iccom_fanout *const f
+                              , struct iccom_subscriber *const s
+                              , struct iccom_fanout_msg *const msg)
+{
+        const uint64_t tail = atomic_load_explicit(&s->tail
+                                                   , memory_order_relaxed);
+        if (tail - s->head_cache > s->mask) {
+                s->head_cache = atomic_load_explicit(&s->head
+                                                     , memory_order_acquire);
+        }
+        if (tail - s->head_cache > s->mask) {
+                switch (s->policy) {
+                case ICCOM_FANOUT_DROP_OLDEST:
+                        iccom_fanout_drop_oldest(s, tail);
+                        break;
+                case ICCOM_FANOUT_BLOCK:
+                        atomic_fetch_add_explicit(&s->full_waits, 1
+                                                  , memory_order_relaxed);
+                        while (tail - s->head_cache > s->mask) {
+                                if (atomic_load_explicit(&f->stop
+                                                , memory_order_relaxed)
+                                        || atomic_load_explicit(&s->closing
+                                                , memory_order_relaxed)) {
+                                        atomic_fetch_add_explicit(
+                                                &s->dropped, 1
+                                                , memory_order_relaxed);
+                                        return;
+                                }
+                                __iccom_sleep_ns(ICCOM_FANOUT_FULL_SLEEP_NS);
+                                s->head_cache = atomic_load_explicit(
+                                                &s->head
+                                                , memory_order_acquire);
+                        }
+                        break;
+                default:
+                        atomic_fetch_add_explicit(&s->dropped, 1
+                                                  , memory_order_relaxed);
+                        return;
+                }
+        }
+
+        iccom_shared_msg_ref(&msg->pub);
+        atomic_store_explicit(&s->slots[tail & s->mask], msg
+                              , memory_order_relaxed);
+        atomic_store_explicit(&s->tail, tail + 1, memory_order_release);
+        atomic_fetch_add_explicit(&s->queued, 1, memory_order_relaxed);
+        __iccom_waiter_wake(&s->consumer, 0);
+}
+
+// The fan-out thread.
+static void *iccom_fanout_loop(void *arg)
+{
+        struct iccom_fanout *const f = (struct iccom_fanout *)arg;
+
+        __iccom_thread_place(ICCOM_THREAD_RECEIVER, f->cpu);
+
+        while (!atomic_load_explicit(&f->stop, memory_order_relaxed)) {
+                void *buf;
+                int offset;
+                const uint64_t start_ns = __iccom_now_ns();
+                const int res = iccom_receive_data_alloc(f->sock.fd, &buf
+                                                         , &offset);
+                if (res <= 0) {
+                        if (res < 0) {
+                                atomic_fetch_add_explicit(&f->receive_errors
+                                                , 1, memory_order_relaxed);
+                        }
+                        __iccom_rx_backoff(res, start_ns);
+                        continue;
+                }
+                atomic_fetch_add_explicit(&f->received, 1
+                                          , memory_order_relaxed);
+
+                size_t capacity;
+                struct iccom_fanout_msg *const msg = (struct iccom_fanout_msg *)
+                                __iccom_msg_pool_alloc(sizeof(*msg)
+                                                       , &capacity);
+                if (!msg) {
+                        iccom_free_received_buffer(buf);
+                        continue;
+                }
+                msg->pub.data = (const char *)buf + offset;
+                msg->pub.size = res;
+                msg->pub.rx_time_ns = __iccom_now_ns();
+                msg->buf = buf;
+                // the fan-out thread reference, released after the push
+                atomic_init(&msg->refs, 1);
+
+                pthread_mutex_lock(&f->lock);
+                for (unsigned int i = 0; i < f->count; i++) {
+                        iccom_fanout_push(f, f->subscribers[i], msg);
+                }
+                pthread_mutex_unlock(&f->lock);
+
+                iccom_shared_msg_unref(&msg->pub);
+        }
+        return NULL;
+}
+
+// See iccom_fanout.h
+int iccom_fanout_start(const iccom_fanout_cfg *const cfg
+                       , iccom_fanout **const fanout__out)
+{
+        if (!cfg || !fanout__out) {
+                log("no configuration or output ptr is provided");
+                return -EINVAL;
+        }
+
+        struct iccom_fanout *const f = (struct iccom_fanout *)
+                        calloc(1, sizeof(*f));
+        if (!f) {
+                return -ENOMEM;
+        }
+        f->cpu = cfg->cpu;
+        pthread_mutex_init(&f->lock, NULL);
+
+        int res;
+        res = __iccom_rx_socket_take(cfg->channel, cfg->sock_fd
+                        , cfg->stop_latency_ms
+                          ? (int)cfg->stop_latency_ms
+                          : ICCOM_FANOUT_DEFAULT_STOP_LATENCY_MS
+                        , &f->sock);
+        if (res < 0) {
+                goto free_fanout;
+        }
+
+        res = -pthread_create(&f->thread, NULL, iccom_fanout_loop, f);
+        if (res < 0) {
+                log("Could not start the fan-out thread: %d(%s)"
+                    , -res, strerror(-res));
+                goto close_socket;
+        }
+
+        *fanout__out = f;
+        return 0;
+
+close_socket:
+        __iccom_rx_socket_release(&f->sock);
+free_fanout:
+        pthread_mutex_destroy(&f->lock);
+        free(f);
+        return res;
+}
+
+// See iccom_fanout.h
+void iccom_fanout_stop(iccom_fanout *const f)
+{
+        if (!f) {
+                return;
+        }
+        atomic_store_explicit(&f->stop, 1, memory_order_relaxed);
+        pthread_join(f->thread, NULL);
+
+        if (f->count) {
+                log("The fan-out is stopped with %u subscribers left"
+                    , f->count);
+        }
+        __iccom_rx_socket_release(&f->sock);
+        pthread_mutex_destroy(&f->lock);
+        free(f->subscribers);
+        free(f);
+}
+
+// See iccom_fanout.h
+int iccom_fanout_get_stats(const iccom_fanout *const f
+                           , iccom_fanout_stats *const out)
+{
+        if (!f || !out) {
+                log("no fan-out or output ptr is provided");
+                return -EINVAL;
+        }
+        out->received = atomic_load_explicit(&f->received
+                                             , memory_order_relaxed);
+        out->receive_errors = atomic_load_explicit(&f->receive_errors
+                                                   , memory_order_relaxed);
+        return 0;
+}
+
+// See iccom_fanout.h
+int iccom_fanout_subscribe(iccom_fanout *const f
+                           , const iccom_subscriber_cfg *const cfg
+                           , iccom_subscriber **const subscriber__out)
+{
+        if (!f || !cfg || !subscriber__out) {
+                log("no fan-out, configuration or output ptr is provided");
+                return -EINVAL;
+        }
+        const unsigned int queue_size = cfg->queue_size
+                                        ? cfg->queue_size
+                                        : ICCOM_FANOUT_DEFAULT_QUEUE_SIZE;
+        if (queue_size & (queue_size - 1)) {
+                log("The queue size %u is not a power of two", queue_size);
+                return -EINVAL;
+        }
+        if (cfg->policy < ICCOM_FANOUT_DROP_NEWEST
+                        || cfg->policy > ICCOM_FANOUT_BLOCK) {
+                log("Unknown full queue policy: %d", cfg->policy);
+                return -EINVAL;
+        }
+
+        const size_t size = (sizeof(struct iccom_subscriber)
+                             + ICCOM_CACHE_LINE_SIZE - 1)
+                            / ICCOM_CACHE_LINE_SIZE * ICCOM_CACHE_LINE_SIZE;
+        struct iccom_subscriber *const s = (struct iccom_subscriber *)
+                        aligned_alloc(ICCOM_CACHE_LINE_SIZE, size);
+        if (!s) {
+                return -ENOMEM;
+        }
+        memset(s, 0, sizeof(*s));
+        s->slots = calloc(queue_size, sizeof(s->slots[0]));
+        if (!s->slots) {
+                free(s);
+                return -ENOMEM;
+        }
+        s->mask = queue_size - 1;
+        s->policy = cfg->policy;
+        s->fanout = f;
+        __iccom_waiter_init(&s->consumer);
+
+        pthread_mutex_lock(&f->lock);
+        if (f->count == f->capacity) {
+                const unsigned int capacity = f->capacity
+                                              ? 2 * f->capacity : 4;
+                struct iccom_subscriber **const subscribers
+                                = (struct iccom_subscriber **)realloc(
+                                        f->subscribers
+                                        , capacity * sizeof(subscribers[0]));
+                if (!subscribers) {
+                        pthread_mutex_unlock(&f->lock);
+                        __iccom_waiter_destroy(&s->consumer);
+                        free(s->slots);
+                        free(s);
+                        return -ENOMEM;
+                }
+                f->subscribers = subscribers;
+                f->capacity = capacity;
+        }
+        f->subscribers[f->count++] = s;
+        pthread_mutex_unlock(&f->lock);
+
+        *subscriber__out = s;
+        return 0;
+}
+
+// See iccom_fanout.h
+void iccom_fanout_unsubscribe(iccom_subscriber *const s)
+{
+        if (!s) {
+                return;
+        }
+        struct iccom_fanout *const f = s->fanout;
+
+        // releases the fan-out thread waiting for the subscriber
+        atomic_store_explicit(&s->closing, 1, memory_order_relaxed);
+        pthread_mutex_lock(&f->lock);
+        for (unsigned int i = 0; i < f->count; i++) {
+                if (f->subscribers[i] == s) {
+                        f->subscribers[i] = f->subscribers[--f->count];
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&f->lock);
+
+        const iccom_shared_msg *msg;
+        while (iccom_subscriber_poll(s, &msg)) {
+                iccom_shared_msg_unref(msg);
+        }
+        __iccom_waiter_destroy(&s->consumer);
+        free(s->slots);
+        free(s);
+}
+
+// See iccom_fanout.h
+int iccom_subscriber_poll(iccom_subscriber *const s
+                          , const iccom_shared_msg **const msg__out)
+{
+        uint64_t head = atomic_load_explicit(&s->head, memory_order_relaxed);
+        while (1) {
+                // the fan-out thread may move the head past the cached
+                // tail (ICCOM_FANOUT_DROP_OLDEST)
+                if ((int64_t)(s->tail_cache - head) <= 0) {
+                        s->tail_cache = atomic_load_explicit(&s->tail
+                                                , memory_order_acquire);
+                        if (s->tail_cache == head) {
+                                return 0;
+                        }
+                }
+                struct iccom_fanout_msg *const msg = atomic_load_explicit(
+                                &s->slots[head & s->mask]
+                                , memory_order_relaxed);
+                if (s->policy != ICCOM_FANOUT_DROP_OLDEST) {
+                        atomic_store_explicit(&s->head, head + 1
+                                              , memory_order_release);
+                } else if (!atomic_compare_exchange_weak_explicit(
+                                &s->head, &head, head + 1
+                                , memory_order_acq_rel
+                                , memory_order_relaxed)) {
+                        continue;
+                }
+                *msg__out = &msg->pub;
+                return 1;
+        }
+}
+
+static int iccom_subscriber_take(void *const ctx)
+{
+        struct iccom_subscriber_take *const t
+                        = (struct iccom_subscriber_take *)ctx;
+        return iccom_subscriber_poll(t->s, t->msg__out);
+}
+
+// See iccom_fanout.h
+int iccom_subscriber_wait(iccom_subscriber *const s
+                          , const iccom_shared_msg **const msg__out
+                          , const int timeout_ms)
+{
+        if (iccom_subscriber_poll(s, msg__out)) {
+                return 1;
+        }
+        struct iccom_subscriber_take take = { s, msg__out };
+        return __iccom_waiter_wait(&s->consumer, iccom_subscriber_take
+                                   , &take, timeout_ms);
+}
+
+// See iccom_fanout.h
+int iccom_subscriber_get_stats(const iccom_subscriber *const s
+                               , iccom_subscriber_stats *const out)
+{
+        if (!s || !out) {
+                log("no subscriber or output ptr is provided");
+                return -EINVAL;
+        }
+        out->queued = atomic_load_explicit(&s->queued, memory_order_relaxed);
+        out->dropped = atomic_load_explicit(&s->dropped
+                                            , memory_order_relaxed);
+        out->full_waits = atomic_load_explicit(&s->full_waits
+                                               , memory_order_relaxed);
+        return 0;
+}
@@ -0,0 +1,312 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the socket filter rules verification, compilation
+ * into the classic BPF program and evaluation, see filter.h.
+ *
+ * The compiled program runs on the netlink message as the kernel ICCom
+ * modification delivers it: the netlink header (with nlmsg_len in the
+ * host byte order) followed by the payload. The payload size is
+ * computed once into the scratch memory, then every rule is a block of
+ * checks, which jumps to the next rule block on first mismatch, and
+ * accepts the message when all checks pass:
+ *
+ *      ld M[SIZE]
+ *      jge #min_size    ; if min_size
+ *      jgt #max_size    ; if max_size
+ *      jge #offset+width ; if width, guards the field load
+ *      ld{b,h,} [payload + offset]
+ *      and #mask        ; if mask is not full
+ *      jeq #value
+ *      ret #ACCEPT
+ *      ...              ; next rule
+ *      ret #0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sched.h>
+#include <linux/netlink.h>
+
+#include "iccom.h"
+#include "utils.h"
+#include "filter.h"
+
+/* -------------------- MACRO DEFINITIONS ------------------------------ */
+
+// the BPF scratch memory slots
+#define ICCOM_FILTER_M_TMP 0
+#define ICCOM_FILTER_M_SIZE 1
+
+// keep the whole message
+#define ICCOM_FILTER_ACCEPT 0xFFFFFFFFu
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+// The program being built.
+//
+// @insns the program instructions
+// @count the number of instructions
+struct iccom_filter_prog {
+        struct sock_filter *insns;
+        size_t count;
+};
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+// RETURNS: the max field value of the given width
+static uint32_t iccom_filter_full_mask(const uint32_t width)
+{
+        return width >= 4 ? 0xFFFFFFFFu : (1u << (8 * width)) - 1;
+}
+
+// See filter.h
+int __iccom_filter_verify(const iccom_filter_rule *const rules
+                          , const size_t count)
+{
+        if (count > ICCOM_FILTER_MAX_RULES) {
+                log("Too many filter rules: %zu, max: %d", count
+                    , ICCOM_FILTER_MAX_RULES);
+                return -EINVAL;
+        }
+        if (count && !rules) {
+                log("No filter rules ptr is provided.");
+                return -EINVAL;
+        }
+        for (size_t i = 0; i < count; i++) {
+                const iccom_filter_rule *const r = &rules[i];
+                if (r->width != 0 && r->width != 1 && r->width != 2
+                            && r->width != 4) {
+                        log("Filter rule %zu: invalid field width: %u"
+                            , i, r->width);
+                        return -EINVAL;
+                }
+                if (r->width && (r->offset > ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES
+                                 - r->width
+                                 || (r->mask & ~iccom_filter_full_mask(
+                                                        r->width))
+                                 || (r->value & ~r->mask))) {
+                        log("Filter rule %zu: the field offset, mask or"
+                            " value don't fit the field/message", i);
+                        return -EINVAL;
+                }
+                if (r->max_size && r->max_size < r->min_size) {
+                        log("Filter rule %zu: empty size range [%u; %u]"
+                            , i, r->min_size, r->max_size);
+                        return -EINVAL;
+                }
+        }
+        return 0;
+}
+
+// RETURNS: the index of the emitted instruction
+static size_t iccom_filter_emit(struct iccom_filter_prog *const prog
+                                , const uint16_t code, const uint32_t k)
+{
+        const struct sock_filter insn = BPF_STMT(code, k);
+        prog->insns[prog->count] = insn;
+        return prog->count++;
+}
+
+// Emits the conditional jump, which proceeds to the next instruction
+// when the condition is @expected, and jumps to the rule end (patched
+// later, see @iccom_filter_patch) otherwise.
+//
+// RETURNS: the index of the emitted instruction
+static size_t iccom_filter_emit_check(struct iccom_filter_prog *const prog
+                                      , const uint16_t code
+                                      , const uint32_t k
+                                      , const int expected)
+{
+        const size_t idx = iccom_filter_emit(prog, BPF_JMP | code | BPF_K, k);
+        // the not patched jump is marked by the max offset
+        if (expected) {
+                prog->insns[idx].jf = UINT8_MAX;
+        } else {
+                prog->insns[idx].jt = UINT8_MAX;
+        }
+        return idx;
+}
+
+// Points the rule block checks [@from; current end) to the end of the
+// block.
+static void iccom_filter_patch(struct iccom_filter_prog *const prog
+                               , const size_t from)
+{
+        for (size_t i = from; i < prog->count; i++) {
+                struct sock_filter *const insn = &prog->insns[i];
+                if (BPF_CLASS(insn->code) != BPF_JMP) {
+                        continue;
+                }
+                const uint8_t off = (uint8_t)(prog->count - i - 1);
+                if (insn->jt == UINT8_MAX) {
+                        insn->jt = off;
+                }
+                if (insn->jf == UINT8_MAX) {
+                        insn->jf = off;
+                }
+        }
+}
+
+// Emits the payload size computation into the M[ICCOM_FILTER_M_SIZE].
+static void iccom_filter_emit_size(struct iccom_filter_prog *const prog)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        iccom_filter_emit(prog, BPF_LD | BPF_W | BPF_ABS, 0);
+#else
+        // the BPF loads are big endian, so the little endian nlmsg_len
+        // is assembled byte by byte
+        iccom_filter_emit(prog, BPF_LD | BPF_B | BPF_ABS, 3);
+        for (int byte = 2; byte >= 0; byte--) {
+                iccom_filter_emit(prog, BPF_ALU | BPF_LSH | BPF_K, 8);
+                iccom_filter_emit(prog, BPF_ST, ICCOM_FILTER_M_TMP);
+                iccom_filter_emit(prog, BPF_LD | BPF_B | BPF_ABS
+                                  , (uint32_t)byte);
+                iccom_filter_emit(prog, BPF_LDX | BPF_W | BPF_MEM
+                                  , ICCOM_FILTER_M_TMP);
+                iccom_filter_emit(prog, BPF_ALU | BPF_OR | BPF_X, 0);
+        }
+#endif
+        iccom_filter_emit(prog, BPF_ALU | BPF_SUB | BPF_K, NLMSG_HDRLEN);
+        iccom_filter_emit(prog, BPF_ST, ICCOM_FILTER_M_SIZE);
+}
+
+// See filter.h
+size_t __iccom_filter_compile(const iccom_filter_rule *const rules
+                              , const size_t count
+                              , struct sock_filter *const prog_out)
+{
+        struct iccom_filter_prog prog = { .insns = prog_out, .count = 0 };
+
+        iccom_filter_emit_size(&prog);
+
+        for (size_t i = 0; i < count; i++) {
+                const iccom_filter_rule *const r = &rules[i];
+                const size_t block = iccom_filter_emit(&prog
+                                        , BPF_LD | BPF_W | BPF_MEM
+                                        , ICCOM_FILTER_M_SIZE);
+                if (r->min_size) {
+                        iccom_filter_emit_check(&prog, BPF_JGE, r->min_size
+                                                , 1);
+                }
+                if (r->max_size) {
+                        iccom_filter_emit_check(&prog, BPF_JGT, r->max_size
+                                                , 0);
+                }
+                if (r->width) {
+                        const uint16_t size = (r->width == 1) ? BPF_B
+                                              : (r->width == 2) ? BPF_H
+                                              : BPF_W;
+                        iccom_filter_emit_check(&prog, BPF_JGE
+                                                , r->offset + r->width, 1);
+                        iccom_filter_emit(&prog, BPF_LD | size | BPF_ABS
+                                          , NLMSG_HDRLEN + r->offset);
+                        if (r->mask != iccom_filter_full_mask(r->width)) {
+                                iccom_filter_emit(&prog
+                                                  , BPF_ALU | BPF_AND | BPF_K
+                                                  , r->mask);
+                        }
+                        iccom_filter_emit_check(&prog, BPF_JEQ, r->value, 1);
+                }
+                iccom_filter_emit(&prog, BPF_RET | BPF_K, ICCOM_FILTER_ACCEPT);
+                iccom_filter_patch(&prog, block);
+        }
+
+        iccom_filter_emit(&prog, BPF_RET | BPF_K, 0);
+        return prog.count;
+}
+
+// See filter.h
+int __iccom_filter_match(const iccom_filter_rule *const rules
+                         , const size_t count
+                         , const void *const payload, const size_t size)
+{
+        const unsigned char *const data = (const unsigned char *)payload;
+        for (size_t i = 0; i < count; i++) {
+                const iccom_filter_rule *const r = &rules[i];
+                if (size < r->min_size || (r->max_size && size > r->max_size)) {
+                        continue;
+                }
+                if (r->width) {
+                        if (size < (size_t)r->offset + r->width) {
+                                continue;
+                        }
+                        uint32_t field = 0;
+                        for (uint32_t b = 0; b < r->width; b++) {
+                                field = (field << 8) | data[r->offset + b];
+                        }
+                        if ((field & r->mask) != r->value) {
+                                continue;
+                        }
+                }
+                return 1;
+        }
+        return 0;
+}
+
+// See filter.h
+int __iccom_sock_filter_set(const int sock_fd
+                            , const iccom_filter_rule *const rules
+                            , const size_t count)
+{
+        struct iccom_sock_state *const st = __iccom_sock_state(sock_fd);
+        if (!st) {
+                if (count) {
+                        log("The socket %d is out of the registry range, the"
+                            " filter can't be set", sock_fd);
+                        return -EBADF;
+                }
+                return 0;
+        }
+
+        struct iccom_sock_filter *filter = NULL;
+        if (count) {
+                filter = (struct iccom_sock_filter *)malloc(
+                                sizeof(*filter) + count * sizeof(rules[0]));
+                if (!filter) {
+                        return -ENOMEM;
+                }
+                filter->count = count;
+                memcpy(filter->rules, rules, count * sizeof(rules[0]));
+        }
+
+        struct iccom_sock_filter *const old = atomic_exchange(&st->filter
+                                                              , filter);
+        if (old) {
+                // the evaluations which could have got the old filter
+                while (atomic_load(&st->filter_users) > 0) {
+                        sched_yield();
+                }
+                free(old);
+        }
+        return 0;
+}
+
+// See filter.h
+int __iccom_sock_filter_pass_slow(struct iccom_sock_state *const st
+                                  , const void *const payload
+                                  , const size_t size)
+{
+        // NOTE: the filter is loaded again after the users increment, so
+        //      its replacement waits for this evaluation to finish
+        atomic_fetch_add(&st->filter_users, 1);
+        const struct iccom_sock_filter *const filter
+                = atomic_load(&st->filter);
+        const int pass = !filter || __iccom_filter_match(filter->rules
+                                                         , filter->count
+                                                         , payload, size);
+        atomic_fetch_sub(&st->filter_users, 1);
+        return pass;
+}
@@ -0,0 +1,99 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+// Internal part of the socket filter facility (see the socket filter
+// API in iccom.h): the rules verification, their compilation into the
+// classic BPF program (for the kernel modification) and their
+// evaluation in the library (for the network sockets modification).
+
+#ifndef LIBICCOM_FILTER_H
+#define LIBICCOM_FILTER_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <linux/filter.h>
+
+#include "iccom.h"
+#include "sock_registry.h"
+
+/* -------------------- MACRO DEFINITIONS ------------------------------ */
+
+// the max BPF program size: the payload size computation prologue,
+// up to 8 instructions per rule and the final reject
+#define ICCOM_FILTER_MAX_INSNS (32 + 8 * ICCOM_FILTER_MAX_RULES)
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+// The filter evaluated in the library.
+//
+// @count the number of rules
+// @rules the rules
+struct iccom_sock_filter {
+        size_t count;
+        iccom_filter_rule rules[];
+};
+
+/* -------------------- ROUTINES DECLARATIONS -------------------------- */
+
+int __iccom_filter_verify(const iccom_filter_rule *const rules
+                          , const size_t count);
+
+// Compiles the (verified) rules into the classic BPF program, which
+// runs on the netlink message (header + payload).
+//
+// @prog {valid ptr to ICCOM_FILTER_MAX_INSNS instructions} the output
+//
+// RETURNS: the number of the program instructions
+size_t __iccom_filter_compile(const iccom_filter_rule *const rules
+                              , const size_t count
+                              , struct sock_filter *const prog);
+
+// RETURNS:
+//      !0: the payload matches the rules
+//      0: otherwise
+int __iccom_filter_match(const iccom_filter_rule *const rules
+                         , const size_t count
+                         , const void *const payload, const size_t size);
+
+// Sets the (verified) rules to be evaluated in the library for the
+// socket, NULL/0 removes the filter. Waits for the ongoing evaluations
+// of the replaced filter to finish.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int __iccom_sock_filter_set(const int sock_fd
+                            , const iccom_filter_rule *const rules
+                            , const size_t count);
+
+int __iccom_sock_filter_pass_slow(struct iccom_sock_state *const st
+                                  , const void *const payload
+                                  , const size_t size);
+
+// Evaluates the library side socket filter. Costs a single relaxed load
+// for the sockets without filter.
+//
+// RETURNS:
+//      !0: the message is to be delivered
+//      0: the message is to be dropped
+static inline int __iccom_sock_filter_pass(const int sock_fd
+                                           , const void *const payload
+                                           , const size_t size)
+{
+        struct iccom_sock_state *const st = __iccom_sock_state(sock_fd);
+        if (!st || !atomic_load_explicit(&st->filter, memory_order_relaxed)) {
+                return 1;
+        }
+        return __iccom_sock_filter_pass_slow(st, payload, size);
+}
+
+#endif //ifndef LIBICCOM_FILTER_H
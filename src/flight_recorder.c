@@ -0,0 +1,534 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the ICCom flight recorder: the always-on per
+ * channel rings of the latest frames, common for all ICCom
+ * modifications. See iccom.h for the IF description.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "iccom.h"
+#include "utils.h"
+#include "ring.h"
+#include "threads.h"
+#include "flight_recorder.h"
+
+/* -------------------- BUILD TIME CONFIGURATION ----------------------- */
+
+// the minimal interval between two error triggered dumps, so a
+// persistently failing channel doesn't turn into a dump storm
+#define ICCOM_FR_ERROR_DUMP_MIN_INTERVAL_NS 1000000000ull
+
+/* -------------------- MACRO DEFINITIONS ------------------------------ */
+
+#define ICCOM_FR_CHANNELS_COUNT                                              \
+        (2 * (ICCOM_MAX_CHANNEL - ICCOM_MIN_CHANNEL + 1))
+
+#define ICCOM_FR_ALIGNED(size)                                               \
+        (((size) + ICCOM_CAPTURE_ALIGN - 1) & ~((size_t)ICCOM_CAPTURE_ALIGN - 1))
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+// The ring slot, followed by the snaplen bytes of the payload.
+//
+// @seq the slot sequence: 2 * frame index + 1 while the slot is being
+//      written, 2 * frame index + 2 when the slot is consistent
+// @rec the frame record header, ready to be written to the dump
+struct iccom_fr_slot {
+        _Atomic uint64_t seq;
+        iccom_capture_record_header rec;
+};
+
+// @channel the channel of the ring
+// @mask the slots count - 1 (slots count is a power of 2)
+// @slot_size the size of a single slot including payload bytes
+// @snaplen the payload bytes stored per slot
+// @head the index of the next frame to be written
+// @slots the slots area
+struct iccom_fr_ring {
+        unsigned int channel;
+        uint32_t mask;
+        uint32_t slot_size;
+        uint32_t snaplen;
+        _Atomic uint64_t head;
+        char slots[];
+};
+
+/* ------------------- GLOBAL VARIABLES / CONSTANTS -------------------- */
+
+// the rings are allocated on the first channel opening and never freed,
+// so the recorded history survives the channel reopening
+static struct iccom_fr_ring *_Atomic fr_rings[ICCOM_FR_CHANNELS_COUNT];
+
+static _Atomic unsigned int fr_frames = ICCOM_FLIGHT_RECORDER_DEFAULT_FRAMES;
+static _Atomic unsigned int fr_snaplen = ICCOM_FLIGHT_RECORDER_DEFAULT_SNAPLEN;
+
+// @path the dump path for signal and error triggered dumps
+// @path_set !0 when @path is valid
+// @signo the currently installed dump signal, 0 if none
+// @last_error_dump_ns the time of the last error triggered dump
+// @lock serializes the configuration calls
+// @dumper_started !0 when the error dumps thread runs (never stops)
+// @requested !0 when the error triggered dump is requested
+// @error_sock_fd, @error the socket and the error of the request
+// @dumper the error dumps thread sleep, so the send/receive error
+//      paths only wake it up and never write the file themselves
+static struct {
+        char path[PATH_MAX];
+        _Atomic int path_set;
+        int signo;
+        _Atomic uint64_t last_error_dump_ns;
+        pthread_mutex_t lock;
+        _Atomic int dumper_started;
+        _Atomic int requested;
+        _Atomic int error_sock_fd;
+        _Atomic int error;
+        struct iccom_waiter dumper;
+} fr_dump = {
+        .path = {0}
+        , .path_set = 0
+        , .signo = 0
+        , .last_error_dump_ns = 0
+        , .lock = PTHREAD_MUTEX_INITIALIZER
+        , .dumper_started = 0
+        , .requested = 0
+};
+
+static const char fr_zero_pad[ICCOM_CAPTURE_ALIGN] = {0};
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+static inline struct iccom_fr_slot *iccom_fr_slot(
+                const struct iccom_fr_ring *const ring, const uint64_t idx)
+{
+        return (struct iccom_fr_slot *)(ring->slots
+                        + (size_t)(idx & ring->mask) * ring->slot_size);
+}
+
+// RETURNS:
+//      the flight recorder ring for the given channel, allocating it
+//      on first call for the channel
+//      NULL: if flight recorder is disabled or allocation failed
+struct iccom_fr_ring *__iccom_flight_recorder_ring(const unsigned int channel)
+{
+        if (channel >= ICCOM_FR_CHANNELS_COUNT) {
+                return NULL;
+        }
+
+        struct iccom_fr_ring *ring = atomic_load(&fr_rings[channel]);
+        if (ring) {
+                return ring;
+        }
+
+        const unsigned int frames = atomic_load(&fr_frames);
+        const unsigned int snaplen = atomic_load(&fr_snaplen);
+        if (frames == 0) {
+                return NULL;
+        }
+
+        unsigned int slots = 1;
+        while (slots < frames) {
+                slots <<= 1;
+        }
+        const size_t slot_size = ICCOM_FR_ALIGNED(
+                        sizeof(struct iccom_fr_slot) + snaplen);
+
+        ring = (struct iccom_fr_ring *)calloc(1, sizeof(*ring)
+                                              + slots * slot_size);
+        if (!ring) {
+                log("could not allocate flight recorder ring for ch %u"
+                    , channel);
+                return NULL;
+        }
+        ring->channel = channel;
+        ring->mask = slots - 1;
+        ring->slot_size = (uint32_t)slot_size;
+        ring->snaplen = snaplen;
+        atomic_init(&ring->head, 0);
+
+        struct iccom_fr_ring *expected = NULL;
+        if (!atomic_compare_exchange_strong(&fr_rings[channel], &expected
+                                            , ring)) {
+                // somebody else was faster
+                free(ring);
+                return expected;
+        }
+        return ring;
+}
+
+// Writes the frame into the next ring slot: one atomic add to claim
+// the slot and one copy, no locks.
+void __iccom_flight_recorder_put(struct iccom_fr_ring *const ring
+                                 , const int direction
+                                 , const void *const payload
+                                 , const size_t payload_size)
+{
+        const uint64_t idx = atomic_fetch_add_explicit(&ring->head, 1
+                                                       , memory_order_relaxed);
+        struct iccom_fr_slot *const slot = iccom_fr_slot(ring, idx);
+        const size_t cap_size = payload_size < ring->snaplen
+                                ? payload_size : ring->snaplen;
+
+        atomic_store_explicit(&slot->seq, 2 * idx + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        slot->rec.record_size = (uint32_t)ICCOM_FR_ALIGNED(
+                        sizeof(iccom_capture_record_header) + cap_size);
+        slot->rec.direction = (uint16_t)direction;
+        slot->rec.flags = 0;
+        slot->rec.channel = ring->channel;
+        slot->rec.orig_size = (uint32_t)payload_size;
+        slot->rec.cap_size = (uint32_t)cap_size;
+        slot->rec.reserved = 0;
+        slot->rec.timestamp_ns = __iccom_clock_ns(CLOCK_MONOTONIC);
+        if (cap_size) {
+                memcpy(slot + 1, payload, cap_size);
+        }
+
+        atomic_store_explicit(&slot->seq, 2 * idx + 2, memory_order_release);
+}
+
+// Writes the whole buffer to the fd (async signal safe).
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+static int iccom_fr_write_all(const int fd, const void *const data
+                              , const size_t size)
+{
+        size_t done = 0;
+        while (done < size) {
+                const ssize_t res = write(fd, (const char *)data + done
+                                          , size - done);
+                if (res < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return -errno;
+                }
+                done += (size_t)res;
+        }
+        return 0;
+}
+
+// Dumps all rings into the given file in the capture file format.
+// Only async signal safe calls are used, so this is also the signal
+// handler dump path.
+//
+// RETURNS:
+//      >=0: number of dumped records
+//      <0: negated error code
+static int iccom_fr_dump_fd(const int fd)
+{
+        iccom_capture_file_header hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = ICCOM_CAPTURE_MAGIC;
+        hdr.version = ICCOM_CAPTURE_VERSION;
+        hdr.header_size = sizeof(hdr);
+        hdr.realtime_base_ns = __iccom_clock_ns(CLOCK_REALTIME);
+        hdr.monotonic_base_ns = __iccom_clock_ns(CLOCK_MONOTONIC);
+        // NOTE: the rings keep the snaplen they were allocated with,
+        //      so the header gets the largest of them, and every
+        //      record has its own cap size anyway
+        hdr.snaplen = 0;
+        for (unsigned int ch = 0; ch < ICCOM_FR_CHANNELS_COUNT; ch++) {
+                const struct iccom_fr_ring *const ring
+                        = atomic_load(&fr_rings[ch]);
+                if (ring && ring->snaplen > hdr.snaplen) {
+                        hdr.snaplen = ring->snaplen;
+                }
+        }
+
+        int res = iccom_fr_write_all(fd, &hdr, sizeof(hdr));
+        if (res < 0) {
+                return res;
+        }
+
+        uint64_t total = sizeof(hdr);
+        int records = 0;
+        // NOTE: aligned as the slots themselves
+        uint64_t copy[(sizeof(struct iccom_fr_slot)
+                       + ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES)
+                      / sizeof(uint64_t) + 1];
+        struct iccom_fr_slot *const local = (struct iccom_fr_slot *)copy;
+
+        for (unsigned int ch = 0; ch < ICCOM_FR_CHANNELS_COUNT; ch++) {
+                const struct iccom_fr_ring *const ring
+                        = atomic_load(&fr_rings[ch]);
+                if (!ring) {
+                        continue;
+                }
+                const uint64_t head = atomic_load(&ring->head);
+                const uint64_t slots = (uint64_t)ring->mask + 1;
+                const uint64_t first = head > slots ? head - slots : 0;
+
+                for (uint64_t i = first; i < head; i++) {
+                        const struct iccom_fr_slot *const slot
+                                = iccom_fr_slot(ring, i);
+                        const uint64_t seq = atomic_load_explicit(
+                                        &slot->seq, memory_order_acquire);
+                        if (seq != 2 * i + 2) {
+                                // being written or already overwritten
+                                continue;
+                        }
+                        memcpy(local, slot, ring->slot_size);
+                        atomic_thread_fence(memory_order_acquire);
+                        if (atomic_load_explicit(&slot->seq
+                                        , memory_order_relaxed) != seq) {
+                                continue;
+                        }
+
+                        const size_t data_size
+                                = sizeof(local->rec) + local->rec.cap_size;
+                        res = iccom_fr_write_all(fd, &local->rec, data_size);
+                        if (res == 0) {
+                                res = iccom_fr_write_all(fd, fr_zero_pad
+                                        , local->rec.record_size - data_size);
+                        }
+                        if (res < 0) {
+                                return res;
+                        }
+                        total += local->rec.record_size;
+                        records++;
+                }
+        }
+
+        hdr.capacity_bytes = total;
+        hdr.used_bytes = total;
+        if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+                return -errno;
+        }
+        return records;
+}
+
+static int iccom_fr_dump_path(const char *const path)
+{
+        const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+                return -errno;
+        }
+        const int res = iccom_fr_dump_fd(fd);
+        close(fd);
+        return res;
+}
+
+static int iccom_fr_dump_requested(void *const ctx)
+{
+        (void)ctx;
+        return atomic_load(&fr_dump.requested);
+}
+
+// The error triggered dumps thread.
+static void *iccom_fr_dumper_loop(void *arg)
+{
+        (void)arg;
+
+        __iccom_thread_place(ICCOM_THREAD_FLIGHT_RECORDER, -1);
+
+        while (1) {
+                __iccom_waiter_wait(&fr_dump.dumper, iccom_fr_dump_requested
+                                    , NULL, -1);
+                atomic_store(&fr_dump.requested, 0);
+
+                pthread_mutex_lock(&fr_dump.lock);
+                if (!atomic_load(&fr_dump.path_set)) {
+                        pthread_mutex_unlock(&fr_dump.lock);
+                        continue;
+                }
+                const int sock_fd = atomic_load(&fr_dump.error_sock_fd);
+                const int error = atomic_load(&fr_dump.error);
+                const int res = iccom_fr_dump_path(fr_dump.path);
+                if (res < 0) {
+                        log("flight recorder dump to %s failed: %d(%s)"
+                            , fr_dump.path, -res, strerror(-res));
+                } else {
+                        log("error %d on socket %d: flight recorder"
+                            " (%d frames) dumped to %s", error, sock_fd
+                            , res, fr_dump.path);
+                }
+                pthread_mutex_unlock(&fr_dump.lock);
+        }
+        return NULL;
+}
+
+// Starts the error dumps thread if not yet, under the @fr_dump.lock.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+static int iccom_fr_dumper_start(void)
+{
+        if (atomic_load(&fr_dump.dumper_started)) {
+                return 0;
+        }
+        __iccom_waiter_init(&fr_dump.dumper);
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_t thread;
+        const int res = -pthread_create(&thread, &attr, iccom_fr_dumper_loop
+                                        , NULL);
+        pthread_attr_destroy(&attr);
+        if (res < 0) {
+                log("Could not start the flight recorder dump thread:"
+                    " %d(%s)", -res, strerror(-res));
+                __iccom_waiter_destroy(&fr_dump.dumper);
+                return res;
+        }
+        atomic_store(&fr_dump.dumper_started, 1);
+        return 0;
+}
+
+// Requests the flight recorder dump to the configured dump path on the
+// error path of the socket (rate limited). The dump itself is written
+// by the dump thread, so the caller never blocks on the file I/O.
+//
+// @sock_fd the socket which faced the error
+// @error the negated error code
+void __iccom_flight_recorder_on_error(const int sock_fd, const int error)
+{
+        if (!atomic_load(&fr_dump.path_set)
+                        || !atomic_load(&fr_dump.dumper_started)) {
+                return;
+        }
+        const uint64_t now = __iccom_clock_ns(CLOCK_MONOTONIC);
+        uint64_t last = atomic_load(&fr_dump.last_error_dump_ns);
+        if (last != 0 && now - last < ICCOM_FR_ERROR_DUMP_MIN_INTERVAL_NS) {
+                return;
+        }
+        if (!atomic_compare_exchange_strong(&fr_dump.last_error_dump_ns
+                                            , &last, now)) {
+                return;
+        }
+
+        atomic_store(&fr_dump.error_sock_fd, sock_fd);
+        atomic_store(&fr_dump.error, error);
+        atomic_store(&fr_dump.requested, 1);
+        __iccom_waiter_wake(&fr_dump.dumper, 0);
+}
+
+static void iccom_fr_dump_handler(int signo)
+{
+        (void)signo;
+        const int saved_errno = errno;
+        if (atomic_load(&fr_dump.path_set)) {
+                iccom_fr_dump_path(fr_dump.path);
+        }
+        errno = saved_errno;
+}
+
+// See iccom.h
+int iccom_flight_recorder_configure(const unsigned int frames
+                                    , const unsigned int snaplen)
+{
+        if (frames > ICCOM_FLIGHT_RECORDER_MAX_FRAMES) {
+                log("frames %u is above max (%u)", frames
+                    , ICCOM_FLIGHT_RECORDER_MAX_FRAMES);
+                return -EINVAL;
+        }
+        if (snaplen > ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES) {
+                log("snaplen %u is above max message size (%d)", snaplen
+                    , ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES);
+                return -EINVAL;
+        }
+        atomic_store(&fr_frames, frames);
+        atomic_store(&fr_snaplen, snaplen);
+        return 0;
+}
+
+// See iccom.h
+int iccom_flight_recorder_set_dump_path(const char *const path)
+{
+        if (path && strlen(path) >= sizeof(fr_dump.path)) {
+                log("dump path is too long");
+                return -ENAMETOOLONG;
+        }
+
+        pthread_mutex_lock(&fr_dump.lock);
+        const int res = path ? iccom_fr_dumper_start() : 0;
+        if (res == 0) {
+                atomic_store(&fr_dump.path_set, 0);
+                if (path) {
+                        strcpy(fr_dump.path, path);
+                        atomic_store(&fr_dump.path_set, 1);
+                }
+        }
+        pthread_mutex_unlock(&fr_dump.lock);
+        return res;
+}
+
+// See iccom.h
+int iccom_flight_recorder_set_dump_signal(const int signo)
+{
+        if (signo < 0 || signo >= NSIG) {
+                log("invalid signal number: %d", signo);
+                return -EINVAL;
+        }
+
+        pthread_mutex_lock(&fr_dump.lock);
+
+        if (fr_dump.signo) {
+                signal(fr_dump.signo, SIG_DFL);
+                fr_dump.signo = 0;
+        }
+
+        int ret_val = 0;
+        if (signo) {
+                struct sigaction sa;
+                memset(&sa, 0, sizeof(sa));
+                sa.sa_handler = &iccom_fr_dump_handler;
+                sa.sa_flags = SA_RESTART;
+                sigemptyset(&sa.sa_mask);
+                if (sigaction(signo, &sa, NULL) < 0) {
+                        const int err = errno;
+                        log("failed to install flight recorder dump handler"
+                            " for signal %d: %d(%s)", signo, err
+                            , strerror(err));
+                        ret_val = -err;
+                } else {
+                        fr_dump.signo = signo;
+                }
+        }
+
+        pthread_mutex_unlock(&fr_dump.lock);
+        return ret_val;
+}
+
+// See iccom.h
+int iccom_flight_recorder_dump(const char *const path)
+{
+        const char *const dst = path ? path
+                                : (atomic_load(&fr_dump.path_set)
+                                   ? fr_dump.path : NULL);
+        if (!dst) {
+                log("no dump path given nor configured");
+                return -EINVAL;
+        }
+        const int res = iccom_fr_dump_path(dst);
+        if (res < 0) {
+                log("flight recorder dump to %s failed: %d(%s)"
+                    , dst, -res, strerror(-res));
+        }
+        return res;
+}
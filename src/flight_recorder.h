@@ -0,0 +1,59 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+// Internal hooks of the flight recorder, to be called by the ICCom
+// modifications on every sent/received frame and on error paths.
+//
+// NOTE: the public flight recorder IF is declared in the iccom.h.
+
+#ifndef LIBICCOM_FLIGHT_RECORDER_H
+#define LIBICCOM_FLIGHT_RECORDER_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "sock_registry.h"
+
+/* -------------------- ROUTINES DECLARATIONS -------------------------- */
+
+struct iccom_fr_ring *__iccom_flight_recorder_ring(const unsigned int channel);
+void __iccom_flight_recorder_put(struct iccom_fr_ring *const ring
+                                 , const int direction
+                                 , const void *const payload
+                                 , const size_t payload_size);
+void __iccom_flight_recorder_on_error(const int sock_fd, const int error);
+
+// Stores the frame metadata and its first bytes into the flight
+// recorder ring of the socket channel (if any).
+//
+// @sock_fd the socket the frame was sent/received via
+// @direction ICCOM_CAPTURE_DIR_TX or ICCOM_CAPTURE_DIR_RX
+// @payload {valid ptr} the frame payload
+// @payload_size the frame payload size
+static inline void __iccom_flight_recorder(const int sock_fd
+                                           , const int direction
+                                           , const void *const payload
+                                           , const size_t payload_size)
+{
+        struct iccom_sock_state *const st = __iccom_sock_state(sock_fd);
+        if (!st) {
+                return;
+        }
+        struct iccom_fr_ring *const ring
+                = atomic_load_explicit(&st->fr_ring, memory_order_acquire);
+        if (!ring) {
+                return;
+        }
+        __iccom_flight_recorder_put(ring, direction, payload, payload_size);
+}
+
+#endif //ifndef LIBICCOM_FLIGHT_RECORDER_H
@@ -0,0 +1,58 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+// The frame level hooks, which every ICCom modification calls on
+// its send/receive paths. They fan out to the diagnostics facilities
+// (capture, flight recorder), so modifications need only a single call
+// per event.
+
+#ifndef LIBICCOM_HOOKS_H
+#define LIBICCOM_HOOKS_H
+
+#include <stddef.h>
+
+#include "iccom.h"
+#include "capture.h"
+#include "flight_recorder.h"
+
+/* -------------------- ROUTINES DECLARATIONS -------------------------- */
+
+// To be called when the frame was successfully sent.
+static inline void __iccom_frame_sent(const int sock_fd
+                                      , const void *const payload
+                                      , const size_t payload_size)
+{
+        __iccom_capture(sock_fd, ICCOM_CAPTURE_DIR_TX, payload, payload_size);
+        __iccom_flight_recorder(sock_fd, ICCOM_CAPTURE_DIR_TX, payload
+                                , payload_size);
+}
+
+// To be called when the frame was successfully received.
+static inline void __iccom_frame_received(const int sock_fd
+                                          , const void *const payload
+                                          , const size_t payload_size)
+{
+        __iccom_capture(sock_fd, ICCOM_CAPTURE_DIR_RX, payload, payload_size);
+        __iccom_flight_recorder(sock_fd, ICCOM_CAPTURE_DIR_RX, payload
+                                , payload_size);
+}
+
+// To be called on the send/receive error paths which indicate the
+// broken communication (not on timeouts nor on IF misuse).
+//
+// @error the negated error code to be returned to the caller
+static inline void __iccom_frame_error(const int sock_fd, const int error)
+{
+        __iccom_flight_recorder_on_error(sock_fd, error);
+}
+
+#endif //ifndef LIBICCOM_HOOKS_H
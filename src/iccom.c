@@ -15,16 +15,24 @@
  * boiler plate in ICCom sockets communication establishing.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <linux/netlink.h>
 
 #include "iccom.h"
 #include "utils.h"
+#include "sock_registry.h"
+#include "hooks.h"
+#include "filter.h"
+#include "msg_pool.h"
+#include "busy_poll.h"
 
 // DEV STACK
 // @@@@@@@@@@@@@
@@ -137,6 +145,7 @@ int iccom_open_socket(const unsigned int channel)
                 return -err;
         }
 
+        __iccom_sock_register(sock_fd, channel);
         return sock_fd;
 }
 
@@ -182,9 +191,72 @@ int iccom_get_socket_read_timeout(const int sock_fd)
         return timeout.tv_sec * 1000 + timeout.tv_usec / 1000;
 }
 
+// See iccom.h
+int iccom_set_socket_filter(const int sock_fd
+                            , const iccom_filter_rule *const rules
+                            , const size_t count)
+{
+        if (count == 0) {
+                return iccom_clear_socket_filter(sock_fd);
+        }
+        const int verify_res = __iccom_filter_verify(rules, count);
+        if (verify_res < 0) {
+                return verify_res;
+        }
+
+        struct sock_filter prog[ICCOM_FILTER_MAX_INSNS];
+        const struct sock_fprog fprog = {
+                .len = (unsigned short)__iccom_filter_compile(rules, count
+                                                              , prog)
+                , .filter = prog
+        };
+
+        if (setsockopt(sock_fd, SOL_SOCKET, SO_ATTACH_FILTER
+                       , &fprog, sizeof(fprog)) != 0) {
+                const int err = errno;
+                log("Failed to attach the filter (%zu rules) to socket %d"
+                    ", error: %d(%s)", count, sock_fd, err, strerror(err));
+                return -err;
+        }
+        return 0;
+}
+
+// See iccom.h
+int iccom_clear_socket_filter(const int sock_fd)
+{
+        const int dummy = 0;
+        if (setsockopt(sock_fd, SOL_SOCKET, SO_DETACH_FILTER
+                       , &dummy, sizeof(dummy)) != 0) {
+                const int err = errno;
+                // no filter attached
+                if (err == ENOENT) {
+                        return 0;
+                }
+                log("Failed to detach the filter from socket %d"
+                    ", error: %d(%s)", sock_fd, err, strerror(err));
+                return -err;
+        }
+        return 0;
+}
+
+// See iccom.h
+int iccom_set_socket_no_enobufs(const int sock_fd, const char enable)
+{
+        const int value = enable ? 1 : 0;
+        if (setsockopt(sock_fd, SOL_NETLINK, NETLINK_NO_ENOBUFS
+                       , &value, sizeof(value)) != 0) {
+                const int err = errno;
+                log("Failed to set NETLINK_NO_ENOBUFS to %d for socket %d"
+                    ", error: %d(%s)", value, sock_fd, err, strerror(err));
+                return -err;
+        }
+        return 0;
+}
+
 // See iccom.h
 void iccom_close_socket(const int sock_fd)
 {
+        __iccom_sock_unregister(sock_fd);
         if (close(sock_fd) < 0) {
                 int err = errno;
                 log("Failed to close the socket %d; "
@@ -199,29 +271,11 @@ int iccom_send_data_nocopy(const int sock_fd, const void *const buf
                            , const size_t data_offset
                            , const size_t data_size_bytes)
 {
-        if (buf_size_bytes != NLMSG_SPACE(data_size_bytes)) {
-                log("Buffer size %zu doesn't match data size %zu."
-                    , buf_size_bytes, data_size_bytes);
-                return -EINVAL;
-        }
-        if (data_offset != NLMSG_LENGTH(0)) {
-                log("The user data (message) offset %zu doesn't"
-                    " match expected value: %d."
-                    , data_offset, NLMSG_LENGTH(0));
-                return -EINVAL;
-        }
-        if (data_size_bytes > ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES) {
-                log("Can't send messages larger than: %d bytes."
-                    , ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES);
-                return -E2BIG;
-        }
-        if (data_size_bytes == 0) {
-                log("Message to send is of zero size. Nothing to send");
-                return -EINVAL;
-        }
-        if (!buf) {
-                log("Null buffer pointer. Nothing to send.");
-                return -EINVAL;
+        const int verify_res = __iccom_nocopy_buf_verify(buf, buf_size_bytes
+                                                         , data_offset
+                                                         , data_size_bytes);
+        if (verify_res < 0) {
+                return verify_res;
         }
 
         struct nlmsghdr *const nl_msg = (struct nlmsghdr *const)buf;
@@ -261,9 +315,11 @@ int iccom_send_data_nocopy(const int sock_fd, const void *const buf
                 int err = errno;
                 log("sending of the message failed, error:"
                        " %d(%s)", err, strerror(err));
+                __iccom_frame_error(sock_fd, -err);
                 return -err;
         }
 
+        __iccom_frame_sent(sock_fd, NLMSG_DATA(nl_msg), data_size_bytes);
         return 0;
 }
 
@@ -306,20 +362,85 @@ int iccom_send_data(const int sock_fd, const void *const data
 }
 
 // See iccom.h
-int iccom_receive_data_nocopy(
-                const int sock_fd, void *const receive_buffer
-                , const size_t buffer_size, int *const data_offset__out)
+int iccom_send_data_batch_nocopy(const int sock_fd
+                                 , const iccom_send_batch_item *const items
+                                 , const size_t count)
 {
-        if (buffer_size <= NLMSG_SPACE(0)) {
-                log("incoming buffer size %zu is too small for netlink message"
-                    " (min size is %d)", buffer_size, NLMSG_SPACE(0));
-                return -ENFILE;
-        }
-        if (!data_offset__out) {
-                log("data_offset__out is not set.");
+        if (!items || count == 0) {
+                log("Empty batch. Nothing to send.");
                 return -EINVAL;
         }
+        // the messages before the incorrect one are still sent, the
+        // incorrect one fails the next call
+        size_t valid = count;
+        for (size_t i = 0; i < valid; i++) {
+                const int verify_res = __iccom_nocopy_buf_verify(
+                                items[i].buf, items[i].buf_size_bytes
+                                , NLMSG_LENGTH(0), items[i].data_size_bytes);
+                if (verify_res < 0) {
+                        log("Batch message %zu is incorrect.", i);
+                        if (i == 0) {
+                                return verify_res;
+                        }
+                        valid = i;
+                }
+        }
+
+        size_t sent = 0;
+        while (sent < valid) {
+                struct mmsghdr msgs[ICCOM_SEND_BATCH_CHUNK];
+                struct iovec iovs[ICCOM_SEND_BATCH_CHUNK];
+                const size_t chunk = (valid - sent < ICCOM_SEND_BATCH_CHUNK)
+                                     ? valid - sent : ICCOM_SEND_BATCH_CHUNK;
+
+                for (size_t i = 0; i < chunk; i++) {
+                        const iccom_send_batch_item *const item
+                                = &items[sent + i];
+                        struct nlmsghdr *const nl_msg
+                                = (struct nlmsghdr *)item->buf;
+
+                        memset(nl_msg, 0, sizeof(*nl_msg));
+                        nl_msg->nlmsg_len = NLMSG_LENGTH(item->data_size_bytes);
+
+                        iovs[i].iov_base = nl_msg;
+                        iovs[i].iov_len = nl_msg->nlmsg_len;
+
+                        memset(&msgs[i], 0, sizeof(msgs[i]));
+                        msgs[i].msg_hdr.msg_name = &dest_addr;
+                        msgs[i].msg_hdr.msg_namelen = sizeof(dest_addr);
+                        msgs[i].msg_hdr.msg_iov = &iovs[i];
+                        msgs[i].msg_hdr.msg_iovlen = 1;
+                }
+
+                const int res = sendmmsg(sock_fd, msgs, (unsigned int)chunk, 0);
+                if (res < 0) {
+                        const int err = errno;
+                        log("sending of the message batch failed, error:"
+                            " %d(%s)", err, strerror(err));
+                        __iccom_frame_error(sock_fd, -err);
+                        return sent ? (int)sent : -err;
+                }
+
+                for (int i = 0; i < res; i++) {
+                        const iccom_send_batch_item *const item
+                                = &items[sent + i];
+                        __iccom_frame_sent(sock_fd
+                                           , NLMSG_DATA((struct nlmsghdr *)
+                                                        item->buf)
+                                           , item->data_size_bytes);
+                }
+                sent += (size_t)res;
+        }
+
+        return (int)sent;
+}
 
+// Receives the next message into the (verified) buffer, see
+// @iccom_receive_data_nocopy.
+static int iccom_receive_frame(
+                const int sock_fd, void *const receive_buffer
+                , const size_t buffer_size, int *const data_offset__out)
+{
         struct nlmsghdr *const nl_header = (struct nlmsghdr *)receive_buffer;
 
         struct iovec iov = { receive_buffer, buffer_size };
@@ -334,8 +455,17 @@ int iccom_receive_data_nocopy(
                 if (err == EAGAIN) {
                         return 0;
                 }
+                // the queue overrun, the socket itself is fine
+                if (err == ENOBUFS) {
+                        __iccom_rcvbuf_overrun(sock_fd);
+                        __iccom_frame_error(sock_fd, -err);
+                        return -err;
+                }
                 log("Error reading data from socket (fd: %d): %d(%s)"
                     , sock_fd, err, strerror(err));
+                if (err != EINTR) {
+                        __iccom_frame_error(sock_fd, -err);
+                }
                 return -err;
         } else if (len == 0) {
                 // interrupted from read by signal
@@ -345,16 +475,19 @@ int iccom_receive_data_nocopy(
         if (msg.msg_flags & MSG_TRUNC) {
                 log("The message from socket (fs: %d) was truncated"
                     " and part of it was lost. Dropping message.", sock_fd);
+                __iccom_frame_error(sock_fd, -EOVERFLOW);
                 return -EOVERFLOW;
         }
         if (msg.msg_flags & MSG_CTRUNC) {
                 log("The message control data from socket (fs: %d)"
                     " was truncated. Dropping message", sock_fd);
+                __iccom_frame_error(sock_fd, -EOVERFLOW);
                 return -EOVERFLOW;
         }
         if (msg.msg_flags & MSG_ERRQUEUE) {
                 log("The socket error message was received"
                     " from socket (fs: %d). Dropping message.", sock_fd);
+                __iccom_frame_error(sock_fd, -EBADE);
                 return -EBADE;
         }
 
@@ -372,6 +505,7 @@ int iccom_receive_data_nocopy(
                                 , LIBICCOM_LOG_PREFIX
                                   "iccom_receive_data_nocopy:     ");
                 log("    [RCV] ----- netlink message data end -----");
+                __iccom_frame_error(sock_fd, -EPIPE);
                 return -EPIPE;
         }
 
@@ -396,9 +530,94 @@ int iccom_receive_data_nocopy(
         log("    [RCV] ------- payload data end ---------");
 #endif
 
+        __iccom_frame_received(sock_fd, NLMSG_DATA(nl_header), data_len);
         return data_len;
 }
 
+// See iccom.h
+int iccom_receive_data_nocopy(
+                const int sock_fd, void *const receive_buffer
+                , const size_t buffer_size, int *const data_offset__out)
+{
+        if (buffer_size <= NLMSG_SPACE(0)) {
+                log("incoming buffer size %zu is too small for netlink message"
+                    " (min size is %d)", buffer_size, NLMSG_SPACE(0));
+                return -ENFILE;
+        }
+        if (!data_offset__out) {
+                log("data_offset__out is not set.");
+                return -EINVAL;
+        }
+        if (__iccom_busy_poll_active(sock_fd)
+                    && __iccom_busy_poll_wait(sock_fd) == 0) {
+                return 0;
+        }
+        return iccom_receive_frame(sock_fd, receive_buffer, buffer_size
+                                   , data_offset__out);
+}
+
+// See iccom.h
+int iccom_receive_data_alloc(const int sock_fd, void **const buf__out
+                             , int *const data_offset__out)
+{
+        if (!buf__out || !data_offset__out) {
+                log("buf__out or data_offset__out is not set.");
+                return -EINVAL;
+        }
+        *buf__out = NULL;
+        if (__iccom_busy_poll_active(sock_fd)
+                    && __iccom_busy_poll_wait(sock_fd) == 0) {
+                return 0;
+        }
+
+        // the datagram is left in the queue, only its full size is taken
+        struct iovec iov = { NULL, 0 };
+        struct msghdr msg = { &remote_addr, sizeof(remote_addr),
+                              &iov, 1, NULL, 0, 0 };
+        const ssize_t len = recvmsg(sock_fd, &msg, MSG_PEEK | MSG_TRUNC);
+
+        if (len < 0) {
+                const int err = errno;
+                if (err == EAGAIN) {
+                        return 0;
+                }
+                if (err == ENOBUFS) {
+                        __iccom_rcvbuf_overrun(sock_fd);
+                        __iccom_frame_error(sock_fd, -err);
+                        return -err;
+                }
+                log("Error peeking data from socket (fd: %d): %d(%s)"
+                    , sock_fd, err, strerror(err));
+                if (err != EINTR) {
+                        __iccom_frame_error(sock_fd, -err);
+                }
+                return -err;
+        } else if (len == 0) {
+                return 0;
+        }
+
+        size_t capacity;
+        void *const buf = __iccom_msg_pool_alloc(
+                        ((size_t)len > NLMSG_SPACE(0)) ? (size_t)len
+                                                       : NLMSG_SPACE(1)
+                        , &capacity);
+        if (!buf) {
+                // the datagram is dropped, as the stream frame is
+                recv(sock_fd, NULL, 0, MSG_TRUNC);
+                __iccom_rx_nomem_drop(sock_fd, (size_t)len);
+                return -ENOMEM;
+        }
+
+        const int res = iccom_receive_frame(sock_fd, buf, capacity
+                                            , data_offset__out);
+        if (res <= 0) {
+                iccom_free_received_buffer(buf);
+                return res;
+        }
+        *buf__out = buf;
+        return res;
+}
+
 // See iccom.h
 // TODO: rename __iccom_receive_data_pure into iccom_receive_data
 //       and this version of iccom_receive_data to be deleted
@@ -560,6 +779,74 @@ int iccom_loopback_get(loopback_cfg *const out)
         return ret_val;
 }
 
+// The link emulation is a feature of the network sockets modification,
+// here the real link is used.
+//
+// See iccom.h
+int iccom_link_emu_enable(const iccom_link_emu_cfg *const cfg)
+{
+        (void)cfg;
+        return -EOPNOTSUPP;
+}
+
+// See iccom.h
+int iccom_link_emu_disable(void)
+{
+        return -EOPNOTSUPP;
+}
+
+// See iccom.h
+int iccom_link_emu_get_stats(iccom_link_emu_stats *const out)
+{
+        (void)out;
+        return -EOPNOTSUPP;
+}
+
+// The virtual clock is a feature of the network sockets modification,
+// here the real time is used.
+//
+// See iccom.h
+int iccom_vclock_enable(const iccom_vclock_cfg *const cfg)
+{
+        (void)cfg;
+        return -EOPNOTSUPP;
+}
+
+// See iccom.h
+int iccom_vclock_disable(void)
+{
+        return -EOPNOTSUPP;
+}
+
+// See iccom.h
+int iccom_vclock_leave(void)
+{
+        return -EOPNOTSUPP;
+}
+
+// See iccom.h
+uint64_t iccom_vclock_now_ns(void)
+{
+        return __iccom_now_ns();
+}
+
+// See iccom.h
+int iccom_vclock_sleep_us(const uint64_t us)
+{
+        const struct timespec ts = {
+                .tv_sec = (time_t)(us / 1000000)
+                , .tv_nsec = (long)(us % 1000000) * 1000
+        };
+        return -clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+}
+
+// See iccom.h
+int iccom_vclock_get_stats(iccom_vclock_stats *const out)
+{
+        (void)out;
+        return -EOPNOTSUPP;
+}
+
 
 #ifdef __cplusplus
 } /* extern C */
@@ -25,11 +25,21 @@
 #include <errno.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <linux/netlink.h>
 
 #include "iccom.h"
 #include "utils.h"
+#include "sock_registry.h"
+#include "hooks.h"
+#include "link_emu.h"
+#include "vclock.h"
+#include "filter.h"
+#include "msg_pool.h"
+#include "busy_poll.h"
 
 // DEV STACK
 // @@@@@@@@@@@@@
@@ -47,6 +57,10 @@ extern "C" {
 // if defined then debug messages are printed
 //#define ICCOM_API_DEBUG
 
+// the max wait for the rest of the started frame when the socket has
+// no read timeout set
+#define ICCOM_NSOCK_FRAME_REST_TIMEOUT_MS 1000
+
 /* -------------------- MACRO DEFINITIONS ------------------------------ */
 
 /* -------------------- FORWARD DECLARATIONS --------------------------- */
@@ -81,6 +95,7 @@ int iccom_open_socket(const unsigned int channel)
 {
         log("ICCom lib in network sockets mode, opening: %s:%d"
             , iccom_current_config.target_host_address, channel);
+        __iccom_link_emu_env_init();
         if (iccom_channel_verify(channel) < 0) {
                 log("Failed to open the socket: "
                     "channel (%d) is out of bounds see "
@@ -160,6 +175,7 @@ int iccom_open_socket(const unsigned int channel)
                 return -EPIPE;
         }
 
+        __iccom_sock_register(sock_fd, channel);
         return sock_fd;
 }
 
@@ -205,9 +221,42 @@ int iccom_get_socket_read_timeout(const int sock_fd)
         return timeout.tv_sec * 1000 + timeout.tv_usec / 1000;
 }
 
+// NOTE: the filter is evaluated by the library, see
+//      @iccom_receive_data_nocopy.
+//
+// See iccom.h
+int iccom_set_socket_filter(const int sock_fd
+                            , const iccom_filter_rule *const rules
+                            , const size_t count)
+{
+        const int verify_res = __iccom_filter_verify(rules, count);
+        if (verify_res < 0) {
+                return verify_res;
+        }
+        return __iccom_sock_filter_set(sock_fd, rules, count);
+}
+
+// See iccom.h
+int iccom_clear_socket_filter(const int sock_fd)
+{
+        return __iccom_sock_filter_set(sock_fd, NULL, 0);
+}
+
+// NOTE: the stream transport never overruns, so nothing to set.
+//
+// See iccom.h
+int iccom_set_socket_no_enobufs(const int sock_fd, const char enable)
+{
+        (void)sock_fd;
+        (void)enable;
+        return 0;
+}
+
 // See iccom.h
 void iccom_close_socket(const int sock_fd)
 {
+        __iccom_link_emu_forget(sock_fd);
+        __iccom_sock_unregister(sock_fd);
         if (close(sock_fd) < 0) {
                 int err = errno;
                 log("Failed to close the socket %d; "
@@ -222,29 +271,11 @@ int iccom_send_data_nocopy(const int sock_fd, const void *const buf
                            , const size_t data_offset
                            , const size_t data_size_bytes)
 {
-        if (buf_size_bytes != NLMSG_SPACE(data_size_bytes)) {
-                log("Buffer size %zu doesn't match data size %zu."
-                    , buf_size_bytes, data_size_bytes);
-                return -EINVAL;
-        }
-        if (data_offset != NLMSG_LENGTH(0)) {
-                log("The user data (message) offset %zu doesn't"
-                    " match expected value: %d."
-                    , data_offset, NLMSG_LENGTH(0));
-                return -EINVAL;
-        }
-        if (data_size_bytes > ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES) {
-                log("Can't send messages larger than: %d bytes."
-                    , ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES);
-                return -E2BIG;
-        }
-        if (data_size_bytes == 0) {
-                log("Message to send is of zero size. Nothing to send");
-                return -EINVAL;
-        }
-        if (!buf) {
-                log("Null buffer pointer. Nothing to send.");
-                return -EINVAL;
+        const int verify_res = __iccom_nocopy_buf_verify(buf, buf_size_bytes
+                                                         , data_offset
+                                                         , data_size_bytes);
+        if (verify_res < 0) {
+                return verify_res;
         }
 
         // we use the same netlink configuration for now
@@ -255,19 +286,36 @@ int iccom_send_data_nocopy(const int sock_fd, const void *const buf
         memset(nl_msg, 0, sizeof(*nl_msg));
         nl_msg->nlmsg_len = data_size_bytes;
 
+        if (__iccom_link_emu_active()) {
+                const int emu_res = __iccom_link_emu_send(sock_fd, buf
+                                                          , buf_size_bytes
+                                                          , data_size_bytes);
+                if (emu_res < 0) {
+                        return emu_res;
+                }
+                if (emu_res == 0) {
+                        __iccom_frame_sent(sock_fd, NLMSG_DATA(nl_msg)
+                                           , data_size_bytes);
+                        return 0;
+                }
+        }
+
         ssize_t res = write(sock_fd, buf, buf_size_bytes);
 
         if (res < 0) {
                 int err = errno;
                 log("Sending of the message to channel failed, error:"
                        " %d(%s)", err, strerror(err));
+                __iccom_frame_error(sock_fd, -err);
                 return -err;
         }
         if (res != buf_size_bytes) {
                 log("Message  truncation occured.");
+                __iccom_frame_error(sock_fd, -EPIPE);
                 return -EPIPE;
         }
 
+        __iccom_frame_sent(sock_fd, NLMSG_DATA(nl_msg), data_size_bytes);
         return 0;
 }
 
@@ -311,58 +359,423 @@ int iccom_send_data(const int sock_fd, const void *const data
         return res;
 }
 
-// See iccom.h
-int iccom_receive_data_nocopy(
-                const int sock_fd, void *const receive_buffer
-                , const size_t buffer_size, int *const data_offset__out)
+// Writes the rest of the partially written message, so the stream
+// message framing is kept.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+static int iccom_write_rest(const int sock_fd, const char *data
+                            , size_t size)
 {
-        if (buffer_size <= NLMSG_SPACE(0)) {
-                log("incoming buffer size %zu is too small for netlink message"
-                    " (min size is %d)", buffer_size, NLMSG_SPACE(0));
-                return -ENFILE;
+        while (size > 0) {
+                const ssize_t res = write(sock_fd, data, size);
+                if (res < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return -errno;
+                }
+                data += res;
+                size -= (size_t)res;
         }
-        if (!data_offset__out) {
-                log("data_offset__out is not set.");
+        return 0;
+}
+
+// See iccom.h
+int iccom_send_data_batch_nocopy(const int sock_fd
+                                 , const iccom_send_batch_item *const items
+                                 , const size_t count)
+{
+        if (!items || count == 0) {
+                log("Empty batch. Nothing to send.");
                 return -EINVAL;
         }
+        // the messages before the incorrect one are still sent, the
+        // incorrect one fails the next call
+        size_t valid = count;
+        for (size_t i = 0; i < valid; i++) {
+                const int verify_res = __iccom_nocopy_buf_verify(
+                                items[i].buf, items[i].buf_size_bytes
+                                , NLMSG_LENGTH(0), items[i].data_size_bytes);
+                if (verify_res < 0) {
+                        log("Batch message %zu is incorrect.", i);
+                        if (i == 0) {
+                                return verify_res;
+                        }
+                        valid = i;
+                }
+        }
 
-        ssize_t len = read(sock_fd, receive_buffer, buffer_size);
+        // the emulated link takes the frames one by one
+        if (__iccom_link_emu_active()) {
+                for (size_t i = 0; i < valid; i++) {
+                        const int res = iccom_send_data_nocopy(sock_fd
+                                        , items[i].buf
+                                        , items[i].buf_size_bytes
+                                        , NLMSG_LENGTH(0)
+                                        , items[i].data_size_bytes);
+                        if (res < 0) {
+                                return i ? (int)i : res;
+                        }
+                }
+                return (int)valid;
+        }
 
-        if (len < 0) {
-                int err = errno;
-                // timeout not an error
-                if (err == EAGAIN) {
-                        return 0;
+        size_t sent = 0;
+        while (sent < valid) {
+                struct iovec iovs[ICCOM_SEND_BATCH_CHUNK];
+                const size_t chunk = (valid - sent < ICCOM_SEND_BATCH_CHUNK)
+                                     ? valid - sent : ICCOM_SEND_BATCH_CHUNK;
+
+                // see iccom_send_data_nocopy(...) for the header format
+                for (size_t i = 0; i < chunk; i++) {
+                        const iccom_send_batch_item *const item
+                                = &items[sent + i];
+                        struct nlmsghdr *const nl_msg
+                                = (struct nlmsghdr *)item->buf;
+
+                        memset(nl_msg, 0, sizeof(*nl_msg));
+                        nl_msg->nlmsg_len = item->data_size_bytes;
+
+                        iovs[i].iov_base = nl_msg;
+                        iovs[i].iov_len = item->buf_size_bytes;
+                }
+
+                ssize_t res = writev(sock_fd, iovs, (int)chunk);
+                if (res < 0) {
+                        const int err = errno;
+                        log("Sending of the message batch to channel failed"
+                            ", error: %d(%s)", err, strerror(err));
+                        __iccom_frame_error(sock_fd, -err);
+                        return sent ? (int)sent : -err;
+                }
+
+                // accounting the fully written messages, and finishing
+                // the partially written one if any
+                for (size_t i = 0; i < chunk && res > 0; i++) {
+                        const iccom_send_batch_item *const item
+                                = &items[sent];
+                        if ((size_t)res < item->buf_size_bytes) {
+                                const int err = iccom_write_rest(sock_fd
+                                                , (const char *)item->buf + res
+                                                , item->buf_size_bytes
+                                                  - (size_t)res);
+                                if (err < 0) {
+                                        log("Message truncation occured.");
+                                        __iccom_frame_error(sock_fd, -EPIPE);
+                                        return sent ? (int)sent : -EPIPE;
+                                }
+                                res = (ssize_t)item->buf_size_bytes;
+                        }
+                        res -= (ssize_t)item->buf_size_bytes;
+                        __iccom_frame_sent(sock_fd
+                                           , NLMSG_DATA((struct nlmsghdr *)
+                                                        item->buf)
+                                           , item->data_size_bytes);
+                        sent++;
+                }
+        }
+
+        return (int)sent;
+}
+
+// Reads exactly @size bytes, unless the socket gets closed, fails, or
+// the read times out before any byte of the frame is read. Once the
+// frame is started (@frame_started or the first byte is read), the
+// signals and the non blocking socket EAGAIN are waited through
+// (polling the socket for the rest), so the stream message framing is
+// kept. The rest of the frame is waited for within the socket read
+// timeout only (ICCOM_NSOCK_FRAME_REST_TIMEOUT_MS for the non blocking
+// socket without the read timeout), so the stalled peer never blocks
+// the reader forever.
+//
+// RETURNS:
+//      @size: on success
+//      [0; @size): the socket was closed (0 also on timeout or signal
+//          before any data of the not started frame came)
+//      -ETIMEDOUT: the peer stalled in the middle of the frame, the
+//          stream framing is lost
+//      <0: other negated error code
+static ssize_t iccom_read_exact(const int sock_fd, void *const buf
+                                , const size_t size
+                                , const int frame_started)
+{
+        size_t done = 0;
+        uint64_t deadline_ns = 0;
+        while (done < size) {
+                const ssize_t res = read(sock_fd, (char *)buf + done
+                                         , size - done);
+                if (res == 0) {
+                        break;
+                }
+                if (res >= 0) {
+                        done += (size_t)res;
+                        continue;
+                }
+
+                const int err = errno;
+                if (err != EAGAIN && err != EINTR) {
+                        return -err;
+                }
+                if (done == 0 && !frame_started) {
+                        return err == EAGAIN ? 0 : -err;
                 }
+
+                if (err == EINTR) {
+                        continue;
+                }
+
+                const uint64_t now_ns = __iccom_now_ns();
+                if (!deadline_ns) {
+                        // the blocking socket EAGAIN is the expiry of its
+                        // read timeout already
+                        const int flags = fcntl(sock_fd, F_GETFL);
+                        const int timeout_ms
+                                = iccom_get_socket_read_timeout(sock_fd);
+                        deadline_ns = (flags >= 0 && !(flags & O_NONBLOCK))
+                                ? now_ns
+                                : now_ns + (uint64_t)(timeout_ms > 0
+                                        ? timeout_ms
+                                        : ICCOM_NSOCK_FRAME_REST_TIMEOUT_MS)
+                                  * 1000000;
+                }
+                if (now_ns >= deadline_ns) {
+                        log("The frame rest didn't come in time, socket %d"
+                            " stream is out of sync", sock_fd);
+                        return -ETIMEDOUT;
+                }
+                const uint64_t left_ns = deadline_ns - now_ns;
+                struct pollfd pfd = { .fd = sock_fd, .events = POLLIN };
+                if (poll(&pfd, 1, (int)((left_ns + 999999) / 1000000)) < 0
+                                && errno != EINTR) {
+                        return -errno;
+                }
+        }
+        return (ssize_t)done;
+}
+
+// Consumes the given number of bytes from the socket, to keep the
+// framing when the frame is dropped.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code (-EBADE: the socket was closed)
+static int iccom_drain(const int sock_fd, size_t size)
+{
+        char drop[256];
+        while (size > 0) {
+                const size_t chunk = size < sizeof(drop) ? size : sizeof(drop);
+                const ssize_t len = iccom_read_exact(sock_fd, drop, chunk, 1);
+                if (len < 0) {
+                        return (int)len;
+                }
+                if ((size_t)len != chunk) {
+                        return -EBADE;
+                }
+                size -= chunk;
+        }
+        return 0;
+}
+
+// Reads the next frame header, the read timeout runs on the virtual
+// clock if it is enabled, the socket is busy polled first if enabled.
+//
+// RETURNS:
+//      1: the valid header is read
+//      0: timeout, signal before any data came or the socket closed
+//      <0: negated error code
+static int iccom_read_header(const int sock_fd, struct nlmsghdr *const hdr)
+{
+        if (__iccom_vclock_active()) {
+                const int ready = __iccom_vclock_wait_readable(sock_fd);
+                if (ready <= 0) {
+                        return ready;
+                }
+        } else if (__iccom_busy_poll_active(sock_fd)) {
+                const int ready = __iccom_busy_poll_wait(sock_fd);
+                if (ready <= 0) {
+                        return ready;
+                }
+        }
+
+        // NOTE: TCP is a stream, so the frame is read exactly: first
+        //      the header, then the rest of the frame it declares
+        const ssize_t len = iccom_read_exact(sock_fd, hdr, sizeof(*hdr)
+                                             , 0);
+
+        if (len < 0) {
+                const int err = -(int)len;
                 log("Error reading data from socket (fd: %d): %d(%s)"
                     , sock_fd, err, strerror(err));
+                if (err != EINTR) {
+                        __iccom_frame_error(sock_fd, -err);
+                }
                 return -err;
         } else if (len == 0) {
                 // ICCOM: interrupted from read by signal
                 //  before any data came,
                 // ICCOM OVER TCP: OR: the socket has been closed
+                //  OR: timeout
                 return 0;
         }
 
-        if (len < sizeof(struct nlmsghdr)) {
+        if ((size_t)len < sizeof(*hdr)) {
                 log("The truncated data received from the socket: %d. "
                     "Dropping message.", sock_fd);
+                __iccom_frame_error(sock_fd, -EBADE);
                 return -EBADE;
         }
 
-        struct nlmsghdr *const nl_header = (struct nlmsghdr *)receive_buffer;
+        if (hdr->nlmsg_len > ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES) {
+                log("Inconsistent data lenght declared (%lu). Socket: %d."
+                    "Dropping message."
+                    , (unsigned long)NLMSG_SPACE(hdr->nlmsg_len), sock_fd);
+                __iccom_frame_error(sock_fd, -EBADE);
+                return -EBADE;
+        }
+        return 1;
+}
+
+// Reads the rest of the frame which header is already at the buffer
+// start (see @iccom_read_header). The frame which doesn't fit is
+// consumed to keep the framing.
+//
+// RETURNS:
+//      >=0: the frame payload size
+//      <0: negated error code
+static int iccom_read_body(const int sock_fd, void *const buffer
+                           , const size_t buffer_size)
+{
+        struct nlmsghdr *const nl_header = (struct nlmsghdr *)buffer;
         const size_t data_size_bytes = nl_header->nlmsg_len;
         const size_t nl_total_msg_size = NLMSG_SPACE(data_size_bytes);
 
-        if (len != nl_total_msg_size) {
+        const size_t rest_size = nl_total_msg_size - sizeof(struct nlmsghdr);
+        const size_t fit_size = nl_total_msg_size <= buffer_size
+                                ? rest_size
+                                : buffer_size - sizeof(struct nlmsghdr);
+        const ssize_t len = iccom_read_exact(sock_fd, nl_header + 1
+                                             , fit_size, 1);
+        if (len >= 0 && (size_t)len == fit_size && fit_size < rest_size) {
+                iccom_drain(sock_fd, rest_size - fit_size);
+                log("The message (%zu bytes) doesn't fit into buffer (%zu)."
+                    " Socket: %d. Dropping message."
+                    , nl_total_msg_size, buffer_size, sock_fd);
+                __iccom_frame_error(sock_fd, -EOVERFLOW);
+                return -EOVERFLOW;
+        }
+        if (len == -ETIMEDOUT) {
+                __iccom_frame_error(sock_fd, -ETIMEDOUT);
+                return -ETIMEDOUT;
+        }
+        if (len < 0 || (size_t)len != fit_size) {
                 log("Inconsistent data lenght declared (%lu) and "
                     "actual data size (%ld). Socket: %d."
-                    "Dropping message.", nl_total_msg_size, len, sock_fd);
+                    "Dropping message.", nl_total_msg_size
+                    , (long)len + (long)sizeof(struct nlmsghdr), sock_fd);
+                __iccom_frame_error(sock_fd, -EBADE);
                 return -EBADE;
         }
+        return (int)data_size_bytes;
+}
 
-        *data_offset__out = NLMSG_LENGTH(0);
-        return data_size_bytes;
+// See iccom.h
+int iccom_receive_data_nocopy(
+                const int sock_fd, void *const receive_buffer
+                , const size_t buffer_size, int *const data_offset__out)
+{
+        if (buffer_size <= NLMSG_SPACE(0)) {
+                log("incoming buffer size %zu is too small for netlink message"
+                    " (min size is %d)", buffer_size, NLMSG_SPACE(0));
+                return -ENFILE;
+        }
+        if (!data_offset__out) {
+                log("data_offset__out is not set.");
+                return -EINVAL;
+        }
+
+        struct nlmsghdr *const nl_header = (struct nlmsghdr *)receive_buffer;
+        while (1) {
+                const int hdr_res = iccom_read_header(sock_fd, nl_header);
+                if (hdr_res <= 0) {
+                        return hdr_res;
+                }
+                const int data_size_bytes = iccom_read_body(sock_fd
+                                                , receive_buffer, buffer_size);
+                if (data_size_bytes < 0) {
+                        return data_size_bytes;
+                }
+
+                // the frames not passing the socket filter are never seen
+                // by the caller, like with the kernel side filter
+                if (!__iccom_sock_filter_pass(sock_fd, NLMSG_DATA(nl_header)
+                                              , data_size_bytes)) {
+                        continue;
+                }
+
+                *data_offset__out = NLMSG_LENGTH(0);
+                __iccom_frame_received(sock_fd, NLMSG_DATA(nl_header)
+                                       , data_size_bytes);
+                return data_size_bytes;
+        }
+}
+
+// NOTE: the stream frame header tells the frame size, so the buffer
+//      is taken right after the header is read.
+//
+// See iccom.h
+int iccom_receive_data_alloc(const int sock_fd, void **const buf__out
+                             , int *const data_offset__out)
+{
+        if (!buf__out || !data_offset__out) {
+                log("buf__out or data_offset__out is not set.");
+                return -EINVAL;
+        }
+        *buf__out = NULL;
+
+        while (1) {
+                struct nlmsghdr hdr;
+                const int hdr_res = iccom_read_header(sock_fd, &hdr);
+                if (hdr_res <= 0) {
+                        return hdr_res;
+                }
+
+                size_t capacity;
+                void *const buf = __iccom_msg_pool_alloc(
+                                        NLMSG_SPACE(hdr.nlmsg_len), &capacity);
+                if (!buf) {
+                        // drains the frame
+                        const int drain_res = iccom_drain(sock_fd
+                                        , NLMSG_SPACE(hdr.nlmsg_len)
+                                          - sizeof(hdr));
+                        if (drain_res < 0) {
+                                return drain_res;
+                        }
+                        __iccom_rx_nomem_drop(sock_fd
+                                        , NLMSG_SPACE(hdr.nlmsg_len));
+                        return -ENOMEM;
+                }
+                memcpy(buf, &hdr, sizeof(hdr));
+
+                const int data_size_bytes = iccom_read_body(sock_fd, buf
+                                                            , capacity);
+                if (data_size_bytes < 0) {
+                        iccom_free_received_buffer(buf);
+                        return data_size_bytes;
+                }
+                if (!__iccom_sock_filter_pass(sock_fd, NLMSG_DATA(buf)
+                                              , data_size_bytes)) {
+                        iccom_free_received_buffer(buf);
+                        continue;
+                }
+
+                *buf__out = buf;
+                *data_offset__out = NLMSG_LENGTH(0);
+                __iccom_frame_received(sock_fd, NLMSG_DATA(buf)
+                                       , data_size_bytes);
+                return data_size_bytes;
+        }
 }
 
 // See iccom.h
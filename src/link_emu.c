@@ -0,0 +1,568 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the link emulator of the network sockets ICCom
+ * modification (see the link emulation API in iccom.h).
+ *
+ * The sent frames are copied into the per direction FIFO delay lines
+ * with their delivery time computed by the link model, and the
+ * delivery thread writes every frame to its socket when its time comes.
+ *
+ * Link model (per direction): the link is busy with one frame at a time,
+ * the frame occupies the link for
+ *      packages * max(package wire time at bitrate, transfer interval)
+ * starting from the moment the link becomes free, and is delivered
+ * latency + jitter later, but never before the previous frame of the
+ * same direction.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "iccom.h"
+#include "utils.h"
+#include "threads.h"
+#include "sock_registry.h"
+#include "hooks.h"
+#include "link_emu.h"
+
+/* -------------------- BUILD TIME CONFIGURATION ----------------------- */
+
+#define ICCOM_LINK_EMU_DEFAULT_QUEUE_FRAMES 256
+
+#define ICCOM_LINK_EMU_ENV "ICCOM_LINK_EMU"
+
+/* -------------------- MACRO DEFINITIONS ------------------------------ */
+
+// the link directions
+#define ICCOM_LINK_EMU_TO_TARGET 0
+#define ICCOM_LINK_EMU_FROM_TARGET 1
+#define ICCOM_LINK_EMU_DIRS 2
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+// The frame in flight.
+//
+// @next the next frame of the same direction
+// @sock_fd the socket to deliver the frame to
+// @due_ns the CLOCK_MONOTONIC delivery time
+// @size the frame size
+// @data the frame itself
+struct iccom_le_frame {
+        struct iccom_le_frame *next;
+        int sock_fd;
+        uint64_t due_ns;
+        size_t size;
+        char data[];
+};
+
+// The delay line of a single link direction.
+//
+// @head the first frame to be delivered, NULL if none
+// @tail the last frame to be delivered
+// @link_free_ns the time the link gets free of the queued frames
+// @last_due_ns the delivery time of the last queued frame
+struct iccom_le_lane {
+        struct iccom_le_frame *head;
+        struct iccom_le_frame *tail;
+        uint64_t link_free_ns;
+        uint64_t last_due_ns;
+};
+
+// @ctl_lock serializes the enable/disable calls
+// @lock protects all fields below
+// @wake signalled to the delivery thread on new frame or stop
+// @space signalled to the senders when a frame leaves the queue
+// @idle signalled when the delivery thread finishes the socket write
+// @running !0 while emulation is enabled
+// @thread_up !0 while the delivery thread is to be joined
+// @thread the delivery thread
+// @cfg the current link configuration
+// @queue_limit the max frames in flight
+// @queued the number of frames in flight (including the one being
+//      written by the delivery thread)
+// @writing_fd the socket being written by the delivery thread, -1 if none
+// @rnd the jitter random generator state
+// @lanes the delay lines
+// @stats the emulation counters
+static struct {
+        pthread_mutex_t ctl_lock;
+        pthread_mutex_t lock;
+        pthread_cond_t wake;
+        pthread_cond_t space;
+        pthread_cond_t idle;
+        int running;
+        int thread_up;
+        pthread_t thread;
+        iccom_link_emu_cfg cfg;
+        unsigned int queue_limit;
+        unsigned int queued;
+        int writing_fd;
+        uint64_t rnd;
+        struct iccom_le_lane lanes[ICCOM_LINK_EMU_DIRS];
+        iccom_link_emu_stats stats;
+} le = {
+        .ctl_lock = PTHREAD_MUTEX_INITIALIZER
+        , .lock = PTHREAD_MUTEX_INITIALIZER
+        , .writing_fd = -1
+};
+
+static pthread_once_t iccom_le_init_once = PTHREAD_ONCE_INIT;
+static pthread_once_t iccom_le_env_once = PTHREAD_ONCE_INIT;
+
+_Atomic int __iccom_link_emu_on = 0;
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+// The conditions wait on CLOCK_MONOTONIC, so the delivery times are not
+// affected by the wall clock changes.
+static void iccom_le_init(void)
+{
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&le.wake, &attr);
+        pthread_cond_init(&le.space, &attr);
+        pthread_cond_init(&le.idle, &attr);
+        pthread_condattr_destroy(&attr);
+        le.rnd = __iccom_now_ns() | 1;
+}
+
+// RETURNS: the random value in [0; max]
+//
+// NOTE: to be called under the le.lock
+static uint64_t iccom_le_random(const uint64_t max)
+{
+        // xorshift64
+        le.rnd ^= le.rnd << 13;
+        le.rnd ^= le.rnd >> 7;
+        le.rnd ^= le.rnd << 17;
+        return max ? le.rnd % (max + 1) : 0;
+}
+
+// RETURNS: the link direction of the socket
+static int iccom_le_direction(const int sock_fd)
+{
+        const int channel = __iccom_sock_channel(sock_fd);
+        loopback_cfg lb;
+        if (channel == ICCOM_SOCK_CHANNEL_UNKNOWN
+                    || !iccom_loopback_is_active()
+                    || iccom_loopback_get(&lb) < 0) {
+                return ICCOM_LINK_EMU_TO_TARGET;
+        }
+        const long long remote_from = (long long)lb.from_ch + lb.range_shift;
+        const long long remote_to = (long long)lb.to_ch + lb.range_shift;
+        return (channel >= remote_from && channel <= remote_to)
+               ? ICCOM_LINK_EMU_FROM_TARGET : ICCOM_LINK_EMU_TO_TARGET;
+}
+
+// Writes the whole frame to the socket, so the stream message framing
+// is kept.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+static int iccom_le_write_all(const int sock_fd, const char *data
+                              , size_t size)
+{
+        while (size > 0) {
+                const ssize_t res = write(sock_fd, data, size);
+                if (res < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return -errno;
+                }
+                data += res;
+                size -= (size_t)res;
+        }
+        return 0;
+}
+
+// RETURNS: the lane with the earliest frame to be delivered, NULL if
+//      no frames are in flight
+//
+// NOTE: to be called under the le.lock
+static struct iccom_le_lane *iccom_le_next_lane(void)
+{
+        struct iccom_le_lane *next = NULL;
+        for (int i = 0; i < ICCOM_LINK_EMU_DIRS; i++) {
+                struct iccom_le_lane *const lane = &le.lanes[i];
+                if (lane->head && (!next
+                                   || lane->head->due_ns < next->head->due_ns)) {
+                        next = lane;
+                }
+        }
+        return next;
+}
+
+// The delivery thread: writes the frames when their time comes, when
+// the emulation is being disabled flushes the rest of frames
+// immediately.
+static void *iccom_le_deliver(void *arg)
+{
+        (void)arg;
+        __iccom_thread_place(ICCOM_THREAD_LINK_EMU, -1);
+        pthread_mutex_lock(&le.lock);
+        while (1) {
+                struct iccom_le_lane *const lane = iccom_le_next_lane();
+                if (!lane) {
+                        if (!le.running) {
+                                break;
+                        }
+                        pthread_cond_wait(&le.wake, &le.lock);
+                        continue;
+                }
+
+                struct iccom_le_frame *const frame = lane->head;
+                if (le.running && frame->due_ns > __iccom_now_ns()) {
+                        const struct timespec due = {
+                                .tv_sec = (time_t)(frame->due_ns
+                                                   / 1000000000ull)
+                                , .tv_nsec = (long)(frame->due_ns
+                                                    % 1000000000ull)
+                        };
+                        pthread_cond_timedwait(&le.wake, &le.lock, &due);
+                        continue;
+                }
+
+                lane->head = frame->next;
+                if (!lane->head) {
+                        lane->tail = NULL;
+                }
+                le.writing_fd = frame->sock_fd;
+                pthread_mutex_unlock(&le.lock);
+
+                const int res = iccom_le_write_all(frame->sock_fd
+                                                   , frame->data
+                                                   , frame->size);
+                if (res < 0) {
+                        log("Delivery of the emulated link frame to socket"
+                            " %d failed, error: %d(%s)", frame->sock_fd
+                            , -res, strerror(-res));
+                        __iccom_frame_error(frame->sock_fd, res);
+                }
+                free(frame);
+
+                pthread_mutex_lock(&le.lock);
+                // the frame leaves the queue only when it is written, so
+                // the direct senders never write to the socket meanwhile
+                le.queued--;
+                le.writing_fd = -1;
+                pthread_cond_broadcast(&le.space);
+                pthread_cond_broadcast(&le.idle);
+        }
+        pthread_mutex_unlock(&le.lock);
+        return NULL;
+}
+
+// Computes the link occupation by the frame and updates the counters.
+//
+// RETURNS: the time the frame occupies the link in ns
+//
+// NOTE: to be called under the le.lock
+static uint64_t iccom_le_frame_time_ns(const size_t data_size)
+{
+        const iccom_link_emu_cfg *const cfg = &le.cfg;
+        uint64_t packages = 1;
+        uint64_t package_bytes = data_size;
+        if (cfg->package_payload_bytes) {
+                packages = (data_size + cfg->package_payload_bytes - 1)
+                           / cfg->package_payload_bytes;
+                if (packages == 0) {
+                        packages = 1;
+                }
+                package_bytes = cfg->package_payload_bytes;
+        }
+        package_bytes += cfg->package_overhead_bytes;
+
+        uint64_t package_ns = 0;
+        if (cfg->bitrate_bps) {
+                package_ns = package_bytes * 8ull * 1000000000ull
+                             / cfg->bitrate_bps;
+        }
+        const uint64_t interval_ns = (uint64_t)cfg->xfer_interval_us * 1000;
+        if (package_ns < interval_ns) {
+                package_ns = interval_ns;
+        }
+
+        le.stats.packages += packages;
+        le.stats.wire_bytes += packages * package_bytes;
+        return packages * package_ns;
+}
+
+// See link_emu.h
+int __iccom_link_emu_send(const int sock_fd, const void *const frame
+                          , const size_t frame_size, const size_t data_size)
+{
+        const int dir = iccom_le_direction(sock_fd);
+
+        struct iccom_le_frame *const f
+                = (struct iccom_le_frame *)malloc(sizeof(*f) + frame_size);
+        if (!f) {
+                log("Could not allocate the emulated link frame of size: %zu"
+                    , frame_size);
+                return -ENOMEM;
+        }
+        f->next = NULL;
+        f->sock_fd = sock_fd;
+        f->size = frame_size;
+        memcpy(f->data, frame, frame_size);
+
+        pthread_mutex_lock(&le.lock);
+        // when the emulation is being disabled, the direct sends wait
+        // for the frames in flight to keep the order
+        int blocked = 0;
+        while (le.running ? le.queued >= le.queue_limit
+                          : (le.queued > 0 || le.writing_fd != -1)) {
+                if (le.running) {
+                        const int flags = fcntl(sock_fd, F_GETFL);
+                        if (flags >= 0 && (flags & O_NONBLOCK)) {
+                                le.stats.blocked_sends++;
+                                pthread_mutex_unlock(&le.lock);
+                                free(f);
+                                return -EAGAIN;
+                        }
+                }
+                blocked = 1;
+                pthread_cond_wait(&le.space, &le.lock);
+        }
+        if (!le.running) {
+                pthread_mutex_unlock(&le.lock);
+                free(f);
+                return 1;
+        }
+        if (blocked) {
+                le.stats.blocked_sends++;
+        }
+
+        struct iccom_le_lane *const lane = &le.lanes[dir];
+        const uint64_t now = __iccom_now_ns();
+        const uint64_t start = (lane->link_free_ns > now)
+                               ? lane->link_free_ns : now;
+        lane->link_free_ns = start + iccom_le_frame_time_ns(data_size);
+
+        uint64_t due = lane->link_free_ns
+                       + (uint64_t)le.cfg.latency_us * 1000
+                       + iccom_le_random((uint64_t)le.cfg.jitter_us * 1000);
+        if (due < lane->last_due_ns) {
+                due = lane->last_due_ns;
+        }
+        lane->last_due_ns = due;
+        f->due_ns = due;
+
+        if (lane->tail) {
+                lane->tail->next = f;
+        } else {
+                lane->head = f;
+        }
+        lane->tail = f;
+        le.queued++;
+
+        le.stats.frames++;
+        le.stats.bytes += data_size;
+        if (le.queued > le.stats.queue_max) {
+                le.stats.queue_max = le.queued;
+        }
+        if (due - now > le.stats.max_delay_ns) {
+                le.stats.max_delay_ns = due - now;
+        }
+
+        pthread_cond_signal(&le.wake);
+        pthread_mutex_unlock(&le.lock);
+        return 0;
+}
+
+// See link_emu.h
+void __iccom_link_emu_forget(const int sock_fd)
+{
+        pthread_mutex_lock(&le.lock);
+        for (int i = 0; i < ICCOM_LINK_EMU_DIRS; i++) {
+                struct iccom_le_lane *const lane = &le.lanes[i];
+                struct iccom_le_frame **link = &lane->head;
+                lane->tail = NULL;
+                while (*link) {
+                        struct iccom_le_frame *const f = *link;
+                        if (f->sock_fd == sock_fd) {
+                                *link = f->next;
+                                free(f);
+                                le.queued--;
+                                continue;
+                        }
+                        lane->tail = f;
+                        link = &f->next;
+                }
+        }
+        pthread_cond_broadcast(&le.space);
+        while (le.writing_fd == sock_fd) {
+                pthread_cond_wait(&le.idle, &le.lock);
+        }
+        pthread_mutex_unlock(&le.lock);
+}
+
+// See iccom.h
+int iccom_link_emu_enable(const iccom_link_emu_cfg *const cfg)
+{
+        if (!cfg) {
+                log("no configuration ptr is provided");
+                return -EINVAL;
+        }
+        pthread_once(&iccom_le_init_once, iccom_le_init);
+
+        pthread_mutex_lock(&le.ctl_lock);
+        pthread_mutex_lock(&le.lock);
+        le.cfg = *cfg;
+        le.queue_limit = cfg->queue_frames ? cfg->queue_frames
+                                           : ICCOM_LINK_EMU_DEFAULT_QUEUE_FRAMES;
+        if (le.running) {
+                pthread_cond_broadcast(&le.space);
+                pthread_mutex_unlock(&le.lock);
+                pthread_mutex_unlock(&le.ctl_lock);
+                return 0;
+        }
+        memset(&le.stats, 0, sizeof(le.stats));
+        for (int i = 0; i < ICCOM_LINK_EMU_DIRS; i++) {
+                le.lanes[i].link_free_ns = 0;
+                le.lanes[i].last_due_ns = 0;
+        }
+        le.running = 1;
+        pthread_mutex_unlock(&le.lock);
+
+        const int res = pthread_create(&le.thread, NULL, iccom_le_deliver
+                                       , NULL);
+        if (res != 0) {
+                log("Could not start the link emulation thread: %d(%s)"
+                    , res, strerror(res));
+                pthread_mutex_lock(&le.lock);
+                le.running = 0;
+                pthread_mutex_unlock(&le.lock);
+                pthread_mutex_unlock(&le.ctl_lock);
+                return -res;
+        }
+        le.thread_up = 1;
+        atomic_store_explicit(&__iccom_link_emu_on, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&le.ctl_lock);
+        return 0;
+}
+
+// See iccom.h
+int iccom_link_emu_disable(void)
+{
+        pthread_mutex_lock(&le.ctl_lock);
+        if (!le.thread_up) {
+                pthread_mutex_unlock(&le.ctl_lock);
+                return 0;
+        }
+        // the senders keep going through the emulation (and so wait
+        // for the frames in flight) till the queue is flushed
+        pthread_mutex_lock(&le.lock);
+        le.running = 0;
+        pthread_cond_signal(&le.wake);
+        pthread_mutex_unlock(&le.lock);
+
+        pthread_join(le.thread, NULL);
+        le.thread_up = 0;
+        atomic_store_explicit(&__iccom_link_emu_on, 0, memory_order_relaxed);
+
+        pthread_mutex_lock(&le.lock);
+        pthread_cond_broadcast(&le.space);
+        pthread_mutex_unlock(&le.lock);
+        pthread_mutex_unlock(&le.ctl_lock);
+        return 0;
+}
+
+// See iccom.h
+int iccom_link_emu_get_stats(iccom_link_emu_stats *const out)
+{
+        if (!out) {
+                log("no output ptr is provided");
+                return -EINVAL;
+        }
+        pthread_mutex_lock(&le.lock);
+        const int running = le.running;
+        *out = le.stats;
+        pthread_mutex_unlock(&le.lock);
+        return running ? 0 : -ENODEV;
+}
+
+// Applies the ICCOM_LINK_EMU environment variable configuration.
+static void iccom_le_env_apply(void)
+{
+        const char *const env = getenv(ICCOM_LINK_EMU_ENV);
+        if (!env || !*env) {
+                return;
+        }
+
+        iccom_link_emu_cfg cfg;
+        memset(&cfg, 0, sizeof(cfg));
+
+        const char *p = env;
+        while (*p) {
+                const char *const eq = strchr(p, '=');
+                if (!eq) {
+                        log(ICCOM_LINK_EMU_ENV " is malformed at: %s", p);
+                        return;
+                }
+                char *end;
+                const unsigned long long value = strtoull(eq + 1, &end, 10);
+                if (end == eq + 1 || (*end != ',' && *end != '\0')) {
+                        log(ICCOM_LINK_EMU_ENV " has invalid value at: %s"
+                            , p);
+                        return;
+                }
+                const size_t key_len = (size_t)(eq - p);
+                #define ICCOM_LE_KEY(key)                                     \
+                        (key_len == sizeof(key) - 1                           \
+                         && strncmp(p, key, key_len) == 0)
+                if (ICCOM_LE_KEY("bitrate")) {
+                        cfg.bitrate_bps = value;
+                } else if (ICCOM_LE_KEY("package")) {
+                        cfg.package_payload_bytes = (uint32_t)value;
+                } else if (ICCOM_LE_KEY("overhead")) {
+                        cfg.package_overhead_bytes = (uint32_t)value;
+                } else if (ICCOM_LE_KEY("interval_us")) {
+                        cfg.xfer_interval_us = (uint32_t)value;
+                } else if (ICCOM_LE_KEY("latency_us")) {
+                        cfg.latency_us = (uint32_t)value;
+                } else if (ICCOM_LE_KEY("jitter_us")) {
+                        cfg.jitter_us = (uint32_t)value;
+                } else if (ICCOM_LE_KEY("queue")) {
+                        cfg.queue_frames = (uint32_t)value;
+                } else {
+                        log(ICCOM_LINK_EMU_ENV " has unknown key at: %s", p);
+                        return;
+                }
+                #undef ICCOM_LE_KEY
+                p = (*end == ',') ? end + 1 : end;
+        }
+
+        const int res = iccom_link_emu_enable(&cfg);
+        if (res < 0) {
+                log("Could not enable the link emulation from "
+                    ICCOM_LINK_EMU_ENV ": %d(%s)", -res, strerror(-res));
+        }
+}
+
+// See link_emu.h
+void __iccom_link_emu_env_init(void)
+{
+        pthread_once(&iccom_le_env_once, iccom_le_env_apply);
+}
@@ -0,0 +1,60 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+// Internal hooks of the link emulator of the network sockets ICCom
+// modification, see the link emulation API in iccom.h.
+
+#ifndef LIBICCOM_LINK_EMU_H
+#define LIBICCOM_LINK_EMU_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/* -------------------- ROUTINES DECLARATIONS -------------------------- */
+
+extern _Atomic int __iccom_link_emu_on;
+
+// Applies the ICCOM_LINK_EMU environment configuration, if any. Only the
+// first call does anything.
+void __iccom_link_emu_env_init(void);
+
+// Queues the frame to the emulated link, the frame is copied, so the
+// buffer can be reused right after the call.
+//
+// @sock_fd the socket to deliver the frame to
+// @frame {valid ptr} the whole frame to be written to the socket
+// @frame_size the whole frame size
+// @data_size the frame payload size (used for link timings)
+//
+// RETURNS:
+//      0: the frame is queued
+//      1: the emulation is disabled, the frame is to be sent directly
+//      <0: negated error code (-EAGAIN: the queue is full and the
+//          socket is non-blocking)
+int __iccom_link_emu_send(const int sock_fd, const void *const frame
+                          , const size_t frame_size, const size_t data_size);
+
+// Drops the frames in flight for the socket and waits till the socket
+// is not used by the link emulator anymore. To be called before the
+// socket is closed.
+void __iccom_link_emu_forget(const int sock_fd);
+
+// RETURNS:
+//      !0: the link emulation is enabled (costs a single relaxed load)
+//      0: otherwise
+static inline int __iccom_link_emu_active(void)
+{
+        return atomic_load_explicit(&__iccom_link_emu_on
+                                    , memory_order_relaxed);
+}
+
+#endif //ifndef LIBICCOM_LINK_EMU_H
@@ -0,0 +1,315 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the size class pool of the received message
+ * buffers, see msg_pool.h.
+ *
+ * Every buffer is preceded by the small header which keeps its size
+ * class, so the free call needs no size. The freed buffers are kept to
+ * be reused by the next allocations, so the steady state path does no
+ * heap calls, while the buffers stay as small as the messages they
+ * hold.
+ *
+ * The buffers are usually allocated by one thread (the producer, the
+ * receive thread) and freed by another (the flusher, the consumer), so
+ * the free buffers are kept in three tiers per size class:
+ * * the thread cache: the plain free list of the allocating thread,
+ *   no atomics; the thread which never allocated the class doesn't
+ *   keep its buffers;
+ * * the return stack: the lock free stack the other threads push the
+ *   freed buffers to; the allocating thread takes the whole stack at
+ *   once (exchange) into its thread cache when the latter is empty, so
+ *   the stack is never popped by the single node and has no ABA;
+ * * the locked list: the overflow of the above and the buffers of the
+ *   exited threads, touched only when the above two are empty/full.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <linux/netlink.h>
+
+#include "iccom.h"
+#include "msg_pool.h"
+
+/* -------------------- BUILD TIME CONFIGURATION ----------------------- */
+
+// max free buffers kept per size class in the locked list and in the
+// return stack (each)
+#define ICCOM_MSG_POOL_CACHE_PER_CLASS 256
+// max free buffers the thread keeps per size class on its own
+#define ICCOM_MSG_POOL_THREAD_CACHE_PER_CLASS 64
+
+/* -------------------- MACRO DEFINITIONS ------------------------------ */
+
+// the number of the size classes, see @iccom_msg_pool_sizes
+#define ICCOM_MSG_POOL_CLASSES_COUNT 4
+
+// the size class of the buffers not fitting any class
+#define ICCOM_MSG_POOL_CLASS_NONE UINT32_MAX
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+// The buffer header.
+//
+// @cls the buffer size class, ICCOM_MSG_POOL_CLASS_NONE for the
+//      oversize buffers
+// @next the next free buffer of the class (while in the free list)
+// NOTE: the alignment keeps the buffer (netlink header) aligned
+struct iccom_msg_pool_hdr {
+        uint32_t cls;
+        struct iccom_msg_pool_hdr *next;
+} __attribute__((aligned(16)));
+
+// The size class shared free buffers.
+//
+// @lock protects the @head list
+// @head the first free buffer of the locked list, NULL if none
+// @count the number of the free buffers in the locked list
+// @returned the return stack top, NULL if empty
+// @returned_count the (approximate) number of buffers in @returned
+struct iccom_msg_pool_class {
+        pthread_mutex_t lock;
+        struct iccom_msg_pool_hdr *head;
+        unsigned int count;
+        _Atomic(struct iccom_msg_pool_hdr *) returned;
+        _Atomic unsigned int returned_count;
+};
+
+// The thread own free buffers.
+//
+// @head the first free buffer of the class, NULL if none
+// @count the number of the free buffers of the class
+// @allocates !0 if the thread ever allocated the class buffer
+struct iccom_msg_pool_thread_cache {
+        struct iccom_msg_pool_hdr *head[ICCOM_MSG_POOL_CLASSES_COUNT];
+        unsigned int count[ICCOM_MSG_POOL_CLASSES_COUNT];
+        unsigned char allocates[ICCOM_MSG_POOL_CLASSES_COUNT];
+};
+
+/* ------------------- GLOBAL VARIABLES / CONSTANTS -------------------- */
+
+// the buffer sizes of the classes, ascending
+static const size_t iccom_msg_pool_sizes[] = {
+        NLMSG_SPACE(64)
+        , NLMSG_SPACE(256)
+        , NLMSG_SPACE(1024)
+        , NLMSG_SPACE(ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES)
+};
+
+_Static_assert(sizeof(iccom_msg_pool_sizes)
+               / sizeof(iccom_msg_pool_sizes[0])
+               == ICCOM_MSG_POOL_CLASSES_COUNT
+               , "ICCOM_MSG_POOL_CLASSES_COUNT doesn't match the sizes");
+
+static struct iccom_msg_pool_class iccom_msg_pool[] = {
+        { PTHREAD_MUTEX_INITIALIZER, NULL, 0, NULL, 0 }
+        , { PTHREAD_MUTEX_INITIALIZER, NULL, 0, NULL, 0 }
+        , { PTHREAD_MUTEX_INITIALIZER, NULL, 0, NULL, 0 }
+        , { PTHREAD_MUTEX_INITIALIZER, NULL, 0, NULL, 0 }
+};
+
+// the thread cache, its state: 0 - not set up yet, 1 - in use,
+// -1 - no cache (the thread is exiting or the cache can't be set up)
+static _Thread_local struct iccom_msg_pool_thread_cache iccom_msg_pool_tc;
+static _Thread_local int iccom_msg_pool_tc_state;
+
+// the key to flush the thread cache on the thread exit
+static pthread_key_t iccom_msg_pool_tc_key;
+static int iccom_msg_pool_tc_key_ok;
+static pthread_once_t iccom_msg_pool_once = PTHREAD_ONCE_INIT;
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+// Puts the buffer into the locked list or frees it if the list is full.
+static void iccom_msg_pool_put_locked(struct iccom_msg_pool_hdr *const hdr)
+{
+        struct iccom_msg_pool_class *const pc = &iccom_msg_pool[hdr->cls];
+        pthread_mutex_lock(&pc->lock);
+        if (pc->count < ICCOM_MSG_POOL_CACHE_PER_CLASS) {
+                hdr->next = pc->head;
+                pc->head = hdr;
+                pc->count++;
+                pthread_mutex_unlock(&pc->lock);
+                return;
+        }
+        pthread_mutex_unlock(&pc->lock);
+        free(hdr);
+}
+
+// Moves the exiting thread cache buffers to the locked lists.
+static void iccom_msg_pool_tc_flush(void *const arg)
+{
+        struct iccom_msg_pool_thread_cache *const tc
+                        = (struct iccom_msg_pool_thread_cache *)arg;
+        iccom_msg_pool_tc_state = -1;
+        for (uint32_t cls = 0; cls < ICCOM_MSG_POOL_CLASSES_COUNT; cls++) {
+                while (tc->head[cls]) {
+                        struct iccom_msg_pool_hdr *const hdr = tc->head[cls];
+                        tc->head[cls] = hdr->next;
+                        iccom_msg_pool_put_locked(hdr);
+                }
+                tc->count[cls] = 0;
+        }
+}
+
+static void iccom_msg_pool_init(void)
+{
+        iccom_msg_pool_tc_key_ok = pthread_key_create(&iccom_msg_pool_tc_key
+                                                , iccom_msg_pool_tc_flush)
+                                   == 0;
+}
+
+// RETURNS:
+//      the calling thread cache
+//      NULL: the thread has no cache (exiting, or its flush on exit
+//          could not be set up)
+static struct iccom_msg_pool_thread_cache *iccom_msg_pool_thread_cache(void)
+{
+        if (iccom_msg_pool_tc_state > 0) {
+                return &iccom_msg_pool_tc;
+        }
+        if (iccom_msg_pool_tc_state < 0) {
+                return NULL;
+        }
+        pthread_once(&iccom_msg_pool_once, iccom_msg_pool_init);
+        if (!iccom_msg_pool_tc_key_ok
+                    || pthread_setspecific(iccom_msg_pool_tc_key
+                                           , &iccom_msg_pool_tc) != 0) {
+                iccom_msg_pool_tc_state = -1;
+                return NULL;
+        }
+        iccom_msg_pool_tc_state = 1;
+        return &iccom_msg_pool_tc;
+}
+
+// Takes the free buffer of the class: from the thread cache (refilled
+// by the whole return stack when empty), then from the locked list.
+//
+// RETURNS:
+//      the buffer: on success
+//      NULL: no free buffer
+static struct iccom_msg_pool_hdr *iccom_msg_pool_get(const uint32_t cls)
+{
+        struct iccom_msg_pool_class *const pc = &iccom_msg_pool[cls];
+        struct iccom_msg_pool_thread_cache *const tc
+                        = iccom_msg_pool_thread_cache();
+        struct iccom_msg_pool_hdr *hdr;
+
+        if (tc) {
+                tc->allocates[cls] = 1;
+                if (!tc->head[cls]) {
+                        hdr = atomic_exchange_explicit(&pc->returned, NULL
+                                                , memory_order_acquire);
+                        unsigned int count = 0;
+                        for (struct iccom_msg_pool_hdr *it = hdr; it
+                                        ; it = it->next) {
+                                count++;
+                        }
+                        atomic_fetch_sub_explicit(&pc->returned_count, count
+                                                  , memory_order_relaxed);
+                        tc->head[cls] = hdr;
+                        tc->count[cls] = count;
+                }
+                hdr = tc->head[cls];
+                if (hdr) {
+                        tc->head[cls] = hdr->next;
+                        tc->count[cls]--;
+                        return hdr;
+                }
+        }
+
+        pthread_mutex_lock(&pc->lock);
+        hdr = pc->head;
+        if (hdr) {
+                pc->head = hdr->next;
+                pc->count--;
+        }
+        pthread_mutex_unlock(&pc->lock);
+        return hdr;
+}
+
+// See msg_pool.h
+void *__iccom_msg_pool_alloc(const size_t size, size_t *const capacity__out)
+{
+        uint32_t cls = 0;
+        while (cls < ICCOM_MSG_POOL_CLASSES_COUNT
+                    && iccom_msg_pool_sizes[cls] < size) {
+                cls++;
+        }
+
+        struct iccom_msg_pool_hdr *hdr = NULL;
+        size_t capacity = size;
+        if (cls < ICCOM_MSG_POOL_CLASSES_COUNT) {
+                capacity = iccom_msg_pool_sizes[cls];
+                hdr = iccom_msg_pool_get(cls);
+        } else {
+                cls = ICCOM_MSG_POOL_CLASS_NONE;
+        }
+
+        if (!hdr) {
+                hdr = (struct iccom_msg_pool_hdr *)malloc(sizeof(*hdr)
+                                                          + capacity);
+                if (!hdr) {
+                        return NULL;
+                }
+                hdr->cls = cls;
+        }
+        *capacity__out = capacity;
+        return hdr + 1;
+}
+
+// See iccom.h
+void iccom_free_received_buffer(void *const buf)
+{
+        if (!buf) {
+                return;
+        }
+        struct iccom_msg_pool_hdr *const hdr
+                = (struct iccom_msg_pool_hdr *)buf - 1;
+        if (hdr->cls == ICCOM_MSG_POOL_CLASS_NONE) {
+                free(hdr);
+                return;
+        }
+
+        // the allocating thread keeps the buffer on its own
+        const uint32_t cls = hdr->cls;
+        struct iccom_msg_pool_thread_cache *const tc
+                        = iccom_msg_pool_thread_cache();
+        if (tc && tc->allocates[cls]
+                    && tc->count[cls] < ICCOM_MSG_POOL_THREAD_CACHE_PER_CLASS) {
+                hdr->next = tc->head[cls];
+                tc->head[cls] = hdr;
+                tc->count[cls]++;
+                return;
+        }
+
+        // otherwise the buffer goes back to the allocating threads
+        struct iccom_msg_pool_class *const pc = &iccom_msg_pool[cls];
+        if (atomic_load_explicit(&pc->returned_count, memory_order_relaxed)
+                        < ICCOM_MSG_POOL_CACHE_PER_CLASS) {
+                atomic_fetch_add_explicit(&pc->returned_count, 1
+                                          , memory_order_relaxed);
+                struct iccom_msg_pool_hdr *top = atomic_load_explicit(
+                                        &pc->returned, memory_order_relaxed);
+                do {
+                        hdr->next = top;
+                } while (!atomic_compare_exchange_weak_explicit(
+                                        &pc->returned, &top, hdr
+                                        , memory_order_release
+                                        , memory_order_relaxed));
+                return;
+        }
+
+        iccom_msg_pool_put_locked(hdr);
+}
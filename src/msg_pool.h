@@ -0,0 +1,36 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+// The size class pool of the received message buffers, see
+// @iccom_receive_data_alloc in iccom.h.
+
+#ifndef LIBICCOM_MSG_POOL_H
+#define LIBICCOM_MSG_POOL_H
+
+#include <stddef.h>
+
+/* -------------------- ROUTINES DECLARATIONS -------------------------- */
+
+// Gets the buffer of the smallest size class which fits the given size.
+//
+// @size the required buffer size in bytes
+// @capacity__out {valid ptr} where to write the actual buffer size to
+//
+// RETURNS:
+//      the buffer: on success
+//      NULL: out of memory
+void *__iccom_msg_pool_alloc(const size_t size, size_t *const capacity__out);
+
+// NOTE: the buffers are returned to the pool by the public
+//      @iccom_free_received_buffer.
+
+#endif //ifndef LIBICCOM_MSG_POOL_H
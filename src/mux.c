@@ -0,0 +1,423 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the ICCom sub-channels, see iccom_mux.h.
+ *
+ * The streams are looked up by the sub-channel id in the open
+ * addressing table (2 x max streams, linear probing, backward shift
+ * deletion), which is guarded by the mutex the demultiplexer thread
+ * holds while it delivers the message, so the streams can be opened
+ * and closed on the fly.
+ *
+ * The stream queue is the SPSC rx ring (see ring.h), the demultiplexer
+ * thread produces, the stream consumer consumes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "iccom.h"
+#include "iccom_mux.h"
+#include "threads.h"
+#include "utils.h"
+#include "ring.h"
+
+/* -------------------- BUILD TIME CONFIGURATION ----------------------- */
+
+#define ICCOM_DEMUX_DEFAULT_MAX_STREAMS 64
+#define ICCOM_DEMUX_DEFAULT_QUEUE_SIZE 64
+#define ICCOM_DEMUX_DEFAULT_STOP_LATENCY_MS 100
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+// @ring the stream queue
+// @sub_id the sub-channel id
+// @demux the demultiplexer
+struct iccom_demux_stream {
+        struct iccom_rx_ring ring;
+        uint32_t sub_id;
+        struct iccom_demux *demux;
+};
+
+// @lock protects @table and @count, held by the demultiplexer thread
+//      while it delivers the message
+// @table the streams table, @table_mask + 1 slots, NULL - empty slot
+// @count the number of open streams, <= @max_streams
+// @sock the socket to receive from
+// @stop !0 when the demultiplexer thread is to exit
+// @thread the demultiplexer thread
+// @cpu the CPU to pin the thread to, <0 if none
+// @received, ... the counters (see iccom_demux_stats)
+struct iccom_demux {
+        pthread_mutex_t lock;
+        struct iccom_demux_stream **table;
+        uint32_t table_mask;
+        unsigned int count;
+        unsigned int max_streams;
+        struct iccom_rx_socket sock;
+        _Atomic int stop;
+        pthread_t thread;
+        int cpu;
+        _Atomic uint64_t received;
+        _Atomic uint64_t delivered;
+        _Atomic uint64_t dropped;
+        _Atomic uint64_t unknown;
+        _Atomic uint64_t malformed;
+        _Atomic uint64_t receive_errors;
+};
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+// See iccom_mux.h
+int iccom_mux_parse(const void *const payload, const size_t size
+                    , uint32_t *const sub_id__out)
+{
+        const uint8_t *const p = (const uint8_t *)payload;
+        uint32_t sub_id = 0;
+        for (size_t i = 0; i < size && i < ICCOM_MUX_MAX_HEADER_SIZE; i++) {
+                sub_id |= (uint32_t)(p[i] & 0x7f) << (7 * i);
+                if (!(p[i] & 0x80)) {
+                        // the last byte carries 4 bits only
+                        if (i == ICCOM_MUX_MAX_HEADER_SIZE - 1
+                                        && p[i] > 0x0f) {
+                                return -EBADMSG;
+                        }
+                        *sub_id__out = sub_id;
+                        return (int)(i + 1);
+                }
+        }
+        return -EBADMSG;
+}
+
+// See iccom_mux.h
+int iccom_mux_send(const int sock_fd, const uint32_t sub_id
+                   , const void *const data, const size_t size)
+{
+        const size_t hdr_size = iccom_mux_header_size(sub_id);
+        if ((size && !data)
+                        || size > ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES
+                                  - hdr_size) {
+                log("invalid sub-channel %u message: size %zu"
+                    , sub_id, size);
+                return -EINVAL;
+        }
+        _Alignas(struct nlmsghdr) char buf[NLMSG_SPACE(
+                        ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES)];
+        const int offset = iccom_get_data_payload_offset();
+        iccom_mux_write_header(sub_id, buf + offset);
+        if (size) {
+                memcpy(buf + offset + hdr_size, data, size);
+        }
+        const size_t msg_size = hdr_size + size;
+        return iccom_send_data_nocopy(sock_fd, buf
+                        , iccom_get_required_buffer_size(msg_size), offset
+                        , msg_size);
+}
+
+static inline uint32_t iccom_demux_home(const struct iccom_demux *const d
+                                        , const uint32_t sub_id)
+{
+        return (sub_id * 2654435761u) & d->table_mask;
+}
+
+// RETURNS: the table slot of the sub-channel id, or the empty slot
+//      where it would be
+static uint32_t iccom_demux_slot(const struct iccom_demux *const d
+                                 , const uint32_t sub_id)
+{
+        uint32_t i = iccom_demux_home(d, sub_id);
+        while (d->table[i] && d->table[i]->sub_id != sub_id) {
+                i = (i + 1) & d->table_mask;
+        }
+        return i;
+}
+
+// Removes the table slot with the backward shift of the following
+// entries of the probe chain.
+static void iccom_demux_table_remove(struct iccom_demux *const d, uint32_t i)
+{
+        uint32_t j = i;
+        while (1) {
+                j = (j + 1) & d->table_mask;
+                if (!d->table[j]) {
+                        break;
+                }
+                const uint32_t k = iccom_demux_home(d, d->table[j]->sub_id);
+                // the entry at j can move to i if its home is not
+                // within (i; j] (cyclically)
+                const int movable = (i <= j) ? (k <= i || k > j)
+                                             : (k <= i && k > j);
+                if (movable) {
+                        d->table[i] = d->table[j];
+                        i = j;
+                }
+        }
+        d->table[i] = NULL;
+}
+
+// The demultiplexer thread.
+static void *iccom_demux_loop(void *arg)
+{
+        struct iccom_demux *const d = (struct iccom_demux *)arg;
+
+        __iccom_thread_place(ICCOM_THREAD_RECEIVER, d->cpu);
+
+        while (!atomic_load_explicit(&d->stop, memory_order_relaxed)) {
+                iccom_rx_message msg;
+                const uint64_t start_ns = __iccom_now_ns();
+                const int res = iccom_receive_data_alloc(d->sock.fd
+                                        , &msg.buf, &msg.data_offset);
+                if (res <= 0) {
+                        if (res < 0) {
+                                atomic_fetch_add_explicit(&d->receive_errors
+                                                , 1, memory_order_relaxed);
+                        }
+                        __iccom_rx_backoff(res, start_ns);
+                        continue;
+                }
+                atomic_fetch_add_explicit(&d->received, 1
+                                          , memory_order_relaxed);
+
+                uint32_t sub_id;
+                const int hdr_size = iccom_mux_parse(
+                                iccom_rx_message_data(&msg), (size_t)res
+                                , &sub_id);
+                if (hdr_size < 0) {
+                        atomic_fetch_add_explicit(&d->malformed, 1
+                                                  , memory_order_relaxed);
+                        iccom_free_received_buffer(msg.buf);
+                        continue;
+                }
+                msg.data_offset += hdr_size;
+                msg.size = res - hdr_size;
+                msg.rx_time_ns = __iccom_now_ns();
+
+                _Atomic uint64_t *counter = &d->unknown;
+                pthread_mutex_lock(&d->lock);
+                struct iccom_demux_stream *const s
+                                = d->table[iccom_demux_slot(d, sub_id)];
+                if (s) {
+                        counter = __iccom_rx_ring_push(&s->ring, &msg)
+                                  ? &d->delivered : &d->dropped;
+                }
+                pthread_mutex_unlock(&d->lock);
+
+                atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+                if (counter != &d->delivered) {
+                        iccom_free_received_buffer(msg.buf);
+                }
+        }
+        return NULL;
+}
+
+// See iccom_mux.h
+int iccom_demux_start(const iccom_demux_cfg *const cfg
+                      , iccom_demux **const demux__out)
+{
+        if (!cfg || !demux__out) {
+                log("no configuration or output ptr is provided");
+                return -EINVAL;
+        }
+        const unsigned int max_streams = cfg->max_streams
+                                         ? cfg->max_streams
+                                         : ICCOM_DEMUX_DEFAULT_MAX_STREAMS;
+        if (max_streams > (1u << 20)) {
+                log("Too many streams: %u", max_streams);
+                return -EINVAL;
+        }
+
+        struct iccom_demux *const d = (struct iccom_demux *)
+                        calloc(1, sizeof(*d));
+        if (!d) {
+                return -ENOMEM;
+        }
+        uint32_t table_size = 4;
+        while (table_size < 2 * max_streams) {
+                table_size *= 2;
+        }
+        d->table = calloc(table_size, sizeof(d->table[0]));
+        if (!d->table) {
+                free(d);
+                return -ENOMEM;
+        }
+        d->table_mask = table_size - 1;
+        d->max_streams = max_streams;
+        d->cpu = cfg->cpu;
+        pthread_mutex_init(&d->lock, NULL);
+
+        int res;
+        res = __iccom_rx_socket_take(cfg->channel, cfg->sock_fd
+                        , cfg->stop_latency_ms
+                          ? (int)cfg->stop_latency_ms
+                          : ICCOM_DEMUX_DEFAULT_STOP_LATENCY_MS
+                        , &d->sock);
+        if (res < 0) {
+                goto free_demux;
+        }
+
+        res = -pthread_create(&d->thread, NULL, iccom_demux_loop, d);
+        if (res < 0) {
+                log("Could not start the demultiplexer thread: %d(%s)"
+                    , -res, strerror(-res));
+                goto close_socket;
+        }
+
+        *demux__out = d;
+        return 0;
+
+close_socket:
+        __iccom_rx_socket_release(&d->sock);
+free_demux:
+        pthread_mutex_destroy(&d->lock);
+        free(d->table);
+        free(d);
+        return res;
+}
+
+// See iccom_mux.h
+void iccom_demux_stop(iccom_demux *const d)
+{
+        if (!d) {
+                return;
+        }
+        atomic_store_explicit(&d->stop, 1, memory_order_relaxed);
+        pthread_join(d->thread, NULL);
+
+        if (d->count) {
+                log("The demultiplexer is stopped with %u streams left"
+                    , d->count);
+        }
+        __iccom_rx_socket_release(&d->sock);
+        pthread_mutex_destroy(&d->lock);
+        free(d->table);
+        free(d);
+}
+
+// See iccom_mux.h
+int iccom_demux_get_stats(const iccom_demux *const d
+                          , iccom_demux_stats *const out)
+{
+        if (!d || !out) {
+                log("no demultiplexer or output ptr is provided");
+                return -EINVAL;
+        }
+        out->received = atomic_load_explicit(&d->received
+                                             , memory_order_relaxed);
+        out->delivered = atomic_load_explicit(&d->delivered
+                                              , memory_order_relaxed);
+        out->dropped = atomic_load_explicit(&d->dropped
+                                            , memory_order_relaxed);
+        out->unknown = atomic_load_explicit(&d->unknown
+                                            , memory_order_relaxed);
+        out->malformed = atomic_load_explicit(&d->malformed
+                                              , memory_order_relaxed);
+        out->receive_errors = atomic_load_explicit(&d->receive_errors
+                                                   , memory_order_relaxed);
+        return 0;
+}
+
+// See iccom_mux.h
+int iccom_demux_open_stream(iccom_demux *const d, const uint32_t sub_id
+                            , const unsigned int queue_size
+                            , iccom_demux_stream **const stream__out)
+{
+        if (!d || !stream__out) {
+                log("no demultiplexer or output ptr is provided");
+                return -EINVAL;
+        }
+        const unsigned int size = queue_size
+                                  ? queue_size
+                                  : ICCOM_DEMUX_DEFAULT_QUEUE_SIZE;
+        if (size & (size - 1)) {
+                log("The queue size %u is not a power of two", size);
+                return -EINVAL;
+        }
+
+        const size_t alloc_size = (sizeof(struct iccom_demux_stream)
+                                   + ICCOM_CACHE_LINE_SIZE - 1)
+                                  / ICCOM_CACHE_LINE_SIZE
+                                  * ICCOM_CACHE_LINE_SIZE;
+        struct iccom_demux_stream *const s = (struct iccom_demux_stream *)
+                        aligned_alloc(ICCOM_CACHE_LINE_SIZE, alloc_size);
+        if (!s) {
+                return -ENOMEM;
+        }
+        memset(s, 0, sizeof(*s));
+        int res = __iccom_rx_ring_init(&s->ring, size);
+        if (res < 0) {
+                free(s);
+                return res;
+        }
+        s->sub_id = sub_id;
+        s->demux = d;
+
+        pthread_mutex_lock(&d->lock);
+        const uint32_t i = iccom_demux_slot(d, sub_id);
+        if (d->table[i]) {
+                res = -EEXIST;
+        } else if (d->count == d->max_streams) {
+                res = -ENOSPC;
+        } else {
+                d->table[i] = s;
+                d->count++;
+        }
+        pthread_mutex_unlock(&d->lock);
+
+        if (res < 0) {
+                __iccom_rx_ring_destroy(&s->ring);
+                free(s);
+                return res;
+        }
+        *stream__out = s;
+        return 0;
+}
+
+// See iccom_mux.h
+void iccom_demux_close_stream(iccom_demux_stream *const s)
+{
+        if (!s) {
+                return;
+        }
+        struct iccom_demux *const d = s->demux;
+
+        pthread_mutex_lock(&d->lock);
+        const uint32_t i = iccom_demux_slot(d, s->sub_id);
+        if (d->table[i] == s) {
+                iccom_demux_table_remove(d, i);
+                d->count--;
+        }
+        pthread_mutex_unlock(&d->lock);
+
+        __iccom_rx_ring_destroy(&s->ring);
+        free(s);
+}
+
+// See iccom_mux.h
+int iccom_demux_stream_poll(iccom_demux_stream *const s
+                            , iccom_rx_message *const msg__out)
+{
+        return __iccom_rx_ring_poll(&s->ring, msg__out);
+}
+
+// See iccom_mux.h
+int iccom_demux_stream_wait(iccom_demux_stream *const s
+                            , iccom_rx_message *const msg__out
+                            , const int timeout_ms)
+{
+        return __iccom_rx_ring_wait(&s->ring, msg__out, timeout_ms);
+}
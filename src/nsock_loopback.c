@@ -0,0 +1,553 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the ICCom loopback emulation for the network
+ * sockets ICCom modification.
+ *
+ * While loopback is enabled, the process serves the TCP ports of both
+ * channel regions on the local host, and relays every frame written to
+ * the channel C connection to the channel C + range_shift connection
+ * and vice versa. Like with the kernel loopback, the frames sent while
+ * the other end is not connected are dropped.
+ *
+ * NOTE: the relay lives in the process which enabled the loopback, but
+ *      any local process can connect to the relayed channels.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <linux/netlink.h>
+
+#include "iccom.h"
+#include "utils.h"
+#include "threads.h"
+
+/* -------------------- BUILD TIME CONFIGURATION ----------------------- */
+
+// max channels in the looped back region
+#define ICCOM_NSOCK_LOOPBACK_MAX_CHANNELS 1024
+
+#define ICCOM_NSOCK_LOOPBACK_LISTEN_BACKLOG 16
+
+/* -------------------- MACRO DEFINITIONS ------------------------------ */
+
+#define ICCOM_NSOCK_LOOPBACK_FRAME_MAX                                       \
+        NLMSG_SPACE(ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES)
+
+// the epoll tag of the wake up eventfd
+#define ICCOM_NSOCK_LOOPBACK_WAKE_TAG 0xFFFFFFFFu
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+// The relayed channel end point, the end points [0; count) are the
+// local region channels, [count; 2 * count) - the remote region ones.
+//
+// @fd the accepted connection, -1 if not connected
+// @gen incremented on every connection change, used by the forwarder
+//      of the other end to refresh its cached peer descriptor
+struct iccom_lb_end {
+        int fd;
+        unsigned int gen;
+};
+
+// @lock protects all fields below
+// @cond signalled when the forwarders count drops and when the stop
+//      is done
+// @active !0 when loopback is enabled
+// @stopping !0 while the relay is being stopped (lb.lock is released
+//      then to join the acceptor)
+// @cfg the current loopback configuration
+// @count the number of channels in a region
+// @listen_fds IPv4 and IPv6 listening sockets per end point, -1 if none
+// @ends the end points
+// @epoll_fd the acceptor epoll
+// @wake_fd the eventfd to stop the acceptor
+// @acceptor the acceptor thread
+// @forwarders the number of running forwarder threads
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        int active;
+        int stopping;
+        loopback_cfg cfg;
+        unsigned int count;
+        int *listen_fds;
+        struct iccom_lb_end *ends;
+        int epoll_fd;
+        int wake_fd;
+        pthread_t acceptor;
+        unsigned int forwarders;
+} lb = {
+        .lock = PTHREAD_MUTEX_INITIALIZER
+        , .cond = PTHREAD_COND_INITIALIZER
+        , .active = 0
+        , .stopping = 0
+        , .count = 0
+        , .listen_fds = NULL
+        , .ends = NULL
+        , .epoll_fd = -1
+        , .wake_fd = -1
+        , .forwarders = 0
+};
+
+// @idx the end point index
+// @fd the end point connection
+struct iccom_lb_forwarder_arg {
+        unsigned int idx;
+        int fd;
+};
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+static unsigned int iccom_lb_peer(const unsigned int idx)
+{
+        return idx < lb.count ? idx + lb.count : idx - lb.count;
+}
+
+static unsigned int iccom_lb_port(const unsigned int idx)
+{
+        return idx < lb.count
+               ? lb.cfg.from_ch + idx
+               : (unsigned int)((int)(lb.cfg.from_ch + idx - lb.count)
+                                + lb.cfg.range_shift);
+}
+
+static int iccom_lb_write_all(const int fd, const char *data, size_t size)
+{
+        while (size > 0) {
+                const ssize_t res = write(fd, data, size);
+                if (res < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return -errno;
+                }
+                data += res;
+                size -= (size_t)res;
+        }
+        return 0;
+}
+
+// Reads the frames from the end point and writes whole frames to the
+// connection of the other end point, if it is connected.
+static void *iccom_lb_forwarder(void *arg)
+{
+        const struct iccom_lb_forwarder_arg fwd
+                = *(struct iccom_lb_forwarder_arg *)arg;
+        free(arg);
+        __iccom_thread_place(ICCOM_THREAD_LOOPBACK, -1);
+
+        static const size_t buf_size = 2 * ICCOM_NSOCK_LOOPBACK_FRAME_MAX;
+        char *const buf = (char *)malloc(buf_size);
+        size_t buffered = 0;
+        int peer_fd = -1;
+        unsigned int peer_gen = 0;
+
+        while (buf) {
+                const ssize_t len = read(fwd.fd, buf + buffered
+                                         , buf_size - buffered);
+                if (len < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (len <= 0) {
+                        break;
+                }
+                buffered += (size_t)len;
+
+                // framing: see iccom_send_data_nocopy(...)
+                size_t complete = 0;
+                int broken = 0;
+                while (buffered - complete >= sizeof(struct nlmsghdr)) {
+                        const struct nlmsghdr *const hdr
+                                = (const struct nlmsghdr *)(buf + complete);
+                        const size_t frame_size = NLMSG_SPACE(hdr->nlmsg_len);
+                        if (frame_size > ICCOM_NSOCK_LOOPBACK_FRAME_MAX) {
+                                broken = 1;
+                                break;
+                        }
+                        if (buffered - complete < frame_size) {
+                                break;
+                        }
+                        complete += frame_size;
+                }
+                if (broken) {
+                        log("broken framing on ch %u, dropping connection"
+                            , iccom_lb_port(fwd.idx));
+                        break;
+                }
+
+                pthread_mutex_lock(&lb.lock);
+                const struct iccom_lb_end *const peer
+                        = &lb.ends[iccom_lb_peer(fwd.idx)];
+                if (peer_gen != peer->gen) {
+                        if (peer_fd >= 0) {
+                                close(peer_fd);
+                        }
+                        peer_fd = peer->fd >= 0 ? dup(peer->fd) : -1;
+                        peer_gen = peer->gen;
+                }
+                pthread_mutex_unlock(&lb.lock);
+
+                if (complete && peer_fd >= 0) {
+                        // peer failures are peer forwarder business
+                        iccom_lb_write_all(peer_fd, buf, complete);
+                }
+
+                memmove(buf, buf + complete, buffered - complete);
+                buffered -= complete;
+        }
+
+        free(buf);
+        if (peer_fd >= 0) {
+                close(peer_fd);
+        }
+
+        pthread_mutex_lock(&lb.lock);
+        lb.ends[fwd.idx].fd = -1;
+        lb.ends[fwd.idx].gen++;
+        lb.forwarders--;
+        pthread_cond_broadcast(&lb.cond);
+        pthread_mutex_unlock(&lb.lock);
+
+        close(fwd.fd);
+        return NULL;
+}
+
+static void iccom_lb_accept(const unsigned int listen_idx)
+{
+        const unsigned int idx = listen_idx / 2;
+        const int fd = accept4(lb.listen_fds[listen_idx], NULL, NULL
+                               , SOCK_CLOEXEC);
+        if (fd < 0) {
+                return;
+        }
+
+        pthread_mutex_lock(&lb.lock);
+        if (lb.stopping) {
+                pthread_mutex_unlock(&lb.lock);
+                close(fd);
+                return;
+        }
+        if (lb.ends[idx].fd >= 0) {
+                pthread_mutex_unlock(&lb.lock);
+                log("ch %u is already connected, refusing the second"
+                    " connection", iccom_lb_port(idx));
+                close(fd);
+                return;
+        }
+
+        struct iccom_lb_forwarder_arg *const arg
+                = (struct iccom_lb_forwarder_arg *)malloc(sizeof(*arg));
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (arg) {
+                arg->idx = idx;
+                arg->fd = fd;
+        }
+        if (!arg || pthread_create(&thread, &attr, &iccom_lb_forwarder
+                                   , arg) != 0) {
+                pthread_attr_destroy(&attr);
+                pthread_mutex_unlock(&lb.lock);
+                log("could not start forwarder for ch %u", iccom_lb_port(idx));
+                free(arg);
+                close(fd);
+                return;
+        }
+        pthread_attr_destroy(&attr);
+
+        lb.ends[idx].fd = fd;
+        lb.ends[idx].gen++;
+        lb.forwarders++;
+        pthread_mutex_unlock(&lb.lock);
+}
+
+static void *iccom_lb_acceptor(void *arg)
+{
+        (void)arg;
+        __iccom_thread_place(ICCOM_THREAD_LOOPBACK, -1);
+        struct epoll_event events[16];
+        while (1) {
+                const int n = epoll_wait(lb.epoll_fd, events
+                                         , sizeof(events) / sizeof(events[0])
+                                         , -1);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        log("loopback acceptor failed: %d(%s)"
+                            , errno, strerror(errno));
+                        return NULL;
+                }
+                for (int i = 0; i < n; i++) {
+                        if (events[i].data.u32
+                                    == ICCOM_NSOCK_LOOPBACK_WAKE_TAG) {
+                                return NULL;
+                        }
+                        iccom_lb_accept(events[i].data.u32);
+                }
+        }
+}
+
+// Opens the listening socket for the end point on the loopback address.
+//
+// RETURNS:
+//      >=0: the listening socket
+//      <0: negated error code
+static int iccom_lb_listen(const unsigned int port, const int family)
+{
+        const int fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                return -errno;
+        }
+        const int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+        int res;
+        if (family == AF_INET) {
+                struct sockaddr_in addr;
+                memset(&addr, 0, sizeof(addr));
+                addr.sin_family = AF_INET;
+                addr.sin_port = htons((uint16_t)port);
+                addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                res = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+        } else {
+                struct sockaddr_in6 addr;
+                memset(&addr, 0, sizeof(addr));
+                addr.sin6_family = AF_INET6;
+                addr.sin6_port = htons((uint16_t)port);
+                addr.sin6_addr = in6addr_loopback;
+                setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+                res = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+        }
+        if (res < 0 || listen(fd, ICCOM_NSOCK_LOOPBACK_LISTEN_BACKLOG) < 0) {
+                const int err = errno;
+                close(fd);
+                return -err;
+        }
+        return fd;
+}
+
+// Releases all relay resources, lb.lock is to be held, the acceptor
+// is to be stopped already.
+static void iccom_lb_teardown(void)
+{
+        if (lb.ends) {
+                for (unsigned int i = 0; i < 2 * lb.count; i++) {
+                        if (lb.ends[i].fd >= 0) {
+                                shutdown(lb.ends[i].fd, SHUT_RDWR);
+                        }
+                }
+                while (lb.forwarders) {
+                        pthread_cond_wait(&lb.cond, &lb.lock);
+                }
+        }
+        if (lb.listen_fds) {
+                for (unsigned int i = 0; i < 4 * lb.count; i++) {
+                        if (lb.listen_fds[i] >= 0) {
+                                close(lb.listen_fds[i]);
+                        }
+                }
+        }
+        if (lb.epoll_fd >= 0) {
+                close(lb.epoll_fd);
+        }
+        if (lb.wake_fd >= 0) {
+                close(lb.wake_fd);
+        }
+        free(lb.listen_fds);
+        free(lb.ends);
+        lb.listen_fds = NULL;
+        lb.ends = NULL;
+        lb.epoll_fd = -1;
+        lb.wake_fd = -1;
+        lb.count = 0;
+        lb.active = 0;
+        memset(&lb.cfg, 0, sizeof(lb.cfg));
+}
+
+// Stops the acceptor thread and tears the relay down, lb.lock is
+// to be held, it is released while the acceptor is joined (the
+// acceptor takes it too).
+static void iccom_lb_stop(void)
+{
+        lb.stopping = 1;
+        const uint64_t one = 1;
+        if (write(lb.wake_fd, &one, sizeof(one)) != sizeof(one)) {
+                log("could not wake up the loopback acceptor");
+        }
+        pthread_mutex_unlock(&lb.lock);
+        pthread_join(lb.acceptor, NULL);
+        pthread_mutex_lock(&lb.lock);
+        iccom_lb_teardown();
+        lb.stopping = 0;
+        pthread_cond_broadcast(&lb.cond);
+}
+
+// Waits till the stop in progress (if any) is done, lb.lock is to be
+// held.
+static void iccom_lb_wait_stopped(void)
+{
+        while (lb.stopping) {
+                pthread_cond_wait(&lb.cond, &lb.lock);
+        }
+}
+
+// See iccom.h
+int iccom_loopback_enable(const unsigned int from_ch, const unsigned int to_ch
+                          , const int range_shift)
+{
+        if (to_ch < from_ch) {
+                log("to_ch (%d) must be > from_ch (%d)", to_ch, from_ch);
+                return -EINVAL;
+        }
+        if (to_ch - from_ch + 1 > ICCOM_NSOCK_LOOPBACK_MAX_CHANNELS) {
+                log("network loopback supports up to %d channels"
+                    , ICCOM_NSOCK_LOOPBACK_MAX_CHANNELS);
+                return -EINVAL;
+        }
+        if (((int)from_ch) < -range_shift) {
+                log("range_shift can not shift to the negative area");
+                return -EINVAL;
+        }
+        const unsigned int dst_from_ch = from_ch + range_shift;
+        const unsigned int dst_to_ch = to_ch + range_shift;
+        if (to_ch > 0xFFFF || dst_to_ch > 0xFFFF) {
+                log("network loopback channels must fit into TCP port range");
+                return -EINVAL;
+        }
+        if ((dst_from_ch <= to_ch) && (dst_to_ch >= from_ch)) {
+                log("range_shift should shift the channel region in such a way"
+                    " which avoids overlapping of original and resulting"
+                    " regions");
+                return -EINVAL;
+        }
+
+        pthread_mutex_lock(&lb.lock);
+
+        iccom_lb_wait_stopped();
+        if (lb.active) {
+                iccom_lb_stop();
+        }
+
+        lb.cfg.from_ch = from_ch;
+        lb.cfg.to_ch = to_ch;
+        lb.cfg.range_shift = range_shift;
+        lb.count = to_ch - from_ch + 1;
+
+        int ret_val = 0;
+        lb.listen_fds = (int *)malloc(4 * lb.count * sizeof(int));
+        lb.ends = (struct iccom_lb_end *)calloc(2 * lb.count
+                                                , sizeof(struct iccom_lb_end));
+        lb.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        lb.wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (!lb.listen_fds || !lb.ends || lb.epoll_fd < 0 || lb.wake_fd < 0) {
+                log("could not allocate network loopback resources");
+                ret_val = -ENOMEM;
+                goto fail;
+        }
+        for (unsigned int i = 0; i < 2 * lb.count; i++) {
+                lb.ends[i].fd = -1;
+                lb.listen_fds[2 * i] = -1;
+                lb.listen_fds[2 * i + 1] = -1;
+        }
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        for (unsigned int i = 0; i < 4 * lb.count; i++) {
+                const unsigned int port = iccom_lb_port(i / 2);
+                const int fd = iccom_lb_listen(port
+                                               , (i % 2) ? AF_INET6 : AF_INET);
+                if (fd < 0) {
+                        // IPv6 is optional
+                        if (i % 2) {
+                                continue;
+                        }
+                        log("could not listen on local port %u: %d(%s)"
+                            , port, -fd, strerror(-fd));
+                        ret_val = fd;
+                        goto fail;
+                }
+                lb.listen_fds[i] = fd;
+                ev.data.u32 = i;
+                if (epoll_ctl(lb.epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                        ret_val = -errno;
+                        goto fail;
+                }
+        }
+        ev.data.u32 = ICCOM_NSOCK_LOOPBACK_WAKE_TAG;
+        if (epoll_ctl(lb.epoll_fd, EPOLL_CTL_ADD, lb.wake_fd, &ev) < 0) {
+                ret_val = -errno;
+                goto fail;
+        }
+
+        if (pthread_create(&lb.acceptor, NULL, &iccom_lb_acceptor, NULL) != 0) {
+                log("could not start network loopback acceptor");
+                ret_val = -EAGAIN;
+                goto fail;
+        }
+
+        lb.active = 1;
+        pthread_mutex_unlock(&lb.lock);
+        return 0;
+
+fail:
+        iccom_lb_teardown();
+        pthread_mutex_unlock(&lb.lock);
+        return ret_val;
+}
+
+// See iccom.h
+int iccom_loopback_disable(void)
+{
+        pthread_mutex_lock(&lb.lock);
+        iccom_lb_wait_stopped();
+        if (lb.active) {
+                iccom_lb_stop();
+        }
+        pthread_mutex_unlock(&lb.lock);
+        return 0;
+}
+
+// See iccom.h
+char iccom_loopback_is_active(void)
+{
+        pthread_mutex_lock(&lb.lock);
+        const char active = lb.active ? 1 : 0;
+        pthread_mutex_unlock(&lb.lock);
+        return active;
+}
+
+// See iccom.h
+int iccom_loopback_get(loopback_cfg *const out)
+{
+        if (out == NULL) {
+                log("no output ptr is provided");
+                return -EINVAL;
+        }
+        pthread_mutex_lock(&lb.lock);
+        *out = lb.cfg;
+        pthread_mutex_unlock(&lb.lock);
+        return 0;
+}
@@ -233,9 +233,9 @@ static PyObject *iccom_socket_close_py(PyObject *self, PyObject *args)
 }
 
 // Wrapper around:
-//      int __iccom_receive_data_pure(const int sock_fd
-//                                    , void *const receive_buffer
-//                                    , const size_t buffer_size)
+//      int iccom_receive_data_alloc(const int sock_fd
+//                                   , void **const buf__out
+//                                   , int *const data_offset__out)
 static PyObject *iccom_receive_py(PyObject *self, PyObject *args)
 {
         int fd = 0;
@@ -244,13 +244,10 @@ static PyObject *iccom_receive_py(PyObject *self, PyObject *args)
                 return NULL;
         }
 
-        const unsigned int max_msg_size = iccom_get_max_payload_size();
-        const size_t buffer_size = iccom_get_required_buffer_size(max_msg_size);
-
-        char buff[buffer_size];
-
-        // TODO: not pure REPLACE WITH nocopy
-        int res = __iccom_receive_data_pure(fd, (void *)buff, buffer_size);
+        // the message sized buffer instead of the max size one
+        void *buff = NULL;
+        int data_offset = 0;
+        int res = iccom_receive_data_alloc(fd, &buff, &data_offset);
 
         // timeout
         if (res == 0) {
@@ -259,24 +256,21 @@ static PyObject *iccom_receive_py(PyObject *self, PyObject *args)
 
         // data
         if (res > 0) {
-                return PyByteArray_FromStringAndSize((const char *)buff, (Py_ssize_t)res);
+                PyObject *const data = PyByteArray_FromStringAndSize(
+                                (const char *)buff + data_offset
+                                , (Py_ssize_t)res);
+                iccom_free_received_buffer(buff);
+                return data;
         }
 
         // error
         char error_string[EBUF_LEN];
 
         switch(-res) {
-        case ENFILE:
-                snprintf(error_string, sizeof(error_string)
-                         , "incoming buffer size %zu is too small for netlink"
-                           " message (min size is %ld)"
-                         , buffer_size, iccom_get_required_buffer_size(0));
-                PyErr_SetString(PyExc_OverflowError, (const char*)error_string);
-                break;
-        case EINVAL:
+        case ENOMEM:
                 snprintf(error_string, sizeof(error_string)
-                         , "data offset output is not set");
-                PyErr_SetString(PyExc_ValueError, (const char*)error_string);
+                         , "could not allocate the message buffer");
+                PyErr_SetString(PyExc_MemoryError, (const char*)error_string);
                 break;
         case EPIPE:
                 snprintf(error_string, sizeof(error_string)
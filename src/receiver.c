@@ -0,0 +1,235 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the ICCom dedicated receiver, see
+ * iccom_receiver.h.
+ *
+ * The receiver thread is the producer of the SPSC rx ring (see ring.h),
+ * the receiver user is its consumer.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "iccom.h"
+#include "iccom_receiver.h"
+#include "utils.h"
+#include "ring.h"
+#include "threads.h"
+
+/* -------------------- BUILD TIME CONFIGURATION ----------------------- */
+
+#define ICCOM_RECEIVER_DEFAULT_RING_SIZE 1024
+#define ICCOM_RECEIVER_DEFAULT_STOP_LATENCY_MS 100
+
+// the producer sleep while the ring is full
+#define ICCOM_RECEIVER_FULL_SLEEP_NS 50000
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+// @ring the received messages ring
+// @sock the socket to receive from
+// @stop !0 when the receiver thread is to exit
+// @thread the receiver thread
+// @cpu the CPU to pin the thread to, <0 if none
+// @received, @ring_full_waits, @receive_errors the counters
+struct iccom_receiver {
+        struct iccom_rx_ring ring;
+        struct iccom_rx_socket sock;
+        _Atomic int stop;
+        pthread_t thread;
+        int cpu;
+        _Atomic uint64_t received;
+        _Atomic uint64_t ring_full_waits;
+        _Atomic uint64_t receive_errors;
+};
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+// Puts the message into the ring, waits for the consumer while the ring
+// is full.
+//
+// RETURNS:
+//      0: on success
+//      -ECANCELED: the receiver is stopped meanwhile
+static int iccom_receiver_push(struct iccom_receiver *const r
+                               , const iccom_rx_message *const msg)
+{
+        if (__iccom_rx_ring_push(&r->ring, msg)) {
+                return 0;
+        }
+        atomic_fetch_add_explicit(&r->ring_full_waits, 1
+                                  , memory_order_relaxed);
+        do {
+                if (atomic_load_explicit(&r->stop, memory_order_relaxed)) {
+                        return -ECANCELED;
+                }
+                __iccom_sleep_ns(ICCOM_RECEIVER_FULL_SLEEP_NS);
+        } while (!__iccom_rx_ring_push(&r->ring, msg));
+        return 0;
+}
+
+// The receiver thread.
+static void *iccom_receiver_loop(void *arg)
+{
+        struct iccom_receiver *const r = (struct iccom_receiver *)arg;
+
+        __iccom_thread_place(ICCOM_THREAD_RECEIVER, r->cpu);
+
+        while (!atomic_load_explicit(&r->stop, memory_order_relaxed)) {
+                iccom_rx_message msg;
+                const uint64_t start_ns = __iccom_now_ns();
+                const int res = iccom_receive_data_alloc(r->sock.fd, &msg.buf
+                                                         , &msg.data_offset);
+                if (res <= 0) {
+                        if (res < 0) {
+                                atomic_fetch_add_explicit(&r->receive_errors
+                                                , 1, memory_order_relaxed);
+                        }
+                        __iccom_rx_backoff(res, start_ns);
+                        continue;
+                }
+                msg.size = res;
+                msg.rx_time_ns = __iccom_now_ns();
+                atomic_fetch_add_explicit(&r->received, 1
+                                          , memory_order_relaxed);
+                if (iccom_receiver_push(r, &msg) < 0) {
+                        iccom_free_received_buffer(msg.buf);
+                        break;
+                }
+        }
+        return NULL;
+}
+
+// See iccom_receiver.h
+int iccom_receiver_start(const iccom_receiver_cfg *const cfg
+                         , iccom_receiver **const receiver__out)
+{
+        if (!cfg || !receiver__out) {
+                log("no configuration or output ptr is provided");
+                return -EINVAL;
+        }
+        const unsigned int ring_size = cfg->ring_size
+                                       ? cfg->ring_size
+                                       : ICCOM_RECEIVER_DEFAULT_RING_SIZE;
+        if (ring_size & (ring_size - 1)) {
+                log("The ring size %u is not a power of two", ring_size);
+                return -EINVAL;
+        }
+
+        const size_t size = (sizeof(struct iccom_receiver)
+                             + ICCOM_CACHE_LINE_SIZE - 1)
+                            / ICCOM_CACHE_LINE_SIZE * ICCOM_CACHE_LINE_SIZE;
+        struct iccom_receiver *const r = (struct iccom_receiver *)
+                        aligned_alloc(ICCOM_CACHE_LINE_SIZE, size);
+        if (!r) {
+                return -ENOMEM;
+        }
+        memset(r, 0, sizeof(*r));
+        int res = __iccom_rx_ring_init(&r->ring, ring_size);
+        if (res < 0) {
+                free(r);
+                return res;
+        }
+        r->cpu = cfg->cpu;
+
+        res = __iccom_rx_socket_take(cfg->channel, cfg->sock_fd
+                        , cfg->stop_latency_ms
+                          ? (int)cfg->stop_latency_ms
+                          : ICCOM_RECEIVER_DEFAULT_STOP_LATENCY_MS
+                        , &r->sock);
+        if (res < 0) {
+                goto free_receiver;
+        }
+
+        res = -pthread_create(&r->thread, NULL, iccom_receiver_loop, r);
+        if (res < 0) {
+                log("Could not start the receiver thread: %d(%s)"
+                    , -res, strerror(-res));
+                goto close_socket;
+        }
+
+        *receiver__out = r;
+        return 0;
+
+close_socket:
+        __iccom_rx_socket_release(&r->sock);
+free_receiver:
+        __iccom_rx_ring_destroy(&r->ring);
+        free(r);
+        return res;
+}
+
+// See iccom_receiver.h
+void iccom_receiver_stop(iccom_receiver *const r)
+{
+        if (!r) {
+                return;
+        }
+        atomic_store_explicit(&r->stop, 1, memory_order_relaxed);
+        pthread_join(r->thread, NULL);
+
+        __iccom_rx_socket_release(&r->sock);
+        __iccom_rx_ring_destroy(&r->ring);
+        free(r);
+}
+
+// See iccom_receiver.h
+int iccom_receiver_poll(iccom_receiver *const r
+                        , iccom_rx_message *const msg__out)
+{
+        return __iccom_rx_ring_poll(&r->ring, msg__out);
+}
+
+// See iccom_receiver.h
+int iccom_receiver_wait(iccom_receiver *const r
+                        , iccom_rx_message *const msg__out
+                        , const int timeout_ms)
+{
+        return __iccom_rx_ring_wait(&r->ring, msg__out, timeout_ms);
+}
+
+// See iccom_receiver.h
+int iccom_receiver_get_stats(const iccom_receiver *const r
+                             , iccom_receiver_stats *const out)
+{
+        if (!r || !out) {
+                log("no receiver or output ptr is provided");
+                return -EINVAL;
+        }
+        out->received = atomic_load_explicit(&r->received
+                                             , memory_order_relaxed);
+        out->ring_full_waits = atomic_load_explicit(&r->ring_full_waits
+                                                    , memory_order_relaxed);
+        out->receive_errors = atomic_load_explicit(&r->receive_errors
+                                                   , memory_order_relaxed);
+        return 0;
+}
+
+// See iccom_receiver.h
+void iccom_rx_message_free(iccom_rx_message *const msg)
+{
+        if (!msg) {
+                return;
+        }
+        iccom_free_received_buffer(msg->buf);
+        memset(msg, 0, sizeof(*msg));
+}
@@ -0,0 +1,396 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the ICCom recorded traffic replay engine,
+ * common for all ICCom modifications. See iccom.h for the IF
+ * description.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "iccom.h"
+#include "utils.h"
+
+/* -------------------- MACRO DEFINITIONS ------------------------------ */
+
+#define ICCOM_REPLAY_CHANNELS_COUNT                                          \
+        (2 * (ICCOM_MAX_CHANNEL - ICCOM_MIN_CHANNEL + 1))
+
+#define ICCOM_REPLAY_BUF_SIZE                                                \
+        NLMSG_SPACE(ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES)
+
+// the channel socket was not opened yet
+#define ICCOM_REPLAY_FD_NONE (-1)
+// the channel socket failed to open, not to retry
+#define ICCOM_REPLAY_FD_FAILED (-2)
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+// @ts_ns the record timestamp
+// @offset the record offset in the traffic file
+struct iccom_replay_index_entry {
+        uint64_t ts_ns;
+        size_t offset;
+};
+
+// @cfg the replay configuration
+// @stats the replay results being gathered
+// @batch_size the effective batch size
+// @fds the per channel sockets
+// @bufs the batch_size message buffers
+// @items the batch being collected
+// @pending number of messages in the batch
+// @pending_fd the socket the batch is collected for
+struct iccom_replay_ctx {
+        const iccom_replay_cfg *cfg;
+        iccom_replay_stats *stats;
+        unsigned int batch_size;
+        int *fds;
+        char *bufs;
+        iccom_send_batch_item *items;
+        size_t pending;
+        int pending_fd;
+};
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+static void iccom_replay_sleep_until(const uint64_t deadline_ns)
+{
+        const struct timespec ts = {
+                .tv_sec = (time_t)(deadline_ns / 1000000000ull)
+                , .tv_nsec = (long)(deadline_ns % 1000000000ull)
+        };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+                        == EINTR) {
+        }
+}
+
+// RETURNS:
+//      >=0: the socket for the channel (opened on first use)
+//      <0: the channel socket could not be opened
+static int iccom_replay_fd(struct iccom_replay_ctx *const ctx
+                           , const unsigned int channel)
+{
+        int *const fd = &ctx->fds[channel];
+        if (*fd == ICCOM_REPLAY_FD_NONE) {
+                const int res = iccom_open_socket(channel);
+                if (res < 0) {
+                        log("could not open channel %u, its frames"
+                            " will be skipped", channel);
+                }
+                *fd = res < 0 ? ICCOM_REPLAY_FD_FAILED : res;
+        }
+        return *fd;
+}
+
+// Sends the collected batch, a failed message is accounted and
+// skipped, the rest of the batch is still sent.
+static void iccom_replay_flush(struct iccom_replay_ctx *const ctx)
+{
+        size_t done = 0;
+        while (done < ctx->pending) {
+                const int res = iccom_send_data_batch_nocopy(
+                                ctx->pending_fd, ctx->items + done
+                                , ctx->pending - done);
+                if (res < 0) {
+                        ctx->stats->send_errors++;
+                        done++;
+                        continue;
+                }
+                for (size_t i = done; i < done + (size_t)res; i++) {
+                        ctx->stats->frames_sent++;
+                        ctx->stats->bytes_sent += ctx->items[i].data_size_bytes;
+                }
+                done += (size_t)res;
+        }
+        ctx->pending = 0;
+}
+
+// Replays a single record.
+//
+// @rec {valid record} the record to replay
+// @first_ts_ns the timestamp of the first replayed record
+// @start_ns the replay start time
+static void iccom_replay_record(struct iccom_replay_ctx *const ctx
+                , const iccom_capture_record_header *const rec
+                , const uint64_t first_ts_ns, const uint64_t start_ns)
+{
+        const iccom_replay_cfg *const cfg = ctx->cfg;
+
+        const long long channel = (long long)rec->channel + cfg->channel_shift;
+        if (rec->channel == ICCOM_CAPTURE_CHANNEL_UNKNOWN
+                    || channel < 0 || channel >= ICCOM_REPLAY_CHANNELS_COUNT
+                    || rec->orig_size == 0
+                    || rec->orig_size > ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES
+                    || rec->cap_size > rec->orig_size) {
+                ctx->stats->frames_skipped++;
+                return;
+        }
+        const int fd = iccom_replay_fd(ctx, (unsigned int)channel);
+        if (fd < 0) {
+                ctx->stats->frames_skipped++;
+                return;
+        }
+
+        if (cfg->timing == ICCOM_REPLAY_TIMING_ORIGINAL) {
+                // NOTE: the records are replayed in the timestamp order,
+                //      so the first one is the oldest
+                const uint64_t due = start_ns
+                                + (uint64_t)((double)(rec->timestamp_ns
+                                                      - first_ts_ns)
+                                             / cfg->speed);
+                const uint64_t now = __iccom_now_ns();
+                if (now < due) {
+                        iccom_replay_sleep_until(due);
+                } else if (now - due > ctx->stats->max_lag_ns) {
+                        ctx->stats->max_lag_ns = now - due;
+                }
+        } else if (ctx->pending && ctx->pending_fd != fd) {
+                iccom_replay_flush(ctx);
+        }
+
+        char *const buf = ctx->bufs + ctx->pending * ICCOM_REPLAY_BUF_SIZE;
+        char *const data = buf + iccom_get_data_payload_offset();
+        memcpy(data, rec + 1, rec->cap_size);
+        if (rec->cap_size < rec->orig_size) {
+                memset(data + rec->cap_size, 0
+                       , rec->orig_size - rec->cap_size);
+                ctx->stats->frames_padded++;
+        }
+
+        iccom_send_batch_item *const item = &ctx->items[ctx->pending];
+        item->buf = buf;
+        item->buf_size_bytes = iccom_get_required_buffer_size(rec->orig_size);
+        item->data_size_bytes = rec->orig_size;
+        ctx->pending++;
+        ctx->pending_fd = fd;
+
+        if (cfg->timing == ICCOM_REPLAY_TIMING_ORIGINAL
+                    || ctx->pending == ctx->batch_size) {
+                iccom_replay_flush(ctx);
+        }
+}
+
+// Orders the index by the timestamp, the equal ones by the file offset.
+static int iccom_replay_index_cmp(const void *const a, const void *const b)
+{
+        const struct iccom_replay_index_entry *const x
+                        = (const struct iccom_replay_index_entry *)a;
+        const struct iccom_replay_index_entry *const y
+                        = (const struct iccom_replay_index_entry *)b;
+        if (x->ts_ns != y->ts_ns) {
+                return x->ts_ns < y->ts_ns ? -1 : 1;
+        }
+        return x->offset < y->offset ? -1 : (x->offset > y->offset);
+}
+
+// Indexes the records of the mapped traffic file in the timestamp
+// order: the file order is not the time order, the flight recorder
+// dump stores the per channel rings one after another and the capture
+// stamps the records after the slot reservation.
+//
+// @index__out where to write the malloc'ed index to (NULL if the file
+//      has no records)
+//
+// RETURNS:
+//      >=0: the number of the indexed records
+//      <0: negated error code
+static long iccom_replay_index(const char *const base, const size_t end
+                , const size_t begin
+                , struct iccom_replay_index_entry **const index__out)
+{
+        *index__out = NULL;
+        long count = 0;
+        size_t capacity = 0;
+        size_t offset = begin;
+        while (offset + sizeof(iccom_capture_record_header) <= end) {
+                const iccom_capture_record_header *const rec
+                        = (const iccom_capture_record_header *)(base + offset);
+                if (rec->record_size < sizeof(*rec)
+                            || rec->record_size > end - offset
+                            || rec->cap_size > rec->record_size - sizeof(*rec)) {
+                        break;
+                }
+                if ((size_t)count == capacity) {
+                        capacity = capacity ? 2 * capacity : 1024;
+                        struct iccom_replay_index_entry *const index
+                                = (struct iccom_replay_index_entry *)realloc(
+                                        *index__out
+                                        , capacity * sizeof(**index__out));
+                        if (!index) {
+                                free(*index__out);
+                                *index__out = NULL;
+                                return -ENOMEM;
+                        }
+                        *index__out = index;
+                }
+                (*index__out)[count].ts_ns = rec->timestamp_ns;
+                (*index__out)[count].offset = offset;
+                count++;
+                offset += rec->record_size;
+        }
+        if (count > 1) {
+                qsort(*index__out, (size_t)count, sizeof(**index__out)
+                      , iccom_replay_index_cmp);
+        }
+        return count;
+}
+
+// Replays the indexed records of the mapped traffic file once.
+static void iccom_replay_pass(struct iccom_replay_ctx *const ctx
+                , const char *const base
+                , const struct iccom_replay_index_entry *const index
+                , const long count)
+{
+        const unsigned int directions = ctx->cfg->directions
+                                        ? ctx->cfg->directions : ~0u;
+        const uint64_t start_ns = __iccom_now_ns();
+        uint64_t first_ts_ns = 0;
+        int first = 1;
+
+        for (long i = 0; i < count; i++) {
+                const iccom_capture_record_header *const rec
+                        = (const iccom_capture_record_header *)
+                                        (base + index[i].offset);
+                if (rec->direction >= 32
+                            || !(directions
+                                 & ICCOM_REPLAY_DIR_MASK(rec->direction))) {
+                        ctx->stats->frames_skipped++;
+                        continue;
+                }
+                if (first) {
+                        first_ts_ns = rec->timestamp_ns;
+                        first = 0;
+                }
+                iccom_replay_record(ctx, rec, first_ts_ns, start_ns);
+        }
+        iccom_replay_flush(ctx);
+}
+
+// See iccom.h
+int iccom_replay_run(const iccom_replay_cfg *const cfg
+                     , iccom_replay_stats *const stats)
+{
+        if (!cfg || !cfg->path) {
+                log("no replay configuration or file path provided");
+                return -EINVAL;
+        }
+        if (cfg->timing != ICCOM_REPLAY_TIMING_ORIGINAL
+                    && cfg->timing != ICCOM_REPLAY_TIMING_MAX_SPEED) {
+                log("unknown timing mode: %d", cfg->timing);
+                return -EINVAL;
+        }
+        if (cfg->timing == ICCOM_REPLAY_TIMING_ORIGINAL && !(cfg->speed > 0)) {
+                log("speed must be > 0");
+                return -EINVAL;
+        }
+
+        iccom_replay_stats local_stats;
+        struct iccom_replay_ctx ctx;
+        memset(&ctx, 0, sizeof(ctx));
+        ctx.cfg = cfg;
+        ctx.stats = stats ? stats : &local_stats;
+        ctx.batch_size = (cfg->timing == ICCOM_REPLAY_TIMING_ORIGINAL
+                          || cfg->batch_size == 0) ? 1 : cfg->batch_size;
+        memset(ctx.stats, 0, sizeof(*ctx.stats));
+
+        const int file_fd = open(cfg->path, O_RDONLY);
+        if (file_fd < 0) {
+                const int err = errno;
+                log("could not open %s: %d(%s)", cfg->path, err, strerror(err));
+                return -err;
+        }
+        struct stat st;
+        if (fstat(file_fd, &st) < 0
+                    || (size_t)st.st_size < sizeof(iccom_capture_file_header)) {
+                log("%s is not a capture file (too small)", cfg->path);
+                close(file_fd);
+                return -EINVAL;
+        }
+        const size_t file_size = (size_t)st.st_size;
+        const char *const base = (const char *)mmap(NULL, file_size, PROT_READ
+                                                    , MAP_PRIVATE, file_fd, 0);
+        close(file_fd);
+        if (base == MAP_FAILED) {
+                const int err = errno;
+                log("could not map %s: %d(%s)", cfg->path, err, strerror(err));
+                return -err;
+        }
+
+        int ret_val = 0;
+        const iccom_capture_file_header *const hdr
+                = (const iccom_capture_file_header *)base;
+        if (hdr->magic != ICCOM_CAPTURE_MAGIC
+                    || hdr->version != ICCOM_CAPTURE_VERSION
+                    || hdr->header_size < sizeof(*hdr)
+                    || hdr->header_size > file_size) {
+                log("%s is not a supported capture file", cfg->path);
+                ret_val = -EINVAL;
+                goto unmap;
+        }
+        // NOTE: used_bytes == 0 for captures which were not closed
+        //      properly, then the records are walked till the end mark
+        const size_t end = (hdr->used_bytes && hdr->used_bytes < file_size)
+                           ? (size_t)hdr->used_bytes : file_size;
+
+        struct iccom_replay_index_entry *index;
+        const long count = iccom_replay_index(base, end, hdr->header_size
+                                              , &index);
+        if (count < 0) {
+                log("could not allocate the replay index");
+                ret_val = (int)count;
+                goto unmap;
+        }
+
+        ctx.fds = (int *)malloc(ICCOM_REPLAY_CHANNELS_COUNT * sizeof(int));
+        ctx.bufs = (char *)malloc(ctx.batch_size * ICCOM_REPLAY_BUF_SIZE);
+        ctx.items = (iccom_send_batch_item *)malloc(
+                        ctx.batch_size * sizeof(iccom_send_batch_item));
+        if (!ctx.fds || !ctx.bufs || !ctx.items) {
+                log("could not allocate replay buffers");
+                ret_val = -ENOMEM;
+                goto free;
+        }
+        for (unsigned int i = 0; i < ICCOM_REPLAY_CHANNELS_COUNT; i++) {
+                ctx.fds[i] = ICCOM_REPLAY_FD_NONE;
+        }
+
+        const uint64_t start_ns = __iccom_now_ns();
+        const unsigned int loops = cfg->loops ? cfg->loops : 1;
+        for (unsigned int i = 0; i < loops; i++) {
+                iccom_replay_pass(&ctx, base, index, count);
+        }
+        ctx.stats->duration_ns = __iccom_now_ns() - start_ns;
+
+        for (unsigned int i = 0; i < ICCOM_REPLAY_CHANNELS_COUNT; i++) {
+                if (ctx.fds[i] >= 0) {
+                        iccom_close_socket(ctx.fds[i]);
+                }
+        }
+
+free:
+        free(ctx.items);
+        free(ctx.bufs);
+        free(ctx.fds);
+        free(index);
+unmap:
+        munmap((void *)base, file_size);
+        return ret_val;
+}
@@ -0,0 +1,164 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the lock free queue building blocks of the
+ * library threads, see ring.h.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "iccom.h"
+#include "iccom_receiver.h"
+#include "utils.h"
+#include "ring.h"
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+// The @__iccom_rx_ring_wait context.
+struct iccom_rx_ring_take {
+        struct iccom_rx_ring *ring;
+        iccom_rx_message *msg__out;
+};
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+// The condition waits on CLOCK_MONOTONIC, so the wait timeouts are not
+// affected by the wall clock changes.
+void __iccom_waiter_init(struct iccom_waiter *const w)
+{
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&w->cond, &attr);
+        pthread_condattr_destroy(&attr);
+        pthread_mutex_init(&w->lock, NULL);
+        atomic_init(&w->sleepers, 0);
+}
+
+void __iccom_waiter_destroy(struct iccom_waiter *const w)
+{
+        pthread_cond_destroy(&w->cond);
+        pthread_mutex_destroy(&w->lock);
+}
+
+// The @__iccom_waiter_wake part which runs only when somebody sleeps.
+void __iccom_waiter_wake_slow(struct iccom_waiter *const w, const int all)
+{
+        pthread_mutex_lock(&w->lock);
+        if (all) {
+                pthread_cond_broadcast(&w->cond);
+        } else {
+                pthread_cond_signal(&w->cond);
+        }
+        pthread_mutex_unlock(&w->lock);
+}
+
+// Sleeps till @ready(@ctx) returns !0 (it is called under the waiter
+// lock) or the timeout expires.
+//
+// @timeout_ms the max wait, <0 - no limit
+//
+// RETURNS: the last @ready result, so 0 on timeout
+int __iccom_waiter_wait(struct iccom_waiter *const w
+                        , const iccom_waiter_ready ready, void *const ctx
+                        , const int timeout_ms)
+{
+        struct timespec deadline;
+        if (timeout_ms >= 0) {
+                clock_gettime(CLOCK_MONOTONIC, &deadline);
+                deadline.tv_sec += timeout_ms / 1000;
+                deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+                if (deadline.tv_nsec >= 1000000000) {
+                        deadline.tv_sec++;
+                        deadline.tv_nsec -= 1000000000;
+                }
+        }
+
+        int res;
+        pthread_mutex_lock(&w->lock);
+        atomic_fetch_add_explicit(&w->sleepers, 1, memory_order_relaxed);
+        // pairs with the fence in @__iccom_waiter_wake
+        atomic_thread_fence(memory_order_seq_cst);
+        while (!(res = ready(ctx))) {
+                const int wait_res = (timeout_ms >= 0)
+                                ? pthread_cond_timedwait(&w->cond, &w->lock
+                                                         , &deadline)
+                                : pthread_cond_wait(&w->cond, &w->lock);
+                if (wait_res == ETIMEDOUT) {
+                        res = ready(ctx);
+                        break;
+                }
+        }
+        atomic_fetch_sub_explicit(&w->sleepers, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&w->lock);
+        return res;
+}
+
+// Allocates the ring slots.
+//
+// @ring {zero initialized}
+// @size {power of two} the ring size in messages
+//
+// RETURNS:
+//      0: on success
+//      -ENOMEM: no memory
+int __iccom_rx_ring_init(struct iccom_rx_ring *const ring
+                         , const unsigned int size)
+{
+        ring->slots = (iccom_rx_message *)calloc(size
+                                                 , sizeof(ring->slots[0]));
+        if (!ring->slots) {
+                return -ENOMEM;
+        }
+        ring->mask = size - 1;
+        __iccom_waiter_init(&ring->consumer);
+        return 0;
+}
+
+// Frees the ring together with the messages left in it.
+void __iccom_rx_ring_destroy(struct iccom_rx_ring *const ring)
+{
+        iccom_rx_message msg;
+        while (__iccom_rx_ring_poll(ring, &msg)) {
+                iccom_rx_message_free(&msg);
+        }
+        __iccom_waiter_destroy(&ring->consumer);
+        free(ring->slots);
+        ring->slots = NULL;
+}
+
+static int iccom_rx_ring_take(void *const ctx)
+{
+        struct iccom_rx_ring_take *const t = (struct iccom_rx_ring_take *)ctx;
+        return __iccom_rx_ring_poll(t->ring, t->msg__out);
+}
+
+// Takes the message from the ring, waits up to @timeout_ms (<0 - no
+// limit) for it if the ring is empty.
+//
+// RETURNS: !0 if the message is taken, 0 on timeout
+int __iccom_rx_ring_wait(struct iccom_rx_ring *const ring
+                         , iccom_rx_message *const msg__out
+                         , const int timeout_ms)
+{
+        if (__iccom_rx_ring_poll(ring, msg__out)) {
+                return 1;
+        }
+        struct iccom_rx_ring_take take = { ring, msg__out };
+        return __iccom_waiter_wait(&ring->consumer, iccom_rx_ring_take
+                                   , &take, timeout_ms);
+}
@@ -0,0 +1,149 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+// The lock free queue building blocks of the library threads.
+//
+// The waiter is the sleep/wake handshake of the queue side which
+// blocks: the waiting side announces its sleep, then rechecks the queue
+// and sleeps on the condition; the other side publishes its change,
+// then wakes the sleepers if any. The full fence on both sides makes
+// either the sleeper see the change or the waker see the sleeper, so no
+// wakeup is lost, and the waker takes no lock while nobody sleeps.
+//
+// The rx ring is the single producer single consumer ring of the
+// received messages. Its indices are free running counters, the
+// producer owns the tail, the consumer owns the head, each side keeps
+// the cached copy of the other side index to touch the shared cache
+// line only when the cached one says the ring is full/empty. The
+// producer and consumer indices live on separate cache lines.
+
+#ifndef LIBICCOM_RING_H
+#define LIBICCOM_RING_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "iccom_receiver.h"
+#include "utils.h"
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+// @sleepers the number of threads sleeping or going to sleep
+// @lock, @cond the sleep, @cond waits on CLOCK_MONOTONIC
+struct iccom_waiter {
+        _Atomic unsigned int sleepers;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+};
+
+// RETURNS: !0 when the waited condition is met
+typedef int (*iccom_waiter_ready)(void *const ctx);
+
+// @tail the producer index (next slot to fill)
+// @head_cache the producer copy of the @head
+// @head the consumer index (next slot to take)
+// @tail_cache the consumer copy of the @tail
+// @consumer the consumer blocking wait
+// @slots the ring slots
+// @mask the ring size - 1
+struct iccom_rx_ring {
+        _Alignas(ICCOM_CACHE_LINE_SIZE) _Atomic uint64_t tail;
+        uint64_t head_cache;
+
+        _Alignas(ICCOM_CACHE_LINE_SIZE) _Atomic uint64_t head;
+        uint64_t tail_cache;
+
+        _Alignas(ICCOM_CACHE_LINE_SIZE) struct iccom_waiter consumer;
+
+        _Alignas(ICCOM_CACHE_LINE_SIZE) iccom_rx_message *slots;
+        uint64_t mask;
+};
+
+/* -------------------- ROUTINES DECLARATIONS -------------------------- */
+
+void __iccom_waiter_init(struct iccom_waiter *const w);
+void __iccom_waiter_destroy(struct iccom_waiter *const w);
+void __iccom_waiter_wake_slow(struct iccom_waiter *const w, const int all);
+int __iccom_waiter_wait(struct iccom_waiter *const w
+                        , const iccom_waiter_ready ready, void *const ctx
+                        , const int timeout_ms);
+
+int __iccom_rx_ring_init(struct iccom_rx_ring *const ring
+                         , const unsigned int size);
+void __iccom_rx_ring_destroy(struct iccom_rx_ring *const ring);
+int __iccom_rx_ring_wait(struct iccom_rx_ring *const ring
+                         , iccom_rx_message *const msg__out
+                         , const int timeout_ms);
+
+// Wakes up the sleepers (one of them if !@all), to be called after the
+// change the sleepers wait for is published.
+static inline void __iccom_waiter_wake(struct iccom_waiter *const w
+                                       , const int all)
+{
+        // pairs with the fence in @__iccom_waiter_wait
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&w->sleepers, memory_order_relaxed)) {
+                __iccom_waiter_wake_slow(w, all);
+        }
+}
+
+// RETURNS: !0 if the ring is full (the producer side)
+static inline int __iccom_rx_ring_full(struct iccom_rx_ring *const ring)
+{
+        const uint64_t tail = atomic_load_explicit(&ring->tail
+                                                   , memory_order_relaxed);
+        if (tail - ring->head_cache > ring->mask) {
+                ring->head_cache = atomic_load_explicit(&ring->head
+                                                , memory_order_acquire);
+        }
+        return tail - ring->head_cache > ring->mask;
+}
+
+// Puts the message into the ring and wakes up the consumer.
+//
+// RETURNS: !0 if the message is queued, 0 if the ring is full
+static inline int __iccom_rx_ring_push(struct iccom_rx_ring *const ring
+                                       , const iccom_rx_message *const msg)
+{
+        if (__iccom_rx_ring_full(ring)) {
+                return 0;
+        }
+        const uint64_t tail = atomic_load_explicit(&ring->tail
+                                                   , memory_order_relaxed);
+        ring->slots[tail & ring->mask] = *msg;
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+        __iccom_waiter_wake(&ring->consumer, 0);
+        return 1;
+}
+
+// Takes the message from the ring without waiting.
+//
+// RETURNS: !0 if the message is taken, 0 if the ring is empty
+static inline int __iccom_rx_ring_poll(struct iccom_rx_ring *const ring
+                                       , iccom_rx_message *const msg__out)
+{
+        const uint64_t head = atomic_load_explicit(&ring->head
+                                                   , memory_order_relaxed);
+        if (head == ring->tail_cache) {
+                ring->tail_cache = atomic_load_explicit(&ring->tail
+                                                , memory_order_acquire);
+                if (head == ring->tail_cache) {
+                        return 0;
+                }
+        }
+        *msg__out = ring->slots[head & ring->mask];
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+        return 1;
+}
+
+#endif //ifndef LIBICCOM_RING_H
@@ -0,0 +1,411 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the ICCom message type router, see iccom_router.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+
+#include "iccom.h"
+#include "iccom_router.h"
+#include "utils.h"
+
+/* -------------------- BUILD TIME CONFIGURATION ----------------------- */
+
+#define ICCOM_ROUTER_DEFAULT_DENSE_IDS 256
+#define ICCOM_ROUTER_INITIAL_SPARSE_SLOTS 16
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+// The route.
+//
+// @handler the handler, NULL - no route
+// @ctx the handler context
+// @messages, @bytes the counters, written only by the dispatching
+//      thread (so plain relaxed load + store, no atomic RMW)
+struct iccom_route {
+        iccom_route_handler handler;
+        void *ctx;
+        _Atomic uint64_t messages;
+        _Atomic uint64_t bytes;
+};
+
+// The sparse table slot.
+//
+// @used !0 if the slot keeps the id (the route removal keeps the slot,
+//      just clears the handler)
+// @id the message id
+// @route the id route
+struct iccom_sparse_route {
+        int used;
+        uint32_t id;
+        struct iccom_route route;
+};
+
+// @cfg the router configuration (defaults applied)
+// @id_limit the max id + 1 representable by the id width
+// @dense the direct table, @cfg.dense_ids routes
+// @sparse the sparse routes hash table
+// @sparse_mask the sparse table size - 1
+// @sparse_used the number of the used sparse table slots
+// @default_route the default route (its counters are not used)
+// @routed, @unrouted, @malformed the counters
+// @rx_buf the buffer of @iccom_router_receive, @rx_buf_size bytes
+struct iccom_router {
+        iccom_router_cfg cfg;
+        uint64_t id_limit;
+        struct iccom_route *dense;
+        struct iccom_sparse_route *sparse;
+        uint32_t sparse_mask;
+        uint32_t sparse_used;
+        struct iccom_route default_route;
+        _Atomic uint64_t routed;
+        _Atomic uint64_t unrouted;
+        _Atomic uint64_t malformed;
+        char *rx_buf;
+        size_t rx_buf_size;
+};
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+// Single writer counter increment.
+static inline void iccom_router_count(_Atomic uint64_t *const counter
+                                      , const uint64_t value)
+{
+        atomic_store_explicit(counter
+                        , atomic_load_explicit(counter, memory_order_relaxed)
+                          + value
+                        , memory_order_relaxed);
+}
+
+static inline uint32_t iccom_router_home(const uint32_t id
+                                         , const uint32_t mask)
+{
+        return (id * 2654435761u) & mask;
+}
+
+// RETURNS: the sparse slot of the id or the free slot where it would be
+static struct iccom_sparse_route *iccom_router_sparse_slot(
+                struct iccom_sparse_route *const table, const uint32_t mask
+                , const uint32_t id)
+{
+        uint32_t i = iccom_router_home(id, mask);
+        while (table[i].used && table[i].id != id) {
+                i = (i + 1) & mask;
+        }
+        return &table[i];
+}
+
+// Doubles the sparse table.
+static int iccom_router_sparse_grow(struct iccom_router *const router)
+{
+        const uint32_t old_size = router->sparse ? router->sparse_mask + 1 : 0;
+        const uint32_t size = old_size ? 2 * old_size
+                                       : ICCOM_ROUTER_INITIAL_SPARSE_SLOTS;
+        struct iccom_sparse_route *const table = (struct iccom_sparse_route *)
+                        calloc(size, sizeof(table[0]));
+        if (!table) {
+                return -ENOMEM;
+        }
+        for (uint32_t i = 0; i < old_size; i++) {
+                const struct iccom_sparse_route *const old
+                                = &router->sparse[i];
+                if (!old->used) {
+                        continue;
+                }
+                struct iccom_sparse_route *const slot
+                                = iccom_router_sparse_slot(table, size - 1
+                                                           , old->id);
+                slot->used = 1;
+                slot->id = old->id;
+                slot->route.handler = old->route.handler;
+                slot->route.ctx = old->route.ctx;
+                atomic_init(&slot->route.messages, atomic_load_explicit(
+                                &old->route.messages, memory_order_relaxed));
+                atomic_init(&slot->route.bytes, atomic_load_explicit(
+                                &old->route.bytes, memory_order_relaxed));
+        }
+        free(router->sparse);
+        router->sparse = table;
+        router->sparse_mask = size - 1;
+        return 0;
+}
+
+// RETURNS: the route of the id, NULL if the id was never routed
+static inline struct iccom_route *iccom_router_find(
+                const struct iccom_router *const router, const uint32_t id)
+{
+        if (id < router->cfg.dense_ids) {
+                return &router->dense[id];
+        }
+        if (!router->sparse) {
+                return NULL;
+        }
+        struct iccom_sparse_route *const slot = iccom_router_sparse_slot(
+                        router->sparse, router->sparse_mask, id);
+        return slot->used ? &slot->route : NULL;
+}
+
+// RETURNS: the message id
+//
+// NOTE: the message is expected to contain the id
+static inline uint32_t iccom_router_read_id(
+                const struct iccom_router *const router
+                , const uint8_t *const payload)
+{
+        const iccom_router_cfg *const cfg = &router->cfg;
+        const uint8_t *const p = payload + cfg->id_offset;
+        switch (cfg->id_width) {
+        case 1:
+                return p[0];
+        case 2: {
+                uint16_t v;
+                memcpy(&v, p, sizeof(v));
+                return cfg->id_big_endian ? ntohs(v) : v;
+        }
+        default: {
+                uint32_t v;
+                memcpy(&v, p, sizeof(v));
+                return cfg->id_big_endian ? ntohl(v) : v;
+        }
+        }
+}
+
+// See iccom_router.h
+int iccom_router_create(const iccom_router_cfg *const cfg
+                        , iccom_router **const router__out)
+{
+        if (!cfg || !router__out) {
+                log("no configuration or output ptr is provided");
+                return -EINVAL;
+        }
+        const unsigned int width = cfg->id_width ? cfg->id_width : 1;
+        if (width != 1 && width != 2 && width != 4) {
+                log("unsupported id width: %u", cfg->id_width);
+                return -EINVAL;
+        }
+        if (cfg->id_offset > ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES - width) {
+                log("the id doesn't fit the message: offset %u"
+                    , cfg->id_offset);
+                return -EINVAL;
+        }
+        if (cfg->dense_ids > ICCOM_ROUTER_MAX_DENSE_IDS) {
+                log("The dense ids number %u exceeds max %d", cfg->dense_ids
+                    , ICCOM_ROUTER_MAX_DENSE_IDS);
+                return -EINVAL;
+        }
+
+        struct iccom_router *const router = (struct iccom_router *)
+                        calloc(1, sizeof(*router));
+        if (!router) {
+                return -ENOMEM;
+        }
+        router->cfg = *cfg;
+        router->cfg.id_width = width;
+        router->id_limit = 1ull << (8 * width);
+        if (!router->cfg.dense_ids) {
+                router->cfg.dense_ids = ICCOM_ROUTER_DEFAULT_DENSE_IDS;
+        }
+        // no need for the dense slots the id can't take
+        if (router->cfg.dense_ids > router->id_limit) {
+                router->cfg.dense_ids = (uint32_t)router->id_limit;
+        }
+        router->dense = (struct iccom_route *)calloc(router->cfg.dense_ids
+                                                     , sizeof(router->dense[0]));
+        if (!router->dense) {
+                iccom_router_destroy(router);
+                return -ENOMEM;
+        }
+
+        *router__out = router;
+        return 0;
+}
+
+// See iccom_router.h
+void iccom_router_destroy(iccom_router *const router)
+{
+        if (!router) {
+                return;
+        }
+        free(router->rx_buf);
+        free(router->sparse);
+        free(router->dense);
+        free(router);
+}
+
+// See iccom_router.h
+int iccom_router_set_route(iccom_router *const router, const uint32_t msg_id
+                           , const iccom_route_handler handler
+                           , void *const ctx)
+{
+        if (!router) {
+                log("no router is provided");
+                return -EINVAL;
+        }
+        if (msg_id == ICCOM_ROUTER_NO_ID || msg_id >= router->id_limit) {
+                log("The message id %u doesn't fit the id width %u", msg_id
+                    , router->cfg.id_width);
+                return -EINVAL;
+        }
+
+        struct iccom_route *route = iccom_router_find(router, msg_id);
+        if (!route) {
+                if (!handler) {
+                        return 0;
+                }
+                // load factor up to 1/2
+                if (!router->sparse || 2 * (router->sparse_used + 1)
+                                       > router->sparse_mask + 1) {
+                        const int res = iccom_router_sparse_grow(router);
+                        if (res < 0) {
+                                return res;
+                        }
+                }
+                struct iccom_sparse_route *const slot
+                                = iccom_router_sparse_slot(router->sparse
+                                                , router->sparse_mask, msg_id);
+                slot->used = 1;
+                slot->id = msg_id;
+                router->sparse_used++;
+                route = &slot->route;
+        }
+        route->handler = handler;
+        route->ctx = ctx;
+        atomic_store_explicit(&route->messages, 0, memory_order_relaxed);
+        atomic_store_explicit(&route->bytes, 0, memory_order_relaxed);
+        return 0;
+}
+
+// See iccom_router.h
+int iccom_router_set_default(iccom_router *const router
+                             , const iccom_route_handler handler
+                             , void *const ctx)
+{
+        if (!router) {
+                log("no router is provided");
+                return -EINVAL;
+        }
+        router->default_route.handler = handler;
+        router->default_route.ctx = ctx;
+        return 0;
+}
+
+// See iccom_router.h
+int iccom_router_dispatch(iccom_router *const router
+                          , const void *const payload, const size_t size)
+{
+        if (!router || (!payload && size)) {
+                return -EINVAL;
+        }
+        if (size < router->cfg.id_width
+                    || size - router->cfg.id_width < router->cfg.id_offset) {
+                iccom_router_count(&router->malformed, 1);
+                if (router->default_route.handler) {
+                        router->default_route.handler(
+                                        router->default_route.ctx
+                                        , ICCOM_ROUTER_NO_ID, payload, size);
+                }
+                return -EBADMSG;
+        }
+        const uint32_t id = iccom_router_read_id(router
+                                        , (const uint8_t *)payload);
+
+        // dense ids: single indexed load, no hashing
+        struct iccom_route *const route = (id < router->cfg.dense_ids)
+                                          ? &router->dense[id]
+                                          : iccom_router_find(router, id);
+        if (!route || !route->handler) {
+                iccom_router_count(&router->unrouted, 1);
+                if (router->default_route.handler) {
+                        router->default_route.handler(
+                                        router->default_route.ctx, id
+                                        , payload, size);
+                }
+                return -ENOENT;
+        }
+
+        iccom_router_count(&route->messages, 1);
+        iccom_router_count(&route->bytes, size);
+        iccom_router_count(&router->routed, 1);
+        route->handler(route->ctx, id, payload, size);
+        return 0;
+}
+
+// See iccom_router.h
+int iccom_router_receive(iccom_router *const router, const int sock_fd)
+{
+        if (!router) {
+                return -EINVAL;
+        }
+        if (!router->rx_buf) {
+                router->rx_buf_size = iccom_get_required_buffer_size(
+                                ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES);
+                router->rx_buf = (char *)malloc(router->rx_buf_size);
+                if (!router->rx_buf) {
+                        return -ENOMEM;
+                }
+        }
+        int offset;
+        const int res = iccom_receive_data_nocopy(sock_fd, router->rx_buf
+                                                  , router->rx_buf_size
+                                                  , &offset);
+        if (res <= 0) {
+                // 0 is the timeout
+                return res ? res : -EAGAIN;
+        }
+        return iccom_router_dispatch(router, router->rx_buf + offset
+                                     , (size_t)res);
+}
+
+// See iccom_router.h
+int iccom_router_get_route_stats(const iccom_router *const router
+                                 , const uint32_t msg_id
+                                 , iccom_route_stats *const out)
+{
+        if (!router || !out) {
+                log("no router or output ptr is provided");
+                return -EINVAL;
+        }
+        const struct iccom_route *const route
+                        = iccom_router_find(router, msg_id);
+        if (!route || !route->handler) {
+                return -ENOENT;
+        }
+        out->messages = atomic_load_explicit(&route->messages
+                                             , memory_order_relaxed);
+        out->bytes = atomic_load_explicit(&route->bytes
+                                          , memory_order_relaxed);
+        return 0;
+}
+
+// See iccom_router.h
+int iccom_router_get_stats(const iccom_router *const router
+                           , iccom_router_stats *const out)
+{
+        if (!router || !out) {
+                log("no router or output ptr is provided");
+                return -EINVAL;
+        }
+        out->routed = atomic_load_explicit(&router->routed
+                                           , memory_order_relaxed);
+        out->unrouted = atomic_load_explicit(&router->unrouted
+                                             , memory_order_relaxed);
+        out->malformed = atomic_load_explicit(&router->malformed
+                                              , memory_order_relaxed);
+        return 0;
+}
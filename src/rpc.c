@@ -0,0 +1,595 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the ICCom RPC client, see iccom_rpc.h.
+ *
+ * The outstanding request entries live in a fixed pool. The hash table
+ * (2 x pool size, linear probing, backward shift deletion, so no
+ * tombstones) maps the correlation id to the entry. The timer wheel
+ * slot keeps the doubly linked list of the entries expiring at the
+ * ticks which map to the slot; the entries of the later wheel rounds
+ * are just skipped when the slot is processed.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+
+#include "iccom.h"
+#include "iccom_rpc.h"
+#include "utils.h"
+#include "sock_registry.h"
+
+/* -------------------- BUILD TIME CONFIGURATION ----------------------- */
+
+#define ICCOM_RPC_DEFAULT_MAX_OUTSTANDING 256
+#define ICCOM_RPC_DEFAULT_TICK_MS 1
+
+// the timer wheel size in ticks, power of two
+#define ICCOM_RPC_WHEEL_SLOTS 512
+
+/* -------------------- MACRO DEFINITIONS ------------------------------ */
+
+#define ICCOM_RPC_NIL UINT32_MAX
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+// @id the request correlation id, 0 if the entry is free
+// @expire_tick the tick the request times out at
+// @callback, @ctx the request completion
+// @prev, @next the wheel slot list links (@next links the free list
+//      for the free entries)
+struct iccom_rpc_entry {
+        uint32_t id;
+        uint64_t expire_tick;
+        iccom_rpc_callback callback;
+        void *ctx;
+        uint32_t prev;
+        uint32_t next;
+};
+
+// @sock_fd the channel socket
+// @tick_ms the tick duration
+// @entries the entries pool, @max_outstanding of them
+// @free_head the free entries list head
+// @outstanding the number of the used entries
+// @table the id -> entry index + 1 table, 0 - the empty slot
+// @table_mask the table size - 1
+// @wheel the wheel slots list heads
+// @tick the last processed tick
+// @next_id the next correlation id
+// @buf_size the size of @tx_buf and @rx_buf
+// @tx_buf, @rx_buf the netlink buffers for the max size message
+// @stats the counters
+struct iccom_rpc {
+        int sock_fd;
+        unsigned int tick_ms;
+        struct iccom_rpc_entry *entries;
+        unsigned int max_outstanding;
+        uint32_t free_head;
+        unsigned int outstanding;
+        uint32_t *table;
+        uint32_t table_mask;
+        uint32_t wheel[ICCOM_RPC_WHEEL_SLOTS];
+        uint64_t tick;
+        uint32_t next_id;
+        size_t buf_size;
+        char *tx_buf;
+        char *rx_buf;
+        iccom_rpc_stats stats;
+};
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+static inline uint64_t iccom_rpc_now_ms(void)
+{
+        return __iccom_now_ns() / 1000000ull;
+}
+
+static inline uint32_t iccom_rpc_home(const struct iccom_rpc *const rpc
+                                      , const uint32_t id)
+{
+        return (id * 2654435761u) & rpc->table_mask;
+}
+
+// RETURNS: the table slot of the id, or the empty slot where it would be
+static uint32_t iccom_rpc_slot(const struct iccom_rpc *const rpc
+                               , const uint32_t id)
+{
+        uint32_t i = iccom_rpc_home(rpc, id);
+        while (rpc->table[i] && rpc->entries[rpc->table[i] - 1].id != id) {
+                i = (i + 1) & rpc->table_mask;
+        }
+        return i;
+}
+
+// Removes the table slot with the backward shift of the following
+// entries of the probe chain.
+static void iccom_rpc_table_remove(struct iccom_rpc *const rpc, uint32_t i)
+{
+        uint32_t j = i;
+        while (1) {
+                j = (j + 1) & rpc->table_mask;
+                if (!rpc->table[j]) {
+                        break;
+                }
+                const uint32_t k = iccom_rpc_home(rpc
+                                , rpc->entries[rpc->table[j] - 1].id);
+                // the entry at j can move to i if its home is not
+                // within (i; j] (cyclically)
+                const int movable = (i <= j) ? (k <= i || k > j)
+                                             : (k <= i && k > j);
+                if (movable) {
+                        rpc->table[i] = rpc->table[j];
+                        i = j;
+                }
+        }
+        rpc->table[i] = 0;
+}
+
+static void iccom_rpc_wheel_unlink(struct iccom_rpc *const rpc
+                                   , const uint32_t idx)
+{
+        struct iccom_rpc_entry *const e = &rpc->entries[idx];
+        if (e->prev != ICCOM_RPC_NIL) {
+                rpc->entries[e->prev].next = e->next;
+        } else {
+                rpc->wheel[e->expire_tick & (ICCOM_RPC_WHEEL_SLOTS - 1)]
+                                = e->next;
+        }
+        if (e->next != ICCOM_RPC_NIL) {
+                rpc->entries[e->next].prev = e->prev;
+        }
+}
+
+// Releases the entry (already unlinked from the wheel) and removes it
+// from the table.
+static void iccom_rpc_release(struct iccom_rpc *const rpc, const uint32_t idx
+                              , const uint32_t table_slot)
+{
+        iccom_rpc_table_remove(rpc, table_slot);
+        rpc->entries[idx].id = 0;
+        rpc->entries[idx].next = rpc->free_head;
+        rpc->free_head = idx;
+        rpc->outstanding--;
+}
+
+// Drops the outstanding request without calling its callback.
+static void iccom_rpc_cancel(struct iccom_rpc *const rpc, const uint32_t id)
+{
+        const uint32_t slot = iccom_rpc_slot(rpc, id);
+        if (!id || !rpc->table[slot]) {
+                return;
+        }
+        const uint32_t idx = rpc->table[slot] - 1;
+        iccom_rpc_wheel_unlink(rpc, idx);
+        iccom_rpc_release(rpc, idx, slot);
+}
+
+// Expires the requests up to the current tick.
+//
+// RETURNS: the number of the requests expired
+static int iccom_rpc_expire(struct iccom_rpc *const rpc)
+{
+        const uint64_t now_tick = iccom_rpc_now_ms() / rpc->tick_ms;
+        if (now_tick <= rpc->tick) {
+                return 0;
+        }
+        // all slots are visited at most once per call
+        const uint64_t from = (now_tick - rpc->tick > ICCOM_RPC_WHEEL_SLOTS)
+                              ? now_tick - ICCOM_RPC_WHEEL_SLOTS + 1
+                              : rpc->tick + 1;
+        rpc->tick = now_tick;
+
+        int expired = 0;
+        for (uint64_t t = from; t <= now_tick; t++) {
+                uint32_t idx = rpc->wheel[t & (ICCOM_RPC_WHEEL_SLOTS - 1)];
+                while (idx != ICCOM_RPC_NIL) {
+                        struct iccom_rpc_entry *const e = &rpc->entries[idx];
+                        const uint32_t next = e->next;
+                        if (e->expire_tick <= now_tick) {
+                                const iccom_rpc_callback callback
+                                                = e->callback;
+                                void *const ctx = e->ctx;
+                                iccom_rpc_wheel_unlink(rpc, idx);
+                                iccom_rpc_release(rpc, idx
+                                                  , iccom_rpc_slot(rpc, e->id));
+                                rpc->stats.timed_out++;
+                                expired++;
+                                callback(ctx, -ETIMEDOUT, NULL, 0);
+                        }
+                        idx = next;
+                }
+        }
+        return expired;
+}
+
+// RETURNS: the time in ms till the nearest nonempty wheel slot tick,
+//      -1 if no request is outstanding
+static int iccom_rpc_next_timeout_ms(const struct iccom_rpc *const rpc)
+{
+        if (!rpc->outstanding) {
+                return -1;
+        }
+        const uint64_t now_ms = iccom_rpc_now_ms();
+        for (uint64_t t = rpc->tick + 1
+                        ; t <= rpc->tick + ICCOM_RPC_WHEEL_SLOTS; t++) {
+                if (rpc->wheel[t & (ICCOM_RPC_WHEEL_SLOTS - 1)]
+                                != ICCOM_RPC_NIL) {
+                        const uint64_t at_ms = t * rpc->tick_ms;
+                        return at_ms > now_ms ? (int)(at_ms - now_ms) : 0;
+                }
+        }
+        return -1;
+}
+
+// Matches the received message to the outstanding request.
+//
+// RETURNS: 1 if the request was completed, 0 otherwise
+static int iccom_rpc_handle(struct iccom_rpc *const rpc
+                            , const void *const payload, const size_t size)
+{
+        iccom_rpc_hdr hdr;
+        const void *body;
+        const int body_size = iccom_rpc_parse(payload, size, &hdr, &body);
+        if (body_size < 0 || hdr.kind != ICCOM_RPC_KIND_RESPONSE) {
+                rpc->stats.unmatched++;
+                return 0;
+        }
+        const uint32_t slot = iccom_rpc_slot(rpc, hdr.id);
+        if (!hdr.id || !rpc->table[slot]) {
+                rpc->stats.late++;
+                return 0;
+        }
+        const uint32_t idx = rpc->table[slot] - 1;
+        const iccom_rpc_callback callback = rpc->entries[idx].callback;
+        void *const ctx = rpc->entries[idx].ctx;
+        iccom_rpc_wheel_unlink(rpc, idx);
+        iccom_rpc_release(rpc, idx, slot);
+        rpc->stats.completed++;
+        callback(ctx, 0, body, (size_t)body_size);
+        return 1;
+}
+
+// See iccom_rpc.h
+int iccom_rpc_create(const iccom_rpc_cfg *const cfg
+                     , iccom_rpc **const rpc__out)
+{
+        if (!cfg || !rpc__out) {
+                log("no configuration or output ptr is provided");
+                return -EINVAL;
+        }
+        // NOTE: 0 of the zero initialized configuration is not valid
+        if (__iccom_sock_channel(cfg->sock_fd) == ICCOM_SOCK_CHANNEL_UNKNOWN) {
+                log("The socket %d is not an ICCom socket", cfg->sock_fd);
+                return -EBADF;
+        }
+
+        struct iccom_rpc *const rpc = (struct iccom_rpc *)
+                        calloc(1, sizeof(*rpc));
+        if (!rpc) {
+                return -ENOMEM;
+        }
+        rpc->sock_fd = cfg->sock_fd;
+        rpc->tick_ms = cfg->tick_ms ? cfg->tick_ms
+                                    : ICCOM_RPC_DEFAULT_TICK_MS;
+        rpc->max_outstanding = cfg->max_outstanding
+                               ? cfg->max_outstanding
+                               : ICCOM_RPC_DEFAULT_MAX_OUTSTANDING;
+        uint32_t table_size = 1;
+        while (table_size < 2 * rpc->max_outstanding) {
+                table_size <<= 1;
+        }
+        rpc->table_mask = table_size - 1;
+        rpc->buf_size = iccom_get_required_buffer_size(
+                                ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES);
+
+        rpc->entries = (struct iccom_rpc_entry *)
+                        calloc(rpc->max_outstanding, sizeof(rpc->entries[0]));
+        rpc->table = (uint32_t *)calloc(table_size, sizeof(rpc->table[0]));
+        rpc->tx_buf = (char *)malloc(rpc->buf_size);
+        rpc->rx_buf = (char *)malloc(rpc->buf_size);
+        if (!rpc->entries || !rpc->table || !rpc->tx_buf || !rpc->rx_buf) {
+                iccom_rpc_destroy(rpc);
+                return -ENOMEM;
+        }
+        for (unsigned int i = 0; i < rpc->max_outstanding; i++) {
+                rpc->entries[i].next = (i + 1 < rpc->max_outstanding)
+                                       ? i + 1 : ICCOM_RPC_NIL;
+        }
+        rpc->free_head = 0;
+        for (unsigned int i = 0; i < ICCOM_RPC_WHEEL_SLOTS; i++) {
+                rpc->wheel[i] = ICCOM_RPC_NIL;
+        }
+        rpc->tick = iccom_rpc_now_ms() / rpc->tick_ms;
+        rpc->next_id = 1;
+
+        *rpc__out = rpc;
+        return 0;
+}
+
+// See iccom_rpc.h
+void iccom_rpc_destroy(iccom_rpc *const rpc)
+{
+        if (!rpc) {
+                return;
+        }
+        if (rpc->entries && rpc->table) {
+                for (unsigned int i = 0; i < rpc->max_outstanding; i++) {
+                        struct iccom_rpc_entry *const e = &rpc->entries[i];
+                        if (e->id) {
+                                e->id = 0;
+                                e->callback(e->ctx, -ECANCELED, NULL, 0);
+                        }
+                }
+        }
+        free(rpc->rx_buf);
+        free(rpc->tx_buf);
+        free(rpc->table);
+        free(rpc->entries);
+        free(rpc);
+}
+
+// See iccom_rpc.h
+int iccom_rpc_call_async(iccom_rpc *const rpc, const void *const body
+                         , const size_t size, const unsigned int timeout_ms
+                         , const iccom_rpc_callback callback
+                         , void *const ctx, uint32_t *const id__out)
+{
+        if (!rpc || !callback || (size && !body) || !timeout_ms) {
+                log("no client, callback, body or timeout is provided");
+                return -EINVAL;
+        }
+        if (size > ICCOM_RPC_MAX_BODY_SIZE) {
+                log("The request body size %zu exceeds max %d", size
+                    , ICCOM_RPC_MAX_BODY_SIZE);
+                return -EINVAL;
+        }
+        if (rpc->free_head == ICCOM_RPC_NIL) {
+                return -EBUSY;
+        }
+
+        const uint32_t id = rpc->next_id;
+        rpc->next_id = (rpc->next_id == UINT32_MAX) ? 1 : rpc->next_id + 1;
+
+        const int offset = iccom_get_data_payload_offset();
+        const iccom_rpc_hdr hdr = { .id = id
+                                    , .kind = ICCOM_RPC_KIND_REQUEST
+                                    , .reserved = 0 };
+        memcpy(rpc->tx_buf + offset, &hdr, sizeof(hdr));
+        if (size) {
+                memcpy(rpc->tx_buf + offset + sizeof(hdr), body, size);
+        }
+        const size_t msg_size = sizeof(hdr) + size;
+        const int res = iccom_send_data_nocopy(rpc->sock_fd, rpc->tx_buf
+                        , iccom_get_required_buffer_size(msg_size), offset
+                        , msg_size);
+        if (res < 0) {
+                return res;
+        }
+
+        // registered after the send: the response is handled only by
+        // the @iccom_rpc_poll on the same thread
+        const uint32_t idx = rpc->free_head;
+        struct iccom_rpc_entry *const e = &rpc->entries[idx];
+        rpc->free_head = e->next;
+        rpc->outstanding++;
+
+        e->id = id;
+        e->callback = callback;
+        e->ctx = ctx;
+        // the started tick is not complete yet, so +1
+        const uint64_t ticks = (timeout_ms + rpc->tick_ms - 1) / rpc->tick_ms;
+        e->expire_tick = iccom_rpc_now_ms() / rpc->tick_ms + ticks + 1;
+        if (e->expire_tick <= rpc->tick) {
+                e->expire_tick = rpc->tick + 1;
+        }
+        uint32_t *const head = &rpc->wheel[e->expire_tick
+                                           & (ICCOM_RPC_WHEEL_SLOTS - 1)];
+        e->prev = ICCOM_RPC_NIL;
+        e->next = *head;
+        if (*head != ICCOM_RPC_NIL) {
+                rpc->entries[*head].prev = idx;
+        }
+        *head = idx;
+
+        rpc->table[iccom_rpc_slot(rpc, id)] = idx + 1;
+        rpc->stats.sent++;
+        if (id__out) {
+                *id__out = id;
+        }
+        return 0;
+}
+
+// @iccom_rpc_call completion.
+//
+// @buf, @buf_size the response buffer
+// @res the call result
+// @done !0 when completed
+struct iccom_rpc_sync {
+        void *buf;
+        size_t buf_size;
+        int res;
+        int done;
+};
+
+static void iccom_rpc_sync_done(void *const ctx, const int status
+                                , const void *const body, const size_t size)
+{
+        struct iccom_rpc_sync *const sync = (struct iccom_rpc_sync *)ctx;
+        sync->done = 1;
+        if (status < 0) {
+                sync->res = status;
+        } else if (size > sync->buf_size) {
+                sync->res = -EOVERFLOW;
+        } else {
+                memcpy(sync->buf, body, size);
+                sync->res = (int)size;
+        }
+}
+
+// See iccom_rpc.h
+int iccom_rpc_call(iccom_rpc *const rpc, const void *const body
+                   , const size_t size, const unsigned int timeout_ms
+                   , void *const resp_buf, const size_t resp_buf_size)
+{
+        if (!resp_buf && resp_buf_size) {
+                log("no response buffer is provided");
+                return -EINVAL;
+        }
+        struct iccom_rpc_sync sync = { resp_buf, resp_buf_size, 0, 0 };
+        uint32_t id;
+        int res = iccom_rpc_call_async(rpc, body, size, timeout_ms
+                                       , iccom_rpc_sync_done, &sync, &id);
+        if (res < 0) {
+                return res;
+        }
+        while (!sync.done) {
+                res = iccom_rpc_poll(rpc, -1);
+                if (res < 0 && res != -EINTR && res != -ENOBUFS
+                            && res != -EAGAIN && res != -ETIMEDOUT) {
+                        // the pending request keeps the ptr to @sync
+                        log("The RPC receive failed: %d", res);
+                        iccom_rpc_cancel(rpc, id);
+                        return res;
+                }
+        }
+        return sync.res;
+}
+
+// See iccom_rpc.h
+int iccom_rpc_poll(iccom_rpc *const rpc, const int timeout_ms)
+{
+        if (!rpc) {
+                return -EINVAL;
+        }
+        const uint64_t end_ms = iccom_rpc_now_ms()
+                                + (timeout_ms > 0 ? (uint64_t)timeout_ms : 0);
+        struct pollfd pfd = { .fd = rpc->sock_fd
+                              , .events = POLLIN | POLLRDHUP };
+        int completed = 0;
+
+        while (1) {
+                completed += iccom_rpc_expire(rpc);
+
+                // all the responses already there
+                while (poll(&pfd, 1, 0) > 0) {
+                        int offset;
+                        const int res = iccom_receive_data_nocopy(
+                                        rpc->sock_fd, rpc->rx_buf
+                                        , rpc->buf_size, &offset);
+                        if (res < 0) {
+                                if (completed) {
+                                        return completed;
+                                }
+                                return res;
+                        }
+                        if (res == 0) {
+                                // the closed stream socket keeps being
+                                // readable with nothing to read
+                                if (!completed && (pfd.revents
+                                                   & (POLLHUP | POLLRDHUP
+                                                      | POLLERR))) {
+                                        return -EPIPE;
+                                }
+                                break;
+                        }
+                        completed += iccom_rpc_handle(rpc
+                                        , rpc->rx_buf + offset, (size_t)res);
+                }
+
+                if (completed || timeout_ms == 0) {
+                        return completed;
+                }
+                int wait_ms = iccom_rpc_next_timeout_ms(rpc);
+                if (timeout_ms > 0) {
+                        const uint64_t now_ms = iccom_rpc_now_ms();
+                        if (now_ms >= end_ms) {
+                                return 0;
+                        }
+                        const int left_ms = (int)(end_ms - now_ms);
+                        if (wait_ms < 0 || wait_ms > left_ms) {
+                                wait_ms = left_ms;
+                        }
+                } else if (wait_ms < 0) {
+                        // nothing outstanding, nothing to wait for
+                        return 0;
+                }
+                poll(&pfd, 1, wait_ms);
+        }
+}
+
+// See iccom_rpc.h
+unsigned int iccom_rpc_outstanding(const iccom_rpc *const rpc)
+{
+        return rpc ? rpc->outstanding : 0;
+}
+
+// See iccom_rpc.h
+int iccom_rpc_get_stats(const iccom_rpc *const rpc
+                        , iccom_rpc_stats *const out)
+{
+        if (!rpc || !out) {
+                log("no client or output ptr is provided");
+                return -EINVAL;
+        }
+        *out = rpc->stats;
+        return 0;
+}
+
+// See iccom_rpc.h
+int iccom_rpc_parse(const void *const payload, const size_t size
+                    , iccom_rpc_hdr *const hdr__out
+                    , const void **const body__out)
+{
+        if (!payload || size < sizeof(iccom_rpc_hdr)
+                    || !hdr__out || !body__out) {
+                return -EBADMSG;
+        }
+        memcpy(hdr__out, payload, sizeof(*hdr__out));
+        if (hdr__out->kind != ICCOM_RPC_KIND_REQUEST
+                    && hdr__out->kind != ICCOM_RPC_KIND_RESPONSE) {
+                return -EBADMSG;
+        }
+        *body__out = (const char *)payload + sizeof(iccom_rpc_hdr);
+        return (int)(size - sizeof(iccom_rpc_hdr));
+}
+
+// See iccom_rpc.h
+int iccom_rpc_reply(const int sock_fd, const uint32_t id
+                    , const void *const body, const size_t size)
+{
+        if ((size && !body) || size > ICCOM_RPC_MAX_BODY_SIZE || !id) {
+                log("invalid response: id %u, body size %zu", id, size);
+                return -EINVAL;
+        }
+        _Alignas(struct nlmsghdr) char buf[NLMSG_SPACE(
+                        ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES)];
+        const int offset = iccom_get_data_payload_offset();
+        const iccom_rpc_hdr hdr = { .id = id
+                                    , .kind = ICCOM_RPC_KIND_RESPONSE
+                                    , .reserved = 0 };
+        memcpy(buf + offset, &hdr, sizeof(hdr));
+        if (size) {
+                memcpy(buf + offset + sizeof(hdr), body, size);
+        }
+        const size_t msg_size = sizeof(hdr) + size;
+        return iccom_send_data_nocopy(sock_fd, buf
+                        , iccom_get_required_buffer_size(msg_size), offset
+                        , msg_size);
+}
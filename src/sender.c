@@ -0,0 +1,424 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the ICCom concurrent sender, see iccom_sender.h.
+ *
+ * The queue is the bounded MPSC queue with the per slot sequence
+ * (D. Vyukov): the producers reserve the slot by CAS on the enqueue
+ * position and commit it by the slot sequence (pos + 1), the flusher
+ * takes the committed slots in order and gives them back by the
+ * sequence (pos + queue size). The flusher sleeps only when the
+ * queue is empty, the producers wake it only when it sleeps (see the
+ * waiter in ring.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "iccom.h"
+#include "iccom_sender.h"
+#include "msg_pool.h"
+#include "threads.h"
+#include "utils.h"
+#include "ring.h"
+
+/* -------------------- BUILD TIME CONFIGURATION ----------------------- */
+
+#define ICCOM_SENDER_DEFAULT_QUEUE_SIZE 1024
+#define ICCOM_SENDER_DEFAULT_MAX_BATCH 64
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+// @seq see the file description
+// @buf, @size the queued message
+struct iccom_sender_slot {
+        _Atomic uint64_t seq;
+        void *buf;
+        size_t size;
+};
+
+// @enqueue_pos the next slot to reserve by the producers
+// @dequeue_pos the next slot to take by the flusher
+// @sent_pos the number of messages the flusher is done with
+// @flusher the flusher blocking wait
+// @flushed the @iccom_sender_flush callers blocking wait
+// @slots the queue slots, @mask + 1 of them
+// @items the flusher batch
+// @max_batch max messages in the batch
+// @sock the socket to send to
+// @stop !0 when the flusher thread is to exit
+// @thread the flusher thread
+// @cpu the CPU to pin the thread to, <0 if none
+// @sent, ... the counters (see iccom_sender_stats)
+struct iccom_sender {
+        _Alignas(ICCOM_CACHE_LINE_SIZE) _Atomic uint64_t enqueue_pos;
+
+        _Alignas(ICCOM_CACHE_LINE_SIZE) uint64_t dequeue_pos;
+        _Atomic uint64_t sent_pos;
+
+        _Alignas(ICCOM_CACHE_LINE_SIZE) struct iccom_waiter flusher;
+        struct iccom_waiter flushed;
+
+        _Alignas(ICCOM_CACHE_LINE_SIZE) struct iccom_sender_slot *slots;
+        uint64_t mask;
+        iccom_send_batch_item *items;
+        unsigned int max_batch;
+        struct iccom_rx_socket sock;
+        _Atomic int stop;
+        pthread_t thread;
+        int cpu;
+        _Atomic uint64_t sent;
+        _Atomic uint64_t batches;
+        _Atomic uint64_t full;
+        _Atomic uint64_t send_errors;
+};
+
+// The @iccom_sender_flush wait context.
+//
+// @s the sender
+// @target the send position to wait for
+struct iccom_sender_flush_wait {
+        const struct iccom_sender *s;
+        uint64_t target;
+};
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+// See iccom_sender.h
+int iccom_tx_message_alloc(const size_t capacity
+                           , iccom_tx_message *const msg__out)
+{
+        if (!msg__out || !capacity
+                        || capacity > ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES) {
+                log("invalid message capacity: %zu", capacity);
+                return -EINVAL;
+        }
+        size_t buf_size;
+        void *const buf = __iccom_msg_pool_alloc(
+                        iccom_get_required_buffer_size(capacity), &buf_size);
+        if (!buf) {
+                return -ENOMEM;
+        }
+        const size_t max_capacity = buf_size - iccom_get_data_payload_offset();
+        msg__out->buf = buf;
+        msg__out->capacity = max_capacity < ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES
+                             ? max_capacity
+                             : ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES;
+        msg__out->size = 0;
+        return 0;
+}
+
+// See iccom_sender.h
+void iccom_tx_message_free(iccom_tx_message *const msg)
+{
+        if (!msg) {
+                return;
+        }
+        iccom_free_received_buffer(msg->buf);
+        memset(msg, 0, sizeof(*msg));
+}
+
+// RETURNS: !0 if the next slot to take is committed
+static inline int iccom_sender_ready(const struct iccom_sender *const s)
+{
+        return atomic_load_explicit(
+                        &s->slots[s->dequeue_pos & s->mask].seq
+                        , memory_order_acquire) == s->dequeue_pos + 1;
+}
+
+// Takes up to @max_batch committed messages into the batch and frees
+// their slots.
+//
+// RETURNS: the number of messages taken
+static unsigned int iccom_sender_take(struct iccom_sender *const s)
+{
+        unsigned int count = 0;
+        while (count < s->max_batch && iccom_sender_ready(s)) {
+                struct iccom_sender_slot *const slot
+                                = &s->slots[s->dequeue_pos & s->mask];
+                s->items[count].buf = slot->buf;
+                s->items[count].buf_size_bytes
+                                = iccom_get_required_buffer_size(slot->size);
+                s->items[count].data_size_bytes = slot->size;
+                count++;
+                atomic_store_explicit(&slot->seq
+                                      , s->dequeue_pos + s->mask + 1
+                                      , memory_order_release);
+                s->dequeue_pos++;
+        }
+        return count;
+}
+
+// Sends the batch, the failed message is dropped and the rest of the
+// batch is sent on.
+static void iccom_sender_send_batch(struct iccom_sender *const s
+                                    , const unsigned int count)
+{
+        unsigned int done = 0;
+        while (done < count) {
+                const int res = iccom_send_data_batch_nocopy(s->sock.fd
+                                        , s->items + done, count - done);
+                atomic_fetch_add_explicit(&s->batches, 1
+                                          , memory_order_relaxed);
+                if (res < 0) {
+                        atomic_fetch_add_explicit(&s->send_errors, 1
+                                                  , memory_order_relaxed);
+                        done++;
+                        continue;
+                }
+                atomic_fetch_add_explicit(&s->sent, (uint64_t)res
+                                          , memory_order_relaxed);
+                done += (unsigned int)res;
+        }
+        for (unsigned int i = 0; i < count; i++) {
+                iccom_free_received_buffer((void *)s->items[i].buf);
+        }
+
+        atomic_store_explicit(&s->sent_pos, s->dequeue_pos
+                              , memory_order_release);
+        __iccom_waiter_wake(&s->flushed, 1);
+}
+
+// RETURNS: !0 if the flusher is not to sleep
+static int iccom_sender_wakeup(void *const ctx)
+{
+        const struct iccom_sender *const s = (struct iccom_sender *)ctx;
+        return iccom_sender_ready(s)
+               || atomic_load_explicit(&s->stop, memory_order_relaxed);
+}
+
+// The flusher thread.
+static void *iccom_sender_loop(void *arg)
+{
+        struct iccom_sender *const s = (struct iccom_sender *)arg;
+
+        __iccom_thread_place(ICCOM_THREAD_SENDER, s->cpu);
+
+        while (1) {
+                const unsigned int count = iccom_sender_take(s);
+                if (count) {
+                        iccom_sender_send_batch(s, count);
+                        continue;
+                }
+                // the messages queued before the stop are sent anyway
+                if (atomic_load_explicit(&s->stop, memory_order_relaxed)) {
+                        break;
+                }
+
+                __iccom_waiter_wait(&s->flusher, iccom_sender_wakeup, s, -1);
+        }
+        return NULL;
+}
+
+// See iccom_sender.h
+int iccom_sender_start(const iccom_sender_cfg *const cfg
+                       , iccom_sender **const sender__out)
+{
+        if (!cfg || !sender__out) {
+                log("no configuration or output ptr is provided");
+                return -EINVAL;
+        }
+        const unsigned int queue_size = cfg->queue_size
+                                        ? cfg->queue_size
+                                        : ICCOM_SENDER_DEFAULT_QUEUE_SIZE;
+        if (queue_size & (queue_size - 1)) {
+                log("The queue size %u is not a power of two", queue_size);
+                return -EINVAL;
+        }
+
+        struct iccom_sender *const s = (struct iccom_sender *)
+                        aligned_alloc(ICCOM_CACHE_LINE_SIZE
+                                , (sizeof(*s) + ICCOM_CACHE_LINE_SIZE - 1)
+                                  / ICCOM_CACHE_LINE_SIZE
+                                  * ICCOM_CACHE_LINE_SIZE);
+        if (!s) {
+                return -ENOMEM;
+        }
+        memset(s, 0, sizeof(*s));
+        s->max_batch = cfg->max_batch ? cfg->max_batch
+                                      : ICCOM_SENDER_DEFAULT_MAX_BATCH;
+        s->slots = calloc(queue_size, sizeof(s->slots[0]));
+        s->items = calloc(s->max_batch, sizeof(s->items[0]));
+        int res = -ENOMEM;
+        if (!s->slots || !s->items) {
+                goto free_sender;
+        }
+        for (unsigned int i = 0; i < queue_size; i++) {
+                atomic_init(&s->slots[i].seq, i);
+        }
+        s->mask = queue_size - 1;
+        s->cpu = cfg->cpu;
+        __iccom_waiter_init(&s->flusher);
+        __iccom_waiter_init(&s->flushed);
+
+        // the flusher only sends, the socket read timeout is left as is
+        res = __iccom_rx_socket_take(cfg->channel, cfg->sock_fd, -1, &s->sock);
+        if (res < 0) {
+                goto destroy_sync;
+        }
+
+        res = -pthread_create(&s->thread, NULL, iccom_sender_loop, s);
+        if (res < 0) {
+                log("Could not start the sender thread: %d(%s)"
+                    , -res, strerror(-res));
+                goto close_socket;
+        }
+
+        *sender__out = s;
+        return 0;
+
+close_socket:
+        __iccom_rx_socket_release(&s->sock);
+destroy_sync:
+        __iccom_waiter_destroy(&s->flushed);
+        __iccom_waiter_destroy(&s->flusher);
+free_sender:
+        free(s->items);
+        free(s->slots);
+        free(s);
+        return res;
+}
+
+// See iccom_sender.h
+void iccom_sender_stop(iccom_sender *const s)
+{
+        if (!s) {
+                return;
+        }
+        atomic_store_explicit(&s->stop, 1, memory_order_relaxed);
+        __iccom_waiter_wake(&s->flusher, 0);
+        pthread_join(s->thread, NULL);
+
+        __iccom_rx_socket_release(&s->sock);
+        __iccom_waiter_destroy(&s->flushed);
+        __iccom_waiter_destroy(&s->flusher);
+        free(s->items);
+        free(s->slots);
+        free(s);
+}
+
+// See iccom_sender.h
+int iccom_sender_submit(iccom_sender *const s, iccom_tx_message *const msg)
+{
+        if (!s || !msg || !msg->buf || !msg->size
+                        || msg->size > msg->capacity) {
+                log("no sender or invalid message is provided");
+                return -EINVAL;
+        }
+
+        struct iccom_sender_slot *slot;
+        uint64_t pos = atomic_load_explicit(&s->enqueue_pos
+                                            , memory_order_relaxed);
+        while (1) {
+                slot = &s->slots[pos & s->mask];
+                const uint64_t seq = atomic_load_explicit(&slot->seq
+                                                , memory_order_acquire);
+                const int64_t diff = (int64_t)(seq - pos);
+                if (diff == 0) {
+                        if (atomic_compare_exchange_weak_explicit(
+                                        &s->enqueue_pos, &pos, pos + 1
+                                        , memory_order_relaxed
+                                        , memory_order_relaxed)) {
+                                break;
+                        }
+                } else if (diff < 0) {
+                        atomic_fetch_add_explicit(&s->full, 1
+                                                  , memory_order_relaxed);
+                        return -EAGAIN;
+                } else {
+                        pos = atomic_load_explicit(&s->enqueue_pos
+                                                   , memory_order_relaxed);
+                }
+        }
+        slot->buf = msg->buf;
+        slot->size = msg->size;
+        atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+        memset(msg, 0, sizeof(*msg));
+        __iccom_waiter_wake(&s->flusher, 0);
+        return 0;
+}
+
+// See iccom_sender.h
+int iccom_sender_send(iccom_sender *const s, const void *const data
+                      , const size_t size)
+{
+        if (!data || !size) {
+                log("no data is provided");
+                return -EINVAL;
+        }
+        iccom_tx_message msg;
+        int res = iccom_tx_message_alloc(size, &msg);
+        if (res < 0) {
+                return res;
+        }
+        memcpy(iccom_tx_message_data(&msg), data, size);
+        msg.size = size;
+        res = iccom_sender_submit(s, &msg);
+        if (res < 0) {
+                iccom_tx_message_free(&msg);
+        }
+        return res;
+}
+
+// RETURNS: !0 if the messages the flush waits for are sent
+static int iccom_sender_flushed(void *const ctx)
+{
+        const struct iccom_sender_flush_wait *const w
+                        = (struct iccom_sender_flush_wait *)ctx;
+        return atomic_load_explicit(&w->s->sent_pos, memory_order_acquire)
+               >= w->target;
+}
+
+// See iccom_sender.h
+int iccom_sender_flush(iccom_sender *const s, const int timeout_ms)
+{
+        if (!s) {
+                log("no sender is provided");
+                return -EINVAL;
+        }
+        const uint64_t target = atomic_load_explicit(&s->enqueue_pos
+                                                     , memory_order_relaxed);
+        if (atomic_load_explicit(&s->sent_pos, memory_order_acquire)
+                        >= target) {
+                return 0;
+        }
+
+        struct iccom_sender_flush_wait wait = { s, target };
+        return __iccom_waiter_wait(&s->flushed, iccom_sender_flushed, &wait
+                                   , timeout_ms) ? 0 : -ETIMEDOUT;
+}
+
+// See iccom_sender.h
+int iccom_sender_get_stats(const iccom_sender *const s
+                           , iccom_sender_stats *const out)
+{
+        if (!s || !out) {
+                log("no sender or output ptr is provided");
+                return -EINVAL;
+        }
+        // the producers don't share a counter of their own
+        out->submitted = atomic_load_explicit(&s->enqueue_pos
+                                              , memory_order_relaxed);
+        out->sent = atomic_load_explicit(&s->sent, memory_order_relaxed);
+        out->batches = atomic_load_explicit(&s->batches
+                                            , memory_order_relaxed);
+        out->full = atomic_load_explicit(&s->full, memory_order_relaxed);
+        out->send_errors = atomic_load_explicit(&s->send_errors
+                                                , memory_order_relaxed);
+        return 0;
+}
@@ -0,0 +1,69 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the per socket state registry shared by all
+ * ICCom modifications, see sock_registry.h.
+ */
+
+#include "sock_registry.h"
+#include "flight_recorder.h"
+#include "filter.h"
+
+/* ------------------- GLOBAL VARIABLES / CONSTANTS -------------------- */
+
+// NOTE: zero initialized, see struct iccom_sock_state
+struct iccom_sock_state __iccom_sock_registry[ICCOM_SOCK_REGISTRY_SIZE];
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+// Registers the freshly opened socket.
+//
+// @sock_fd {valid opened socket fd} if out of registry range, then
+//      the call does nothing
+// @channel the channel the socket is bound to
+void __iccom_sock_register(const int sock_fd, const unsigned int channel)
+{
+        struct iccom_sock_state *const st = __iccom_sock_state(sock_fd);
+        if (!st) {
+                return;
+        }
+        atomic_store_explicit(&st->overruns, 0, memory_order_relaxed);
+        atomic_store_explicit(&st->rcvbuf_grows, 0, memory_order_relaxed);
+        atomic_store_explicit(&st->rcvbuf_auto_max, 0, memory_order_relaxed);
+        atomic_store_explicit(&st->rcvbuf_capped, 0, memory_order_relaxed);
+        atomic_store_explicit(&st->busy_poll_max_us, 0, memory_order_relaxed);
+        atomic_store_explicit(&st->busy_poll_wait_ns, 0
+                              , memory_order_relaxed);
+        atomic_store_explicit(&st->busy_poll_hits, 0, memory_order_relaxed);
+        atomic_store_explicit(&st->busy_poll_misses, 0
+                              , memory_order_relaxed);
+        atomic_store_explicit(&st->nomem_drops, 0, memory_order_relaxed);
+        atomic_store_explicit(&st->channel_1, (int)channel + 1
+                              , memory_order_relaxed);
+        atomic_store_explicit(&st->fr_ring
+                              , __iccom_flight_recorder_ring(channel)
+                              , memory_order_release);
+}
+
+// Drops the socket registration, called right before socket closing.
+//
+// @sock_fd {any} if not registered, then the call does nothing
+void __iccom_sock_unregister(const int sock_fd)
+{
+        struct iccom_sock_state *const st = __iccom_sock_state(sock_fd);
+        if (!st) {
+                return;
+        }
+        __iccom_sock_filter_set(sock_fd, NULL, 0);
+        atomic_store_explicit(&st->fr_ring, NULL, memory_order_relaxed);
+        atomic_store_explicit(&st->channel_1, 0, memory_order_relaxed);
+}
@@ -0,0 +1,108 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+// The per socket state registry. Keeps the library side information
+// about every opened ICCom socket (like its channel), indexed directly
+// by the socket file descriptor, so the hot send/receive paths can get
+// it without any syscall, lock or lookup.
+//
+// NOTE: sockets with file descriptors >= ICCOM_SOCK_REGISTRY_SIZE are
+//      not tracked, all registry based features treat them as
+//      "unknown" sockets.
+
+#ifndef LIBICCOM_SOCK_REGISTRY_H
+#define LIBICCOM_SOCK_REGISTRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* -------------------- BUILD TIME CONFIGURATION ----------------------- */
+
+#define ICCOM_SOCK_REGISTRY_SIZE 4096
+
+/* -------------------- MACRO DEFINITIONS ------------------------------ */
+
+#define ICCOM_SOCK_CHANNEL_UNKNOWN (-1)
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+struct iccom_fr_ring;
+struct iccom_sock_filter;
+
+// @channel_1 the ICCom channel the socket is bound to plus one,
+//      0 if socket is not registered (this way the zero initialized
+//      registry needs no explicit initialization)
+// @fr_ring the flight recorder ring of the socket channel, NULL if
+//      flight recorder is disabled for the socket
+// @filter the library side socket filter, NULL if none
+// @filter_users the number of ongoing @filter evaluations
+// @overruns the number of the receive queue overruns
+// @rcvbuf_grows the number of the automatic receive buffer grows
+// @rcvbuf_auto_max the automatic receive buffer sizing limit, 0 if
+//      disabled
+// @rcvbuf_capped !0 if the receive buffer can't grow further for the
+//      system limit (SO_RCVBUF is clamped to rmem_max)
+// @busy_poll_max_us the receive busy polling budget limit, 0 if
+//      disabled
+// @busy_poll_wait_ns the moving average of the receive wait for the
+//      message (the busy polling budget base)
+// @busy_poll_hits the number of messages caught by busy polling
+// @busy_poll_misses the number of busy polling budgets exhausted
+// @nomem_drops the number of messages dropped for no buffer memory
+struct iccom_sock_state {
+        _Atomic int channel_1;
+        struct iccom_fr_ring *_Atomic fr_ring;
+        struct iccom_sock_filter *_Atomic filter;
+        _Atomic int filter_users;
+        _Atomic uint64_t overruns;
+        _Atomic uint64_t rcvbuf_grows;
+        _Atomic int rcvbuf_auto_max;
+        _Atomic int rcvbuf_capped;
+        _Atomic int busy_poll_max_us;
+        _Atomic uint64_t busy_poll_wait_ns;
+        _Atomic uint64_t busy_poll_hits;
+        _Atomic uint64_t busy_poll_misses;
+        _Atomic uint64_t nomem_drops;
+};
+
+extern struct iccom_sock_state __iccom_sock_registry[ICCOM_SOCK_REGISTRY_SIZE];
+
+/* -------------------- ROUTINES DECLARATIONS -------------------------- */
+
+void __iccom_sock_register(const int sock_fd, const unsigned int channel);
+void __iccom_sock_unregister(const int sock_fd);
+
+// RETURNS:
+//      pointer to the socket state: if socket is tracked
+//      NULL: if socket fd is out of the registry range
+static inline struct iccom_sock_state *__iccom_sock_state(const int sock_fd)
+{
+        if (sock_fd < 0 || sock_fd >= ICCOM_SOCK_REGISTRY_SIZE) {
+                return NULL;
+        }
+        return &__iccom_sock_registry[sock_fd];
+}
+
+// RETURNS:
+//      >= 0: the channel of the socket
+//      ICCOM_SOCK_CHANNEL_UNKNOWN: if the socket is not tracked
+static inline int __iccom_sock_channel(const int sock_fd)
+{
+        const struct iccom_sock_state *const st = __iccom_sock_state(sock_fd);
+        if (!st) {
+                return ICCOM_SOCK_CHANNEL_UNKNOWN;
+        }
+        return atomic_load_explicit(&st->channel_1, memory_order_relaxed) - 1;
+}
+
+#endif //ifndef LIBICCOM_SOCK_REGISTRY_H
@@ -0,0 +1,246 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the library threads placement shared by all ICCom
+ * modifications, see threads.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "iccom.h"
+#include "utils.h"
+#include "threads.h"
+
+/* ------------------- GLOBAL VARIABLES / CONSTANTS -------------------- */
+
+// @lock protects the struct
+// @roles the per role placement
+// @started the per role number of the started threads (spread order)
+// @isolated the CPUs the library threads don't run on
+static struct {
+        pthread_mutex_t lock;
+        iccom_thread_placement roles[ICCOM_THREAD_ROLES_COUNT];
+        unsigned int started[ICCOM_THREAD_ROLES_COUNT];
+        iccom_cpu_mask isolated;
+} placement = {
+        .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+// the thread name prefixes per role (the names are limited to 15 chars)
+static const char *const iccom_thread_names[ICCOM_THREAD_ROLES_COUNT] = {
+        "iccom-rx", "iccom-dw", "iccom-drx", "iccom-lb", "iccom-le"
+        , "iccom-vc", "iccom-cf"
+        , "iccom-br", "iccom-tx", "iccom-fr"
+};
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+static int iccom_cpu_mask_empty(const iccom_cpu_mask *const mask)
+{
+        for (size_t i = 0; i < sizeof(mask->bits) / sizeof(mask->bits[0]);
+                        i++) {
+                if (mask->bits[i]) {
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+static int iccom_cpu_mask_has(const iccom_cpu_mask *const mask
+                              , const unsigned int cpu)
+{
+        return (mask->bits[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+static void iccom_thread_set_affinity(const int role
+                                      , const iccom_thread_placement *const p
+                                      , const iccom_cpu_mask *const isolated
+                                      , const unsigned int index
+                                      , const int cpu)
+{
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (cpu >= 0) {
+                CPU_SET(cpu, &set);
+        } else {
+                const int all = iccom_cpu_mask_empty(&p->cpus);
+                if (all && iccom_cpu_mask_empty(isolated)) {
+                        return;
+                }
+                const long online = sysconf(_SC_NPROCESSORS_CONF);
+                const unsigned int max = (online > 0
+                                          && online < ICCOM_THREAD_MAX_CPUS)
+                                         ? (unsigned int)online
+                                         : ICCOM_THREAD_MAX_CPUS;
+                unsigned int count = 0;
+                unsigned int cpus[ICCOM_THREAD_MAX_CPUS];
+                for (unsigned int i = 0; i < max; i++) {
+                        if ((all || iccom_cpu_mask_has(&p->cpus, i))
+                                    && !iccom_cpu_mask_has(isolated, i)) {
+                                cpus[count++] = i;
+                        }
+                }
+                if (!count) {
+                        log("No CPU is left for the %s threads after the"
+                            " isolation, not placing them"
+                            , iccom_thread_names[role]);
+                        return;
+                }
+                if (p->spread) {
+                        CPU_SET(cpus[index % count], &set);
+                } else {
+                        for (unsigned int i = 0; i < count; i++) {
+                                CPU_SET(cpus[i], &set);
+                        }
+                }
+        }
+        const int res = pthread_setaffinity_np(pthread_self(), sizeof(set)
+                                               , &set);
+        if (res != 0) {
+                log("Could not set the %s thread affinity: %d(%s)"
+                    , iccom_thread_names[role], res, strerror(res));
+        }
+}
+
+static void iccom_thread_set_sched(const int role
+                                   , const iccom_thread_placement *const p)
+{
+        if (p->sched == ICCOM_SCHED_INHERIT) {
+                return;
+        }
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        int policy = SCHED_OTHER;
+        if (p->sched == ICCOM_SCHED_FIFO || p->sched == ICCOM_SCHED_RR) {
+                policy = (p->sched == ICCOM_SCHED_FIFO) ? SCHED_FIFO
+                                                        : SCHED_RR;
+                param.sched_priority = p->priority;
+        }
+        int res = pthread_setschedparam(pthread_self(), policy, &param);
+        if (res == 0 && policy == SCHED_OTHER
+                    && setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid)
+                                   , p->priority) < 0) {
+                res = errno;
+        }
+        if (res != 0) {
+                log("Could not set the %s thread scheduling: %d(%s)"
+                    , iccom_thread_names[role], res, strerror(res));
+        }
+}
+
+// See threads.h
+void __iccom_thread_place(const int role, const int cpu)
+{
+        if (role < 0 || role >= ICCOM_THREAD_ROLES_COUNT) {
+                return;
+        }
+        pthread_mutex_lock(&placement.lock);
+        const iccom_thread_placement p = placement.roles[role];
+        const iccom_cpu_mask isolated = placement.isolated;
+        const unsigned int index = placement.started[role]++;
+        pthread_mutex_unlock(&placement.lock);
+
+        char name[16];
+        snprintf(name, sizeof(name), "%s%u", iccom_thread_names[role], index);
+        pthread_setname_np(pthread_self(), name);
+
+        iccom_thread_set_affinity(role, &p, &isolated, index, cpu);
+        iccom_thread_set_sched(role, &p);
+}
+
+// See iccom.h
+int iccom_set_thread_placement(const int role
+                               , const iccom_thread_placement *const p)
+{
+        if (role < 0 || role >= ICCOM_THREAD_ROLES_COUNT) {
+                log("Unknown thread role: %d", role);
+                return -EINVAL;
+        }
+        if (p) {
+                switch (p->sched) {
+                case ICCOM_SCHED_INHERIT:
+                        break;
+                case ICCOM_SCHED_OTHER:
+                        if (p->priority < -20 || p->priority > 19) {
+                                log("The nice value %d is out of [-20; 19]"
+                                    , p->priority);
+                                return -EINVAL;
+                        }
+                        break;
+                case ICCOM_SCHED_FIFO:
+                case ICCOM_SCHED_RR: {
+                        const int policy = (p->sched == ICCOM_SCHED_FIFO)
+                                           ? SCHED_FIFO : SCHED_RR;
+                        if (p->priority < sched_get_priority_min(policy)
+                                    || p->priority
+                                       > sched_get_priority_max(policy)) {
+                                log("The real-time priority %d is out of"
+                                    " range", p->priority);
+                                return -EINVAL;
+                        }
+                        break;
+                }
+                default:
+                        log("Unknown scheduling policy: %d", p->sched);
+                        return -EINVAL;
+                }
+        }
+
+        pthread_mutex_lock(&placement.lock);
+        if (p) {
+                placement.roles[role] = *p;
+        } else {
+                memset(&placement.roles[role], 0
+                       , sizeof(placement.roles[role]));
+        }
+        placement.started[role] = 0;
+        pthread_mutex_unlock(&placement.lock);
+        return 0;
+}
+
+// See iccom.h
+int iccom_get_thread_placement(const int role
+                               , iccom_thread_placement *const out)
+{
+        if (role < 0 || role >= ICCOM_THREAD_ROLES_COUNT || !out) {
+                log("Unknown thread role (%d) or no output ptr", role);
+                return -EINVAL;
+        }
+        pthread_mutex_lock(&placement.lock);
+        *out = placement.roles[role];
+        pthread_mutex_unlock(&placement.lock);
+        return 0;
+}
+
+// See iccom.h
+int iccom_set_thread_isolation(const iccom_cpu_mask *const app_cpus)
+{
+        pthread_mutex_lock(&placement.lock);
+        if (app_cpus) {
+                placement.isolated = *app_cpus;
+        } else {
+                memset(&placement.isolated, 0, sizeof(placement.isolated));
+        }
+        pthread_mutex_unlock(&placement.lock);
+        return 0;
+}
@@ -0,0 +1,29 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+// Internal hook of the library threads placement, see the library
+// threads placement API in iccom.h.
+
+#ifndef LIBICCOM_THREADS_H
+#define LIBICCOM_THREADS_H
+
+/* -------------------- ROUTINES DECLARATIONS -------------------------- */
+
+// Applies the role placement to the calling library thread and names
+// the thread after its role. To be called by every library thread
+// right on its start.
+//
+// @role {ICCOM_THREAD_*} the thread role
+// @cpu the explicit CPU of the thread, <0 - the role placement decides
+void __iccom_thread_place(const int role, const int cpu);
+
+#endif //ifndef LIBICCOM_THREADS_H
@@ -16,9 +16,17 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <malloc.h>
+#include <alloca.h>
+#include <linux/netlink.h>
 
 #include "iccom.h"
 #include "utils.h"
+#include "sock_registry.h"
+#include "busy_poll.h"
 
 // See libiccom.h
 void iccom_print_hex_dump(const void *const data, const size_t len)
@@ -116,3 +124,306 @@ int __iccom_channel_verify(const unsigned int channel
         }
         return -EINVAL;
 }
+
+// Verifies the arguments of the nocopy send calls, see
+// @iccom_send_data_nocopy for their description.
+//
+// RETURNS:
+//      0: arguments are correct
+//      <0: negated error code to be returned to the caller
+int __iccom_nocopy_buf_verify(const void *const buf
+                              , const size_t buf_size_bytes
+                              , const size_t data_offset
+                              , const size_t data_size_bytes)
+{
+        if (buf_size_bytes != NLMSG_SPACE(data_size_bytes)) {
+                log("Buffer size %zu doesn't match data size %zu."
+                    , buf_size_bytes, data_size_bytes);
+                return -EINVAL;
+        }
+        if (data_offset != NLMSG_LENGTH(0)) {
+                log("The user data (message) offset %zu doesn't"
+                    " match expected value: %d."
+                    , data_offset, NLMSG_LENGTH(0));
+                return -EINVAL;
+        }
+        if (data_size_bytes > ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES) {
+                log("Can't send messages larger than: %d bytes."
+                    , ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES);
+                return -E2BIG;
+        }
+        if (data_size_bytes == 0) {
+                log("Message to send is of zero size. Nothing to send");
+                return -EINVAL;
+        }
+        if (!buf) {
+                log("Null buffer pointer. Nothing to send.");
+                return -EINVAL;
+        }
+        return 0;
+}
+
+// See iccom.h
+int iccom_set_socket_rcvbuf(const int sock_fd, const int bytes)
+{
+        if (bytes <= 0) {
+                log("The receive buffer size is to be > 0");
+                return -EINVAL;
+        }
+        if (setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUFFORCE
+                       , &bytes, sizeof(bytes)) == 0) {
+                return 0;
+        }
+        if (errno == EPERM && setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF
+                                         , &bytes, sizeof(bytes)) == 0) {
+                return 0;
+        }
+        const int err = errno;
+        log("Failed to set the receive buffer %d bytes for socket %d"
+            ", error: %d(%s)", bytes, sock_fd, err, strerror(err));
+        return -err;
+}
+
+// See iccom.h
+int iccom_get_socket_rcvbuf(const int sock_fd)
+{
+        int bytes = 0;
+        socklen_t size = sizeof(bytes);
+        if (getsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &bytes, &size) != 0) {
+                const int err = errno;
+                log("Failed to get the receive buffer size for socket %d"
+                    ", error: %d(%s)", sock_fd, err, strerror(err));
+                return -err;
+        }
+        return bytes;
+}
+
+// See iccom.h
+int iccom_set_socket_rcvbuf_auto(const int sock_fd, const int max_bytes)
+{
+        struct iccom_sock_state *const st = __iccom_sock_state(sock_fd);
+        if (!st) {
+                log("The socket %d is not tracked", sock_fd);
+                return -EBADF;
+        }
+        if (max_bytes < 0) {
+                log("The receive buffer limit is to be >= 0");
+                return -EINVAL;
+        }
+        atomic_store_explicit(&st->rcvbuf_auto_max, max_bytes
+                              , memory_order_relaxed);
+        atomic_store_explicit(&st->rcvbuf_capped, 0, memory_order_relaxed);
+        return 0;
+}
+
+// See iccom.h
+int iccom_get_socket_rx_stats(const int sock_fd
+                              , iccom_socket_rx_stats *const out)
+{
+        if (!out) {
+                log("no output ptr is provided");
+                return -EINVAL;
+        }
+        const struct iccom_sock_state *const st = __iccom_sock_state(sock_fd);
+        if (!st) {
+                return -EBADF;
+        }
+        out->overruns = atomic_load_explicit(&st->overruns
+                                             , memory_order_relaxed);
+        out->rcvbuf_grows = atomic_load_explicit(&st->rcvbuf_grows
+                                                 , memory_order_relaxed);
+        out->busy_poll_hits = atomic_load_explicit(&st->busy_poll_hits
+                                                   , memory_order_relaxed);
+        out->busy_poll_misses = atomic_load_explicit(&st->busy_poll_misses
+                                                     , memory_order_relaxed);
+        out->busy_poll_budget_ns = __iccom_busy_poll_budget(st);
+        out->nomem_drops = atomic_load_explicit(&st->nomem_drops
+                                                , memory_order_relaxed);
+        return 0;
+}
+
+// Accounts the socket receive queue overrun, and grows the socket
+// receive buffer if automatic sizing is enabled for it.
+//
+// @sock_fd the socket which reported the overrun
+void __iccom_rcvbuf_overrun(const int sock_fd)
+{
+        struct iccom_sock_state *const st = __iccom_sock_state(sock_fd);
+        if (!st) {
+                return;
+        }
+        const uint64_t overruns = atomic_fetch_add_explicit(
+                        &st->overruns, 1, memory_order_relaxed) + 1;
+
+        const int max = atomic_load_explicit(&st->rcvbuf_auto_max
+                                             , memory_order_relaxed);
+        // NOTE: the kernel reports the doubled size
+        const int current = (max && !atomic_load_explicit(&st->rcvbuf_capped
+                                                , memory_order_relaxed))
+                            ? iccom_get_socket_rcvbuf(sock_fd) / 2 : 0;
+        if (current > 0 && current < max) {
+                const int next = (current > max / 2) ? max : current * 2;
+                // NOTE: without CAP_NET_ADMIN the size is silently
+                //      clamped to rmem_max, so the result is read back
+                const int grown = iccom_set_socket_rcvbuf(sock_fd, next) == 0
+                                  ? iccom_get_socket_rcvbuf(sock_fd) / 2 : 0;
+                if (grown > current) {
+                        atomic_fetch_add_explicit(&st->rcvbuf_grows, 1
+                                                  , memory_order_relaxed);
+                        log("Socket %d receive queue overrun (%llu so far)"
+                            ", receive buffer grown to %d bytes", sock_fd
+                            , (unsigned long long)overruns, grown);
+                        return;
+                }
+                if (!atomic_exchange_explicit(&st->rcvbuf_capped, 1
+                                              , memory_order_relaxed)) {
+                        log("Socket %d receive buffer can't grow beyond %d"
+                            " bytes, the system limit is reached (see"
+                            " rmem_max)", sock_fd, current);
+                }
+        }
+        log("Socket %d receive queue overrun (%llu so far), messages lost"
+            , sock_fd, (unsigned long long)overruns);
+}
+
+// Accounts the message dropped by the receive for no buffer memory.
+//
+// @sock_fd the socket the message is dropped from
+// @size the dropped message size
+void __iccom_rx_nomem_drop(const int sock_fd, const size_t size)
+{
+        struct iccom_sock_state *const st = __iccom_sock_state(sock_fd);
+        if (st) {
+                atomic_fetch_add_explicit(&st->nomem_drops, 1
+                                          , memory_order_relaxed);
+        }
+        log("Could not allocate message buffer of size: %zu, socket %d"
+            ", message dropped", size, sock_fd);
+}
+
+// RETURNS: the @clock time in ns
+uint64_t __iccom_clock_ns(const clockid_t clock)
+{
+        struct timespec ts;
+        clock_gettime(clock, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// RETURNS: the CLOCK_MONOTONIC time in ns
+uint64_t __iccom_now_ns(void)
+{
+        return __iccom_clock_ns(CLOCK_MONOTONIC);
+}
+
+void __iccom_sleep_ns(const uint64_t ns)
+{
+        const struct timespec ts = {
+                .tv_sec = (time_t)(ns / 1000000000ull)
+                , .tv_nsec = (long)(ns % 1000000000ull)
+        };
+        nanosleep(&ts, NULL);
+}
+
+// Takes the socket for the library receive thread: opens the channel
+// socket if @sock_fd is ICCOM_OPEN_SOCKET, otherwise checks the caller
+// socket is the ICCom one (the zero initialized configuration would
+// give stdin) and saves its read timeout; then sets the read timeout.
+//
+// @channel the channel to open (if @sock_fd is ICCOM_OPEN_SOCKET)
+// @sock_fd the caller socket or ICCOM_OPEN_SOCKET
+// @timeout_ms the read timeout to set, <0 - not to touch the timeout
+// @out {valid ptr} where to write the socket to
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int __iccom_rx_socket_take(const unsigned int channel, const int sock_fd
+                           , const int timeout_ms
+                           , struct iccom_rx_socket *const out)
+{
+        out->fd = sock_fd;
+        out->own_fd = 0;
+        out->saved_timeout_ms = -1;
+        if (sock_fd == ICCOM_OPEN_SOCKET) {
+                out->fd = iccom_open_socket(channel);
+                if (out->fd < 0) {
+                        return out->fd;
+                }
+                out->own_fd = 1;
+        } else if (__iccom_sock_channel(sock_fd)
+                        == ICCOM_SOCK_CHANNEL_UNKNOWN) {
+                log("The socket %d is not an ICCom socket (use"
+                    " ICCOM_OPEN_SOCKET to open the channel)", sock_fd);
+                return -EBADF;
+        } else if (timeout_ms >= 0) {
+                out->saved_timeout_ms = iccom_get_socket_read_timeout(
+                                                sock_fd);
+        }
+        if (timeout_ms < 0) {
+                return 0;
+        }
+        const int res = iccom_set_socket_read_timeout(out->fd, timeout_ms);
+        if (res < 0) {
+                __iccom_rx_socket_release(out);
+        }
+        return res;
+}
+
+// Gives the socket taken by @__iccom_rx_socket_take back: closes the
+// own socket, restores the read timeout of the caller one.
+void __iccom_rx_socket_release(struct iccom_rx_socket *const sock)
+{
+        if (sock->own_fd) {
+                iccom_close_socket(sock->fd);
+        } else if (sock->saved_timeout_ms >= 0) {
+                iccom_set_socket_read_timeout(sock->fd
+                                              , sock->saved_timeout_ms);
+        }
+        sock->fd = -1;
+        sock->own_fd = 0;
+        sock->saved_timeout_ms = -1;
+}
+
+// Keeps the library receive thread from spinning when its receive call
+// gives nothing: the closed stream socket returns 0 at once (while the
+// real read timeout doesn't come that fast), and the persistent errors
+// (unlike the overrun and signal) return at once too.
+//
+// @res the receive call result, <=0
+// @start_ns the @__iccom_now_ns time the receive call started at
+void __iccom_rx_backoff(const int res, const uint64_t start_ns)
+{
+        if (res == 0) {
+                if (__iccom_now_ns() - start_ns < 1000000) {
+                        __iccom_sleep_ns(1000000);
+                }
+        } else if (res != -ENOBUFS && res != -EINTR) {
+                __iccom_sleep_ns(1000000);
+        }
+}
+
+// See iccom.h
+int iccom_rt_prepare(const size_t stack_bytes)
+{
+        int ret_val = 0;
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+                ret_val = -errno;
+                log("Could not lock the process memory: %d(%s)"
+                    , -ret_val, strerror(-ret_val));
+        }
+
+        // the freed memory stays in the heap, the big allocations come
+        // from the heap too
+        if (!mallopt(M_TRIM_THRESHOLD, -1) || !mallopt(M_MMAP_MAX, 0)) {
+                log("Could not tune the malloc");
+                ret_val = ret_val ? ret_val : -EINVAL;
+        }
+
+        const size_t size = stack_bytes ? stack_bytes : 64 * 1024;
+        volatile char *const stack = (volatile char *)alloca(size);
+        for (size_t i = 0; i < size; i += 4096) {
+                stack[i] = 0;
+        }
+        stack[size - 1] = 0;
+        return ret_val;
+}
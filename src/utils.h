@@ -16,11 +16,23 @@
 // NOTE: those utils which are exported as module IF, are declared
 //      in the iccom.h.
 
+#ifndef LIBICCOM_UTILS_H
+#define LIBICCOM_UTILS_H
+
+#include <stdint.h>
+#include <time.h>
+
 /* -------------------- BUILD TIME CONFIGURATION ----------------------- */
 
 #define LIBICCOM_LOG_PREFIX "libiccom: "
 // TODO: grab it from kernel header
 #define ICCOM_LOOPBACK_IF_CTRL_FILE_PATH "/proc/iccomif/loopbackctl"
+// the max number of messages handed to the kernel in a single syscall
+// by the batch send
+#define ICCOM_SEND_BATCH_CHUNK 64
+// the CPU cache line size, the data written by different threads is
+// aligned to it to avoid the false sharing
+#define ICCOM_CACHE_LINE_SIZE 64
 
 /* -------------------- MACRO DEFINITIONS ------------------------------ */
 
@@ -28,10 +40,51 @@
 #define ICCOM_CHANNEL_AREA_LOOPBACK 2
 #define ICCOM_CHANNEL_AREA_ANY 3
 
+#ifndef ICCOM_RT_PROFILE
 #define log(fmt, ...)                                                         \
         printf(LIBICCOM_LOG_PREFIX "%s: " fmt "\n", __func__, ## __VA_ARGS__);
+#else
+// the real-time profile library never prints, the errors are reported
+// by the return codes only (the arguments are still checked)
+#define log(fmt, ...)                                                         \
+        do {                                                                  \
+                if (0) {                                                      \
+                        printf(LIBICCOM_LOG_PREFIX "%s: " fmt "\n"             \
+                               , __func__, ## __VA_ARGS__);                   \
+                }                                                             \
+        } while (0);
+#endif
 
 /* -------------------- ROUTINES DECLARATIONS -------------------------- */
 
 int __iccom_channel_verify(const unsigned int channel
         , const int area, const char* const comment);
+int __iccom_nocopy_buf_verify(const void *const buf
+                              , const size_t buf_size_bytes
+                              , const size_t data_offset
+                              , const size_t data_size_bytes);
+void __iccom_rcvbuf_overrun(const int sock_fd);
+void __iccom_rx_nomem_drop(const int sock_fd, const size_t size);
+uint64_t __iccom_clock_ns(const clockid_t clock);
+uint64_t __iccom_now_ns(void);
+void __iccom_sleep_ns(const uint64_t ns);
+
+// The socket of the library receive thread.
+//
+// @fd the socket
+// @own_fd !0 if the socket is opened by the library
+// @saved_timeout_ms the read timeout of the caller socket to restore,
+//      <0 if none
+struct iccom_rx_socket {
+        int fd;
+        int own_fd;
+        int saved_timeout_ms;
+};
+
+int __iccom_rx_socket_take(const unsigned int channel, const int sock_fd
+                           , const int timeout_ms
+                           , struct iccom_rx_socket *const out);
+void __iccom_rx_socket_release(struct iccom_rx_socket *const sock);
+void __iccom_rx_backoff(const int res, const uint64_t start_ns);
+
+#endif //ifndef LIBICCOM_UTILS_H
@@ -0,0 +1,420 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* This file provides the virtual clock of the network sockets ICCom
+ * modification (see the virtual clock API in iccom.h).
+ *
+ * The virtual time is the CLOCK_MONOTONIC time plus the offset, which
+ * grows with every jump. Every virtual wait (receive with timeout,
+ * virtual sleep) registers itself as a waiter with its virtual deadline
+ * and waits in poll(...) on the socket and its own wake eventfd. The
+ * advancer thread watches the idle participants count, and once all
+ * participants stayed idle for the quiet period, moves the offset to
+ * the nearest waiter deadline and wakes the waiters to recompute their
+ * real time left.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "iccom.h"
+#include "utils.h"
+#include "threads.h"
+#include "vclock.h"
+
+/* -------------------- BUILD TIME CONFIGURATION ----------------------- */
+
+#define ICCOM_VCLOCK_DEFAULT_QUIET_US 1000
+
+/* -------------------- MACRO DEFINITIONS ------------------------------ */
+
+#define ICCOM_VCLOCK_NO_DEADLINE UINT64_MAX
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+// The thread waiting on the virtual clock.
+//
+// @prev, @next the waiters list links
+// @deadline_ns the virtual deadline, ICCOM_VCLOCK_NO_DEADLINE if none
+// @wake_fd the eventfd to wake the waiter up on the clock jump
+struct iccom_vc_waiter {
+        struct iccom_vc_waiter *prev;
+        struct iccom_vc_waiter *next;
+        uint64_t deadline_ns;
+        int wake_fd;
+};
+
+// @ctl_lock serializes the enable/disable calls
+// @lock protects all fields below but @offset_ns
+// @cond signalled on every participant state change
+// @enabled !0 while the clock is enabled
+// @thread_up !0 while the advancer thread is to be joined
+// @advancer the advancer thread
+// @cfg the current configuration
+// @idle the number of the idle participants (the waiters)
+// @epoch incremented on every participant state change
+// @waiters the waiters list
+// @offset_ns the virtual time offset to the CLOCK_MONOTONIC
+// @stats the virtual clock counters
+static struct {
+        pthread_mutex_t ctl_lock;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        int enabled;
+        int thread_up;
+        pthread_t advancer;
+        iccom_vclock_cfg cfg;
+        unsigned int idle;
+        uint64_t epoch;
+        struct iccom_vc_waiter *waiters;
+        _Atomic uint64_t offset_ns;
+        iccom_vclock_stats stats;
+} vc = {
+        .ctl_lock = PTHREAD_MUTEX_INITIALIZER
+        , .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static pthread_once_t iccom_vc_init_once = PTHREAD_ONCE_INIT;
+
+_Atomic int __iccom_vclock_on = 0;
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+static struct timespec iccom_vc_timespec(const uint64_t ns)
+{
+        const struct timespec ts = {
+                .tv_sec = (time_t)(ns / 1000000000ull)
+                , .tv_nsec = (long)(ns % 1000000000ull)
+        };
+        return ts;
+}
+
+// The advancer waits on CLOCK_MONOTONIC, so the quiet periods are not
+// affected by the wall clock changes.
+static void iccom_vc_init(void)
+{
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&vc.cond, &attr);
+        pthread_condattr_destroy(&attr);
+}
+
+// Wakes all waiters up to recompute their deadlines.
+//
+// NOTE: to be called under the vc.lock
+static void iccom_vc_wake_all(void)
+{
+        const uint64_t one = 1;
+        for (struct iccom_vc_waiter *w = vc.waiters; w; w = w->next) {
+                if (write(w->wake_fd, &one, sizeof(one)) < 0) {
+                        // the counter is already non-zero
+                }
+        }
+}
+
+// RETURNS: the nearest waiter deadline, ICCOM_VCLOCK_NO_DEADLINE if
+//      there are no waiters with deadline
+//
+// NOTE: to be called under the vc.lock
+static uint64_t iccom_vc_nearest_deadline(void)
+{
+        uint64_t nearest = ICCOM_VCLOCK_NO_DEADLINE;
+        for (struct iccom_vc_waiter *w = vc.waiters; w; w = w->next) {
+                if (w->deadline_ns < nearest) {
+                        nearest = w->deadline_ns;
+                }
+        }
+        return nearest;
+}
+
+// The advancer thread: jumps the clock when all participants stay idle
+// for the quiet period.
+static void *iccom_vc_advancer(void *arg)
+{
+        (void)arg;
+        __iccom_thread_place(ICCOM_THREAD_VCLOCK, -1);
+        pthread_mutex_lock(&vc.lock);
+        while (vc.enabled) {
+                if (vc.idle < vc.cfg.participants
+                            || iccom_vc_nearest_deadline()
+                               == ICCOM_VCLOCK_NO_DEADLINE) {
+                        pthread_cond_wait(&vc.cond, &vc.lock);
+                        continue;
+                }
+
+                const uint64_t epoch = vc.epoch;
+                const uint32_t quiet_us = vc.cfg.quiet_us
+                                          ? vc.cfg.quiet_us
+                                          : ICCOM_VCLOCK_DEFAULT_QUIET_US;
+                const struct timespec quiet_end = iccom_vc_timespec(
+                                __iccom_now_ns() + (uint64_t)quiet_us * 1000);
+                pthread_cond_timedwait(&vc.cond, &vc.lock, &quiet_end);
+                if (!vc.enabled || vc.epoch != epoch
+                            || vc.idle < vc.cfg.participants) {
+                        continue;
+                }
+
+                const uint64_t nearest = iccom_vc_nearest_deadline();
+                const uint64_t now = iccom_vclock_now_ns();
+                if (nearest != ICCOM_VCLOCK_NO_DEADLINE && nearest > now) {
+                        atomic_fetch_add(&vc.offset_ns, nearest - now);
+                        vc.stats.jumps++;
+                        vc.stats.skipped_ns += nearest - now;
+                }
+                iccom_vc_wake_all();
+        }
+        pthread_mutex_unlock(&vc.lock);
+        return NULL;
+}
+
+// Waits till the socket gets readable or the virtual deadline comes,
+// the calling thread is an idle participant meanwhile.
+//
+// @sock_fd the socket to wait for, <0 - just wait for the deadline
+// @deadline_ns the virtual deadline, ICCOM_VCLOCK_NO_DEADLINE if none
+//
+// RETURNS:
+//      1: the socket is readable, or the clock is disabled (nothing
+//          waited then)
+//      0: the deadline came
+//      <0: negated error code
+static int iccom_vc_wait(const int sock_fd, const uint64_t deadline_ns)
+{
+        struct iccom_vc_waiter w = {
+                .prev = NULL
+                , .next = NULL
+                , .deadline_ns = deadline_ns
+                , .wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)
+        };
+        if (w.wake_fd < 0) {
+                const int err = errno;
+                log("Could not create the virtual clock wake fd: %d(%s)"
+                    , err, strerror(err));
+                return -err;
+        }
+
+        pthread_mutex_lock(&vc.lock);
+        if (!vc.enabled) {
+                pthread_mutex_unlock(&vc.lock);
+                close(w.wake_fd);
+                return 1;
+        }
+        w.next = vc.waiters;
+        if (vc.waiters) {
+                vc.waiters->prev = &w;
+        }
+        vc.waiters = &w;
+        vc.idle++;
+        vc.epoch++;
+        pthread_cond_signal(&vc.cond);
+        pthread_mutex_unlock(&vc.lock);
+
+        // NOTE: when the clock gets disabled meanwhile, the wait just
+        //      continues on the real time
+        int res;
+        while (1) {
+                const uint64_t now = iccom_vclock_now_ns();
+                if (deadline_ns != ICCOM_VCLOCK_NO_DEADLINE
+                            && now >= deadline_ns) {
+                        res = 0;
+                        break;
+                }
+                struct pollfd fds[2] = {
+                        { .fd = w.wake_fd, .events = POLLIN }
+                        , { .fd = sock_fd, .events = POLLIN }
+                };
+                const nfds_t count = (sock_fd >= 0) ? 2 : 1;
+                struct timespec left;
+                if (deadline_ns != ICCOM_VCLOCK_NO_DEADLINE) {
+                        left = iccom_vc_timespec(deadline_ns - now);
+                }
+                const int poll_res = ppoll(fds, count
+                                           , (deadline_ns
+                                              != ICCOM_VCLOCK_NO_DEADLINE)
+                                             ? &left : NULL
+                                           , NULL);
+                if (poll_res < 0) {
+                        res = -errno;
+                        break;
+                }
+                if (fds[0].revents) {
+                        uint64_t value;
+                        if (read(w.wake_fd, &value, sizeof(value)) < 0) {
+                                // nothing to reset
+                        }
+                }
+                if (count > 1 && fds[1].revents) {
+                        res = 1;
+                        break;
+                }
+        }
+
+        pthread_mutex_lock(&vc.lock);
+        if (w.prev) {
+                w.prev->next = w.next;
+        } else {
+                vc.waiters = w.next;
+        }
+        if (w.next) {
+                w.next->prev = w.prev;
+        }
+        vc.idle--;
+        vc.epoch++;
+        pthread_cond_signal(&vc.cond);
+        pthread_mutex_unlock(&vc.lock);
+
+        close(w.wake_fd);
+        return res;
+}
+
+// See vclock.h
+int __iccom_vclock_wait_readable(const int sock_fd)
+{
+        const int flags = fcntl(sock_fd, F_GETFL);
+        if (flags < 0) {
+                return -errno;
+        }
+        if (flags & O_NONBLOCK) {
+                return 1;
+        }
+        const int timeout_ms = iccom_get_socket_read_timeout(sock_fd);
+        if (timeout_ms < 0) {
+                return timeout_ms;
+        }
+        return iccom_vc_wait(sock_fd, timeout_ms
+                                      ? iccom_vclock_now_ns()
+                                        + (uint64_t)timeout_ms * 1000000
+                                      : ICCOM_VCLOCK_NO_DEADLINE);
+}
+
+// See iccom.h
+int iccom_vclock_enable(const iccom_vclock_cfg *const cfg)
+{
+        if (!cfg || cfg->participants == 0) {
+                log("no configuration or no participants");
+                return -EINVAL;
+        }
+        pthread_once(&iccom_vc_init_once, iccom_vc_init);
+
+        pthread_mutex_lock(&vc.ctl_lock);
+        pthread_mutex_lock(&vc.lock);
+        vc.cfg = *cfg;
+        if (vc.enabled) {
+                pthread_cond_signal(&vc.cond);
+                pthread_mutex_unlock(&vc.lock);
+                pthread_mutex_unlock(&vc.ctl_lock);
+                return 0;
+        }
+        memset(&vc.stats, 0, sizeof(vc.stats));
+        vc.enabled = 1;
+        pthread_mutex_unlock(&vc.lock);
+
+        const int res = pthread_create(&vc.advancer, NULL, iccom_vc_advancer
+                                       , NULL);
+        if (res != 0) {
+                log("Could not start the virtual clock thread: %d(%s)"
+                    , res, strerror(res));
+                pthread_mutex_lock(&vc.lock);
+                vc.enabled = 0;
+                pthread_mutex_unlock(&vc.lock);
+                pthread_mutex_unlock(&vc.ctl_lock);
+                return -res;
+        }
+        vc.thread_up = 1;
+        atomic_store_explicit(&__iccom_vclock_on, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&vc.ctl_lock);
+        return 0;
+}
+
+// See iccom.h
+int iccom_vclock_disable(void)
+{
+        pthread_mutex_lock(&vc.ctl_lock);
+        if (!vc.thread_up) {
+                pthread_mutex_unlock(&vc.ctl_lock);
+                return 0;
+        }
+        atomic_store_explicit(&__iccom_vclock_on, 0, memory_order_relaxed);
+        pthread_mutex_lock(&vc.lock);
+        vc.enabled = 0;
+        pthread_cond_signal(&vc.cond);
+        pthread_mutex_unlock(&vc.lock);
+
+        pthread_join(vc.advancer, NULL);
+        vc.thread_up = 0;
+        pthread_mutex_unlock(&vc.ctl_lock);
+        return 0;
+}
+
+// See iccom.h
+int iccom_vclock_leave(void)
+{
+        pthread_mutex_lock(&vc.lock);
+        if (!vc.enabled) {
+                pthread_mutex_unlock(&vc.lock);
+                return -ENODEV;
+        }
+        if (vc.cfg.participants > 0) {
+                vc.cfg.participants--;
+        }
+        vc.epoch++;
+        pthread_cond_signal(&vc.cond);
+        pthread_mutex_unlock(&vc.lock);
+        return 0;
+}
+
+// See iccom.h
+uint64_t iccom_vclock_now_ns(void)
+{
+        return __iccom_now_ns()
+               + atomic_load_explicit(&vc.offset_ns, memory_order_relaxed);
+}
+
+// See iccom.h
+int iccom_vclock_sleep_us(const uint64_t us)
+{
+        if (__iccom_vclock_active()) {
+                const int res = iccom_vc_wait(-1, iccom_vclock_now_ns()
+                                                  + us * 1000);
+                if (res <= 0) {
+                        return res;
+                }
+        }
+        const struct timespec ts = iccom_vc_timespec(us * 1000);
+        return -clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+}
+
+// See iccom.h
+int iccom_vclock_get_stats(iccom_vclock_stats *const out)
+{
+        if (!out) {
+                log("no output ptr is provided");
+                return -EINVAL;
+        }
+        pthread_mutex_lock(&vc.lock);
+        const int enabled = vc.enabled;
+        *out = vc.stats;
+        pthread_mutex_unlock(&vc.lock);
+        return enabled ? 0 : -ENODEV;
+}
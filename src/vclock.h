@@ -0,0 +1,45 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+// Internal hooks of the virtual clock of the network sockets ICCom
+// modification, see the virtual clock API in iccom.h.
+
+#ifndef LIBICCOM_VCLOCK_H
+#define LIBICCOM_VCLOCK_H
+
+#include <stdatomic.h>
+
+/* -------------------- ROUTINES DECLARATIONS -------------------------- */
+
+extern _Atomic int __iccom_vclock_on;
+
+// Waits for the socket to become readable within its read timeout
+// counted on the virtual clock. The calling thread is an idle
+// participant meanwhile.
+//
+// RETURNS:
+//      1: the socket is readable, or it is to be read as usual
+//          (non-blocking socket, the clock got disabled)
+//      0: the read timeout expired
+//      <0: negated error code
+int __iccom_vclock_wait_readable(const int sock_fd);
+
+// RETURNS:
+//      !0: the virtual clock is enabled (costs a single relaxed load)
+//      0: otherwise
+static inline int __iccom_vclock_active(void)
+{
+        return atomic_load_explicit(&__iccom_vclock_on
+                                    , memory_order_relaxed);
+}
+
+#endif //ifndef LIBICCOM_VCLOCK_H
@@ -0,0 +1,235 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* The socket filter test: the compiled BPF program (netlink
+ * modification) and the library evaluation (network sockets
+ * modification) take the same decision as the rules say on a table
+ * of payloads.
+ *
+ * NOTE: the BPF program is run by the kernel: it is attached to the
+ *      receiving end of the local datagram socket pair, and the
+ *      payloads are sent to it as the kernel ICCom modification
+ *      delivers them (the netlink header + payload), so the dropped
+ *      ones never arrive.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/filter.h>
+
+#include "iccom.h"
+#include "filter.h"
+
+#define ICCOM_TEST_MAX_PAYLOAD 32
+
+// The table entry: the payload and the expected filter decision.
+//
+// @bytes the first payload bytes, the rest are zero
+// @size the payload size
+// @pass !0 when the payload is to pass the filter
+struct iccom_test_payload {
+        unsigned char bytes[ICCOM_TEST_MAX_PAYLOAD];
+        size_t size;
+        int pass;
+};
+
+// the rule kinds: the byte field, the masked half-word field within
+// the size range, the full word field (no mask applied), the size only
+static const iccom_filter_rule iccom_test_rules[] = {
+        { .offset = 0, .width = 1, .mask = 0xff, .value = 0x42 }
+        , { .offset = 2, .width = 2, .mask = 0xfff0, .value = 0x1230
+            , .min_size = 8, .max_size = 16 }
+        , { .offset = 4, .width = 4, .mask = 0xffffffff
+            , .value = 0xdeadbeef }
+        , { .min_size = 100 }
+};
+
+static const struct iccom_test_payload iccom_test_payloads[] = {
+        { .bytes = {0x42}, .size = 1, .pass = 1 }
+        , { .bytes = {0x41}, .size = 1, .pass = 0 }
+        , { .bytes = {0}, .size = 0, .pass = 0 }
+        , { .bytes = {0, 0, 0x12, 0x3f}, .size = 8, .pass = 1 }
+        , { .bytes = {0, 0, 0x12, 0x3f}, .size = 16, .pass = 1 }
+        // out of the size range
+        , { .bytes = {0, 0, 0x12, 0x30}, .size = 4, .pass = 0 }
+        , { .bytes = {0, 0, 0x12, 0x30}, .size = 17, .pass = 0 }
+        // masked out bits differ
+        , { .bytes = {0, 0, 0x13, 0x30}, .size = 8, .pass = 0 }
+        , { .bytes = {0, 0, 0, 0, 0xde, 0xad, 0xbe, 0xef}, .size = 8
+            , .pass = 1 }
+        // the field doesn't fit the payload
+        , { .bytes = {0, 0, 0, 0, 0xde, 0xad, 0xbe}, .size = 7, .pass = 0 }
+        , { .bytes = {0, 0, 0, 0, 0xde, 0xad, 0xbe, 0xee}, .size = 8
+            , .pass = 0 }
+        , { .bytes = {0}, .size = 99, .pass = 0 }
+        , { .bytes = {0}, .size = 100, .pass = 1 }
+        , { .bytes = {0}, .size = ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES
+            , .pass = 1 }
+};
+
+// RETURNS:
+//      !0: the compiled @rules program let the @payload through
+//      0: the program dropped it
+//      <0: on failure
+static int iccom_test_bpf_pass(const iccom_filter_rule *const rules
+                               , const size_t count
+                               , const struct iccom_test_payload *const p)
+{
+        struct sock_filter prog[ICCOM_FILTER_MAX_INSNS];
+        const struct sock_fprog fprog = {
+                .len = (unsigned short)__iccom_filter_compile(rules, count
+                                                              , prog)
+                , .filter = prog
+        };
+
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) != 0) {
+                printf("FAIL: could not create the socket pair: %d\n"
+                       , errno);
+                return -1;
+        }
+        int res = -1;
+        if (setsockopt(fds[1], SOL_SOCKET, SO_ATTACH_FILTER, &fprog
+                       , sizeof(fprog)) != 0) {
+                printf("FAIL: the compiled filter is rejected: %d\n"
+                       , errno);
+                goto close_pair;
+        }
+
+        static unsigned char msg[NLMSG_SPACE(
+                                ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES)];
+        memset(msg, 0, sizeof(msg));
+        struct nlmsghdr *const hdr = (struct nlmsghdr *)msg;
+        hdr->nlmsg_len = NLMSG_LENGTH(p->size);
+        memcpy(NLMSG_DATA(hdr), p->bytes, sizeof(p->bytes));
+
+        if (send(fds[0], msg, hdr->nlmsg_len, 0) != (ssize_t)hdr->nlmsg_len) {
+                printf("FAIL: could not send the message: %d\n", errno);
+                goto close_pair;
+        }
+        const ssize_t received = recv(fds[1], msg, sizeof(msg)
+                                      , MSG_DONTWAIT);
+        if (received < 0 && errno != EAGAIN) {
+                printf("FAIL: could not receive the message: %d\n", errno);
+                goto close_pair;
+        }
+        res = received > 0;
+
+close_pair:
+        close(fds[0]);
+        close(fds[1]);
+        return res;
+}
+
+// Checks the BPF program, the rules match and the socket filter of the
+// @sock_fd take the same expected decision on every table payload.
+//
+// RETURNS:
+//      0: on success
+//      <0: on failure
+static int iccom_test_rules_check(const int sock_fd
+                                  , const iccom_filter_rule *const rules
+                                  , const size_t count
+                                  , const struct iccom_test_payload *const p
+                                  , const size_t payloads_count)
+{
+        if (__iccom_filter_verify(rules, count) != 0) {
+                printf("FAIL: the rules are rejected\n");
+                return -1;
+        }
+        if (__iccom_sock_filter_set(sock_fd, rules, count) != 0) {
+                printf("FAIL: could not set the socket filter\n");
+                return -1;
+        }
+
+        int res = 0;
+        for (size_t i = 0; i < payloads_count && res == 0; i++) {
+                static unsigned char payload[
+                                ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES];
+                memset(payload, 0, sizeof(payload));
+                memcpy(payload, p[i].bytes, sizeof(p[i].bytes));
+
+                const int bpf = iccom_test_bpf_pass(rules, count, &p[i]);
+                const int match = !!__iccom_filter_match(rules, count
+                                                         , payload
+                                                         , p[i].size);
+                const int lib = !!__iccom_sock_filter_pass(sock_fd, payload
+                                                           , p[i].size);
+                if (bpf < 0) {
+                        res = -1;
+                } else if (bpf != p[i].pass || match != p[i].pass
+                           || lib != p[i].pass) {
+                        printf("FAIL: payload %zu (size %zu): bpf %d"
+                               ", match %d, library %d, expected %d\n"
+                               , i, p[i].size, bpf, match, lib
+                               , p[i].pass);
+                        res = -1;
+                }
+        }
+        __iccom_sock_filter_set(sock_fd, NULL, 0);
+        return res;
+}
+
+// The max rules filter, only the last rule matches: the jumps to the
+// next rule block are to stay within the program.
+static int iccom_test_max_rules(const int sock_fd)
+{
+        iccom_filter_rule rules[ICCOM_FILTER_MAX_RULES];
+        memset(rules, 0, sizeof(rules));
+        for (size_t i = 0; i < ICCOM_FILTER_MAX_RULES; i++) {
+                rules[i].width = 1;
+                rules[i].mask = 0xff;
+                rules[i].value = (uint32_t)i;
+                rules[i].max_size = 1;
+        }
+        const struct iccom_test_payload payloads[] = {
+                { .bytes = {ICCOM_FILTER_MAX_RULES - 1}, .size = 1
+                  , .pass = 1 }
+                , { .bytes = {ICCOM_FILTER_MAX_RULES}, .size = 1
+                    , .pass = 0 }
+                , { .bytes = {0}, .size = 2, .pass = 0 }
+        };
+        return iccom_test_rules_check(sock_fd, rules, ICCOM_FILTER_MAX_RULES
+                        , payloads, sizeof(payloads) / sizeof(payloads[0]));
+}
+
+int main(void)
+{
+        // any fd within the socket registry range serves for the
+        // library evaluation
+        const int sock_fd = dup(STDOUT_FILENO);
+        if (sock_fd < 0) {
+                printf("FAIL: could not get the socket fd\n");
+                return EXIT_FAILURE;
+        }
+
+        int res = iccom_test_rules_check(sock_fd, iccom_test_rules
+                        , sizeof(iccom_test_rules) / sizeof(iccom_test_rules[0])
+                        , iccom_test_payloads
+                        , sizeof(iccom_test_payloads)
+                          / sizeof(iccom_test_payloads[0]));
+        if (res == 0) {
+                res = iccom_test_max_rules(sock_fd);
+        }
+        close(sock_fd);
+
+        if (res < 0) {
+                return EXIT_FAILURE;
+        }
+        printf("OK\n");
+        return EXIT_SUCCESS;
+}
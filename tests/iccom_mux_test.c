@@ -0,0 +1,131 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* The sub-channel header test: the LEB128 ids at the encoding size
+ * edges survive the write/parse round trip, the over-long, overflowing
+ * and truncated headers are rejected.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "iccom_mux.h"
+
+// The round trip table entry.
+//
+// @sub_id the sub-channel id
+// @size the expected header size
+struct iccom_test_id {
+        uint32_t sub_id;
+        size_t size;
+};
+
+// The malformed header table entry.
+//
+// @bytes the header bytes
+// @size the payload size
+struct iccom_test_header {
+        uint8_t bytes[ICCOM_MUX_MAX_HEADER_SIZE + 1];
+        size_t size;
+};
+
+static const struct iccom_test_id iccom_test_ids[] = {
+        { 0, 1 }
+        , { 127, 1 }
+        , { 128, 2 }
+        , { 16383, 2 }
+        , { 16384, 3 }
+        , { (1u << 21) - 1, 3 }
+        , { 1u << 21, 4 }
+        , { (1u << 28) - 1, 4 }
+        , { 1u << 28, 5 }
+        , { UINT32_MAX, 5 }
+};
+
+static const struct iccom_test_header iccom_test_malformed[] = {
+        // empty payload
+        { { 0 }, 0 }
+        // truncated: the continuation bit set on the last payload byte
+        , { { 0x80 }, 1 }
+        , { { 0xff, 0xff }, 2 }
+        , { { 0xff, 0xff, 0xff, 0xff }, 4 }
+        // the fifth byte carries more than the 4 remaining id bits
+        , { { 0xff, 0xff, 0xff, 0xff, 0x10 }, 5 }
+        , { { 0x80, 0x80, 0x80, 0x80, 0x7f }, 5 }
+        // longer than the max header
+        , { { 0xff, 0xff, 0xff, 0xff, 0x8f, 0x00 }, 6 }
+};
+
+static int iccom_test_round_trip(void)
+{
+        for (size_t i = 0; i < sizeof(iccom_test_ids)
+                                / sizeof(iccom_test_ids[0]); i++) {
+                const struct iccom_test_id *const t = &iccom_test_ids[i];
+                // the header is followed by the data byte, which is not
+                // to be taken for the header
+                uint8_t payload[ICCOM_MUX_MAX_HEADER_SIZE + 1];
+                memset(payload, 0xAA, sizeof(payload));
+
+                const size_t written = iccom_mux_write_header(t->sub_id
+                                                              , payload);
+                uint32_t parsed_id = 0;
+                const int parsed = iccom_mux_parse(payload, sizeof(payload)
+                                                   , &parsed_id);
+                if (iccom_mux_header_size(t->sub_id) != t->size
+                                || written != t->size
+                                || parsed != (int)t->size
+                                || parsed_id != t->sub_id) {
+                        printf("FAIL: id %u: header size %zu, written %zu"
+                               ", parsed %d as id %u, expected size %zu\n"
+                               , t->sub_id
+                               , iccom_mux_header_size(t->sub_id), written
+                               , parsed, parsed_id, t->size);
+                        return -1;
+                }
+                // the exact size payload (the header only) is valid too
+                if (iccom_mux_parse(payload, t->size, &parsed_id)
+                                != (int)t->size) {
+                        printf("FAIL: id %u: the header only payload is"
+                               " rejected\n", t->sub_id);
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+static int iccom_test_reject(void)
+{
+        for (size_t i = 0; i < sizeof(iccom_test_malformed)
+                                / sizeof(iccom_test_malformed[0]); i++) {
+                const struct iccom_test_header *const t
+                        = &iccom_test_malformed[i];
+                uint32_t sub_id = 0;
+                const int res = iccom_mux_parse(t->bytes, t->size, &sub_id);
+                if (res != -EBADMSG) {
+                        printf("FAIL: malformed header %zu: parsed %d as"
+                               " id %u\n", i, res, sub_id);
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+int main(void)
+{
+        if (iccom_test_round_trip() < 0 || iccom_test_reject() < 0) {
+                return EXIT_FAILURE;
+        }
+        printf("OK\n");
+        return EXIT_SUCCESS;
+}
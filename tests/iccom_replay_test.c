@@ -0,0 +1,240 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* The replay engine test: the malformed records of the capture file
+ * are skipped, the valid ones are sent in their timestamp order.
+ *
+ * NOTE: the test is linked against the shared library, cause it
+ *      substitutes the iccom_open_socket(...) to run without the
+ *      ICCom stack: the frames go to the local TCP connection, which
+ *      takes both the datagram (the netlink destination address is
+ *      ignored by TCP) and the stream frames, the test reads them
+ *      back from the peer end.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+
+#include "iccom.h"
+
+#define ICCOM_TEST_CHANNEL 1
+#define ICCOM_TEST_ORIG_SIZE 16
+// the size of the valid record stored last but stamped first
+#define ICCOM_TEST_EARLY_SIZE 8
+
+// the peer end of the last substitute socket
+static int iccom_test_peer_fd = -1;
+
+// Overrides the library iccom_open_socket(...), so the replay engine
+// gets the substitute socket instead of the real ICCom channel: the
+// local TCP connection, its peer end is kept in @iccom_test_peer_fd.
+int iccom_open_socket(const unsigned int channel)
+{
+        (void)channel;
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        const int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd < 0) {
+                return -1;
+        }
+        int sock_fd = -1;
+        if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0
+                    && listen(listen_fd, 1) == 0
+                    && getsockname(listen_fd, (struct sockaddr *)&addr
+                                   , &addr_len) == 0) {
+                sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+        }
+        if (sock_fd >= 0 && connect(sock_fd, (struct sockaddr *)&addr
+                                    , sizeof(addr)) == 0) {
+                iccom_test_peer_fd = accept(listen_fd, NULL, NULL);
+        }
+        close(listen_fd);
+        if (iccom_test_peer_fd < 0 && sock_fd >= 0) {
+                close(sock_fd);
+                sock_fd = -1;
+        }
+        return sock_fd;
+}
+
+// Reads the next frame from the substitute socket peer end and checks
+// it carries the valid record payload of @expected_size bytes.
+//
+// RETURNS:
+//      0: on success
+//      <0: on failure
+static int iccom_test_check_frame(const size_t expected_size)
+{
+        struct nlmsghdr hdr;
+        unsigned char payload[ICCOM_TEST_ORIG_SIZE + NLMSG_ALIGNTO];
+        if (read(iccom_test_peer_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+                printf("FAIL: no frame header on the peer end\n");
+                return -1;
+        }
+#ifdef ICCOM_TEST_NETWORK_SOCKETS
+        const size_t size = hdr.nlmsg_len;
+        const size_t rest = NLMSG_SPACE(size) - sizeof(hdr);
+#else
+        const size_t size = hdr.nlmsg_len - NLMSG_LENGTH(0);
+        const size_t rest = hdr.nlmsg_len - sizeof(hdr);
+#endif
+        if (size != expected_size || rest > sizeof(payload)
+                    || read(iccom_test_peer_fd, payload, rest)
+                       != (ssize_t)rest) {
+                printf("FAIL: the frame payload size %zu, expected %zu\n"
+                       , size, expected_size);
+                return -1;
+        }
+        for (size_t i = 0; i < size; i++) {
+                if (payload[i] != 0xAA) {
+                        printf("FAIL: the payload byte %zu is %#x\n"
+                               , i, payload[i]);
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+// Appends a record with given timestamp, sizes and 0xAA payload of
+// @cap_size bytes.
+static int iccom_test_write_record(FILE *const f, const uint64_t ts_ns
+                                   , const uint32_t orig_size
+                                   , const uint32_t cap_size)
+{
+        iccom_capture_record_header rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.record_size = (uint32_t)sizeof(rec) + cap_size;
+        rec.timestamp_ns = ts_ns;
+        rec.direction = ICCOM_CAPTURE_DIR_TX;
+        rec.channel = ICCOM_TEST_CHANNEL;
+        rec.orig_size = orig_size;
+        rec.cap_size = cap_size;
+
+        if (fwrite(&rec, sizeof(rec), 1, f) != 1) {
+                return -1;
+        }
+        for (uint32_t i = 0; i < cap_size; i++) {
+                if (fputc(0xAA, f) == EOF) {
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+// Writes the capture file: the bad cap_size records around the valid
+// one, then the valid one stamped before all of them.
+static int iccom_test_write_capture(FILE *const f)
+{
+        iccom_capture_file_header hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = ICCOM_CAPTURE_MAGIC;
+        hdr.version = ICCOM_CAPTURE_VERSION;
+        hdr.header_size = (uint16_t)sizeof(hdr);
+        hdr.snaplen = ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES;
+
+        if (fwrite(&hdr, sizeof(hdr), 1, f) != 1
+                    // more stored than original
+                    || iccom_test_write_record(f, 2000000, ICCOM_TEST_ORIG_SIZE
+                                               , ICCOM_TEST_ORIG_SIZE + 1) < 0
+                    || iccom_test_write_record(f, 2000000, ICCOM_TEST_ORIG_SIZE
+                                               , ICCOM_TEST_ORIG_SIZE) < 0
+                    // more stored than a message may ever be
+                    || iccom_test_write_record(f, 2000000, ICCOM_TEST_ORIG_SIZE
+                                , ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES * 2) < 0
+                    || iccom_test_write_record(f, 2000000
+                                , ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES
+                                , ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES + 1) < 0
+                    || iccom_test_write_record(f, 1000000, ICCOM_TEST_EARLY_SIZE
+                                               , ICCOM_TEST_EARLY_SIZE) < 0) {
+                return -1;
+        }
+        return fflush(f) == 0 ? 0 : -1;
+}
+
+static int iccom_test_replay(const char *const path, const int timing)
+{
+        iccom_replay_cfg cfg;
+        memset(&cfg, 0, sizeof(cfg));
+        cfg.path = path;
+        cfg.timing = timing;
+        cfg.speed = 1.0;
+        cfg.batch_size = 4;
+
+        iccom_replay_stats stats;
+        const int res = iccom_replay_run(&cfg, &stats);
+        if (res != 0) {
+                printf("FAIL: replay returned %d\n", res);
+                return -1;
+        }
+        if (stats.frames_skipped != 3 || stats.frames_sent != 2
+                    || stats.send_errors != 0 || stats.frames_padded != 0) {
+                printf("FAIL: skipped %llu, sent %llu, padded %llu"
+                       ", send errors %llu\n"
+                       , (unsigned long long)stats.frames_skipped
+                       , (unsigned long long)stats.frames_sent
+                       , (unsigned long long)stats.frames_padded
+                       , (unsigned long long)stats.send_errors);
+                return -1;
+        }
+
+        int check_res = iccom_test_check_frame(ICCOM_TEST_EARLY_SIZE);
+        if (check_res == 0) {
+                check_res = iccom_test_check_frame(ICCOM_TEST_ORIG_SIZE);
+        }
+        close(iccom_test_peer_fd);
+        iccom_test_peer_fd = -1;
+        return check_res;
+}
+
+int main(void)
+{
+        char path[] = "/tmp/iccom_replay_test_XXXXXX";
+        const int fd = mkstemp(path);
+        if (fd < 0) {
+                printf("FAIL: could not create the capture file\n");
+                return EXIT_FAILURE;
+        }
+        FILE *const f = fdopen(fd, "wb");
+        if (!f) {
+                printf("FAIL: could not open the capture file\n");
+                close(fd);
+                unlink(path);
+                return EXIT_FAILURE;
+        }
+
+        int res = iccom_test_write_capture(f);
+        fclose(f);
+        if (res < 0) {
+                printf("FAIL: could not write the capture file\n");
+        } else {
+                res = iccom_test_replay(path, ICCOM_REPLAY_TIMING_ORIGINAL);
+        }
+        if (res == 0) {
+                res = iccom_test_replay(path, ICCOM_REPLAY_TIMING_MAX_SPEED);
+        }
+        unlink(path);
+
+        if (res < 0) {
+                return EXIT_FAILURE;
+        }
+        printf("OK\n");
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,240 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* The router test: the id offset/width configuration bounds, the
+ * messages which end right at the id end are routed, the shorter ones
+ * go to the default handler as malformed, the id byte order is
+ * respected and the sparse ids are routed as the dense ones.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "iccom_router.h"
+
+// The last handler call.
+//
+// @calls the number of the handler calls
+// @msg_id the message id of the last call
+// @size the payload size of the last call
+struct iccom_test_call {
+        unsigned int calls;
+        uint32_t msg_id;
+        size_t size;
+};
+
+static void iccom_test_handler(void *const ctx, const uint32_t msg_id
+                               , const void *const payload
+                               , const size_t size)
+{
+        (void)payload;
+        struct iccom_test_call *const call = (struct iccom_test_call *)ctx;
+        call->calls++;
+        call->msg_id = msg_id;
+        call->size = size;
+}
+
+// Dispatches the @size bytes payload, checks the result and the handler
+// which got it.
+//
+// RETURNS:
+//      0: on success
+//      <0: on failure
+static int iccom_test_dispatch(iccom_router *const router
+                               , const void *const payload
+                               , const size_t size
+                               , const int expected_res
+                               , struct iccom_test_call *const handler
+                               , const uint32_t expected_id)
+{
+        const unsigned int calls = handler->calls;
+        const int res = iccom_router_dispatch(router, payload, size);
+        if (res != expected_res || handler->calls != calls + 1
+                    || handler->msg_id != expected_id
+                    || handler->size != size) {
+                printf("FAIL: size %zu dispatched with %d (expected %d)"
+                       ", handler calls %u, last id %#x (expected %#x)\n"
+                       , size, res, expected_res, handler->calls - calls
+                       , handler->msg_id, expected_id);
+                return -1;
+        }
+        return 0;
+}
+
+static int iccom_test_create_bounds(void)
+{
+        const iccom_router_cfg bad[] = {
+                { .id_width = 3 }
+                , { .id_width = 8 }
+                , { .id_width = 4
+                    , .id_offset = ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES - 3 }
+                , { .id_width = 0
+                    , .id_offset = ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES }
+                , { .dense_ids = ICCOM_ROUTER_MAX_DENSE_IDS + 1 }
+        };
+        for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+                iccom_router *router = NULL;
+                const int res = iccom_router_create(&bad[i], &router);
+                if (res != -EINVAL) {
+                        printf("FAIL: bad configuration %zu: created"
+                               " with %d\n", i, res);
+                        iccom_router_destroy(router);
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+// The id at the very end of the max size message.
+static int iccom_test_last_id(void)
+{
+        const iccom_router_cfg cfg = {
+                .id_width = 4
+                , .id_offset = ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES - 4
+                , .id_big_endian = 1
+        };
+        iccom_router *router = NULL;
+        if (iccom_router_create(&cfg, &router) != 0) {
+                printf("FAIL: could not create the last id router\n");
+                return -1;
+        }
+
+        static uint8_t payload[ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES];
+        memset(payload, 0, sizeof(payload));
+        payload[sizeof(payload) - 4] = 0x12;
+        payload[sizeof(payload) - 3] = 0x34;
+        payload[sizeof(payload) - 2] = 0x56;
+        payload[sizeof(payload) - 1] = 0x78;
+
+        struct iccom_test_call routed = {0};
+        struct iccom_test_call other = {0};
+        int res = -1;
+        if (iccom_router_set_route(router, 0x12345678, iccom_test_handler
+                                   , &routed) == 0
+                    && iccom_router_set_default(router, iccom_test_handler
+                                                , &other) == 0
+                    && iccom_test_dispatch(router, payload, sizeof(payload)
+                                           , 0, &routed, 0x12345678) == 0
+                    && iccom_test_dispatch(router, payload
+                                           , sizeof(payload) - 1, -EBADMSG
+                                           , &other, ICCOM_ROUTER_NO_ID)
+                       == 0) {
+                res = 0;
+        }
+        iccom_router_destroy(router);
+        return res;
+}
+
+static int iccom_test_routes(void)
+{
+        const iccom_router_cfg cfg = {
+                .id_width = 2
+                , .id_offset = 3
+                , .id_big_endian = 0
+                , .dense_ids = 16
+        };
+        iccom_router *router = NULL;
+        if (iccom_router_create(&cfg, &router) != 0) {
+                printf("FAIL: could not create the router\n");
+                return -1;
+        }
+
+        struct iccom_test_call dense = {0};
+        struct iccom_test_call sparse = {0};
+        struct iccom_test_call other = {0};
+        int res = -1;
+        if (iccom_router_set_route(router, 0x0005, iccom_test_handler
+                                   , &dense) != 0
+                    || iccom_router_set_route(router, 0xbeef
+                                              , iccom_test_handler
+                                              , &sparse) != 0
+                    || iccom_router_set_default(router, iccom_test_handler
+                                                , &other) != 0) {
+                printf("FAIL: could not set the routes\n");
+                goto destroy;
+        }
+        if (iccom_router_set_route(router, 0x10000, iccom_test_handler
+                                   , &dense) != -EINVAL
+                    || iccom_router_set_route(router, ICCOM_ROUTER_NO_ID
+                                              , iccom_test_handler
+                                              , &dense) != -EINVAL) {
+                printf("FAIL: the id wider than 2 bytes is routed\n");
+                goto destroy;
+        }
+
+        // the host byte order ids
+        uint8_t payload[8] = {0xff, 0xff, 0xff, 0, 0, 0xff};
+        const uint16_t dense_id = 0x0005;
+        const uint16_t sparse_id = 0xbeef;
+        const uint16_t unknown_id = 0x0500;
+
+        memcpy(payload + 3, &dense_id, sizeof(dense_id));
+        if (iccom_test_dispatch(router, payload, 5, 0, &dense, 0x0005) < 0
+                    || iccom_test_dispatch(router, payload, sizeof(payload)
+                                           , 0, &dense, 0x0005) < 0
+                    // the id doesn't fit
+                    || iccom_test_dispatch(router, payload, 4, -EBADMSG
+                                           , &other, ICCOM_ROUTER_NO_ID) < 0
+                    || iccom_test_dispatch(router, payload, 1, -EBADMSG
+                                           , &other, ICCOM_ROUTER_NO_ID) < 0
+                    || iccom_test_dispatch(router, NULL, 0, -EBADMSG
+                                           , &other, ICCOM_ROUTER_NO_ID) < 0) {
+                goto destroy;
+        }
+        memcpy(payload + 3, &sparse_id, sizeof(sparse_id));
+        if (iccom_test_dispatch(router, payload, 5, 0, &sparse, 0xbeef) < 0) {
+                goto destroy;
+        }
+        memcpy(payload + 3, &unknown_id, sizeof(unknown_id));
+        if (iccom_test_dispatch(router, payload, 5, -ENOENT, &other
+                                , 0x0500) < 0) {
+                goto destroy;
+        }
+
+        iccom_router_stats stats;
+        iccom_route_stats dense_stats;
+        if (iccom_router_get_stats(router, &stats) != 0
+                    || iccom_router_get_route_stats(router, 0x0005
+                                                    , &dense_stats) != 0) {
+                printf("FAIL: could not get the counters\n");
+                goto destroy;
+        }
+        if (stats.routed != 3 || stats.unrouted != 1 || stats.malformed != 3
+                    || dense_stats.messages != 2
+                    || dense_stats.bytes != 5 + sizeof(payload)) {
+                printf("FAIL: routed %llu, unrouted %llu, malformed %llu"
+                       ", dense route messages %llu, bytes %llu\n"
+                       , (unsigned long long)stats.routed
+                       , (unsigned long long)stats.unrouted
+                       , (unsigned long long)stats.malformed
+                       , (unsigned long long)dense_stats.messages
+                       , (unsigned long long)dense_stats.bytes);
+                goto destroy;
+        }
+        res = 0;
+
+destroy:
+        iccom_router_destroy(router);
+        return res;
+}
+
+int main(void)
+{
+        if (iccom_test_create_bounds() < 0 || iccom_test_last_id() < 0
+                    || iccom_test_routes() < 0) {
+                return EXIT_FAILURE;
+        }
+        printf("OK\n");
+        return EXIT_SUCCESS;
+}
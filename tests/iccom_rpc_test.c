@@ -0,0 +1,284 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* The RPC client test: the responses completed in the shuffled order
+ * keep the id table consistent (the backward shift deletion in the
+ * colliding probe chains), the late response is counted as late, and
+ * the timeouts longer than the timer wheel expire on time, not on the
+ * wheel wrap.
+ *
+ * NOTE: the client and the server ends are the local socket pair
+ *      registered as the ICCom sockets: the sequenced packet one (the
+ *      netlink destination address is ignored) for the netlink
+ *      modification, the stream one for the network sockets
+ *      modification.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "iccom.h"
+#include "iccom_rpc.h"
+#include "utils.h"
+#include "sock_registry.h"
+
+#define ICCOM_TEST_CHANNEL 1
+// the small pool, so the ids collide in the table of 2 x pool slots
+#define ICCOM_TEST_MAX_OUTSTANDING 8
+#define ICCOM_TEST_ROUNDS 2000
+// above the timer wheel span (512 ticks of 1ms)
+#define ICCOM_TEST_LONG_TIMEOUT_MS 700
+#define ICCOM_TEST_SHORT_TIMEOUT_MS 100
+
+// The request completion record.
+//
+// @calls the number of completions
+// @status the last completion status
+// @body_id the id carried by the last response body
+// @done_ns the time of the last completion
+struct iccom_test_done {
+        unsigned int calls;
+        int status;
+        uint32_t body_id;
+        uint64_t done_ns;
+};
+
+// the server end of the socket pair
+static int iccom_test_server_fd = -1;
+
+static void iccom_test_callback(void *const ctx, const int status
+                                , const void *const body
+                                , const size_t size)
+{
+        struct iccom_test_done *const done = (struct iccom_test_done *)ctx;
+        done->calls++;
+        done->status = status;
+        done->body_id = 0;
+        if (status == 0 && size == sizeof(done->body_id)) {
+                memcpy(&done->body_id, body, sizeof(done->body_id));
+        }
+        done->done_ns = __iccom_now_ns();
+}
+
+// Creates the client end socket, the server end goes to
+// @iccom_test_server_fd.
+//
+// RETURNS:
+//      >=0: the client socket
+//      <0: on failure
+static int iccom_test_open_pair(void)
+{
+        int fds[2];
+#ifdef ICCOM_TEST_NETWORK_SOCKETS
+        const int type = SOCK_STREAM;
+#else
+        const int type = SOCK_SEQPACKET;
+#endif
+        if (socketpair(AF_UNIX, type, 0, fds) != 0) {
+                printf("FAIL: could not create the socket pair: %d\n"
+                       , errno);
+                return -1;
+        }
+        __iccom_sock_register(fds[0], ICCOM_TEST_CHANNEL);
+        __iccom_sock_register(fds[1], ICCOM_TEST_CHANNEL);
+        iccom_test_server_fd = fds[1];
+        return fds[0];
+}
+
+// Drops the requests which came to the server end.
+static void iccom_test_drain_server(void)
+{
+        char buf[ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES];
+        while (recv(iccom_test_server_fd, buf, sizeof(buf), MSG_DONTWAIT)
+               > 0) {
+        }
+}
+
+// Keeps the pool full and completes the outstanding requests in the
+// pseudo random order, every completion is to reach its own request.
+static int iccom_test_shuffled_responses(const int sock_fd)
+{
+        const iccom_rpc_cfg cfg = {
+                .sock_fd = sock_fd
+                , .max_outstanding = ICCOM_TEST_MAX_OUTSTANDING
+        };
+        iccom_rpc *rpc = NULL;
+        if (iccom_rpc_create(&cfg, &rpc) != 0) {
+                printf("FAIL: could not create the RPC client\n");
+                return -1;
+        }
+
+        struct iccom_test_done done[ICCOM_TEST_MAX_OUTSTANDING];
+        uint32_t ids[ICCOM_TEST_MAX_OUTSTANDING];
+        memset(done, 0, sizeof(done));
+        memset(ids, 0, sizeof(ids));
+        uint32_t rnd = 12345;
+        int res = -1;
+
+        for (unsigned int round = 0; round < ICCOM_TEST_ROUNDS; round++) {
+                for (unsigned int i = 0; i < ICCOM_TEST_MAX_OUTSTANDING; i++) {
+                        if (ids[i]) {
+                                continue;
+                        }
+                        if (iccom_rpc_call_async(rpc, NULL, 0, 10000
+                                        , iccom_test_callback, &done[i]
+                                        , &ids[i]) != 0) {
+                                printf("FAIL: round %u: could not send"
+                                       " the request\n", round);
+                                goto destroy;
+                        }
+                }
+                iccom_test_drain_server();
+
+                rnd = rnd * 1103515245u + 12345u;
+                const unsigned int pick = (rnd >> 16)
+                                          % ICCOM_TEST_MAX_OUTSTANDING;
+                const unsigned int calls = done[pick].calls;
+                if (iccom_rpc_reply(iccom_test_server_fd, ids[pick]
+                                    , &ids[pick], sizeof(ids[pick])) != 0
+                            || iccom_rpc_poll(rpc, 1000) != 1
+                            || done[pick].calls != calls + 1
+                            || done[pick].status != 0
+                            || done[pick].body_id != ids[pick]) {
+                        printf("FAIL: round %u: the response to %u is not"
+                               " matched to its request\n", round
+                               , ids[pick]);
+                        goto destroy;
+                }
+                // completes nothing now
+                if (iccom_rpc_reply(iccom_test_server_fd, ids[pick]
+                                    , &ids[pick], sizeof(ids[pick])) != 0
+                            || iccom_rpc_poll(rpc, 0) != 0) {
+                        printf("FAIL: round %u: the late response to %u"
+                               " is matched\n", round, ids[pick]);
+                        goto destroy;
+                }
+                ids[pick] = 0;
+        }
+
+        iccom_rpc_stats stats;
+        iccom_rpc_get_stats(rpc, &stats);
+        if (stats.completed != ICCOM_TEST_ROUNDS
+                    || stats.late != ICCOM_TEST_ROUNDS
+                    || stats.timed_out != 0 || stats.unmatched != 0
+                    // the last completed one is not replaced
+                    || iccom_rpc_outstanding(rpc)
+                       != ICCOM_TEST_MAX_OUTSTANDING - 1) {
+                printf("FAIL: completed %llu, late %llu, timed out %llu"
+                       ", unmatched %llu, outstanding %u\n"
+                       , (unsigned long long)stats.completed
+                       , (unsigned long long)stats.late
+                       , (unsigned long long)stats.timed_out
+                       , (unsigned long long)stats.unmatched
+                       , iccom_rpc_outstanding(rpc));
+                goto destroy;
+        }
+        res = 0;
+
+destroy:
+        iccom_rpc_destroy(rpc);
+        for (unsigned int i = 0; i < ICCOM_TEST_MAX_OUTSTANDING && res == 0
+                        ; i++) {
+                if (ids[i] && done[i].status != -ECANCELED) {
+                        printf("FAIL: the outstanding request %u is not"
+                               " canceled on destroy\n", ids[i]);
+                        res = -1;
+                }
+        }
+        iccom_test_drain_server();
+        return res;
+}
+
+// The timeout longer than the wheel expires after the shorter one and
+// not before its time.
+static int iccom_test_long_timeout(const int sock_fd)
+{
+        const iccom_rpc_cfg cfg = { .sock_fd = sock_fd, .tick_ms = 1 };
+        iccom_rpc *rpc = NULL;
+        if (iccom_rpc_create(&cfg, &rpc) != 0) {
+                printf("FAIL: could not create the RPC client\n");
+                return -1;
+        }
+
+        struct iccom_test_done long_done = {0};
+        struct iccom_test_done short_done = {0};
+        const uint64_t start_ns = __iccom_now_ns();
+        int res = -1;
+        if (iccom_rpc_call_async(rpc, NULL, 0, ICCOM_TEST_LONG_TIMEOUT_MS
+                                 , iccom_test_callback, &long_done
+                                 , NULL) != 0
+                    || iccom_rpc_call_async(rpc, NULL, 0
+                                 , ICCOM_TEST_SHORT_TIMEOUT_MS
+                                 , iccom_test_callback, &short_done
+                                 , NULL) != 0) {
+                printf("FAIL: could not send the requests\n");
+                goto destroy;
+        }
+
+        while (iccom_rpc_outstanding(rpc)) {
+                if (iccom_rpc_poll(rpc, -1) < 0) {
+                        printf("FAIL: the poll failed\n");
+                        goto destroy;
+                }
+                if (long_done.calls && !short_done.calls) {
+                        printf("FAIL: the long timeout expired first\n");
+                        goto destroy;
+                }
+        }
+
+        const uint64_t long_ms = (long_done.done_ns - start_ns) / 1000000;
+        const uint64_t short_ms = (short_done.done_ns - start_ns) / 1000000;
+        if (long_done.calls != 1 || long_done.status != -ETIMEDOUT
+                    || short_done.calls != 1
+                    || short_done.status != -ETIMEDOUT
+                    || long_ms < ICCOM_TEST_LONG_TIMEOUT_MS
+                    || short_ms < ICCOM_TEST_SHORT_TIMEOUT_MS) {
+                printf("FAIL: the timeouts expired after %llu and %llu ms"
+                       ", expected %d and %d ms\n"
+                       , (unsigned long long)long_ms
+                       , (unsigned long long)short_ms
+                       , ICCOM_TEST_LONG_TIMEOUT_MS
+                       , ICCOM_TEST_SHORT_TIMEOUT_MS);
+                goto destroy;
+        }
+        res = 0;
+
+destroy:
+        iccom_rpc_destroy(rpc);
+        iccom_test_drain_server();
+        return res;
+}
+
+int main(void)
+{
+        const int sock_fd = iccom_test_open_pair();
+        if (sock_fd < 0) {
+                return EXIT_FAILURE;
+        }
+
+        int res = iccom_test_shuffled_responses(sock_fd);
+        if (res == 0) {
+                res = iccom_test_long_timeout(sock_fd);
+        }
+        iccom_close_socket(sock_fd);
+        iccom_close_socket(iccom_test_server_fd);
+
+        if (res < 0) {
+                return EXIT_FAILURE;
+        }
+        printf("OK\n");
+        return EXIT_SUCCESS;
+}
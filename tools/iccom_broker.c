@@ -0,0 +1,214 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* The ICCom local channel broker daemon: owns the given channels and
+ * shares them with the client processes over the shared memory (see
+ * iccom_broker.h), till interrupted.
+ *
+ * Usage: see iccom_broker_usage() below.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+
+#include "iccom.h"
+#include "iccom_broker.h"
+#include "tools_utils.h"
+
+/* -------------------- GLOBAL VARIABLES / CONSTANTS -------------------- */
+
+static atomic_int stop = 0;
+
+/* -------------------- ROUTINES --------------------------------------- */
+
+static void iccom_broker_usage(const char *const name)
+{
+        printf("Usage: %s -c CHANNELS [OPTIONS]\n"
+               "Shares the ICCom channels with the local processes over\n"
+               "the shared memory, runs till interrupted.\n"
+               "\n"
+               "  -c CHANNELS  channels to broker: CH or FROM-TO, comma\n"
+               "               separated (max %d channels)\n"
+               "  -n NAME      broker name (default %s)\n"
+               "  -r N         rx ring size in frames, power of two\n"
+               "               (default 1024)\n"
+               "  -t N         tx ring size in frames, power of two\n"
+               "               (default 256)\n"
+               "  -s SIZE      max frame size (default %d)\n"
+               "  -m MODE      shared memory permissions, octal\n"
+               "               (default 0660)\n"
+               "  -C CPU       pin the broker threads to CPU\n"
+               "  -i SEC       print the counters every SEC seconds\n"
+               "               (default: only on exit)\n"
+               "  -h           print this help\n"
+               , name, ICCOM_BROKER_MAX_CHANNELS, ICCOM_BROKER_DEFAULT_NAME
+               , ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES);
+}
+
+static void iccom_broker_on_signal(int signo)
+{
+        (void)signo;
+        atomic_store(&stop, 1);
+}
+
+// Parses the channels list "CH,FROM-TO,...".
+//
+// RETURNS:
+//      >0: the number of channels
+//      <0: negated error code
+static int iccom_broker_parse_channels(const char *const arg
+                                       , unsigned int *const channels)
+{
+        int count = 0;
+        const char *p = arg;
+        while (*p) {
+                char *end;
+                const unsigned long from = strtoul(p, &end, 10);
+                unsigned long to = from;
+                if (end == p) {
+                        return -EINVAL;
+                }
+                p = end;
+                if (*p == '-') {
+                        to = strtoul(p + 1, &end, 10);
+                        if (end == p + 1 || to < from) {
+                                return -EINVAL;
+                        }
+                        p = end;
+                }
+                for (unsigned long ch = from; ch <= to; ch++) {
+                        if (count == ICCOM_BROKER_MAX_CHANNELS) {
+                                return -E2BIG;
+                        }
+                        channels[count++] = (unsigned int)ch;
+                }
+                if (*p == ',') {
+                        p++;
+                } else if (*p) {
+                        return -EINVAL;
+                }
+        }
+        return count ? count : -EINVAL;
+}
+
+static void iccom_broker_print_stats(const iccom_broker *const broker)
+{
+        iccom_broker_stats st;
+        if (iccom_broker_get_stats(broker, &st) < 0) {
+                return;
+        }
+        printf("received %llu, sent %llu, dropped %llu, receive errors %llu"
+               ", send errors %llu, tx stalled %llu\n"
+               , (unsigned long long)st.received
+               , (unsigned long long)st.sent
+               , (unsigned long long)st.dropped
+               , (unsigned long long)st.receive_errors
+               , (unsigned long long)st.send_errors
+               , (unsigned long long)st.tx_stalled);
+        fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+        static unsigned int channels[ICCOM_BROKER_MAX_CHANNELS];
+        iccom_broker_cfg cfg = {
+                .name = NULL
+                , .channels = channels
+                , .channels_count = 0
+                , .rx_slots = 0
+                , .tx_slots = 0
+                , .slot_size = 0
+                , .mode = 0
+                , .cpu = -1
+        };
+        unsigned int interval_s = 0;
+
+        int opt;
+        while ((opt = getopt(argc, argv, "c:n:r:t:s:m:C:i:h")) != -1) {
+                switch (opt) {
+                case 'c': {
+                        const int res = iccom_broker_parse_channels(optarg
+                                                                , channels);
+                        if (res < 0) {
+                                iccom_broker_usage(argv[0]);
+                                return EXIT_FAILURE;
+                        }
+                        cfg.channels_count = (unsigned int)res;
+                        break;
+                }
+                case 'n':
+                        cfg.name = optarg;
+                        break;
+                case 'r':
+                        cfg.rx_slots = (unsigned int)atoi(optarg);
+                        break;
+                case 't':
+                        cfg.tx_slots = (unsigned int)atoi(optarg);
+                        break;
+                case 's':
+                        cfg.slot_size = (unsigned int)atoi(optarg);
+                        break;
+                case 'm':
+                        cfg.mode = (unsigned int)strtoul(optarg, NULL, 8);
+                        break;
+                case 'C':
+                        cfg.cpu = atoi(optarg);
+                        break;
+                case 'i':
+                        interval_s = (unsigned int)atoi(optarg);
+                        break;
+                case 'h':
+                        iccom_broker_usage(argv[0]);
+                        return EXIT_SUCCESS;
+                default:
+                        iccom_broker_usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+        if (optind != argc || cfg.channels_count == 0) {
+                iccom_broker_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        signal(SIGINT, &iccom_broker_on_signal);
+        signal(SIGTERM, &iccom_broker_on_signal);
+
+        iccom_broker *broker;
+        const int res = iccom_broker_start(&cfg, &broker);
+        if (res < 0) {
+                fprintf(stderr, "could not start the broker: %d(%s)\n"
+                        , -res, strerror(-res));
+                return EXIT_FAILURE;
+        }
+        printf("brokering %u channel(s) as \"%s\"\n", cfg.channels_count
+               , cfg.name ? cfg.name : ICCOM_BROKER_DEFAULT_NAME);
+        fflush(stdout);
+
+        unsigned int slept_s = 0;
+        while (!atomic_load(&stop)) {
+                // interrupted by the signal
+                sleep(1);
+                if (interval_s && ++slept_s >= interval_s) {
+                        slept_s = 0;
+                        iccom_broker_print_stats(broker);
+                }
+        }
+
+        iccom_broker_print_stats(broker);
+        iccom_broker_stop(broker);
+        return EXIT_SUCCESS;
+}
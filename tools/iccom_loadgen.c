@@ -0,0 +1,912 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* The ICCom synthetic load generator for channel fleets.
+ *
+ * Opens N channels and spreads them over W worker threads. Every
+ * channel gets its traffic pattern from the configured mix:
+ *   periodic - a message every 1/RATE s,
+ *   poisson - exponentially distributed inter-arrival times with mean
+ *             1/RATE s,
+ *   bursty - BURST messages back to back every BURST/RATE s,
+ * and the configured share of channels carries request/response pairs
+ * (the remote side is expected to echo the requests back).
+ *
+ * With the loopback (-L) every worker also runs the sink for the
+ * remote ends of its channels: it counts the messages (to report the
+ * drops) and echoes the requests.
+ *
+ * The offered load (as scheduled) is reported against the achieved
+ * one (actually sent), together with the drops and the request round
+ * trip times.
+ *
+ * Usage: see iccom_loadgen_usage() below.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "iccom.h"
+#include "tools_utils.h"
+
+/* -------------------- MACRO DEFINITIONS ------------------------------ */
+
+#define ICCOM_LG_PATTERN_PERIODIC 0
+#define ICCOM_LG_PATTERN_POISSON 1
+#define ICCOM_LG_PATTERN_BURSTY 2
+#define ICCOM_LG_PATTERNS_COUNT 3
+
+#define ICCOM_LG_SIZE_FIXED 0
+#define ICCOM_LG_SIZE_UNIFORM 1
+#define ICCOM_LG_SIZE_EXP 2
+
+#define ICCOM_LG_DEFAULT_CHANNEL 100
+#define ICCOM_LG_DEFAULT_CHANNELS 100
+#define ICCOM_LG_DEFAULT_WORKERS 4
+#define ICCOM_LG_DEFAULT_RATE 100.0
+#define ICCOM_LG_DEFAULT_BURST 16
+#define ICCOM_LG_DEFAULT_SIZE 64
+#define ICCOM_LG_DEFAULT_SECONDS 10
+
+// the message header: sequence number, flags and send time, only
+// when the message is big enough
+#define ICCOM_LG_HDR_SIZE 16
+#define ICCOM_LG_FLAG_REQUEST 1u
+
+// the round trip histogram: 1us buckets, the last one for all beyond
+#define ICCOM_LG_RTT_BUCKETS 65536
+
+#define ICCOM_LG_POLL_TIMEOUT_MS 100
+#define ICCOM_LG_DRAIN_IDLE_NS 300000000ull
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+// @patterns_weights the traffic mix: relative share of the channels
+//      for every ICCOM_LG_PATTERN_*
+// @rr_percent the share of request/response channels
+// @rate the per channel messages rate (msg/s)
+// @size_kind ICCOM_LG_SIZE_*
+// @size_a @size_b the fixed size / uniform [a; b] / exponential mean a
+struct iccom_lg_cfg {
+        unsigned int channel;
+        unsigned int channels;
+        unsigned int workers;
+        int shift;
+        unsigned int patterns_weights[ICCOM_LG_PATTERNS_COUNT];
+        unsigned int rr_percent;
+        double rate;
+        unsigned int burst;
+        int size_kind;
+        unsigned int size_a;
+        unsigned int size_b;
+        unsigned int seconds;
+};
+
+// @fd the channel socket
+// @peer_fd the loopback remote end socket, -1 if none
+// @next_ns the next message due time
+// @offered messages scheduled within the run time
+// @sent @sent_bytes messages sent within the run time
+// @requests request messages sent
+struct iccom_lg_channel {
+        unsigned int channel;
+        int fd;
+        int peer_fd;
+        int pattern;
+        int rr;
+        uint64_t next_ns;
+        uint32_t seq;
+        uint64_t offered;
+        uint64_t offered_bytes;
+        uint64_t sent;
+        uint64_t sent_bytes;
+        uint64_t send_errors;
+        uint64_t requests;
+};
+
+// @channels the worker channels (slice of the common array)
+// @heap the channels indexes ordered by next_ns
+// @rng the worker random generator state
+// @sink_received messages received by the loopback sink
+// @responses responses received by the collector
+// @rtt_hist the round trip time histogram (us)
+struct iccom_lg_worker {
+        const struct iccom_lg_cfg *cfg;
+        struct iccom_lg_channel *channels;
+        unsigned int count;
+        unsigned int *heap;
+        uint64_t rng;
+        uint64_t start_ns;
+        uint64_t end_ns;
+        pthread_t sender;
+        pthread_t sink;
+        pthread_t collector;
+        int sink_epoll;
+        int collector_epoll;
+        uint64_t sink_received;
+        uint64_t sink_errors;
+        uint64_t responses;
+        uint64_t rtt_max_ns;
+        uint64_t *rtt_hist;
+};
+
+/* -------------------- GLOBAL VARIABLES ------------------------------- */
+
+static const char *const patterns_names[ICCOM_LG_PATTERNS_COUNT] = {
+        "periodic", "poisson", "bursty"
+};
+
+// set when the sinks and collectors are to stop
+static atomic_int stop = 0;
+
+// the time of the last message received by any sink or collector
+static _Atomic uint64_t last_rx_ns = 0;
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+static void iccom_loadgen_usage(const char *const name)
+{
+        printf("Usage: %s [OPTIONS]\n"
+               "Drives the synthetic traffic over a fleet of ICCom channels.\n"
+               "\n"
+               "  -c CH      first channel (default %d)\n"
+               "  -n N       number of channels (default %d)\n"
+               "  -w N       worker threads (default %d)\n"
+               "  -p MIX     traffic mix: comma separated PATTERN[:WEIGHT],\n"
+               "             PATTERN: periodic, poisson, bursty\n"
+               "             (default periodic)\n"
+               "  -r RATE    messages per second per channel (default %.0f)\n"
+               "  -B N       messages per burst for bursty (default %d)\n"
+               "  -s SIZE    message size: N, MIN:MAX (uniform) or\n"
+               "             exp:MEAN (exponential) (default %d)\n"
+               "  -R PCT     share of channels with request/response\n"
+               "             pairs, their messages are >= %d bytes\n"
+               "             (default 0)\n"
+               "  -t SEC     run time (default %d)\n"
+               "  -L SHIFT   enable the loopback [CH; CH+N-1] -> +SHIFT and\n"
+               "             run the sinks (echo for requests) on the\n"
+               "             remote ends\n"
+               "  -h         print this help\n"
+               , name, ICCOM_LG_DEFAULT_CHANNEL, ICCOM_LG_DEFAULT_CHANNELS
+               , ICCOM_LG_DEFAULT_WORKERS, ICCOM_LG_DEFAULT_RATE
+               , ICCOM_LG_DEFAULT_BURST, ICCOM_LG_DEFAULT_SIZE
+               , ICCOM_LG_HDR_SIZE, ICCOM_LG_DEFAULT_SECONDS);
+}
+
+// RETURNS: the next pseudo random value (xorshift64*)
+static uint64_t iccom_lg_rand(struct iccom_lg_worker *const w)
+{
+        w->rng ^= w->rng >> 12;
+        w->rng ^= w->rng << 25;
+        w->rng ^= w->rng >> 27;
+        return w->rng * 0x2545F4914F6CDD1Dull;
+}
+
+// RETURNS: uniformly distributed value in (0; 1]
+static double iccom_lg_rand_unit(struct iccom_lg_worker *const w)
+{
+        return ((double)(iccom_lg_rand(w) >> 11) + 1.0) / 9007199254740992.0;
+}
+
+static unsigned int iccom_lg_msg_size(struct iccom_lg_worker *const w
+                                      , const struct iccom_lg_channel *ch)
+{
+        const struct iccom_lg_cfg *const cfg = w->cfg;
+        unsigned int size;
+        switch (cfg->size_kind) {
+        case ICCOM_LG_SIZE_UNIFORM:
+                size = cfg->size_a + (unsigned int)(iccom_lg_rand(w)
+                                % (cfg->size_b - cfg->size_a + 1));
+                break;
+        case ICCOM_LG_SIZE_EXP:
+                size = (unsigned int)(-log(iccom_lg_rand_unit(w))
+                                      * cfg->size_a) + 1;
+                break;
+        default:
+                size = cfg->size_a;
+                break;
+        }
+        if (size > ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES) {
+                size = ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES;
+        }
+        if (ch->rr && size < ICCOM_LG_HDR_SIZE) {
+                size = ICCOM_LG_HDR_SIZE;
+        }
+        return size;
+}
+
+// RETURNS: the number of messages in the next event of the channel
+static unsigned int iccom_lg_event_size(const struct iccom_lg_cfg *const cfg
+                                        , const struct iccom_lg_channel *ch)
+{
+        return ch->pattern == ICCOM_LG_PATTERN_BURSTY ? cfg->burst : 1;
+}
+
+// Advances the channel schedule to the next event.
+static void iccom_lg_schedule_next(struct iccom_lg_worker *const w
+                                   , struct iccom_lg_channel *const ch)
+{
+        const double period_ns = 1e9 / w->cfg->rate;
+        switch (ch->pattern) {
+        case ICCOM_LG_PATTERN_POISSON:
+                ch->next_ns += (uint64_t)(-log(iccom_lg_rand_unit(w))
+                                          * period_ns);
+                break;
+        case ICCOM_LG_PATTERN_BURSTY:
+                ch->next_ns += (uint64_t)(period_ns * w->cfg->burst);
+                break;
+        default:
+                ch->next_ns += (uint64_t)period_ns;
+                break;
+        }
+}
+
+/* ------------------- SCHEDULE HEAP ----------------------------------- */
+
+static void iccom_lg_heap_sift_down(struct iccom_lg_worker *const w
+                                    , unsigned int i)
+{
+        unsigned int *const h = w->heap;
+        while (1) {
+                unsigned int min = i;
+                const unsigned int l = 2 * i + 1, r = 2 * i + 2;
+                if (l < w->count && w->channels[h[l]].next_ns
+                                    < w->channels[h[min]].next_ns) {
+                        min = l;
+                }
+                if (r < w->count && w->channels[h[r]].next_ns
+                                    < w->channels[h[min]].next_ns) {
+                        min = r;
+                }
+                if (min == i) {
+                        return;
+                }
+                const unsigned int tmp = h[i];
+                h[i] = h[min];
+                h[min] = tmp;
+                i = min;
+        }
+}
+
+static void iccom_lg_heap_init(struct iccom_lg_worker *const w)
+{
+        for (unsigned int i = 0; i < w->count; i++) {
+                w->heap[i] = i;
+        }
+        for (unsigned int i = w->count / 2; i-- > 0; ) {
+                iccom_lg_heap_sift_down(w, i);
+        }
+}
+
+/* ------------------- WORKER THREADS ---------------------------------- */
+
+static void iccom_lg_sleep_until(const uint64_t deadline_ns)
+{
+        const struct timespec ts = {
+                .tv_sec = (time_t)(deadline_ns / 1000000000ull)
+                , .tv_nsec = (long)(deadline_ns % 1000000000ull)
+        };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+                        == EINTR) {
+        }
+}
+
+static void iccom_lg_send(struct iccom_lg_worker *const w
+                          , struct iccom_lg_channel *const ch
+                          , char *const buf)
+{
+        const unsigned int size = iccom_lg_msg_size(w, ch);
+        char *const payload = buf + iccom_get_data_payload_offset();
+        if (size >= ICCOM_LG_HDR_SIZE) {
+                const uint32_t flags = ch->rr ? ICCOM_LG_FLAG_REQUEST : 0;
+                const uint64_t now = iccom_tools_now_ns();
+                memcpy(payload, &ch->seq, sizeof(ch->seq));
+                memcpy(payload + 4, &flags, sizeof(flags));
+                memcpy(payload + 8, &now, sizeof(now));
+        }
+        ch->seq++;
+        ch->offered++;
+        ch->offered_bytes += size;
+
+        const int res = iccom_send_data_nocopy(ch->fd, buf
+                                        , iccom_get_required_buffer_size(size)
+                                        , iccom_get_data_payload_offset()
+                                        , size);
+        if (res < 0) {
+                ch->send_errors++;
+                return;
+        }
+        ch->sent++;
+        ch->sent_bytes += size;
+        ch->requests += ch->rr ? 1 : 0;
+}
+
+static void *iccom_lg_sender(void *arg)
+{
+        struct iccom_lg_worker *const w = (struct iccom_lg_worker *)arg;
+        char *const buf = (char *)calloc(1, iccom_get_required_buffer_size(
+                                        ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES));
+        if (!buf) {
+                return NULL;
+        }
+
+        for (unsigned int i = 0; i < w->count; i++) {
+                // spreads the channels phases over the first period
+                w->channels[i].next_ns = w->start_ns + (uint64_t)(
+                                iccom_lg_rand_unit(w) * 1e9 / w->cfg->rate);
+        }
+        iccom_lg_heap_init(w);
+
+        while (w->count) {
+                struct iccom_lg_channel *const ch = &w->channels[w->heap[0]];
+                if (ch->next_ns >= w->end_ns) {
+                        break;
+                }
+                if (iccom_tools_now_ns() >= w->end_ns) {
+                        break;
+                }
+                iccom_lg_sleep_until(ch->next_ns);
+
+                const unsigned int n = iccom_lg_event_size(w->cfg, ch);
+                for (unsigned int i = 0; i < n; i++) {
+                        iccom_lg_send(w, ch, buf);
+                }
+                iccom_lg_schedule_next(w, ch);
+                iccom_lg_heap_sift_down(w, 0);
+        }
+
+        // the events due within the run time, which were not sent in time,
+        // are still offered load
+        for (unsigned int i = 0; i < w->count; i++) {
+                struct iccom_lg_channel *const ch = &w->channels[i];
+                while (ch->next_ns < w->end_ns) {
+                        ch->offered += iccom_lg_event_size(w->cfg, ch);
+                        iccom_lg_schedule_next(w, ch);
+                }
+        }
+
+        free(buf);
+        return NULL;
+}
+
+// Receives the messages from the loopback remote ends: counts them and
+// echoes the requests.
+static void *iccom_lg_sink(void *arg)
+{
+        struct iccom_lg_worker *const w = (struct iccom_lg_worker *)arg;
+        const size_t buf_size = iccom_get_required_buffer_size(
+                                        ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES);
+        char *const buf = (char *)malloc(buf_size);
+        struct epoll_event events[64];
+
+        while (buf && !atomic_load_explicit(&stop, memory_order_relaxed)) {
+                const int n = epoll_wait(w->sink_epoll, events
+                                         , sizeof(events) / sizeof(events[0])
+                                         , ICCOM_LG_POLL_TIMEOUT_MS);
+                for (int i = 0; i < n; i++) {
+                        const struct iccom_lg_channel *const ch
+                                = &w->channels[events[i].data.u32];
+                        int offset;
+                        const int res = iccom_receive_data_nocopy(ch->peer_fd
+                                                , buf, buf_size, &offset);
+                        if (res < 0) {
+                                w->sink_errors++;
+                                continue;
+                        }
+                        if (res == 0) {
+                                continue;
+                        }
+                        w->sink_received++;
+                        atomic_store_explicit(&last_rx_ns
+                                              , iccom_tools_now_ns()
+                                              , memory_order_relaxed);
+
+                        uint32_t flags = 0;
+                        if (res >= ICCOM_LG_HDR_SIZE) {
+                                memcpy(&flags, buf + offset + 4, sizeof(flags));
+                        }
+                        if (flags & ICCOM_LG_FLAG_REQUEST) {
+                                iccom_send_data_nocopy(ch->peer_fd, buf
+                                        , iccom_get_required_buffer_size(res)
+                                        , offset, res);
+                        }
+                }
+        }
+
+        free(buf);
+        return NULL;
+}
+
+// Receives the responses to the requests and accounts the round trips.
+static void *iccom_lg_collector(void *arg)
+{
+        struct iccom_lg_worker *const w = (struct iccom_lg_worker *)arg;
+        const size_t buf_size = iccom_get_required_buffer_size(
+                                        ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES);
+        char *const buf = (char *)malloc(buf_size);
+        struct epoll_event events[64];
+
+        while (buf && !atomic_load_explicit(&stop, memory_order_relaxed)) {
+                const int n = epoll_wait(w->collector_epoll, events
+                                         , sizeof(events) / sizeof(events[0])
+                                         , ICCOM_LG_POLL_TIMEOUT_MS);
+                for (int i = 0; i < n; i++) {
+                        const struct iccom_lg_channel *const ch
+                                = &w->channels[events[i].data.u32];
+                        int offset;
+                        const int res = iccom_receive_data_nocopy(ch->fd
+                                                , buf, buf_size, &offset);
+                        if (res < ICCOM_LG_HDR_SIZE) {
+                                continue;
+                        }
+                        uint64_t sent_ns;
+                        memcpy(&sent_ns, buf + offset + 8, sizeof(sent_ns));
+                        const uint64_t now = iccom_tools_now_ns();
+                        const uint64_t rtt_ns = now - sent_ns;
+                        uint64_t bucket = rtt_ns / 1000;
+                        if (bucket >= ICCOM_LG_RTT_BUCKETS) {
+                                bucket = ICCOM_LG_RTT_BUCKETS - 1;
+                        }
+                        w->rtt_hist[bucket]++;
+                        if (rtt_ns > w->rtt_max_ns) {
+                                w->rtt_max_ns = rtt_ns;
+                        }
+                        w->responses++;
+                        atomic_store_explicit(&last_rx_ns, now
+                                              , memory_order_relaxed);
+                }
+        }
+
+        free(buf);
+        return NULL;
+}
+
+/* ------------------- SETUP AND REPORT -------------------------------- */
+
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+static int iccom_lg_parse_mix(const char *const arg
+                              , struct iccom_lg_cfg *const cfg)
+{
+        memset(cfg->patterns_weights, 0, sizeof(cfg->patterns_weights));
+        char *const copy = strdup(arg);
+        if (!copy) {
+                return -ENOMEM;
+        }
+        int ret_val = 0;
+        char *save = NULL;
+        for (char *tok = strtok_r(copy, ",", &save); tok
+                        ; tok = strtok_r(NULL, ",", &save)) {
+                char *const colon = strchr(tok, ':');
+                unsigned int weight = 1;
+                if (colon) {
+                        *colon = '\0';
+                        weight = (unsigned int)atoi(colon + 1);
+                }
+                int found = 0;
+                for (int p = 0; p < ICCOM_LG_PATTERNS_COUNT; p++) {
+                        if (strcmp(tok, patterns_names[p]) == 0) {
+                                cfg->patterns_weights[p] += weight;
+                                found = 1;
+                        }
+                }
+                if (!found) {
+                        fprintf(stderr, "unknown traffic pattern: %s\n", tok);
+                        ret_val = -EINVAL;
+                        break;
+                }
+        }
+        free(copy);
+        return ret_val;
+}
+
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+static int iccom_lg_parse_size(const char *const arg
+                               , struct iccom_lg_cfg *const cfg)
+{
+        if (strncmp(arg, "exp:", 4) == 0) {
+                cfg->size_kind = ICCOM_LG_SIZE_EXP;
+                cfg->size_a = (unsigned int)atoi(arg + 4);
+                return cfg->size_a ? 0 : -EINVAL;
+        }
+        const int res = iccom_tools_parse_size_range(arg, &cfg->size_a
+                                                     , &cfg->size_b);
+        cfg->size_kind = cfg->size_a == cfg->size_b
+                         ? ICCOM_LG_SIZE_FIXED : ICCOM_LG_SIZE_UNIFORM;
+        return res;
+}
+
+// Assigns the channels to workers, patterns and request/response
+// role and opens them.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+static int iccom_lg_setup(const struct iccom_lg_cfg *const cfg
+                          , struct iccom_lg_channel *const channels
+                          , struct iccom_lg_worker *const workers)
+{
+        unsigned int weights_sum = 0;
+        for (int p = 0; p < ICCOM_LG_PATTERNS_COUNT; p++) {
+                weights_sum += cfg->patterns_weights[p];
+        }
+
+        for (unsigned int i = 0; i < cfg->channels; i++) {
+                channels[i].fd = -1;
+                channels[i].peer_fd = -1;
+        }
+        for (unsigned int i = 0; i < cfg->workers; i++) {
+                workers[i].sink_epoll = -1;
+                workers[i].collector_epoll = -1;
+        }
+
+        // channels of the worker are contiguous in the array, patterns
+        // are assigned by the weights proportionally
+        unsigned int idx = 0;
+        for (unsigned int i = 0; i < cfg->workers; i++) {
+                struct iccom_lg_worker *const w = &workers[i];
+                w->cfg = cfg;
+                w->channels = &channels[idx];
+                w->count = cfg->channels / cfg->workers
+                           + (i < cfg->channels % cfg->workers ? 1 : 0);
+                w->rng = 0x9E3779B97F4A7C15ull * (i + 1);
+                w->heap = (unsigned int *)calloc(w->count + 1
+                                                 , sizeof(unsigned int));
+                w->rtt_hist = (uint64_t *)calloc(ICCOM_LG_RTT_BUCKETS
+                                                 , sizeof(uint64_t));
+                if (!w->heap || !w->rtt_hist) {
+                        return -ENOMEM;
+                }
+                idx += w->count;
+        }
+
+        for (unsigned int i = 0; i < cfg->channels; i++) {
+                struct iccom_lg_channel *const ch = &channels[i];
+                ch->channel = cfg->channel + i;
+
+                unsigned int slot = (unsigned int)(((uint64_t)i * weights_sum)
+                                                   / cfg->channels);
+                ch->pattern = 0;
+                while (slot >= cfg->patterns_weights[ch->pattern]) {
+                        slot -= cfg->patterns_weights[ch->pattern];
+                        ch->pattern++;
+                }
+                ch->rr = (i * 100 / cfg->channels) < cfg->rr_percent;
+        }
+
+        for (unsigned int i = 0; i < cfg->workers; i++) {
+                struct iccom_lg_worker *const w = &workers[i];
+                w->sink_epoll = epoll_create1(EPOLL_CLOEXEC);
+                w->collector_epoll = epoll_create1(EPOLL_CLOEXEC);
+                if (w->sink_epoll < 0 || w->collector_epoll < 0) {
+                        return -errno;
+                }
+                for (unsigned int j = 0; j < w->count; j++) {
+                        struct iccom_lg_channel *const ch = &w->channels[j];
+                        struct epoll_event ev = {
+                                .events = EPOLLIN, .data.u32 = j
+                        };
+                        if (cfg->shift) {
+                                ch->peer_fd = iccom_open_socket(ch->channel
+                                                                + cfg->shift);
+                                if (ch->peer_fd < 0 || epoll_ctl(w->sink_epoll
+                                                , EPOLL_CTL_ADD, ch->peer_fd
+                                                , &ev) < 0) {
+                                        fprintf(stderr, "could not open"
+                                                " channel %u\n", ch->channel
+                                                + cfg->shift);
+                                        return -EINVAL;
+                                }
+                        }
+                        ch->fd = iccom_open_socket(ch->channel);
+                        if (ch->fd < 0 || (ch->rr && epoll_ctl(
+                                                w->collector_epoll
+                                                , EPOLL_CTL_ADD, ch->fd
+                                                , &ev) < 0)) {
+                                fprintf(stderr, "could not open channel %u\n"
+                                        , ch->channel);
+                                return -EINVAL;
+                        }
+                }
+        }
+        return 0;
+}
+
+static void iccom_lg_cleanup(const struct iccom_lg_cfg *const cfg
+                             , struct iccom_lg_channel *const channels
+                             , struct iccom_lg_worker *const workers)
+{
+        for (unsigned int i = 0; i < cfg->channels; i++) {
+                if (channels[i].fd >= 0) {
+                        iccom_close_socket(channels[i].fd);
+                }
+                if (channels[i].peer_fd >= 0) {
+                        iccom_close_socket(channels[i].peer_fd);
+                }
+        }
+        for (unsigned int i = 0; i < cfg->workers; i++) {
+                if (workers[i].sink_epoll >= 0) {
+                        close(workers[i].sink_epoll);
+                }
+                if (workers[i].collector_epoll >= 0) {
+                        close(workers[i].collector_epoll);
+                }
+                free(workers[i].heap);
+                free(workers[i].rtt_hist);
+        }
+}
+
+// RETURNS: the given percentile of the merged histogram in us
+static double iccom_lg_rtt_percentile(const uint64_t *const hist
+                                      , const uint64_t total, const double p)
+{
+        const uint64_t rank = (uint64_t)(p / 100.0 * (double)total);
+        uint64_t seen = 0;
+        for (unsigned int i = 0; i < ICCOM_LG_RTT_BUCKETS; i++) {
+                seen += hist[i];
+                if (seen > rank) {
+                        return (double)i;
+                }
+        }
+        return (double)(ICCOM_LG_RTT_BUCKETS - 1);
+}
+
+static void iccom_lg_report(const struct iccom_lg_cfg *const cfg
+                            , const struct iccom_lg_channel *const channels
+                            , const struct iccom_lg_worker *const workers
+                            , const uint64_t elapsed_ns)
+{
+        uint64_t offered = 0, offered_bytes = 0, sent = 0, sent_bytes = 0;
+        uint64_t errors = 0, requests = 0;
+        unsigned int per_pattern[ICCOM_LG_PATTERNS_COUNT] = {0};
+        unsigned int rr_channels = 0;
+        for (unsigned int i = 0; i < cfg->channels; i++) {
+                offered += channels[i].offered;
+                offered_bytes += channels[i].offered_bytes;
+                sent += channels[i].sent;
+                sent_bytes += channels[i].sent_bytes;
+                errors += channels[i].send_errors;
+                requests += channels[i].requests;
+                per_pattern[channels[i].pattern]++;
+                rr_channels += channels[i].rr ? 1 : 0;
+        }
+
+        uint64_t received = 0, sink_errors = 0, responses = 0, rtt_max = 0;
+        uint64_t *const hist = (uint64_t *)calloc(ICCOM_LG_RTT_BUCKETS
+                                                  , sizeof(uint64_t));
+        for (unsigned int i = 0; i < cfg->workers; i++) {
+                received += workers[i].sink_received;
+                sink_errors += workers[i].sink_errors;
+                responses += workers[i].responses;
+                if (workers[i].rtt_max_ns > rtt_max) {
+                        rtt_max = workers[i].rtt_max_ns;
+                }
+                for (unsigned int j = 0; hist && j < ICCOM_LG_RTT_BUCKETS
+                                ; j++) {
+                        hist[j] += workers[i].rtt_hist[j];
+                }
+        }
+
+        const double run_s = (double)cfg->seconds;
+        const double elapsed_s = (double)elapsed_ns / 1e9;
+        printf("channels:  %u (periodic %u, poisson %u, bursty %u),"
+               " %u request/response, %u workers\n"
+               , cfg->channels, per_pattern[ICCOM_LG_PATTERN_PERIODIC]
+               , per_pattern[ICCOM_LG_PATTERN_POISSON]
+               , per_pattern[ICCOM_LG_PATTERN_BURSTY]
+               , rr_channels, cfg->workers);
+        printf("offered:   %llu msg, %.1f msg/s, %.3f MB/s\n"
+               , (unsigned long long)offered, (double)offered / run_s
+               , (double)offered_bytes / run_s / 1e6);
+        printf("achieved:  %llu msg, %.1f msg/s, %.3f MB/s (%.1f%% of"
+               " offered), send errors %llu\n"
+               , (unsigned long long)sent, (double)sent / elapsed_s
+               , (double)sent_bytes / elapsed_s / 1e6
+               , offered ? 100.0 * (double)sent / (double)offered : 0.0
+               , (unsigned long long)errors);
+        if (cfg->shift) {
+                const uint64_t dropped = sent > received ? sent - received : 0;
+                printf("received:  %llu msg by the loopback sinks, dropped"
+                       " %llu (%.3f%%), receive errors %llu\n"
+                       , (unsigned long long)received
+                       , (unsigned long long)dropped
+                       , sent ? 100.0 * (double)dropped / (double)sent : 0.0
+                       , (unsigned long long)sink_errors);
+        }
+        if (requests) {
+                printf("responses: %llu of %llu requests, lost %llu\n"
+                       , (unsigned long long)responses
+                       , (unsigned long long)requests
+                       , (unsigned long long)(requests > responses
+                                              ? requests - responses : 0));
+        }
+        if (responses && hist) {
+                printf("rtt us:    p50 %.0f  p90 %.0f  p99 %.0f  p99.9 %.0f"
+                       "  max %.0f\n"
+                       , iccom_lg_rtt_percentile(hist, responses, 50.0)
+                       , iccom_lg_rtt_percentile(hist, responses, 90.0)
+                       , iccom_lg_rtt_percentile(hist, responses, 99.0)
+                       , iccom_lg_rtt_percentile(hist, responses, 99.9)
+                       , (double)rtt_max / 1e3);
+        }
+        free(hist);
+}
+
+// Raises the open files limit, the fleet (and the loopback emulation
+// in the network build) needs several descriptors per channel.
+static void iccom_lg_raise_nofile(void)
+{
+        struct rlimit lim;
+        if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+                lim.rlim_cur = lim.rlim_max;
+                setrlimit(RLIMIT_NOFILE, &lim);
+        }
+}
+
+int main(int argc, char **argv)
+{
+        struct iccom_lg_cfg cfg = {
+                .channel = ICCOM_LG_DEFAULT_CHANNEL
+                , .channels = ICCOM_LG_DEFAULT_CHANNELS
+                , .workers = ICCOM_LG_DEFAULT_WORKERS
+                , .shift = 0
+                , .patterns_weights = {1, 0, 0}
+                , .rr_percent = 0
+                , .rate = ICCOM_LG_DEFAULT_RATE
+                , .burst = ICCOM_LG_DEFAULT_BURST
+                , .size_kind = ICCOM_LG_SIZE_FIXED
+                , .size_a = ICCOM_LG_DEFAULT_SIZE
+                , .size_b = ICCOM_LG_DEFAULT_SIZE
+                , .seconds = ICCOM_LG_DEFAULT_SECONDS
+        };
+
+        int opt;
+        while ((opt = getopt(argc, argv, "c:n:w:p:r:B:s:R:t:L:h")) != -1) {
+                switch (opt) {
+                case 'c':
+                        cfg.channel = (unsigned int)atoi(optarg);
+                        break;
+                case 'n':
+                        cfg.channels = (unsigned int)atoi(optarg);
+                        break;
+                case 'w':
+                        cfg.workers = (unsigned int)atoi(optarg);
+                        break;
+                case 'p':
+                        if (iccom_lg_parse_mix(optarg, &cfg) < 0) {
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case 'r':
+                        cfg.rate = atof(optarg);
+                        break;
+                case 'B':
+                        cfg.burst = (unsigned int)atoi(optarg);
+                        break;
+                case 's':
+                        if (iccom_lg_parse_size(optarg, &cfg) < 0) {
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case 'R':
+                        cfg.rr_percent = (unsigned int)atoi(optarg);
+                        break;
+                case 't':
+                        cfg.seconds = (unsigned int)atoi(optarg);
+                        break;
+                case 'L':
+                        cfg.shift = atoi(optarg);
+                        break;
+                case 'h':
+                        iccom_loadgen_usage(argv[0]);
+                        return EXIT_SUCCESS;
+                default:
+                        iccom_loadgen_usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+        const unsigned int weights_sum = cfg.patterns_weights[0]
+                                         + cfg.patterns_weights[1]
+                                         + cfg.patterns_weights[2];
+        if (optind != argc || cfg.channels == 0 || cfg.workers == 0
+                    || !(cfg.rate > 0) || cfg.burst == 0 || cfg.seconds == 0
+                    || cfg.rr_percent > 100 || weights_sum == 0) {
+                iccom_loadgen_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+        if (cfg.workers > cfg.channels) {
+                cfg.workers = cfg.channels;
+        }
+
+        iccom_lg_raise_nofile();
+        if (cfg.shift && iccom_tools_loopback_up(cfg.channel
+                                , cfg.channel + cfg.channels - 1
+                                , cfg.shift) < 0) {
+                return EXIT_FAILURE;
+        }
+
+        struct iccom_lg_channel *const channels
+                = (struct iccom_lg_channel *)calloc(cfg.channels
+                                                    , sizeof(*channels));
+        struct iccom_lg_worker *const workers
+                = (struct iccom_lg_worker *)calloc(cfg.workers
+                                                   , sizeof(*workers));
+        int res = (channels && workers) ? 0 : -ENOMEM;
+        if (res == 0) {
+                res = iccom_lg_setup(&cfg, channels, workers);
+        }
+        if (res < 0) {
+                goto cleanup;
+        }
+        if (cfg.shift) {
+                // lets the network loopback relay accept the connections
+                usleep(ICCOM_LG_POLL_TIMEOUT_MS * 1000);
+        }
+
+        const uint64_t start_ns = iccom_tools_now_ns();
+        for (unsigned int i = 0; i < cfg.workers; i++) {
+                struct iccom_lg_worker *const w = &workers[i];
+                w->start_ns = start_ns;
+                w->end_ns = start_ns + (uint64_t)cfg.seconds * 1000000000ull;
+                pthread_create(&w->collector, NULL, &iccom_lg_collector, w);
+                if (cfg.shift) {
+                        pthread_create(&w->sink, NULL, &iccom_lg_sink, w);
+                }
+                pthread_create(&w->sender, NULL, &iccom_lg_sender, w);
+        }
+        for (unsigned int i = 0; i < cfg.workers; i++) {
+                pthread_join(workers[i].sender, NULL);
+        }
+        const uint64_t elapsed_ns = iccom_tools_now_ns() - start_ns;
+
+        // drains the messages still in flight
+        while (1) {
+                usleep(ICCOM_LG_POLL_TIMEOUT_MS * 1000);
+                const uint64_t last = atomic_load(&last_rx_ns);
+                if (iccom_tools_now_ns() - (last ? last : start_ns)
+                                >= ICCOM_LG_DRAIN_IDLE_NS) {
+                        break;
+                }
+        }
+        atomic_store(&stop, 1);
+        for (unsigned int i = 0; i < cfg.workers; i++) {
+                pthread_join(workers[i].collector, NULL);
+                if (cfg.shift) {
+                        pthread_join(workers[i].sink, NULL);
+                }
+        }
+
+        iccom_lg_report(&cfg, channels, workers, elapsed_ns);
+
+cleanup:
+        if (channels && workers) {
+                iccom_lg_cleanup(&cfg, channels, workers);
+        }
+        free(channels);
+        free(workers);
+        if (cfg.shift) {
+                iccom_loopback_disable();
+        }
+        return res < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,573 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* The ICCom channels throughput benchmark tool (iperf-like).
+ *
+ * Every channel is served by its own thread, which sends (or receives)
+ * the messages as fast as possible. The sustained msg/s and MB/s are
+ * reported per channel and for all channels together, as well as
+ * the CPU time spent per message.
+ *
+ * Modes:
+ *   send - sends to the channels [CH; CH + N - 1],
+ *   recv - receives from the channels [CH; CH + N - 1],
+ *   both - sends to the channels [CH; CH + N - 1] and receives from
+ *          the loopback channels [CH + SHIFT; CH + N - 1 + SHIFT].
+ *
+ * Usage: see iccom_perf_usage() below.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#include "iccom.h"
+#include "tools_utils.h"
+
+/* -------------------- MACRO DEFINITIONS ------------------------------ */
+
+#define ICCOM_PERF_MODE_SEND 1
+#define ICCOM_PERF_MODE_RECV 2
+#define ICCOM_PERF_MODE_BOTH (ICCOM_PERF_MODE_SEND | ICCOM_PERF_MODE_RECV)
+
+#define ICCOM_PERF_DEFAULT_CHANNEL 100
+#define ICCOM_PERF_DEFAULT_SHIFT 2000
+#define ICCOM_PERF_DEFAULT_SIZE 64
+#define ICCOM_PERF_DEFAULT_SECONDS 5
+
+#define ICCOM_PERF_MAX_BATCH 1024
+
+// the receiver poll granularity
+#define ICCOM_PERF_RECV_TIMEOUT_MS 100
+// the receivers stop when no data came within this time after
+// the senders are done
+#define ICCOM_PERF_DRAIN_IDLE_NS 300000000ull
+
+// the deadline is checked once per this number of sends
+#define ICCOM_PERF_DEADLINE_CHECK_PERIOD 32
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+// @mode ICCOM_PERF_MODE_*
+// @channel the first channel
+// @channels the number of channels
+// @shift the loopback shift, 0 - loopback is not touched
+// @size_min the smallest message size
+// @size_max the biggest message size, sizes between are powers of 2
+// @seconds the measurement duration per message size
+// @batch the number of messages per send call
+struct iccom_perf_cfg {
+        int mode;
+        unsigned int channel;
+        unsigned int channels;
+        int shift;
+        unsigned int size_min;
+        unsigned int size_max;
+        unsigned int seconds;
+        unsigned int batch;
+};
+
+// The per channel worker state and results.
+//
+// @channel the channel the worker is bound to
+// @size the message size (sender)
+// @deadline_ns the time to stop sending (sender)
+// @msgs messages sent/received
+// @bytes payload bytes sent/received
+// @errors failed calls
+// @first_ns @last_ns the first and last message time
+// @cpu_ns the worker thread CPU time
+struct iccom_perf_worker {
+        const struct iccom_perf_cfg *cfg;
+        pthread_t thread;
+        unsigned int channel;
+        unsigned int size;
+        int fd;
+        uint64_t deadline_ns;
+        uint64_t msgs;
+        uint64_t bytes;
+        uint64_t errors;
+        uint64_t first_ns;
+        uint64_t last_ns;
+        uint64_t cpu_ns;
+};
+
+/* -------------------- GLOBAL VARIABLES ------------------------------- */
+
+static pthread_barrier_t start_barrier;
+
+// set when the receivers are to stop
+static atomic_int recv_stop = 0;
+
+// the time of the last message received on any channel
+static _Atomic uint64_t last_rx_ns = 0;
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+static void iccom_perf_usage(const char *const name)
+{
+        printf("Usage: %s [OPTIONS]\n"
+               "Measures the ICCom channels throughput.\n"
+               "\n"
+               "  -m MODE    send, recv or both (default both)\n"
+               "  -c CH      first channel (default %d)\n"
+               "  -n N       number of channels, a thread per channel"
+               " (default 1)\n"
+               "  -s SIZE    message size in bytes, or MIN:MAX to measure\n"
+               "             the sizes MIN, powers of 2 between, MAX\n"
+               "             (default %d, max %d)\n"
+               "  -t SEC     measurement time per message size"
+               " (default %d)\n"
+               "  -b N       messages per send call (default 1, max %d)\n"
+               "  -L SHIFT   enable the loopback [CH; CH+N-1] -> +SHIFT\n"
+               "             for the run; in both mode the receivers use\n"
+               "             channels CH+SHIFT.. (default %d in both mode)\n"
+               "  -h         print this help\n"
+               , name, ICCOM_PERF_DEFAULT_CHANNEL, ICCOM_PERF_DEFAULT_SIZE
+               , ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES
+               , ICCOM_PERF_DEFAULT_SECONDS, ICCOM_PERF_MAX_BATCH
+               , ICCOM_PERF_DEFAULT_SHIFT);
+}
+
+static void *iccom_perf_sender(void *arg)
+{
+        struct iccom_perf_worker *const w = (struct iccom_perf_worker *)arg;
+        const size_t buf_size = iccom_get_required_buffer_size(w->size);
+        char *const buf = (char *)calloc(1, buf_size);
+        iccom_send_batch_item items[ICCOM_PERF_MAX_BATCH];
+
+        if (buf) {
+                for (unsigned int i = 0; i < w->size; i++) {
+                        buf[iccom_get_data_payload_offset() + i] = (char)i;
+                }
+        }
+        for (unsigned int i = 0; i < w->cfg->batch; i++) {
+                items[i].buf = buf;
+                items[i].buf_size_bytes = buf_size;
+                items[i].data_size_bytes = w->size;
+        }
+
+        pthread_barrier_wait(&start_barrier);
+        if (!buf) {
+                w->errors++;
+                return NULL;
+        }
+
+        const uint64_t cpu_start = iccom_tools_thread_cpu_ns();
+        w->first_ns = iccom_tools_now_ns();
+        uint64_t now = w->first_ns;
+        unsigned int check = 0;
+        while (now < w->deadline_ns) {
+                int res;
+                if (w->cfg->batch > 1) {
+                        res = iccom_send_data_batch_nocopy(w->fd, items
+                                                           , w->cfg->batch);
+                } else {
+                        res = iccom_send_data_nocopy(w->fd, buf, buf_size
+                                        , iccom_get_data_payload_offset()
+                                        , w->size);
+                        res = res < 0 ? res : 1;
+                }
+                if (res < 0) {
+                        w->errors++;
+                        if (res == -ENOBUFS || res == -EAGAIN) {
+                                sched_yield();
+                        }
+                } else {
+                        w->msgs += (uint64_t)res;
+                        w->bytes += (uint64_t)res * w->size;
+                }
+                if (++check == ICCOM_PERF_DEADLINE_CHECK_PERIOD
+                                || res < 0) {
+                        check = 0;
+                        now = iccom_tools_now_ns();
+                }
+        }
+        w->last_ns = iccom_tools_now_ns();
+        w->cpu_ns = iccom_tools_thread_cpu_ns() - cpu_start;
+
+        free(buf);
+        return NULL;
+}
+
+static void *iccom_perf_receiver(void *arg)
+{
+        struct iccom_perf_worker *const w = (struct iccom_perf_worker *)arg;
+        const size_t buf_size = iccom_get_required_buffer_size(
+                                        ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES);
+        char *const buf = (char *)malloc(buf_size);
+
+        pthread_barrier_wait(&start_barrier);
+        if (!buf) {
+                w->errors++;
+                return NULL;
+        }
+
+        const uint64_t cpu_start = iccom_tools_thread_cpu_ns();
+        while (!atomic_load_explicit(&recv_stop, memory_order_relaxed)) {
+                int offset;
+                const int res = iccom_receive_data_nocopy(w->fd, buf, buf_size
+                                                          , &offset);
+                if (res < 0) {
+                        w->errors++;
+                        continue;
+                }
+                if (res == 0) {
+                        continue;
+                }
+                const uint64_t now = iccom_tools_now_ns();
+                if (!w->msgs) {
+                        w->first_ns = now;
+                }
+                w->last_ns = now;
+                w->msgs++;
+                w->bytes += (uint64_t)res;
+                atomic_store_explicit(&last_rx_ns, now, memory_order_relaxed);
+        }
+        w->cpu_ns = iccom_tools_thread_cpu_ns() - cpu_start;
+
+        free(buf);
+        return NULL;
+}
+
+static void iccom_perf_print_header(void)
+{
+        printf("%-8s %8s %12s %12s %10s %10s %8s\n"
+               , "", "channel", "messages", "msg/s", "MB/s", "cpu ns/msg"
+               , "errors");
+}
+
+// @span_ns the time span to compute rates over
+static void iccom_perf_print_line(const char *const title
+                , const char *const channel, const uint64_t msgs
+                , const uint64_t bytes, const uint64_t span_ns
+                , const uint64_t cpu_ns, const uint64_t errors)
+{
+        const double span_s = (double)span_ns / 1e9;
+        printf("%-8s %8s %12llu %12.0f %10.3f %10.0f %8llu\n"
+               , title, channel, (unsigned long long)msgs
+               , span_s > 0 ? (double)msgs / span_s : 0.0
+               , span_s > 0 ? (double)bytes / span_s / 1e6 : 0.0
+               , msgs ? (double)cpu_ns / (double)msgs : 0.0
+               , (unsigned long long)errors);
+}
+
+// Prints per channel and summary lines for the workers.
+static void iccom_perf_report(const char *const title
+                              , const struct iccom_perf_worker *const w
+                              , const unsigned int count
+                              , const uint64_t process_cpu_ns)
+{
+        uint64_t msgs = 0, bytes = 0, errors = 0, cpu_ns = 0;
+        uint64_t first_ns = UINT64_MAX, last_ns = 0;
+        char channel[16];
+
+        for (unsigned int i = 0; i < count; i++) {
+                snprintf(channel, sizeof(channel), "%u", w[i].channel);
+                iccom_perf_print_line(title, channel, w[i].msgs, w[i].bytes
+                                      , w[i].last_ns - w[i].first_ns
+                                      , w[i].cpu_ns, w[i].errors);
+                msgs += w[i].msgs;
+                bytes += w[i].bytes;
+                errors += w[i].errors;
+                cpu_ns += w[i].cpu_ns;
+                if (w[i].msgs && w[i].first_ns < first_ns) {
+                        first_ns = w[i].first_ns;
+                }
+                if (w[i].last_ns > last_ns) {
+                        last_ns = w[i].last_ns;
+                }
+        }
+        if (count > 1) {
+                iccom_perf_print_line(title, "all", msgs, bytes
+                                      , msgs ? last_ns - first_ns : 0
+                                      , cpu_ns, errors);
+        }
+        if (process_cpu_ns) {
+                printf("%-8s process CPU per message: %.0f ns\n", title
+                       , msgs ? (double)process_cpu_ns / (double)msgs : 0.0);
+        }
+}
+
+static int iccom_perf_open_workers(struct iccom_perf_worker *const w
+                                   , const unsigned int count
+                                   , const unsigned int first_channel
+                                   , const int receiver)
+{
+        for (unsigned int i = 0; i < count; i++) {
+                w[i].channel = first_channel + i;
+                w[i].fd = iccom_open_socket(w[i].channel);
+                if (w[i].fd < 0) {
+                        fprintf(stderr, "could not open channel %u: %d\n"
+                                , w[i].channel, w[i].fd);
+                        return w[i].fd;
+                }
+                if (receiver && iccom_set_socket_read_timeout(w[i].fd
+                                        , ICCOM_PERF_RECV_TIMEOUT_MS) < 0) {
+                        fprintf(stderr, "could not set channel %u timeout\n"
+                                , w[i].channel);
+                        return -EINVAL;
+                }
+        }
+        return 0;
+}
+
+static void iccom_perf_close_workers(struct iccom_perf_worker *const w
+                                     , const unsigned int count)
+{
+        for (unsigned int i = 0; i < count; i++) {
+                if (w[i].fd >= 0) {
+                        iccom_close_socket(w[i].fd);
+                }
+        }
+}
+
+// Runs a single measurement: message size @size for all channels.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+static int iccom_perf_run(const struct iccom_perf_cfg *const cfg
+                          , const unsigned int size)
+{
+        const unsigned int n = cfg->channels;
+        struct iccom_perf_worker *const tx
+                = (struct iccom_perf_worker *)calloc(n, sizeof(*tx));
+        struct iccom_perf_worker *const rx
+                = (struct iccom_perf_worker *)calloc(n, sizeof(*rx));
+        if (!tx || !rx) {
+                free(tx);
+                free(rx);
+                return -ENOMEM;
+        }
+        for (unsigned int i = 0; i < n; i++) {
+                tx[i].cfg = rx[i].cfg = cfg;
+                tx[i].fd = rx[i].fd = -1;
+                tx[i].size = size;
+        }
+
+        const int do_tx = cfg->mode & ICCOM_PERF_MODE_SEND;
+        const int do_rx = cfg->mode & ICCOM_PERF_MODE_RECV;
+        const unsigned int rx_channel = cfg->mode == ICCOM_PERF_MODE_BOTH
+                                        ? cfg->channel + cfg->shift
+                                        : cfg->channel;
+
+        int res = 0;
+        if (do_rx) {
+                res = iccom_perf_open_workers(rx, n, rx_channel, 1);
+        }
+        if (res == 0 && do_tx) {
+                res = iccom_perf_open_workers(tx, n, cfg->channel, 0);
+        }
+        if (res < 0) {
+                goto close;
+        }
+        if (do_rx && do_tx) {
+                // lets the network loopback relay accept the connections
+                usleep(ICCOM_PERF_RECV_TIMEOUT_MS * 1000);
+        }
+
+        const unsigned int threads = (do_tx ? n : 0) + (do_rx ? n : 0);
+        pthread_barrier_init(&start_barrier, NULL, threads + 1);
+        atomic_store(&recv_stop, 0);
+        atomic_store(&last_rx_ns, 0);
+
+        const uint64_t deadline_ns = iccom_tools_now_ns()
+                                     + (uint64_t)cfg->seconds * 1000000000ull;
+        for (unsigned int i = 0; i < n; i++) {
+                if (do_rx) {
+                        pthread_create(&rx[i].thread, NULL
+                                       , &iccom_perf_receiver, &rx[i]);
+                }
+                if (do_tx) {
+                        tx[i].deadline_ns = deadline_ns;
+                        pthread_create(&tx[i].thread, NULL
+                                       , &iccom_perf_sender, &tx[i]);
+                }
+        }
+
+        const uint64_t cpu_start = iccom_tools_process_cpu_ns();
+        pthread_barrier_wait(&start_barrier);
+
+        if (do_tx) {
+                for (unsigned int i = 0; i < n; i++) {
+                        pthread_join(tx[i].thread, NULL);
+                }
+        }
+        if (do_rx) {
+                // recv only: measure the given time since the first message,
+                // both: drain what is still in flight after the senders
+                uint64_t until_ns = do_tx ? 0 : UINT64_MAX;
+                while (1) {
+                        usleep(ICCOM_PERF_RECV_TIMEOUT_MS * 1000);
+                        const uint64_t now = iccom_tools_now_ns();
+                        const uint64_t last = atomic_load(&last_rx_ns);
+                        if (do_tx) {
+                                if (now - (last ? last : now)
+                                                >= ICCOM_PERF_DRAIN_IDLE_NS
+                                            || (!last && now > deadline_ns
+                                                + ICCOM_PERF_DRAIN_IDLE_NS)) {
+                                        break;
+                                }
+                                continue;
+                        }
+                        if (last && until_ns == UINT64_MAX) {
+                                until_ns = now + (uint64_t)cfg->seconds
+                                                 * 1000000000ull;
+                        }
+                        if (now >= until_ns) {
+                                break;
+                        }
+                }
+                atomic_store(&recv_stop, 1);
+                for (unsigned int i = 0; i < n; i++) {
+                        pthread_join(rx[i].thread, NULL);
+                }
+        }
+        const uint64_t process_cpu_ns = iccom_tools_process_cpu_ns() - cpu_start;
+        pthread_barrier_destroy(&start_barrier);
+
+        if (do_tx) {
+                printf("message size: %u bytes\n", size);
+        }
+        iccom_perf_print_header();
+        if (do_tx) {
+                iccom_perf_report("send", tx, n, do_rx ? 0 : process_cpu_ns);
+        }
+        if (do_rx) {
+                iccom_perf_report("recv", rx, n, process_cpu_ns);
+        }
+        if (do_tx && do_rx) {
+                uint64_t sent = 0, received = 0;
+                for (unsigned int i = 0; i < n; i++) {
+                        sent += tx[i].msgs;
+                        received += rx[i].msgs;
+                }
+                printf("lost: %llu of %llu (%.2f%%)\n"
+                       , (unsigned long long)(sent > received
+                                              ? sent - received : 0)
+                       , (unsigned long long)sent
+                       , sent && sent > received
+                         ? 100.0 * (double)(sent - received) / (double)sent
+                         : 0.0);
+        }
+        printf("\n");
+
+close:
+        iccom_perf_close_workers(tx, n);
+        iccom_perf_close_workers(rx, n);
+        free(tx);
+        free(rx);
+        return res;
+}
+
+int main(int argc, char **argv)
+{
+        struct iccom_perf_cfg cfg = {
+                .mode = ICCOM_PERF_MODE_BOTH
+                , .channel = ICCOM_PERF_DEFAULT_CHANNEL
+                , .channels = 1
+                , .shift = 0
+                , .size_min = ICCOM_PERF_DEFAULT_SIZE
+                , .size_max = ICCOM_PERF_DEFAULT_SIZE
+                , .seconds = ICCOM_PERF_DEFAULT_SECONDS
+                , .batch = 1
+        };
+
+        int opt;
+        while ((opt = getopt(argc, argv, "m:c:n:s:t:b:L:h")) != -1) {
+                switch (opt) {
+                case 'm':
+                        if (strcmp(optarg, "send") == 0) {
+                                cfg.mode = ICCOM_PERF_MODE_SEND;
+                        } else if (strcmp(optarg, "recv") == 0) {
+                                cfg.mode = ICCOM_PERF_MODE_RECV;
+                        } else if (strcmp(optarg, "both") == 0) {
+                                cfg.mode = ICCOM_PERF_MODE_BOTH;
+                        } else {
+                                iccom_perf_usage(argv[0]);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case 'c':
+                        cfg.channel = (unsigned int)atoi(optarg);
+                        break;
+                case 'n':
+                        cfg.channels = (unsigned int)atoi(optarg);
+                        break;
+                case 's':
+                        if (iccom_tools_parse_size_range(optarg, &cfg.size_min
+                                                         , &cfg.size_max) < 0) {
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case 't':
+                        cfg.seconds = (unsigned int)atoi(optarg);
+                        break;
+                case 'b':
+                        cfg.batch = (unsigned int)atoi(optarg);
+                        break;
+                case 'L':
+                        cfg.shift = atoi(optarg);
+                        break;
+                case 'h':
+                        iccom_perf_usage(argv[0]);
+                        return EXIT_SUCCESS;
+                default:
+                        iccom_perf_usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+        if (optind != argc || cfg.channels == 0 || cfg.seconds == 0
+                    || cfg.batch == 0 || cfg.batch > ICCOM_PERF_MAX_BATCH) {
+                iccom_perf_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+        if (cfg.mode == ICCOM_PERF_MODE_BOTH && cfg.shift == 0) {
+                cfg.shift = ICCOM_PERF_DEFAULT_SHIFT;
+        }
+
+        if (cfg.shift && iccom_tools_loopback_up(cfg.channel
+                                , cfg.channel + cfg.channels - 1
+                                , cfg.shift) < 0) {
+                return EXIT_FAILURE;
+        }
+
+        int res = 0;
+        if (cfg.mode == ICCOM_PERF_MODE_RECV) {
+                res = iccom_perf_run(&cfg, 0);
+        } else {
+                unsigned int size = cfg.size_min;
+                while (res == 0) {
+                        res = iccom_perf_run(&cfg, size);
+                        if (size == cfg.size_max) {
+                                break;
+                        }
+                        // next power of 2, but not beyond the max size
+                        unsigned int next = 1;
+                        while (next <= size) {
+                                next <<= 1;
+                        }
+                        size = next < cfg.size_max ? next : cfg.size_max;
+                }
+        }
+
+        if (cfg.shift) {
+                iccom_loopback_disable();
+        }
+        return res < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
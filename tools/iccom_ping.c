@@ -0,0 +1,427 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* The ICCom round trip latency tool (ping-pong).
+ *
+ * The pinger sends a message with the sequence number to the channel
+ * and waits for the same message to come back, the echo sends every
+ * message it gets back to the same channel (like the echo example in
+ * the readme). After the warmup round trips, every round trip time is
+ * recorded and min/p50/p90/p99/p99.9/max are reported.
+ *
+ * Modes:
+ *   ping - pings the channel CH, the echo is the remote side,
+ *   echo - echoes the channel CH till interrupted,
+ *   both - pings the channel CH, echoes on the loopback channel
+ *          CH + SHIFT in the second thread.
+ *
+ * Usage: see iccom_ping_usage() below.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "iccom.h"
+#include "tools_utils.h"
+
+/* -------------------- MACRO DEFINITIONS ------------------------------ */
+
+#define ICCOM_PING_MODE_PING 1
+#define ICCOM_PING_MODE_ECHO 2
+#define ICCOM_PING_MODE_BOTH (ICCOM_PING_MODE_PING | ICCOM_PING_MODE_ECHO)
+
+#define ICCOM_PING_DEFAULT_CHANNEL 100
+#define ICCOM_PING_DEFAULT_SHIFT 2000
+#define ICCOM_PING_DEFAULT_COUNT 10000
+#define ICCOM_PING_DEFAULT_WARMUP 1000
+#define ICCOM_PING_DEFAULT_SIZE 16
+
+// the round trip is considered lost after this time
+#define ICCOM_PING_TIMEOUT_MS 1000
+#define ICCOM_PING_TIMEOUT_NS (ICCOM_PING_TIMEOUT_MS * 1000000ull)
+
+/* -------------------- DATA STRUCTURES -------------------------------- */
+
+// @mode ICCOM_PING_MODE_*
+// @channel the pinged channel
+// @shift the loopback shift, 0 - loopback is not touched
+// @count the number of measured round trips
+// @warmup the number of not measured round trips before
+// @size the message size
+// @interval_us the pause between the round trips
+// @busy_poll !0: spin on non-blocking receive, 0: blocking receive
+// @ping_cpu @echo_cpu CPUs to pin the pinger and echo to, <0: no pinning
+struct iccom_ping_cfg {
+        int mode;
+        unsigned int channel;
+        int shift;
+        unsigned int count;
+        unsigned int warmup;
+        unsigned int size;
+        unsigned int interval_us;
+        int busy_poll;
+        int ping_cpu;
+        int echo_cpu;
+};
+
+/* -------------------- GLOBAL VARIABLES ------------------------------- */
+
+static atomic_int stop = 0;
+
+/* ------------------- ROUTINES ---------------------------------------- */
+
+static void iccom_ping_usage(const char *const name)
+{
+        printf("Usage: %s [OPTIONS]\n"
+               "Measures the ICCom channel round trip latency.\n"
+               "\n"
+               "  -m MODE    ping, echo or both (default both)\n"
+               "  -c CH      channel (default %d)\n"
+               "  -n N       measured round trips (default %d)\n"
+               "  -w N       warmup round trips (default %d)\n"
+               "  -s SIZE    message size, >= 4 (default %d, max %d)\n"
+               "  -i USEC    pause between round trips (default 0)\n"
+               "  -p         busy poll (default: blocking receive), the\n"
+               "             pinger and echo need dedicated CPUs then\n"
+               "  -C CPU     pin the pinger to CPU\n"
+               "  -E CPU     pin the echo to CPU\n"
+               "  -L SHIFT   enable the loopback CH -> CH+SHIFT for the run,\n"
+               "             the echo in both mode uses CH+SHIFT\n"
+               "             (default %d in both mode)\n"
+               "  -h         print this help\n"
+               , name, ICCOM_PING_DEFAULT_CHANNEL, ICCOM_PING_DEFAULT_COUNT
+               , ICCOM_PING_DEFAULT_WARMUP, ICCOM_PING_DEFAULT_SIZE
+               , ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES
+               , ICCOM_PING_DEFAULT_SHIFT);
+}
+
+static void iccom_ping_on_signal(int signo)
+{
+        (void)signo;
+        atomic_store(&stop, 1);
+}
+
+// Opens the channel in the configured receive mode.
+//
+// RETURNS:
+//      >=0: the socket
+//      <0: negated error code
+static int iccom_ping_open(const struct iccom_ping_cfg *const cfg
+                           , const unsigned int channel)
+{
+        const int fd = iccom_open_socket(channel);
+        if (fd < 0) {
+                fprintf(stderr, "could not open channel %u: %d\n"
+                        , channel, fd);
+                return fd;
+        }
+        const int res = cfg->busy_poll
+                        ? iccom_tools_set_nonblocking(fd)
+                        : iccom_set_socket_read_timeout(fd
+                                                , ICCOM_PING_TIMEOUT_MS);
+        if (res < 0) {
+                iccom_close_socket(fd);
+                return res;
+        }
+        return fd;
+}
+
+// Echoes the messages till stopped.
+static void *iccom_ping_echo(void *arg)
+{
+        const struct iccom_ping_cfg *const cfg
+                = (const struct iccom_ping_cfg *)arg;
+        const unsigned int channel = cfg->mode == ICCOM_PING_MODE_BOTH
+                                     ? cfg->channel + cfg->shift
+                                     : cfg->channel;
+        const size_t buf_size = iccom_get_required_buffer_size(
+                                        ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES);
+        char *const buf = (char *)malloc(buf_size);
+
+        iccom_tools_pin_to_cpu(cfg->echo_cpu);
+        const int fd = buf ? iccom_ping_open(cfg, channel) : -ENOMEM;
+        if (fd < 0) {
+                free(buf);
+                atomic_store(&stop, 1);
+                return NULL;
+        }
+
+        while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+                int offset;
+                const int res = iccom_receive_data_nocopy(fd, buf, buf_size
+                                                          , &offset);
+                if (res <= 0) {
+                        continue;
+                }
+                iccom_send_data_nocopy(fd, buf
+                                       , iccom_get_required_buffer_size(res)
+                                       , offset, res);
+        }
+
+        iccom_close_socket(fd);
+        free(buf);
+        return NULL;
+}
+
+// Waits for the reply with the given sequence number.
+//
+// RETURNS:
+//      >0: the reply came
+//      0: timeout
+//      <0: negated error code
+static int iccom_ping_wait_reply(const int fd, char *const buf
+                                 , const size_t buf_size
+                                 , const uint32_t seq, const uint64_t sent_ns)
+{
+        while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+                int offset;
+                const int res = iccom_receive_data_nocopy(fd, buf, buf_size
+                                                          , &offset);
+                if (res < 0) {
+                        return res;
+                }
+                if (res >= (int)sizeof(seq)) {
+                        uint32_t got;
+                        memcpy(&got, buf + offset, sizeof(got));
+                        // the late replies of lost round trips are skipped
+                        if (got == seq) {
+                                return 1;
+                        }
+                }
+                if (iccom_tools_now_ns() - sent_ns > ICCOM_PING_TIMEOUT_NS) {
+                        return 0;
+                }
+        }
+        return 0;
+}
+
+static int iccom_ping_cmp_u64(const void *a, const void *b)
+{
+        const uint64_t x = *(const uint64_t *)a;
+        const uint64_t y = *(const uint64_t *)b;
+        return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// @sorted {sorted, count > 0} the samples
+static double iccom_ping_percentile_us(const uint64_t *const sorted
+                                       , const size_t count, const double p)
+{
+        size_t idx = (size_t)(p / 100.0 * (double)count);
+        if (idx >= count) {
+                idx = count - 1;
+        }
+        return (double)sorted[idx] / 1e3;
+}
+
+// Runs the pinger.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+static int iccom_ping_run(const struct iccom_ping_cfg *const cfg)
+{
+        const size_t buf_size = iccom_get_required_buffer_size(
+                                        ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES);
+        const size_t tx_buf_size = iccom_get_required_buffer_size(cfg->size);
+        char *const rx_buf = (char *)malloc(buf_size);
+        char *const tx_buf = (char *)calloc(1, tx_buf_size);
+        uint64_t *const samples
+                = (uint64_t *)malloc(cfg->count * sizeof(uint64_t));
+        if (!rx_buf || !tx_buf || !samples) {
+                free(rx_buf);
+                free(tx_buf);
+                free(samples);
+                return -ENOMEM;
+        }
+
+        iccom_tools_pin_to_cpu(cfg->ping_cpu);
+        const int fd = iccom_ping_open(cfg, cfg->channel);
+        if (fd < 0) {
+                free(rx_buf);
+                free(tx_buf);
+                free(samples);
+                return fd;
+        }
+
+        char *const payload = tx_buf + iccom_get_data_payload_offset();
+        size_t measured = 0;
+        unsigned int lost = 0, errors = 0;
+        const unsigned int total = cfg->warmup + cfg->count;
+        for (uint32_t seq = 0; seq < total; seq++) {
+                if (atomic_load_explicit(&stop, memory_order_relaxed)) {
+                        break;
+                }
+                if (cfg->interval_us) {
+                        usleep(cfg->interval_us);
+                }
+
+                memcpy(payload, &seq, sizeof(seq));
+                const uint64_t sent_ns = iccom_tools_now_ns();
+                int res = iccom_send_data_nocopy(fd, tx_buf, tx_buf_size
+                                                 , iccom_get_data_payload_offset()
+                                                 , cfg->size);
+                if (res == 0) {
+                        res = iccom_ping_wait_reply(fd, rx_buf, buf_size, seq
+                                                    , sent_ns);
+                }
+                const uint64_t rtt_ns = iccom_tools_now_ns() - sent_ns;
+
+                if (res < 0) {
+                        errors++;
+                } else if (res == 0) {
+                        lost++;
+                } else if (seq >= cfg->warmup) {
+                        samples[measured++] = rtt_ns;
+                }
+        }
+        iccom_close_socket(fd);
+
+        printf("channel %u, %u bytes, %s receive, %zu round trips"
+               " (+%u warmup), lost %u, errors %u\n"
+               , cfg->channel, cfg->size
+               , cfg->busy_poll ? "busy poll" : "blocking"
+               , measured, cfg->warmup, lost, errors);
+        if (measured) {
+                qsort(samples, measured, sizeof(samples[0])
+                      , &iccom_ping_cmp_u64);
+                double sum = 0;
+                for (size_t i = 0; i < measured; i++) {
+                        sum += (double)samples[i];
+                }
+                printf("rtt us: min %.2f  p50 %.2f  p90 %.2f  p99 %.2f"
+                       "  p99.9 %.2f  max %.2f  mean %.2f\n"
+                       , (double)samples[0] / 1e3
+                       , iccom_ping_percentile_us(samples, measured, 50.0)
+                       , iccom_ping_percentile_us(samples, measured, 90.0)
+                       , iccom_ping_percentile_us(samples, measured, 99.0)
+                       , iccom_ping_percentile_us(samples, measured, 99.9)
+                       , (double)samples[measured - 1] / 1e3
+                       , sum / (double)measured / 1e3);
+        }
+
+        free(rx_buf);
+        free(tx_buf);
+        free(samples);
+        return measured ? 0 : -ETIMEDOUT;
+}
+
+int main(int argc, char **argv)
+{
+        struct iccom_ping_cfg cfg = {
+                .mode = ICCOM_PING_MODE_BOTH
+                , .channel = ICCOM_PING_DEFAULT_CHANNEL
+                , .shift = 0
+                , .count = ICCOM_PING_DEFAULT_COUNT
+                , .warmup = ICCOM_PING_DEFAULT_WARMUP
+                , .size = ICCOM_PING_DEFAULT_SIZE
+                , .interval_us = 0
+                , .busy_poll = 0
+                , .ping_cpu = -1
+                , .echo_cpu = -1
+        };
+
+        int opt;
+        while ((opt = getopt(argc, argv, "m:c:n:w:s:i:pC:E:L:h")) != -1) {
+                switch (opt) {
+                case 'm':
+                        if (strcmp(optarg, "ping") == 0) {
+                                cfg.mode = ICCOM_PING_MODE_PING;
+                        } else if (strcmp(optarg, "echo") == 0) {
+                                cfg.mode = ICCOM_PING_MODE_ECHO;
+                        } else if (strcmp(optarg, "both") == 0) {
+                                cfg.mode = ICCOM_PING_MODE_BOTH;
+                        } else {
+                                iccom_ping_usage(argv[0]);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case 'c':
+                        cfg.channel = (unsigned int)atoi(optarg);
+                        break;
+                case 'n':
+                        cfg.count = (unsigned int)atoi(optarg);
+                        break;
+                case 'w':
+                        cfg.warmup = (unsigned int)atoi(optarg);
+                        break;
+                case 's':
+                        cfg.size = (unsigned int)atoi(optarg);
+                        break;
+                case 'i':
+                        cfg.interval_us = (unsigned int)atoi(optarg);
+                        break;
+                case 'p':
+                        cfg.busy_poll = 1;
+                        break;
+                case 'C':
+                        cfg.ping_cpu = atoi(optarg);
+                        break;
+                case 'E':
+                        cfg.echo_cpu = atoi(optarg);
+                        break;
+                case 'L':
+                        cfg.shift = atoi(optarg);
+                        break;
+                case 'h':
+                        iccom_ping_usage(argv[0]);
+                        return EXIT_SUCCESS;
+                default:
+                        iccom_ping_usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+        if (optind != argc || cfg.count == 0 || cfg.size < sizeof(uint32_t)
+                    || cfg.size > ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES) {
+                iccom_ping_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+        if (cfg.mode == ICCOM_PING_MODE_BOTH && cfg.shift == 0) {
+                cfg.shift = ICCOM_PING_DEFAULT_SHIFT;
+        }
+
+        signal(SIGINT, &iccom_ping_on_signal);
+        signal(SIGTERM, &iccom_ping_on_signal);
+
+        if (cfg.shift && iccom_tools_loopback_up(cfg.channel, cfg.channel
+                                                 , cfg.shift) < 0) {
+                return EXIT_FAILURE;
+        }
+
+        int res = 0;
+        if (cfg.mode == ICCOM_PING_MODE_ECHO) {
+                iccom_ping_echo(&cfg);
+        } else if (cfg.mode == ICCOM_PING_MODE_PING) {
+                res = iccom_ping_run(&cfg);
+        } else {
+                pthread_t echo;
+                if (pthread_create(&echo, NULL, &iccom_ping_echo, &cfg) != 0) {
+                        res = -EAGAIN;
+                } else {
+                        // lets the echo bind its channel end first
+                        usleep(100000);
+                        res = iccom_ping_run(&cfg);
+                        atomic_store(&stop, 1);
+                        pthread_join(echo, NULL);
+                }
+        }
+
+        if (cfg.shift) {
+                iccom_loopback_disable();
+        }
+        return res < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,132 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* The ICCom traffic replay tool: re-emits the recorded traffic (capture
+ * file or flight recorder dump) on the original channels, see
+ * @iccom_replay_run.
+ *
+ * Usage: see iccom_replay_usage() below.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "iccom.h"
+
+static void iccom_replay_usage(const char *const name)
+{
+        printf("Usage: %s [OPTIONS] FILE\n"
+               "Replays the recorded ICCom traffic FILE.\n"
+               "\n"
+               "  -s SPEED   replay with original timing scaled by SPEED\n"
+               "             (default 1.0: original timing)\n"
+               "  -m         replay as fast as possible\n"
+               "  -b N       batch up to N frames per send in -m mode"
+               " (default 32)\n"
+               "  -d DIR     replay only frames of DIR direction:"
+               " tx, rx, all (default all)\n"
+               "  -c SHIFT   add SHIFT to the recorded channel numbers"
+               " (default 0)\n"
+               "  -l N       replay the file N times (default 1)\n"
+               "  -h         print this help\n"
+               , name);
+}
+
+int main(int argc, char **argv)
+{
+        iccom_replay_cfg cfg;
+        memset(&cfg, 0, sizeof(cfg));
+        cfg.timing = ICCOM_REPLAY_TIMING_ORIGINAL;
+        cfg.speed = 1.0;
+        cfg.batch_size = 32;
+        cfg.loops = 1;
+
+        int opt;
+        while ((opt = getopt(argc, argv, "s:mb:d:c:l:h")) != -1) {
+                switch (opt) {
+                case 's':
+                        cfg.speed = atof(optarg);
+                        break;
+                case 'm':
+                        cfg.timing = ICCOM_REPLAY_TIMING_MAX_SPEED;
+                        break;
+                case 'b':
+                        cfg.batch_size = (unsigned int)atoi(optarg);
+                        break;
+                case 'd':
+                        if (strcmp(optarg, "tx") == 0) {
+                                cfg.directions = ICCOM_REPLAY_DIR_MASK(
+                                                ICCOM_CAPTURE_DIR_TX);
+                        } else if (strcmp(optarg, "rx") == 0) {
+                                cfg.directions = ICCOM_REPLAY_DIR_MASK(
+                                                ICCOM_CAPTURE_DIR_RX);
+                        } else if (strcmp(optarg, "all") == 0) {
+                                cfg.directions = 0;
+                        } else {
+                                iccom_replay_usage(argv[0]);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case 'c':
+                        cfg.channel_shift = atoi(optarg);
+                        break;
+                case 'l':
+                        cfg.loops = (unsigned int)atoi(optarg);
+                        break;
+                case 'h':
+                        iccom_replay_usage(argv[0]);
+                        return EXIT_SUCCESS;
+                default:
+                        iccom_replay_usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+        if (optind != argc - 1) {
+                iccom_replay_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+        cfg.path = argv[optind];
+
+        iccom_replay_stats stats;
+        const int res = iccom_replay_run(&cfg, &stats);
+        if (res < 0) {
+                printf("replay of %s failed: %d\n", cfg.path, res);
+                return EXIT_FAILURE;
+        }
+
+        const double duration_s = (double)stats.duration_ns / 1e9;
+        printf("replayed:        %s\n", cfg.path);
+        printf("frames sent:     %llu\n"
+               , (unsigned long long)stats.frames_sent);
+        printf("bytes sent:      %llu\n"
+               , (unsigned long long)stats.bytes_sent);
+        printf("frames padded:   %llu\n"
+               , (unsigned long long)stats.frames_padded);
+        printf("frames skipped:  %llu\n"
+               , (unsigned long long)stats.frames_skipped);
+        printf("send errors:     %llu\n"
+               , (unsigned long long)stats.send_errors);
+        printf("duration:        %.3f s\n", duration_s);
+        if (duration_s > 0) {
+                printf("rate:            %.1f msg/s, %.3f MB/s\n"
+                       , (double)stats.frames_sent / duration_s
+                       , (double)stats.bytes_sent / duration_s / 1e6);
+        }
+        if (cfg.timing == ICCOM_REPLAY_TIMING_ORIGINAL) {
+                printf("max lag:         %.3f ms\n"
+                       , (double)stats.max_lag_ns / 1e6);
+        }
+
+        return stats.send_errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
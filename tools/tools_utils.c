@@ -0,0 +1,119 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "iccom.h"
+#include "tools_utils.h"
+
+static uint64_t iccom_tools_clock_ns(const clockid_t clock)
+{
+        struct timespec ts;
+        clock_gettime(clock, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// See tools_utils.h
+uint64_t iccom_tools_now_ns(void)
+{
+        return iccom_tools_clock_ns(CLOCK_MONOTONIC);
+}
+
+// See tools_utils.h
+uint64_t iccom_tools_thread_cpu_ns(void)
+{
+        return iccom_tools_clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+// See tools_utils.h
+uint64_t iccom_tools_process_cpu_ns(void)
+{
+        return iccom_tools_clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+// See tools_utils.h
+int iccom_tools_loopback_up(const unsigned int from_ch
+                            , const unsigned int to_ch
+                            , const int range_shift)
+{
+        const int res = iccom_loopback_enable(from_ch, to_ch, range_shift);
+        if (res < 0) {
+                fprintf(stderr, "could not enable loopback [%u; %u] -> +%d:"
+                        " %d(%s)\n", from_ch, to_ch, range_shift
+                        , -res, strerror(-res));
+        }
+        return res;
+}
+
+// See tools_utils.h
+int iccom_tools_pin_to_cpu(const int cpu)
+{
+        if (cpu < 0) {
+                return 0;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        const int res = pthread_setaffinity_np(pthread_self(), sizeof(set)
+                                               , &set);
+        if (res != 0) {
+                fprintf(stderr, "could not pin to CPU %d: %d(%s)\n"
+                        , cpu, res, strerror(res));
+                return -res;
+        }
+        return 0;
+}
+
+// See tools_utils.h
+int iccom_tools_set_nonblocking(const int sock_fd)
+{
+        const int flags = fcntl(sock_fd, F_GETFL);
+        if (flags < 0 || fcntl(sock_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+                const int err = errno;
+                fprintf(stderr, "could not set socket %d non-blocking:"
+                        " %d(%s)\n", sock_fd, err, strerror(err));
+                return -err;
+        }
+        return 0;
+}
+
+// See tools_utils.h
+int iccom_tools_parse_size_range(const char *const arg
+                                 , unsigned int *const min__out
+                                 , unsigned int *const max__out)
+{
+        char *end;
+        const unsigned long min = strtoul(arg, &end, 10);
+        unsigned long max = min;
+        if (*end == ':') {
+                max = strtoul(end + 1, &end, 10);
+        }
+        if (*end != '\0' || min < 1 || max < min
+                    || max > ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES) {
+                fprintf(stderr, "invalid message size(s): %s, expected N or"
+                        " MIN:MAX within [1; %d]\n", arg
+                        , ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES);
+                return -EINVAL;
+        }
+        *min__out = (unsigned int)min;
+        *max__out = (unsigned int)max;
+        return 0;
+}
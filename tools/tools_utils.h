@@ -0,0 +1,68 @@
+/**********************************************************************
+* Copyright (c) 2021 Robert Bosch GmbH
+* Artem Gulyaev <Artem.Gulyaev@de.bosch.com>
+*
+* This code is licensed under the Mozilla Public License Version 2.0
+* License text is available in the file ’LICENSE.txt’, which is part of
+* this source code package.
+*
+* SPDX-identifier: MPL-2.0
+*
+**********************************************************************/
+
+/* The routines shared by the libiccom tools. */
+
+#ifndef ICCOM_TOOLS_UTILS_H
+#define ICCOM_TOOLS_UTILS_H
+
+#include <stdint.h>
+
+// RETURNS: the CLOCK_MONOTONIC time in ns
+uint64_t iccom_tools_now_ns(void);
+
+// RETURNS: the CPU time (user + system) consumed by the calling thread
+//      in ns
+uint64_t iccom_tools_thread_cpu_ns(void);
+
+// RETURNS: the CPU time (user + system) consumed by the process in ns
+uint64_t iccom_tools_process_cpu_ns(void);
+
+// Enables the ICCom loopback for the channels [from_ch; to_ch] shifted
+// by @range_shift, reports the failure to the user.
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_tools_loopback_up(const unsigned int from_ch
+                            , const unsigned int to_ch
+                            , const int range_shift);
+
+// Pins the calling thread to the given CPU.
+//
+// @cpu {>=0} the CPU number, <0 - nothing is done
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_tools_pin_to_cpu(const int cpu);
+
+// Switches the socket to the non-blocking mode, so the receive calls
+// return immediately with 0 data when nothing is there (busy polling).
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_tools_set_nonblocking(const int sock_fd);
+
+// Parses the message size argument: either a single size "N" or the
+// sizes range "MIN:MAX", sizes are to be within
+// [1; ICCOM_SOCKET_MAX_MESSAGE_SIZE_BYTES].
+//
+// RETURNS:
+//      0: on success
+//      <0: negated error code
+int iccom_tools_parse_size_range(const char *const arg
+                                 , unsigned int *const min__out
+                                 , unsigned int *const max__out);
+
+#endif //ICCOM_TOOLS_UTILS_H